@@ -8,6 +8,15 @@
 #include "camera_device.h"
 #include "camera_ops.h"
 
+#include <algorithm>
+#include <set>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <linux/drm_fourcc.h>
+
 #include "log.h"
 #include "utils.h"
 
@@ -17,23 +26,158 @@ using namespace libcamera;
 
 LOG_DECLARE_CATEGORY(HAL);
 
+namespace {
+
+/*
+ * Maximum number of imported buffers kept in the cache. Android allocates a
+ * small set of buffers per stream and cycles through them, the limit only
+ * bounds the cache when buffers are reallocated without reconfiguring the
+ * streams.
+ */
+constexpr unsigned int MaxCachedBuffers = 32;
+
+/* Maximum size of a JPEG frame, including the camera3_jpeg_blob_t trailer. */
+constexpr int32_t MaxJpegSize = 13 << 20;
+
+constexpr unsigned int DefaultJpegQuality = 95;
+
+/*
+ * Result metadata is sent in two parts. The sensor values are known when the
+ * first buffer of a request completes and are sent with the shutter
+ * notification, the remaining values once the whole request completes.
+ */
+constexpr int32_t PartialResultCount = 2;
+
+/*
+ * Map the planes of a buffer for reading. The length of planes imported from
+ * gralloc handles is unknown, and is retrieved from the dmabuf in that case.
+ * Planes that share a dmabuf are mapped once.
+ */
+class MappedBuffer
+{
+public:
+	MappedBuffer(const FrameBuffer *buffer)
+	{
+		for (const FrameBuffer::Plane &plane : buffer->planes()) {
+			int fd = plane.fd.fd();
+
+			if (!maps_.empty() && maps_.back().fd == fd)
+				continue;
+
+			size_t length = plane.length;
+			if (!length) {
+				off_t size = lseek(fd, 0, SEEK_END);
+				length = size > 0 ? size : 0;
+			}
+
+			void *address = mmap(nullptr, length, PROT_READ,
+					     MAP_SHARED, fd, 0);
+			if (address == MAP_FAILED) {
+				LOG(HAL, Error) << "Failed to map buffer";
+				address = nullptr;
+				length = 0;
+			}
+
+			maps_.push_back({ fd, static_cast<uint8_t *>(address), length });
+		}
+	}
+
+	~MappedBuffer()
+	{
+		for (const Map &map : maps_) {
+			if (map.address)
+				munmap(map.address, map.length);
+		}
+	}
+
+	unsigned int count() const { return maps_.size(); }
+	const uint8_t *data(unsigned int index) const { return maps_[index].address; }
+	size_t length(unsigned int index) const { return maps_[index].length; }
+
+private:
+	struct Map {
+		int fd;
+		uint8_t *address;
+		size_t length;
+	};
+
+	std::vector<Map> maps_;
+};
+
+} /* namespace */
+
 /*
  * \struct Camera3RequestDescriptor
  *
  * A utility structure that groups information about a capture request to be
  * later re-used at request complete time to notify the framework.
+ *
+ * Descriptors are pooled by the CameraDevice and reset for every request,
+ * the buffers vector keeps its storage across requests.
  */
 
-CameraDevice::Camera3RequestDescriptor::Camera3RequestDescriptor(
-		unsigned int frameNumber, unsigned int numBuffers)
-	: frameNumber(frameNumber), numBuffers(numBuffers)
+void CameraDevice::Camera3RequestDescriptor::reset(unsigned int frame,
+						   unsigned int count)
 {
-	buffers = new camera3_stream_buffer_t[numBuffers];
+	frameNumber = frame;
+	numBuffers = count;
+	buffers.resize(count);
+	sources.assign(count, nullptr);
+	results.clear();
+	results.reserve(count);
+	numDirect = 0;
+	jpegQuality = DefaultJpegQuality;
+	shutterNotified = false;
+	internalBuffers.clear();
+	pendingResults = 1;
 }
 
-CameraDevice::Camera3RequestDescriptor::~Camera3RequestDescriptor()
+/*
+ * Encode a frame to the BLOB buffer of a JPEG stream, and append the
+ * camera3_jpeg_blob_t trailer at the end of the buffer.
+ */
+void CameraDevice::JpegWorker::encode(JpegJob *job)
 {
-	delete[] buffers;
+	Camera3RequestDescriptor *descriptor = job->descriptor;
+	buffer_handle_t camera3Handle = *job->buffer->buffer;
+	int fd = camera3Handle->data[0];
+
+	job->buffer->status = CAMERA3_BUFFER_STATUS_ERROR;
+
+	off_t size = lseek(fd, 0, SEEK_END);
+	if (size < static_cast<off_t>(sizeof(camera3_jpeg_blob_t))) {
+		LOG(HAL, Error) << "Invalid JPEG buffer size " << size;
+		encoded.emit(job);
+		return;
+	}
+
+	void *address = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED, fd, 0);
+	if (address == MAP_FAILED) {
+		LOG(HAL, Error) << "Failed to map JPEG buffer";
+		encoded.emit(job);
+		return;
+	}
+
+	uint8_t *dst = static_cast<uint8_t *>(address);
+	size_t maxSize = size - sizeof(camera3_jpeg_blob_t);
+	const uint8_t *y = job->frame.data();
+	const uint8_t *uv = y + job->size.width * job->size.height;
+
+	int ret = job->encoder->encode(y, uv, job->size.width, dst, maxSize,
+				       descriptor->jpegQuality);
+	if (ret >= 0) {
+		camera3_jpeg_blob_t *blob =
+			reinterpret_cast<camera3_jpeg_blob_t *>(dst + maxSize);
+		blob->jpeg_blob_id = CAMERA3_JPEG_BLOB_ID;
+		blob->jpeg_size = ret;
+
+		job->buffer->status = CAMERA3_BUFFER_STATUS_OK;
+	}
+
+	munmap(address, size);
+
+	encoded.emit(job);
 }
 
 /*
@@ -50,13 +194,23 @@ CameraDevice::Camera3RequestDescriptor::~Camera3RequestDescriptor()
  */
 
 CameraDevice::CameraDevice(unsigned int id, const std::shared_ptr<Camera> &camera)
-	: running_(false), camera_(camera), staticMetadata_(nullptr)
+	: running_(false), camera_(camera), jpegQuality_(DefaultJpegQuality),
+	  staticMetadata_(nullptr), resultMetadataAllocations_(0),
+	  bufferUseCount_(0), bufferCacheMisses_(0)
 {
+	camera_->bufferCompleted.connect(this, &CameraDevice::bufferComplete);
 	camera_->requestCompleted.connect(this, &CameraDevice::requestComplete);
+
+	jpegWorker_.moveToThread(&jpegThread_);
+	jpegWorker_.encoded.connect(this, &CameraDevice::jpegEncoded);
+	jpegThread_.start();
 }
 
 CameraDevice::~CameraDevice()
 {
+	jpegThread_.exit();
+	jpegThread_.wait();
+
 	if (staticMetadata_)
 		delete staticMetadata_;
 
@@ -91,9 +245,20 @@ int CameraDevice::open(const hw_module_t *hardwareModule)
 void CameraDevice::close()
 {
 	camera_->stop();
+
+	/* Complete the pending JPEG encoding before releasing the buffers. */
+	jpegWorker_.invokeMethod(&JpegWorker::flush, ConnectionTypeBlocking);
+
+	allocator_.reset();
+	internalBuffers_.clear();
+	streams_.clear();
+	settings_.reset();
+
 	camera_->release();
 
 	running_ = false;
+
+	clearBufferCache();
 }
 
 void CameraDevice::setCallbacks(const camera3_callback_ops_t *callbacks)
@@ -117,9 +282,9 @@ const camera_metadata_t *CameraDevice::getStaticMetadata()
 
 	/*
 	 * \todo Keep this in sync with the actual number of entries.
-	 * Currently: 50 entries, 666 bytes
+	 * Currently: 51 entries, 584 bytes
 	 */
-	staticMetadata_ = new CameraMetadata(50, 700);
+	staticMetadata_ = new CameraMetadata(51, 600);
 	if (!staticMetadata_->isValid()) {
 		LOG(HAL, Error) << "Failed to allocate static metadata";
 		delete staticMetadata_;
@@ -244,6 +409,9 @@ const camera_metadata_t *CameraDevice::getStaticMetadata()
 				  availableThumbnailSizes.data(),
 				  availableThumbnailSizes.size());
 
+	int32_t jpegMaxSize = MaxJpegSize;
+	staticMetadata_->addEntry(ANDROID_JPEG_MAX_SIZE, &jpegMaxSize, 1);
+
 	/* Sensor static metadata. */
 	int32_t pixelArraySize[] = {
 		2592, 1944,
@@ -402,9 +570,8 @@ const camera_metadata_t *CameraDevice::getStaticMetadata()
 				  &supportedHWLevel, 1);
 
 	/* Request static metadata. */
-	int32_t partialResultCount = 1;
 	staticMetadata_->addEntry(ANDROID_REQUEST_PARTIAL_RESULT_COUNT,
-				  &partialResultCount, 1);
+				  &PartialResultCount, 1);
 
 	uint8_t maxPipelineDepth = 2;
 	staticMetadata_->addEntry(ANDROID_REQUEST_PIPELINE_MAX_DEPTH,
@@ -435,6 +602,7 @@ const camera_metadata_t *CameraDevice::getStaticMetadata()
 		ANDROID_CONTROL_AWB_LOCK_AVAILABLE,
 		ANDROID_CONTROL_AVAILABLE_MODES,
 		ANDROID_JPEG_AVAILABLE_THUMBNAIL_SIZES,
+		ANDROID_JPEG_MAX_SIZE,
 		ANDROID_SENSOR_INFO_PIXEL_ARRAY_SIZE,
 		ANDROID_SENSOR_INFO_ACTIVE_ARRAY_SIZE,
 		ANDROID_SENSOR_INFO_SENSITIVITY_RANGE,
@@ -622,6 +790,11 @@ const camera_metadata_t *CameraDevice::constructDefaultRequestSettings(int type)
 /*
  * Inspect the stream_list to produce a list of StreamConfiguration to
  * be use to configure the Camera.
+ *
+ * Each non-BLOB Android stream is mapped to a libcamera stream. BLOB streams
+ * are JPEG-encoded in software from an NV12 libcamera stream: the stream of
+ * the same size if there is one, or a dedicated still capture stream
+ * otherwise.
  */
 int CameraDevice::configureStreams(camera3_stream_configuration_t *stream_list)
 {
@@ -635,30 +808,78 @@ int CameraDevice::configureStreams(camera3_stream_configuration_t *stream_list)
 			       << ", format: " << utils::hex(stream->format);
 	}
 
-	/* Hardcode viewfinder role, collecting sizes from the stream config. */
-	if (stream_list->num_streams != 1) {
-		LOG(HAL, Error) << "Only one stream supported";
+	/* Buffers allocated for the previous configuration can't be reused. */
+	clearBufferCache();
+	allocator_.reset();
+	internalBuffers_.clear();
+	streams_.clear();
+	settings_.reset();
+	streams_.reserve(stream_list->num_streams);
+
+	StreamRoles roles;
+	std::vector<Size> sizes;
+	std::vector<bool> jpegSources;
+
+	/* Map the non-BLOB streams first, BLOB streams may share them. */
+	for (unsigned int i = 0; i < stream_list->num_streams; ++i) {
+		camera3_stream_t *camera3Stream = stream_list->streams[i];
+
+		if (camera3Stream->format == HAL_PIXEL_FORMAT_BLOB)
+			continue;
+
+		streams_.emplace_back(camera3Stream, roles.size());
+		roles.push_back(StreamRole::Viewfinder);
+		sizes.emplace_back(camera3Stream->width, camera3Stream->height);
+		jpegSources.push_back(false);
+	}
+
+	for (unsigned int i = 0; i < stream_list->num_streams; ++i) {
+		camera3_stream_t *camera3Stream = stream_list->streams[i];
+
+		if (camera3Stream->format != HAL_PIXEL_FORMAT_BLOB)
+			continue;
+
+		Size size(camera3Stream->width, camera3Stream->height);
+		auto match = std::find(sizes.begin(), sizes.end(), size);
+		unsigned int index = match - sizes.begin();
+
+		if (match == sizes.end()) {
+			roles.push_back(StreamRole::StillCapture);
+			sizes.push_back(size);
+			jpegSources.push_back(true);
+		} else {
+			jpegSources[index] = true;
+		}
+
+		streams_.emplace_back(camera3Stream, index);
+	}
+
+	if (roles.empty()) {
+		LOG(HAL, Error) << "No stream to configure";
 		return -EINVAL;
 	}
 
-	StreamRoles roles = { StreamRole::Viewfinder };
 	config_ = camera_->generateConfiguration(roles);
-	if (!config_ || config_->empty()) {
+	if (!config_ || config_->size() != roles.size()) {
 		LOG(HAL, Error) << "Failed to generate camera configuration";
+		config_.reset();
 		return -EINVAL;
 	}
 
-	/* Only one stream is supported. */
-	camera3_stream_t *camera3Stream = stream_list->streams[0];
-	StreamConfiguration *streamConfiguration = &config_->at(0);
-	streamConfiguration->size.width = camera3Stream->width;
-	streamConfiguration->size.height = camera3Stream->height;
+	for (unsigned int i = 0; i < config_->size(); ++i) {
+		StreamConfiguration &cfg = config_->at(i);
+		cfg.size = sizes[i];
 
-	/*
-	 * \todo We'll need to translate from Android defined pixel format codes
-	 * to the libcamera image format codes. For now, do not change the
-	 * format returned from Camera::generateConfiguration().
-	 */
+		/*
+		 * \todo We'll need to translate from Android defined pixel
+		 * format codes to the libcamera image format codes. For now,
+		 * only request NV12 for the sources of JPEG streams, and do
+		 * not change the format returned from
+		 * Camera::generateConfiguration() otherwise.
+		 */
+		if (jpegSources[i])
+			cfg.pixelFormat = DRM_FORMAT_NV12;
+	}
 
 	switch (config_->validate()) {
 	case CameraConfiguration::Valid:
@@ -673,7 +894,17 @@ int CameraDevice::configureStreams(camera3_stream_configuration_t *stream_list)
 		return -EINVAL;
 	}
 
-	camera3Stream->max_buffers = streamConfiguration->bufferCount;
+	for (CameraStream &cameraStream : streams_) {
+		const StreamConfiguration &cfg = config_->at(cameraStream.index);
+		camera3_stream_t *camera3Stream = cameraStream.camera3Stream;
+
+		camera3Stream->max_buffers = cfg.bufferCount;
+		camera3Stream->priv = &cameraStream;
+
+		if (camera3Stream->format == HAL_PIXEL_FORMAT_BLOB)
+			cameraStream.encoder =
+				std::make_unique<JpegEncoder>(cfg.size, false);
+	}
 
 	/*
 	 * Once the CameraConfiguration has been adjusted/validated
@@ -686,17 +917,30 @@ int CameraDevice::configureStreams(camera3_stream_configuration_t *stream_list)
 		return ret;
 	}
 
+	ret = allocateInternalBuffers();
+	if (ret)
+		return ret;
+
+	/* Prepare the result metadata skeletons for the new session. */
+	std::unique_ptr<CameraMetadata> partialTemplate =
+		createPartialResultTemplate();
+	std::unique_ptr<CameraMetadata> resultTemplate = createResultTemplate();
+	if (!partialTemplate || !resultTemplate)
+		return -ENOMEM;
+
+	std::lock_guard<std::mutex> locker(mutex_);
+	partialResults_.resultTemplate = std::move(partialTemplate);
+	partialResults_.pool.clear();
+	finalResults_.resultTemplate = std::move(resultTemplate);
+	finalResults_.pool.clear();
+
 	return 0;
 }
 
 int CameraDevice::processCaptureRequest(camera3_capture_request_t *camera3Request)
 {
-	StreamConfiguration *streamConfiguration = &config_->at(0);
-	Stream *stream = streamConfiguration->stream();
-
-	if (camera3Request->num_output_buffers != 1) {
-		LOG(HAL, Error) << "Invalid number of output buffers: "
-				<< camera3Request->num_output_buffers;
+	if (!camera3Request->num_output_buffers) {
+		LOG(HAL, Error) << "No output buffer in request";
 		return -EINVAL;
 	}
 
@@ -711,6 +955,19 @@ int CameraDevice::processCaptureRequest(camera3_capture_request_t *camera3Reques
 		running_ = true;
 	}
 
+	/*
+	 * Settings are only provided when they change. Keep a sorted copy to
+	 * look them up by binary search, as the framework doesn't guarantee
+	 * the order of the entries.
+	 */
+	if (camera3Request->settings) {
+		settings_ = std::make_unique<CameraMetadata>(camera3Request->settings);
+
+		uint8_t jpegQuality;
+		if (settings_->getValue(ANDROID_JPEG_QUALITY, &jpegQuality))
+			jpegQuality_ = jpegQuality;
+	}
+
 	/*
 	 * Queue a request for the Camera with the provided dmabuf file
 	 * descriptors.
@@ -720,122 +977,523 @@ int CameraDevice::processCaptureRequest(camera3_capture_request_t *camera3Reques
 
 	/*
 	 * Save the request descriptors for use at completion time.
-	 * The descriptor and the associated memory reserved here are freed
-	 * at request complete time.
+	 * The descriptor is returned to the pool once all the buffers of
+	 * the request have been returned to the framework.
 	 */
 	Camera3RequestDescriptor *descriptor =
-		new Camera3RequestDescriptor(camera3Request->frame_number,
-					     camera3Request->num_output_buffers);
+		acquireDescriptor(camera3Request->frame_number,
+				  camera3Request->num_output_buffers);
+	descriptor->jpegQuality = jpegQuality_;
+
+	/*
+	 * Keep track of which stream the request belongs to and store the
+	 * native buffer handles, with the buffers of direct streams first.
+	 */
+	unsigned int jpegIndex = descriptor->numBuffers;
 	for (unsigned int i = 0; i < descriptor->numBuffers; ++i) {
-		/*
-		 * Keep track of which stream the request belongs to and store
-		 * the native buffer handles.
-		 *
-		 * \todo Currently we only support one capture buffer. Copy
-		 * all of them to be ready once we'll support more.
-		 */
-		descriptor->buffers[i].stream = camera3Buffers[i].stream;
-		descriptor->buffers[i].buffer = camera3Buffers[i].buffer;
+		const camera3_stream_buffer_t &camera3Buffer = camera3Buffers[i];
+		unsigned int index = camera3Buffer.stream->format == HAL_PIXEL_FORMAT_BLOB
+				   ? --jpegIndex : descriptor->numDirect++;
+
+		descriptor->buffers[index].stream = camera3Buffer.stream;
+		descriptor->buffers[index].buffer = camera3Buffer.buffer;
+		descriptor->buffers[index].acquire_fence = -1;
+		descriptor->buffers[index].release_fence = -1;
+		descriptor->buffers[index].status = CAMERA3_BUFFER_STATUS_OK;
+	}
+
+	Request *request =
+		camera_->createRequest(reinterpret_cast<uint64_t>(descriptor));
+	int ret = 0;
+
+	/* Import the dmabuf descriptors of the direct buffers. */
+	unsigned int imported = 0;
+	for (; imported < descriptor->numDirect; ++imported) {
+		const camera3_stream_buffer_t &camera3Buffer =
+			descriptor->buffers[imported];
+		CameraStream *cameraStream =
+			static_cast<CameraStream *>(camera3Buffer.stream->priv);
+		Stream *stream = config_->at(cameraStream->index).stream();
+
+		FrameBuffer *buffer = importBuffer(*camera3Buffer.buffer);
+		if (!buffer) {
+			LOG(HAL, Error) << "Failed to create buffer";
+			ret = -ENOMEM;
+			break;
+		}
+
+		request->addBuffer(stream, buffer);
+		descriptor->sources[imported] = buffer;
 	}
 
 	/*
-	 * Create a libcamera buffer using the dmabuf descriptors of the first
-	 * and (currently) only supported request buffer.
+	 * JPEG streams are produced from the buffer of their source stream,
+	 * use an internal buffer if the request doesn't contain one.
 	 */
-	const buffer_handle_t camera3Handle = *camera3Buffers[0].buffer;
+	for (unsigned int i = descriptor->numDirect; !ret && i < descriptor->numBuffers; ++i) {
+		CameraStream *cameraStream =
+			static_cast<CameraStream *>(descriptor->buffers[i].stream->priv);
+		Stream *stream = config_->at(cameraStream->index).stream();
+
+		FrameBuffer *buffer = request->findBuffer(stream);
+		if (!buffer) {
+			buffer = acquireInternalBuffer(stream);
+			if (!buffer) {
+				LOG(HAL, Error) << "No internal buffer available";
+				ret = -ENOMEM;
+				break;
+			}
+
+			descriptor->internalBuffers.emplace_back(stream, buffer);
+			request->addBuffer(stream, buffer);
+		}
 
-	std::vector<FrameBuffer::Plane> planes;
-	for (int i = 0; i < 3; i++) {
-		FrameBuffer::Plane plane;
-		plane.fd = FileDescriptor(camera3Handle->data[i]);
-		/*
-		 * Setting length to zero here is OK as the length is only used
-		 * to map the memory of the plane. Libcamera do not need to poke
-		 * at the memory content queued by the HAL.
-		 */
-		plane.length = 0;
-		planes.push_back(std::move(plane));
+		descriptor->sources[i] = buffer;
 	}
 
-	FrameBuffer *buffer = new FrameBuffer(std::move(planes));
-	if (!buffer) {
-		LOG(HAL, Error) << "Failed to create buffer";
-		delete descriptor;
-		return -ENOMEM;
+	if (!ret) {
+		ret = camera_->queueRequest(request);
+		if (ret)
+			LOG(HAL, Error) << "Failed to queue request";
 	}
 
-	Request *request =
-		camera_->createRequest(reinterpret_cast<uint64_t>(descriptor));
-	request->addBuffer(stream, buffer);
-
-	int ret = camera_->queueRequest(request);
 	if (ret) {
-		LOG(HAL, Error) << "Failed to queue request";
 		delete request;
-		delete descriptor;
+		for (unsigned int i = 0; i < imported; ++i)
+			releaseBuffer(*descriptor->buffers[i].buffer);
+		releaseInternalBuffers(descriptor);
+		releaseDescriptor(descriptor);
 		return ret;
 	}
 
 	return 0;
 }
 
+/*
+ * Return the buffers of a request to the framework as soon as they complete.
+ * The first completed buffer also triggers the shutter notification and the
+ * partial result, as the start of exposure is then known.
+ */
+void CameraDevice::bufferComplete(Request *request, FrameBuffer *buffer)
+{
+	Camera3RequestDescriptor *descriptor =
+		reinterpret_cast<Camera3RequestDescriptor *>(request->cookie());
+	std::unique_ptr<CameraMetadata> partialMetadata;
+
+	/* Failed buffers are returned with the final result. */
+	if (buffer->metadata().status != FrameMetadata::FrameSuccess)
+		return;
+
+	if (!descriptor->shutterNotified) {
+		uint64_t timestamp = buffer->metadata().timestamp;
+
+		notifyShutter(descriptor->frameNumber, timestamp);
+		descriptor->shutterNotified = true;
+
+		partialMetadata = getResultMetadata(partialResults_);
+		if (partialMetadata &&
+		    !partialMetadata->updateEntry(ANDROID_SENSOR_TIMESTAMP,
+						  &timestamp, 1)) {
+			LOG(HAL, Error) << "Failed to construct partial result";
+			partialMetadata.reset();
+		}
+	}
+
+	/*
+	 * Copy the source frames of the JPEG buffers before the buffer is
+	 * returned. The JPEG buffers are returned separately once encoded,
+	 * those that can't be encoded are returned with the final result.
+	 */
+	for (unsigned int i = descriptor->numDirect; i < descriptor->numBuffers; ++i) {
+		if (descriptor->sources[i] != buffer)
+			continue;
+
+		JpegJob *job = prepareJpeg(descriptor, &descriptor->buffers[i],
+					   buffer);
+		if (!job)
+			continue;
+
+		descriptor->sources[i] = nullptr;
+		descriptor->pendingResults++;
+		jpegWorker_.invokeMethod(&JpegWorker::encode,
+					 ConnectionTypeQueued, job);
+	}
+
+	descriptor->results.clear();
+	for (unsigned int i = 0; i < descriptor->numDirect; ++i) {
+		if (descriptor->sources[i] != buffer)
+			continue;
+
+		descriptor->results.push_back(descriptor->buffers[i]);
+		descriptor->sources[i] = nullptr;
+	}
+
+	if (descriptor->results.empty() && !partialMetadata)
+		return;
+
+	camera3_capture_result_t captureResult = {};
+	captureResult.frame_number = descriptor->frameNumber;
+	captureResult.num_output_buffers = descriptor->results.size();
+	captureResult.output_buffers = descriptor->results.data();
+
+	if (partialMetadata) {
+		captureResult.result = partialMetadata->get();
+		captureResult.partial_result = 1;
+	}
+
+	/*
+	 * The framework may queue the buffers again before
+	 * process_capture_result() returns, release them first.
+	 */
+	releaseBuffers(descriptor->results);
+	callbacks_->process_capture_result(callbacks_, &captureResult);
+
+	/* The framework copies the result metadata, recycle the buffer. */
+	releaseResultMetadata(partialResults_, std::move(partialMetadata));
+}
+
+/*
+ * Complete the request with the final result metadata, and return the buffers
+ * that haven't been returned by bufferComplete() as they have failed.
+ */
 void CameraDevice::requestComplete(Request *request)
 {
-	const std::map<Stream *, FrameBuffer *> &buffers = request->buffers();
-	FrameBuffer *buffer = buffers.begin()->second;
-	camera3_buffer_status status = CAMERA3_BUFFER_STATUS_OK;
+	Camera3RequestDescriptor *descriptor =
+		reinterpret_cast<Camera3RequestDescriptor *>(request->cookie());
 	std::unique_ptr<CameraMetadata> resultMetadata;
 
-	if (request->status() != Request::RequestComplete) {
+	if (request->status() != Request::RequestComplete)
 		LOG(HAL, Error) << "Request not succesfully completed: "
 				<< request->status();
-		status = CAMERA3_BUFFER_STATUS_ERROR;
+
+	releaseInternalBuffers(descriptor);
+
+	descriptor->results.clear();
+	for (unsigned int i = 0; i < descriptor->numBuffers; ++i) {
+		if (!descriptor->sources[i])
+			continue;
+
+		camera3_stream_buffer_t &camera3Buffer = descriptor->buffers[i];
+		camera3Buffer.status = CAMERA3_BUFFER_STATUS_ERROR;
+		descriptor->results.push_back(camera3Buffer);
+
+		if (descriptor->shutterNotified)
+			notifyError(descriptor->frameNumber, camera3Buffer.stream,
+				    CAMERA3_MSG_ERROR_BUFFER);
 	}
 
-	/* Prepare to call back the Android camera stack. */
-	Camera3RequestDescriptor *descriptor =
-		reinterpret_cast<Camera3RequestDescriptor *>(request->cookie());
+	if (!descriptor->shutterNotified) {
+		/* No buffer has completed, the whole request has failed. */
+		notifyError(descriptor->frameNumber,
+			    descriptor->buffers[0].stream);
+	} else {
+		if (request->status() == Request::RequestComplete)
+			resultMetadata = getResultMetadata(finalResults_);
+
+		if (!resultMetadata || !resultMetadata->isValid()) {
+			LOG(HAL, Error) << "Failed to construct result metadata";
+			notifyError(descriptor->frameNumber, nullptr,
+				    CAMERA3_MSG_ERROR_RESULT);
+		}
+	}
 
 	camera3_capture_result_t captureResult = {};
 	captureResult.frame_number = descriptor->frameNumber;
-	captureResult.num_output_buffers = descriptor->numBuffers;
-	for (unsigned int i = 0; i < descriptor->numBuffers; ++i) {
+	captureResult.num_output_buffers = descriptor->results.size();
+	captureResult.output_buffers = descriptor->results.data();
+
+	if (resultMetadata && resultMetadata->isValid()) {
+		captureResult.result = resultMetadata->get();
+		captureResult.partial_result = PartialResultCount;
+	}
+
+	releaseBuffers(descriptor->results);
+	if (captureResult.num_output_buffers || captureResult.result)
+		callbacks_->process_capture_result(callbacks_, &captureResult);
+
+	/* The framework copies the result metadata, recycle the buffer. */
+	releaseResultMetadata(finalResults_, std::move(resultMetadata));
+
+	if (--descriptor->pendingResults == 0)
+		releaseDescriptor(descriptor);
+}
+
+/*
+ * Copy the source frame of a JPEG buffer, for encoding in the JPEG thread.
+ */
+CameraDevice::JpegJob *CameraDevice::prepareJpeg(Camera3RequestDescriptor *descriptor,
+						 camera3_stream_buffer_t *buffer,
+						 FrameBuffer *source)
+{
+	CameraStream *cameraStream =
+		static_cast<CameraStream *>(buffer->stream->priv);
+	const StreamConfiguration &cfg = config_->at(cameraStream->index);
+
+	/*
+	 * The source is NV12, with the chroma plane following the luma plane
+	 * when both share the same dmabuf.
+	 *
+	 * \todo Take the line stride into account when it gets reported by
+	 * the stream configuration.
+	 */
+	size_t lumaSize = cfg.size.width * cfg.size.height;
+	size_t chromaSize = lumaSize / 2;
+
+	MappedBuffer mapped(source);
+	const uint8_t *y = mapped.data(0);
+	const uint8_t *uv = nullptr;
+
+	if (mapped.count() > 1 && mapped.length(1) >= chromaSize)
+		uv = mapped.data(1);
+	else if (mapped.length(0) >= lumaSize + chromaSize)
+		uv = y + lumaSize;
+
+	if (!y || !uv) {
+		LOG(HAL, Error) << "Invalid JPEG source buffer";
+		return nullptr;
+	}
+
+	JpegJob *job = new JpegJob();
+	job->descriptor = descriptor;
+	job->buffer = buffer;
+	job->encoder = cameraStream->encoder.get();
+	job->size = cfg.size;
+	job->frame.resize(lumaSize + chromaSize);
+	memcpy(job->frame.data(), y, lumaSize);
+	memcpy(job->frame.data() + lumaSize, uv, chromaSize);
+
+	return job;
+}
+
+/*
+ * Return an encoded JPEG buffer to the framework. This is called in the JPEG
+ * thread.
+ */
+void CameraDevice::jpegEncoded(JpegJob *job)
+{
+	Camera3RequestDescriptor *descriptor = job->descriptor;
+
+	if (job->buffer->status == CAMERA3_BUFFER_STATUS_ERROR)
+		notifyError(descriptor->frameNumber, job->buffer->stream,
+			    CAMERA3_MSG_ERROR_BUFFER);
+
+	camera3_capture_result_t captureResult = {};
+	captureResult.frame_number = descriptor->frameNumber;
+	captureResult.num_output_buffers = 1;
+	captureResult.output_buffers = job->buffer;
+
+	callbacks_->process_capture_result(callbacks_, &captureResult);
+
+	delete job;
+
+	if (--descriptor->pendingResults == 0)
+		releaseDescriptor(descriptor);
+}
+
+CameraDevice::Camera3RequestDescriptor *
+CameraDevice::acquireDescriptor(unsigned int frameNumber, unsigned int numBuffers)
+{
+	std::unique_ptr<Camera3RequestDescriptor> descriptor;
+
+	{
+		std::lock_guard<std::mutex> locker(mutex_);
+
+		if (!descriptorPool_.empty()) {
+			descriptor = std::move(descriptorPool_.back());
+			descriptorPool_.pop_back();
+		}
+	}
+
+	if (!descriptor)
+		descriptor = std::make_unique<Camera3RequestDescriptor>();
+
+	descriptor->reset(frameNumber, numBuffers);
+
+	return descriptor.release();
+}
+
+void CameraDevice::releaseDescriptor(Camera3RequestDescriptor *descriptor)
+{
+	std::lock_guard<std::mutex> locker(mutex_);
+	descriptorPool_.emplace_back(descriptor);
+}
+
+/*
+ * Retrieve the libcamera buffer wrapping the gralloc buffer \a camera3Handle.
+ *
+ * Creating a new FrameBuffer for every request duplicates the dmabuf file
+ * descriptors, which defeats the V4L2 buffer cache and forces the driver to
+ * map the buffer again. Buffers are instead imported once and cached by
+ * handle. As Android may reuse a handle for a different buffer, the cache
+ * entry is validated against the inode of the first dmabuf.
+ */
+FrameBuffer *CameraDevice::importBuffer(buffer_handle_t camera3Handle)
+{
+	struct stat st;
+	if (fstat(camera3Handle->data[0], &st) < 0) {
+		LOG(HAL, Error) << "Invalid buffer handle";
+		return nullptr;
+	}
+
+	std::lock_guard<std::mutex> locker(mutex_);
+
+	auto it = bufferCache_.find(camera3Handle);
+	if (it != bufferCache_.end()) {
+		CachedBuffer &cached = it->second;
+
+		if (cached.inode == st.st_ino && !cached.busy) {
+			cached.busy = true;
+			cached.lastUsed = ++bufferUseCount_;
+			return cached.buffer.get();
+		}
+
+		if (cached.busy) {
+			LOG(HAL, Error) << "Buffer queued twice";
+			return nullptr;
+		}
+
+		bufferCache_.erase(it);
+	}
+
+	/* Evict the least recently used idle buffer if the cache is full. */
+	if (bufferCache_.size() >= MaxCachedBuffers) {
+		auto lru = bufferCache_.end();
+		for (auto entry = bufferCache_.begin(); entry != bufferCache_.end(); ++entry) {
+			if (entry->second.busy)
+				continue;
+
+			if (lru == bufferCache_.end() ||
+			    entry->second.lastUsed < lru->second.lastUsed)
+				lru = entry;
+		}
+
+		if (lru != bufferCache_.end())
+			bufferCache_.erase(lru);
+	}
+
+	std::vector<FrameBuffer::Plane> planes;
+	for (int i = 0; i < 3; i++) {
+		FrameBuffer::Plane plane;
+		plane.fd = FileDescriptor(camera3Handle->data[i]);
 		/*
-		 * \todo Currently we only support one capture buffer. Prepare
-		 * all of them to be ready once we'll support more.
+		 * Setting length to zero here is OK as the length is only used
+		 * to map the memory of the plane. Libcamera do not need to poke
+		 * at the memory content queued by the HAL.
 		 */
-		descriptor->buffers[i].acquire_fence = -1;
-		descriptor->buffers[i].release_fence = -1;
-		descriptor->buffers[i].status = status;
+		plane.length = 0;
+		planes.push_back(std::move(plane));
 	}
-	captureResult.output_buffers =
-		const_cast<const camera3_stream_buffer_t *>(descriptor->buffers);
 
-	if (status == CAMERA3_BUFFER_STATUS_OK) {
-		notifyShutter(descriptor->frameNumber,
-			      buffer->metadata().timestamp);
+	CachedBuffer &cached = bufferCache_[camera3Handle];
+	cached.buffer = std::make_unique<FrameBuffer>(std::move(planes));
+	cached.inode = st.st_ino;
+	cached.busy = true;
+	cached.lastUsed = ++bufferUseCount_;
 
-		captureResult.partial_result = 1;
-		resultMetadata = getResultMetadata(descriptor->frameNumber,
-						   buffer->metadata().timestamp);
-		captureResult.result = resultMetadata->get();
+	bufferCacheMisses_++;
+	LOG(HAL, Debug) << "Imported buffer " << camera3Handle << ", "
+			<< bufferCache_.size() << " buffers cached, "
+			<< bufferCacheMisses_ << " misses";
+
+	return cached.buffer.get();
+}
+
+void CameraDevice::releaseBuffer(buffer_handle_t camera3Handle)
+{
+	std::lock_guard<std::mutex> locker(mutex_);
+
+	auto it = bufferCache_.find(camera3Handle);
+	if (it != bufferCache_.end())
+		it->second.busy = false;
+}
+
+/*
+ * Mark the imported buffers about to be returned to the framework as idle.
+ * Buffers that haven't been imported, such as the JPEG buffers, are ignored.
+ */
+void CameraDevice::releaseBuffers(const std::vector<camera3_stream_buffer_t> &buffers)
+{
+	std::lock_guard<std::mutex> locker(mutex_);
+
+	for (const camera3_stream_buffer_t &camera3Buffer : buffers) {
+		auto it = bufferCache_.find(*camera3Buffer.buffer);
+		if (it != bufferCache_.end())
+			it->second.busy = false;
 	}
+}
 
-	if (status == CAMERA3_BUFFER_STATUS_ERROR || !captureResult.result) {
-		/* \todo Improve error handling. In case we notify an error
-		 * because the metadata generation fails, a shutter event has
-		 * already been notified for this frame number before the error
-		 * is here signalled. Make sure the error path plays well with
-		 * the camera stack state machine.
-		 */
-		notifyError(descriptor->frameNumber,
-			    descriptor->buffers[0].stream);
+/*
+ * Allocate the internal buffers of the JPEG source streams, used when a
+ * request doesn't contain a buffer for the source stream.
+ */
+int CameraDevice::allocateInternalBuffers()
+{
+	std::set<Stream *> sources;
+	for (const CameraStream &cameraStream : streams_) {
+		if (cameraStream.encoder)
+			sources.insert(config_->at(cameraStream.index).stream());
 	}
 
-	callbacks_->process_capture_result(callbacks_, &captureResult);
+	if (sources.empty())
+		return 0;
 
-	delete descriptor;
-	delete buffer;
+	allocator_.reset(FrameBufferAllocator::create(camera_));
+
+	for (Stream *stream : sources) {
+		int ret = allocator_->allocate(stream);
+		if (ret < 0) {
+			LOG(HAL, Error) << "Failed to allocate internal buffers";
+			return ret;
+		}
+
+		std::vector<FrameBuffer *> &pool = internalBuffers_[stream];
+		for (const std::unique_ptr<FrameBuffer> &buffer : allocator_->buffers(stream))
+			pool.push_back(buffer.get());
+	}
+
+	return 0;
+}
+
+FrameBuffer *CameraDevice::acquireInternalBuffer(Stream *stream)
+{
+	std::lock_guard<std::mutex> locker(mutex_);
+
+	auto it = internalBuffers_.find(stream);
+	if (it == internalBuffers_.end() || it->second.empty())
+		return nullptr;
+
+	FrameBuffer *buffer = it->second.back();
+	it->second.pop_back();
+
+	return buffer;
+}
+
+void CameraDevice::releaseInternalBuffers(Camera3RequestDescriptor *descriptor)
+{
+	std::lock_guard<std::mutex> locker(mutex_);
+
+	for (auto const &it : descriptor->internalBuffers)
+		internalBuffers_[it.first].push_back(it.second);
+
+	descriptor->internalBuffers.clear();
+}
+
+/*
+ * Return the number of buffers imported since the cache was last cleared, when
+ * closing the device or configuring streams.
+ */
+unsigned int CameraDevice::bufferCacheMisses()
+{
+	std::lock_guard<std::mutex> locker(mutex_);
+	return bufferCacheMisses_;
+}
+
+void CameraDevice::clearBufferCache()
+{
+	std::lock_guard<std::mutex> locker(mutex_);
+	bufferCache_.clear();
+	bufferUseCount_ = 0;
+	bufferCacheMisses_ = 0;
 }
 
 void CameraDevice::notifyShutter(uint32_t frameNumber, uint64_t timestamp)
@@ -849,50 +1507,37 @@ void CameraDevice::notifyShutter(uint32_t frameNumber, uint64_t timestamp)
 	callbacks_->notify(callbacks_, &notify);
 }
 
-void CameraDevice::notifyError(uint32_t frameNumber, camera3_stream_t *stream)
+void CameraDevice::notifyError(uint32_t frameNumber, camera3_stream_t *stream,
+			       camera3_error_msg_code_t code)
 {
 	camera3_notify_msg_t notify = {};
 
 	notify.type = CAMERA3_MSG_ERROR;
 	notify.message.error.error_stream = stream;
 	notify.message.error.frame_number = frameNumber;
-	notify.message.error.error_code = CAMERA3_MSG_ERROR_REQUEST;
+	notify.message.error.error_code = code;
 
 	callbacks_->notify(callbacks_, &notify);
 }
 
 /*
- * Produce a set of fixed result metadata.
+ * Produce the partial result metadata skeleton for the configured session,
+ * with the sensor values known at the start of exposure. The timestamp is
+ * updated in place for every frame.
  */
-std::unique_ptr<CameraMetadata> CameraDevice::getResultMetadata(int frame_number,
-								int64_t timestamp)
+std::unique_ptr<CameraMetadata> CameraDevice::createPartialResultTemplate()
 {
 	/*
 	 * \todo Keep this in sync with the actual number of entries.
-	 * Currently: 12 entries, 36 bytes
+	 * Currently: 5 entries, 41 bytes
 	 */
 	std::unique_ptr<CameraMetadata> resultMetadata =
-		std::make_unique<CameraMetadata>(15, 50);
+		std::make_unique<CameraMetadata>(5, 50);
 	if (!resultMetadata->isValid()) {
-		LOG(HAL, Error) << "Failed to allocate static metadata";
+		LOG(HAL, Error) << "Failed to allocate partial result metadata";
 		return nullptr;
 	}
 
-	const uint8_t ae_state = ANDROID_CONTROL_AE_STATE_CONVERGED;
-	resultMetadata->addEntry(ANDROID_CONTROL_AE_STATE, &ae_state, 1);
-
-	const uint8_t ae_lock = ANDROID_CONTROL_AE_LOCK_OFF;
-	resultMetadata->addEntry(ANDROID_CONTROL_AE_LOCK, &ae_lock, 1);
-
-	uint8_t af_state = ANDROID_CONTROL_AF_STATE_INACTIVE;
-	resultMetadata->addEntry(ANDROID_CONTROL_AF_STATE, &af_state, 1);
-
-	const uint8_t awb_state = ANDROID_CONTROL_AWB_STATE_CONVERGED;
-	resultMetadata->addEntry(ANDROID_CONTROL_AWB_STATE, &awb_state, 1);
-
-	const uint8_t awb_lock = ANDROID_CONTROL_AWB_LOCK_OFF;
-	resultMetadata->addEntry(ANDROID_CONTROL_AWB_LOCK, &awb_lock, 1);
-
 	const uint8_t lens_state = ANDROID_LENS_STATE_STATIONARY;
 	resultMetadata->addEntry(ANDROID_LENS_STATE, &lens_state, 1);
 
@@ -901,6 +1546,7 @@ std::unique_ptr<CameraMetadata> CameraDevice::getResultMetadata(int frame_number
 	};
 	resultMetadata->addEntry(ANDROID_SCALER_CROP_REGION, sensorSizes, 4);
 
+	const int64_t timestamp = 0;
 	resultMetadata->addEntry(ANDROID_SENSOR_TIMESTAMP, &timestamp, 1);
 
 	/* 33.3 msec */
@@ -913,6 +1559,46 @@ std::unique_ptr<CameraMetadata> CameraDevice::getResultMetadata(int frame_number
 	resultMetadata->addEntry(ANDROID_SENSOR_EXPOSURE_TIME,
 				 &exposure_time, 1);
 
+	if (!resultMetadata->isValid()) {
+		LOG(HAL, Error) << "Failed to construct partial result metadata";
+		return nullptr;
+	}
+
+	return resultMetadata;
+}
+
+/*
+ * Produce the final result metadata skeleton for the configured session, with
+ * the values known once the request completes.
+ */
+std::unique_ptr<CameraMetadata> CameraDevice::createResultTemplate()
+{
+	/*
+	 * \todo Keep this in sync with the actual number of entries.
+	 * Currently: 7 entries, 7 bytes
+	 */
+	std::unique_ptr<CameraMetadata> resultMetadata =
+		std::make_unique<CameraMetadata>(10, 10);
+	if (!resultMetadata->isValid()) {
+		LOG(HAL, Error) << "Failed to allocate result metadata";
+		return nullptr;
+	}
+
+	const uint8_t ae_state = ANDROID_CONTROL_AE_STATE_CONVERGED;
+	resultMetadata->addEntry(ANDROID_CONTROL_AE_STATE, &ae_state, 1);
+
+	const uint8_t ae_lock = ANDROID_CONTROL_AE_LOCK_OFF;
+	resultMetadata->addEntry(ANDROID_CONTROL_AE_LOCK, &ae_lock, 1);
+
+	uint8_t af_state = ANDROID_CONTROL_AF_STATE_INACTIVE;
+	resultMetadata->addEntry(ANDROID_CONTROL_AF_STATE, &af_state, 1);
+
+	const uint8_t awb_state = ANDROID_CONTROL_AWB_STATE_CONVERGED;
+	resultMetadata->addEntry(ANDROID_CONTROL_AWB_STATE, &awb_state, 1);
+
+	const uint8_t awb_lock = ANDROID_CONTROL_AWB_LOCK_OFF;
+	resultMetadata->addEntry(ANDROID_CONTROL_AWB_LOCK, &awb_lock, 1);
+
 	const uint8_t lens_shading_map_mode =
 				ANDROID_STATISTICS_LENS_SHADING_MAP_MODE_OFF;
 	resultMetadata->addEntry(ANDROID_STATISTICS_LENS_SHADING_MAP_MODE,
@@ -922,13 +1608,53 @@ std::unique_ptr<CameraMetadata> CameraDevice::getResultMetadata(int frame_number
 	resultMetadata->addEntry(ANDROID_STATISTICS_SCENE_FLICKER,
 				 &scene_flicker, 1);
 
-	/*
-	 * Return the result metadata pack even is not valid: get() will return
-	 * nullptr.
-	 */
 	if (!resultMetadata->isValid()) {
 		LOG(HAL, Error) << "Failed to construct result metadata";
+		return nullptr;
+	}
+
+	return resultMetadata;
+}
+
+/*
+ * Produce result metadata from the session template of \a results. Result
+ * metadata buffers are copies of the template, recycled through a pool, and
+ * only the per-frame values are updated by the caller. In steady state this
+ * doesn't allocate memory.
+ *
+ * \todo Update the exposure time and 3A states in place once pipeline handlers
+ * report them.
+ */
+std::unique_ptr<CameraMetadata> CameraDevice::getResultMetadata(ResultMetadataPool &results)
+{
+	std::unique_ptr<CameraMetadata> resultMetadata;
+
+	{
+		std::lock_guard<std::mutex> locker(mutex_);
+
+		if (!results.pool.empty()) {
+			resultMetadata = std::move(results.pool.back());
+			results.pool.pop_back();
+		}
+	}
+
+	if (!resultMetadata) {
+		if (!results.resultTemplate)
+			return nullptr;
+
+		resultMetadata = std::make_unique<CameraMetadata>(results.resultTemplate->get());
+		resultMetadataAllocations_++;
 	}
 
 	return resultMetadata;
 }
+
+void CameraDevice::releaseResultMetadata(ResultMetadataPool &results,
+					 std::unique_ptr<CameraMetadata> resultMetadata)
+{
+	if (!resultMetadata || !resultMetadata->isValid())
+		return;
+
+	std::lock_guard<std::mutex> locker(mutex_);
+	results.pool.push_back(std::move(resultMetadata));
+}
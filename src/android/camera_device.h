@@ -7,16 +7,26 @@
 #ifndef __ANDROID_CAMERA_DEVICE_H__
 #define __ANDROID_CAMERA_DEVICE_H__
 
+#include <atomic>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <sys/types.h>
+#include <vector>
 
 #include <hardware/camera3.h>
 
 #include <libcamera/buffer.h>
 #include <libcamera/camera.h>
+#include <libcamera/framebuffer_allocator.h>
+#include <libcamera/object.h>
 #include <libcamera/request.h>
+#include <libcamera/signal.h>
 #include <libcamera/stream.h>
 
+#include "jpeg_encoder.h"
 #include "message.h"
+#include "thread.h"
 
 class CameraMetadata;
 
@@ -37,23 +47,108 @@ public:
 	const camera_metadata_t *constructDefaultRequestSettings(int type);
 	int configureStreams(camera3_stream_configuration_t *stream_list);
 	int processCaptureRequest(camera3_capture_request_t *request);
+	void bufferComplete(libcamera::Request *request,
+			    libcamera::FrameBuffer *buffer);
 	void requestComplete(libcamera::Request *request);
 
+	/* Statistics of the recycled resources, for testing purpose. */
+	unsigned int bufferCacheMisses();
+	unsigned int resultMetadataAllocations() const { return resultMetadataAllocations_; }
+
 private:
+	struct CameraStream {
+		CameraStream(camera3_stream_t *camera3Stream, unsigned int index)
+			: camera3Stream(camera3Stream), index(index)
+		{
+		}
+
+		camera3_stream_t *camera3Stream;
+		/* Index of the libcamera stream in the camera configuration */
+		unsigned int index;
+		/* Encoder for BLOB streams, produced from the libcamera stream */
+		std::unique_ptr<JpegEncoder> encoder;
+	};
+
 	struct Camera3RequestDescriptor {
-		Camera3RequestDescriptor(unsigned int frameNumber,
-					 unsigned int numBuffers);
-		~Camera3RequestDescriptor();
+		void reset(unsigned int frameNumber, unsigned int numBuffers);
 
 		uint32_t frameNumber;
 		uint32_t numBuffers;
-		camera3_stream_buffer_t *buffers;
+		/* Direct buffers first, followed by the JPEG buffers */
+		std::vector<camera3_stream_buffer_t> buffers;
+		/* libcamera buffers of the pending buffers, nullptr once returned */
+		std::vector<libcamera::FrameBuffer *> sources;
+		/* Storage for the buffers sent in a capture result */
+		std::vector<camera3_stream_buffer_t> results;
+		unsigned int numDirect;
+		unsigned int jpegQuality;
+		bool shutterNotified;
+		std::vector<std::pair<libcamera::Stream *, libcamera::FrameBuffer *>> internalBuffers;
+		/* Request completion and JPEG buffers still to be returned */
+		std::atomic<unsigned int> pendingResults;
+	};
+
+	struct ResultMetadataPool {
+		std::unique_ptr<CameraMetadata> resultTemplate;
+		std::vector<std::unique_ptr<CameraMetadata>> pool;
 	};
 
+	struct JpegJob {
+		Camera3RequestDescriptor *descriptor;
+		camera3_stream_buffer_t *buffer;
+		JpegEncoder *encoder;
+		std::vector<uint8_t> frame;
+		libcamera::Size size;
+	};
+
+	class JpegWorker : public libcamera::Object
+	{
+	public:
+		void encode(JpegJob *job);
+		void flush() {}
+
+		libcamera::Signal<JpegJob *> encoded;
+	};
+
+	struct CachedBuffer {
+		std::unique_ptr<libcamera::FrameBuffer> buffer;
+		ino_t inode;
+		/*
+		 * Set while the buffer is queued to the camera. Every path that
+		 * returns the buffer to the framework shall clear it before
+		 * doing so, as the framework may queue the buffer again before
+		 * process_capture_result() returns.
+		 */
+		bool busy;
+		uint64_t lastUsed;
+	};
+
+	Camera3RequestDescriptor *acquireDescriptor(unsigned int frameNumber,
+						    unsigned int numBuffers);
+	void releaseDescriptor(Camera3RequestDescriptor *descriptor);
+
+	libcamera::FrameBuffer *importBuffer(buffer_handle_t camera3Handle);
+	void releaseBuffer(buffer_handle_t camera3Handle);
+	void releaseBuffers(const std::vector<camera3_stream_buffer_t> &buffers);
+	void clearBufferCache();
+
+	int allocateInternalBuffers();
+	libcamera::FrameBuffer *acquireInternalBuffer(libcamera::Stream *stream);
+	void releaseInternalBuffers(Camera3RequestDescriptor *descriptor);
+
+	JpegJob *prepareJpeg(Camera3RequestDescriptor *descriptor,
+			     camera3_stream_buffer_t *buffer,
+			     libcamera::FrameBuffer *source);
+	void jpegEncoded(JpegJob *job);
+
 	void notifyShutter(uint32_t frameNumber, uint64_t timestamp);
-	void notifyError(uint32_t frameNumber, camera3_stream_t *stream);
-	std::unique_ptr<CameraMetadata> getResultMetadata(int frame_number,
-							  int64_t timestamp);
+	void notifyError(uint32_t frameNumber, camera3_stream_t *stream,
+			 camera3_error_msg_code_t code = CAMERA3_MSG_ERROR_REQUEST);
+	std::unique_ptr<CameraMetadata> createPartialResultTemplate();
+	std::unique_ptr<CameraMetadata> createResultTemplate();
+	std::unique_ptr<CameraMetadata> getResultMetadata(ResultMetadataPool &results);
+	void releaseResultMetadata(ResultMetadataPool &results,
+				   std::unique_ptr<CameraMetadata> resultMetadata);
 
 	unsigned int id_;
 	camera3_device_t camera3Device_;
@@ -61,10 +156,35 @@ private:
 	bool running_;
 	std::shared_ptr<libcamera::Camera> camera_;
 	std::unique_ptr<libcamera::CameraConfiguration> config_;
+	std::vector<CameraStream> streams_;
+	std::unique_ptr<libcamera::FrameBufferAllocator> allocator_;
+	unsigned int jpegQuality_;
 
 	CameraMetadata *staticMetadata_;
 	std::map<unsigned int, CameraMetadata *> requestTemplates_;
+	/* Settings of the last request that provided them */
+	std::unique_ptr<CameraMetadata> settings_;
 	const camera3_callback_ops_t *callbacks_;
+
+	/*
+	 * Request descriptors, imported buffers and result metadata are
+	 * recycled across requests. They are accessed from the camera service
+	 * thread when queuing requests and from the camera manager thread on
+	 * completion.
+	 */
+	std::mutex mutex_;
+	std::vector<std::unique_ptr<Camera3RequestDescriptor>> descriptorPool_;
+	std::map<buffer_handle_t, CachedBuffer> bufferCache_;
+	ResultMetadataPool partialResults_;
+	ResultMetadataPool finalResults_;
+	std::atomic<unsigned int> resultMetadataAllocations_;
+	uint64_t bufferUseCount_;
+	unsigned int bufferCacheMisses_;
+	std::map<libcamera::Stream *, std::vector<libcamera::FrameBuffer *>> internalBuffers_;
+
+	/* JPEG encoding runs in a separate thread to keep preview running. */
+	libcamera::Thread jpegThread_;
+	JpegWorker jpegWorker_;
 };
 
 #endif /* __ANDROID_CAMERA_DEVICE_H__ */
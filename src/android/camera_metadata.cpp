@@ -7,6 +7,8 @@
 
 #include "camera_metadata.h"
 
+#include <string.h>
+
 #include "log.h"
 
 using namespace libcamera;
@@ -19,6 +21,19 @@ CameraMetadata::CameraMetadata(size_t entryCapacity, size_t dataCapacity)
 	valid_ = metadata_ != nullptr;
 }
 
+/*
+ * Create a copy of \a metadata, sized to fit its entries and data exactly. The
+ * copy is sorted for fast lookups, regardless of the order of the entries in
+ * \a metadata.
+ */
+CameraMetadata::CameraMetadata(const camera_metadata_t *metadata)
+{
+	metadata_ = metadata ? clone_camera_metadata(metadata) : nullptr;
+	valid_ = metadata_ != nullptr;
+
+	sort();
+}
+
 CameraMetadata::~CameraMetadata()
 {
 	if (metadata_)
@@ -46,7 +61,151 @@ bool CameraMetadata::addEntry(uint32_t tag, const void *data, size_t count)
 	return false;
 }
 
+/*
+ * Update the value of an existing entry in place. The update doesn't allocate
+ * memory as long as the new data has the same size as the existing one, which
+ * is the case for all fixed-size entries.
+ */
+bool CameraMetadata::updateEntry(uint32_t tag, const void *data, size_t count)
+{
+	if (!valid_)
+		return false;
+
+	camera_metadata_entry_t entry;
+	int ret = find_camera_metadata_entry(metadata_, tag, &entry);
+	if (!ret)
+		ret = update_camera_metadata_entry(metadata_, entry.index, data,
+						   count, nullptr);
+	if (!ret)
+		return true;
+
+	const char *name = get_camera_metadata_tag_name(tag);
+	if (name)
+		LOG(CameraMetadata, Error)
+			<< "Failed to update tag " << name;
+	else
+		LOG(CameraMetadata, Error)
+			<< "Failed to update unknown tag " << tag;
+
+	return false;
+}
+
+/*
+ * Find the entry for \a tag. Lookups use a binary search on sorted buffers and
+ * a linear scan otherwise, the buffer is thus sorted first if entries have
+ * been added since the last lookup. Sorting reorders the entries but doesn't
+ * modify their contents.
+ */
+bool CameraMetadata::getEntry(uint32_t tag, camera_metadata_ro_entry_t *entry) const
+{
+	if (!valid_)
+		return false;
+
+	sort();
+
+	return !find_camera_metadata_ro_entry(metadata_, tag, entry);
+}
+
+/*
+ * Retrieve the first value of the entry for \a tag. Return false if the entry
+ * doesn't exist, is empty, or if its type doesn't match the type of \a value.
+ */
+bool CameraMetadata::getValue(uint32_t tag, uint8_t *value) const
+{
+	const void *data = findValue(tag, TYPE_BYTE);
+	if (!data)
+		return false;
+
+	memcpy(value, data, sizeof(*value));
+	return true;
+}
+
+bool CameraMetadata::getValue(uint32_t tag, int32_t *value) const
+{
+	const void *data = findValue(tag, TYPE_INT32);
+	if (!data)
+		return false;
+
+	memcpy(value, data, sizeof(*value));
+	return true;
+}
+
+bool CameraMetadata::getValue(uint32_t tag, float *value) const
+{
+	const void *data = findValue(tag, TYPE_FLOAT);
+	if (!data)
+		return false;
+
+	memcpy(value, data, sizeof(*value));
+	return true;
+}
+
+bool CameraMetadata::getValue(uint32_t tag, int64_t *value) const
+{
+	const void *data = findValue(tag, TYPE_INT64);
+	if (!data)
+		return false;
+
+	memcpy(value, data, sizeof(*value));
+	return true;
+}
+
+bool CameraMetadata::getValue(uint32_t tag, double *value) const
+{
+	const void *data = findValue(tag, TYPE_DOUBLE);
+	if (!data)
+		return false;
+
+	memcpy(value, data, sizeof(*value));
+	return true;
+}
+
+bool CameraMetadata::getValue(uint32_t tag, camera_metadata_rational_t *value) const
+{
+	const void *data = findValue(tag, TYPE_RATIONAL);
+	if (!data)
+		return false;
+
+	memcpy(value, data, sizeof(*value));
+	return true;
+}
+
+/*
+ * Return the buffers sorted by tag, so that the camera service benefits from
+ * fast lookups too.
+ */
 camera_metadata_t *CameraMetadata::get()
 {
-	return valid_ ? metadata_ : nullptr;
+	if (!valid_)
+		return nullptr;
+
+	sort();
+
+	return metadata_;
+}
+
+/*
+ * Sorting is a no-op on buffers already sorted, adding an entry clears the
+ * sorted flag.
+ */
+void CameraMetadata::sort() const
+{
+	if (metadata_)
+		sort_camera_metadata(metadata_);
+}
+
+const void *CameraMetadata::findValue(uint32_t tag, uint8_t type) const
+{
+	camera_metadata_ro_entry_t entry;
+	if (!getEntry(tag, &entry) || !entry.count)
+		return nullptr;
+
+	if (entry.type != type) {
+		LOG(CameraMetadata, Error)
+			<< "Invalid type " << static_cast<unsigned int>(entry.type)
+			<< " for tag " << tag;
+		return nullptr;
+	}
+
+	return entry.data.u8;
 }
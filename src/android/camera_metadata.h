@@ -15,14 +15,30 @@ class CameraMetadata
 {
 public:
 	CameraMetadata(size_t entryCapacity, size_t dataCapacity);
+	CameraMetadata(const camera_metadata_t *metadata);
 	~CameraMetadata();
 
+	CameraMetadata(const CameraMetadata &) = delete;
+	CameraMetadata &operator=(const CameraMetadata &) = delete;
+
 	bool isValid() { return valid_; }
 	bool addEntry(uint32_t tag, const void *data, size_t data_count);
+	bool updateEntry(uint32_t tag, const void *data, size_t data_count);
+
+	bool getEntry(uint32_t tag, camera_metadata_ro_entry_t *entry) const;
+	bool getValue(uint32_t tag, uint8_t *value) const;
+	bool getValue(uint32_t tag, int32_t *value) const;
+	bool getValue(uint32_t tag, float *value) const;
+	bool getValue(uint32_t tag, int64_t *value) const;
+	bool getValue(uint32_t tag, double *value) const;
+	bool getValue(uint32_t tag, camera_metadata_rational_t *value) const;
 
 	camera_metadata_t *get();
 
 private:
+	void sort() const;
+	const void *findValue(uint32_t tag, uint8_t type) const;
+
 	camera_metadata_t *metadata_;
 	bool valid_;
 };
@@ -0,0 +1,211 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * Copyright (C) 2020, Google Inc.
+ *
+ * jpeg_encoder.cpp - Software JPEG encoder for the Android HAL
+ */
+
+#include "jpeg_encoder.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <setjmp.h>
+#include <string.h>
+
+#include <jerror.h>
+
+#include "log.h"
+
+using namespace libcamera;
+
+LOG_DECLARE_CATEGORY(HAL);
+
+namespace {
+
+/*
+ * libjpeg reports errors by calling error_exit, which must not return. Jump
+ * back to the encoder instead of terminating the process.
+ */
+struct ErrorManager {
+	struct jpeg_error_mgr pub;
+	jmp_buf env;
+};
+
+void errorExit(j_common_ptr cinfo)
+{
+	ErrorManager *err = reinterpret_cast<ErrorManager *>(cinfo->err);
+
+	char message[JMSG_LENGTH_MAX];
+	(*cinfo->err->format_message)(cinfo, message);
+	LOG(HAL, Error) << "JPEG encoding failed: " << message;
+
+	longjmp(err->env, 1);
+}
+
+/*
+ * Write the compressed data directly to the destination buffer. Running out
+ * of space is an error, as the destination can't grow.
+ */
+void initDestination(j_compress_ptr cinfo)
+{
+}
+
+boolean emptyOutputBuffer(j_compress_ptr cinfo)
+{
+	ERREXIT(cinfo, JERR_BUFFER_SIZE);
+	return FALSE;
+}
+
+void termDestination(j_compress_ptr cinfo)
+{
+}
+
+} /* namespace */
+
+/*
+ * The encoder compresses NV12 or NV21 frames in raw data mode, feeding the
+ * luma and subsampled chroma planes to libjpeg without colour conversion or
+ * resampling. Only the chroma samples need to be deinterleaved, one MCU row at
+ * a time.
+ *
+ * In raw data mode libjpeg reads full blocks, rows are thus padded to the MCU
+ * width by replicating their last pixel. The luma rows are used in place when
+ * the width is a multiple of the MCU width, and copied otherwise.
+ *
+ * Encoders are not thread-safe, each encoder must only be used by a single
+ * thread at a time.
+ */
+JpegEncoder::JpegEncoder(const Size &size, bool nv21)
+	: size_(size), nv21_(nv21)
+{
+	compress_.err = jpeg_std_error(&jerr_);
+	jpeg_create_compress(&compress_);
+
+	unsigned int mcuWidth = DCTSIZE * 2;
+	paddedWidth_ = (size_.width + mcuWidth - 1) / mcuWidth * mcuWidth;
+
+	if (paddedWidth_ != size_.width)
+		y_.resize(paddedWidth_ * DCTSIZE * 2);
+
+	cb_.resize(paddedWidth_ / 2 * DCTSIZE);
+	cr_.resize(paddedWidth_ / 2 * DCTSIZE);
+}
+
+JpegEncoder::~JpegEncoder()
+{
+	jpeg_destroy_compress(&compress_);
+}
+
+const uint8_t *JpegEncoder::padLuma(const uint8_t *y, unsigned int row)
+{
+	if (y_.empty())
+		return y;
+
+	uint8_t *dst = &y_[row * paddedWidth_];
+	memcpy(dst, y, size_.width);
+	memset(dst + size_.width, y[size_.width - 1],
+	       paddedWidth_ - size_.width);
+
+	return dst;
+}
+
+void JpegEncoder::packChroma(const uint8_t *uv, unsigned int row)
+{
+	unsigned int chromaWidth = (size_.width + 1) / 2;
+	unsigned int paddedWidth = paddedWidth_ / 2;
+	uint8_t *cb = &cb_[row * paddedWidth];
+	uint8_t *cr = &cr_[row * paddedWidth];
+	const uint8_t *u = nv21_ ? uv + 1 : uv;
+	const uint8_t *v = nv21_ ? uv : uv + 1;
+
+	for (unsigned int x = 0; x < chromaWidth; ++x) {
+		cb[x] = u[x * 2];
+		cr[x] = v[x * 2];
+	}
+
+	for (unsigned int x = chromaWidth; x < paddedWidth; ++x) {
+		cb[x] = cb[chromaWidth - 1];
+		cr[x] = cr[chromaWidth - 1];
+	}
+}
+
+/*
+ * Encode the frame with luma plane \a y and interleaved chroma plane \a uv,
+ * both with line stride \a stride, to the \a size bytes of \a dst. Return the
+ * size of the JPEG data, or a negative error code.
+ */
+int JpegEncoder::encode(const uint8_t *y, const uint8_t *uv,
+			unsigned int stride, uint8_t *dst, size_t size,
+			unsigned int quality)
+{
+	ErrorManager err;
+	struct jpeg_destination_mgr dest;
+	unsigned int chromaHeight = (size_.height + 1) / 2;
+
+	err.pub = jerr_;
+	err.pub.error_exit = errorExit;
+	compress_.err = &err.pub;
+
+	if (setjmp(err.env)) {
+		jpeg_abort_compress(&compress_);
+		compress_.err = &jerr_;
+		return -ENOSPC;
+	}
+
+	dest.next_output_byte = dst;
+	dest.free_in_buffer = size;
+	dest.init_destination = initDestination;
+	dest.empty_output_buffer = emptyOutputBuffer;
+	dest.term_destination = termDestination;
+	compress_.dest = &dest;
+
+	compress_.image_width = size_.width;
+	compress_.image_height = size_.height;
+	compress_.input_components = 3;
+	compress_.in_color_space = JCS_YCbCr;
+
+	jpeg_set_defaults(&compress_);
+	jpeg_set_quality(&compress_, quality, TRUE);
+
+	compress_.raw_data_in = TRUE;
+	compress_.comp_info[0].h_samp_factor = 2;
+	compress_.comp_info[0].v_samp_factor = 2;
+	compress_.comp_info[1].h_samp_factor = 1;
+	compress_.comp_info[1].v_samp_factor = 1;
+	compress_.comp_info[2].h_samp_factor = 1;
+	compress_.comp_info[2].v_samp_factor = 1;
+
+	jpeg_start_compress(&compress_, TRUE);
+
+	JSAMPROW yRows[DCTSIZE * 2];
+	JSAMPROW cbRows[DCTSIZE];
+	JSAMPROW crRows[DCTSIZE];
+	JSAMPARRAY planes[3] = { yRows, cbRows, crRows };
+
+	for (unsigned int i = 0; i < DCTSIZE; ++i) {
+		cbRows[i] = &cb_[i * paddedWidth_ / 2];
+		crRows[i] = &cr_[i * paddedWidth_ / 2];
+	}
+
+	/* Rows past the bottom of the image replicate the last row. */
+	while (compress_.next_scanline < compress_.image_height) {
+		unsigned int line = compress_.next_scanline;
+
+		for (unsigned int i = 0; i < DCTSIZE * 2; ++i) {
+			unsigned int row = std::min(line + i, size_.height - 1);
+			yRows[i] = const_cast<uint8_t *>(padLuma(y + row * stride, i));
+		}
+
+		for (unsigned int i = 0; i < DCTSIZE; ++i) {
+			unsigned int row = std::min(line / 2 + i, chromaHeight - 1);
+			packChroma(uv + row * stride, i);
+		}
+
+		jpeg_write_raw_data(&compress_, planes, DCTSIZE * 2);
+	}
+
+	jpeg_finish_compress(&compress_);
+	compress_.err = &jerr_;
+
+	return size - dest.free_in_buffer;
+}
@@ -0,0 +1,47 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * Copyright (C) 2020, Google Inc.
+ *
+ * jpeg_encoder.h - Software JPEG encoder for the Android HAL
+ */
+#ifndef __ANDROID_JPEG_ENCODER_H__
+#define __ANDROID_JPEG_ENCODER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+#include <jpeglib.h>
+
+#include <libcamera/geometry.h>
+
+class JpegEncoder
+{
+public:
+	JpegEncoder(const libcamera::Size &size, bool nv21);
+	~JpegEncoder();
+
+	int encode(const uint8_t *y, const uint8_t *uv, unsigned int stride,
+		   uint8_t *dst, size_t size, unsigned int quality);
+
+private:
+	const uint8_t *padLuma(const uint8_t *y, unsigned int row);
+	void packChroma(const uint8_t *uv, unsigned int row);
+
+	libcamera::Size size_;
+	bool nv21_;
+	/* Width of the luma plane padded to a multiple of the MCU width */
+	unsigned int paddedWidth_;
+
+	struct jpeg_compress_struct compress_;
+	struct jpeg_error_mgr jerr_;
+
+	/* Padded luma rows of one MCU row, for unaligned widths only */
+	std::vector<uint8_t> y_;
+	/* Deinterleaved and padded chroma rows of one MCU row */
+	std::vector<uint8_t> cb_;
+	std::vector<uint8_t> cr_;
+};
+
+#endif /* __ANDROID_JPEG_ENCODER_H__ */
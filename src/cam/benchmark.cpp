@@ -0,0 +1,462 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2020, Google Inc.
+ *
+ * benchmark.cpp - cam - Capture benchmark
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <errno.h>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <numeric>
+
+#include "benchmark.h"
+
+using namespace libcamera;
+
+namespace {
+
+struct Summary {
+	Summary(std::vector<double> values)
+		: count(values.size()), mean(0), stddev(0), min(0), max(0),
+		  p50(0), p90(0), p99(0)
+	{
+		if (values.empty())
+			return;
+
+		std::sort(values.begin(), values.end());
+
+		mean = std::accumulate(values.begin(), values.end(), 0.0) / count;
+
+		double variance = 0;
+		for (double value : values)
+			variance += (value - mean) * (value - mean);
+		stddev = std::sqrt(variance / count);
+
+		min = values.front();
+		max = values.back();
+		p50 = percentile(values, 50);
+		p90 = percentile(values, 90);
+		p99 = percentile(values, 99);
+	}
+
+	/* Nearest-rank percentile of sorted values. */
+	static double percentile(const std::vector<double> &values, double p)
+	{
+		size_t rank = std::ceil(p / 100 * values.size());
+		return values[std::max<size_t>(rank, 1) - 1];
+	}
+
+	size_t count;
+	double mean;
+	double stddev;
+	double min;
+	double max;
+	double p50;
+	double p90;
+	double p99;
+};
+
+double seconds(const struct timeval &tv)
+{
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+double cpuTime(const struct rusage &usage)
+{
+	return seconds(usage.ru_utime) + seconds(usage.ru_stime);
+}
+
+} /* namespace */
+
+/*
+ * The benchmark ignores the first options.warmup requests, and then measures
+ * the capture performance until options.frames requests have completed or
+ * options.duration seconds have elapsed, whichever comes first.
+ *
+ * Buffers are queued from the application and writer threads, and complete in
+ * the camera manager thread. The buffers are registered before capture starts,
+ * so that the queue time table is only updated, never resized, afterwards.
+ */
+Benchmark::Benchmark(const Options &options, const std::string &name)
+	: options_(options), name_(name), requests_(0), measured_(0), complete_(false),
+	  usageStart_{}, usageEnd_{}
+{
+}
+
+void Benchmark::addStream(Stream *stream, const std::string &name)
+{
+	streams_[stream].name = name;
+}
+
+void Benchmark::addBuffer(FrameBuffer *buffer)
+{
+	queueTime_[buffer] = clock::time_point();
+}
+
+void Benchmark::bufferQueued(FrameBuffer *buffer)
+{
+	auto it = queueTime_.find(buffer);
+	if (it != queueTime_.end())
+		it->second = clock::now();
+}
+
+/*
+ * Account for a completed request. Return true when the benchmark is complete.
+ */
+bool Benchmark::requestCompleted(const std::map<Stream *, FrameBuffer *> &buffers)
+{
+	clock::time_point now = clock::now();
+
+	if (complete_)
+		return true;
+
+	if (requests_++ < options_.warmup) {
+		if (requests_ == options_.warmup) {
+			start_ = now;
+			getrusage(RUSAGE_SELF, &usageStart_);
+		}
+
+		/* Track the sequence and timestamps across the warm-up period. */
+		for (auto const &it : buffers) {
+			StreamStats &stats = streams_[it.first];
+			const FrameMetadata &metadata = it.second->metadata();
+
+			stats.lastTimestamp = metadata.timestamp;
+			stats.lastSequence = metadata.sequence;
+		}
+
+		return false;
+	}
+
+	if (!options_.warmup && !measured_) {
+		start_ = now;
+		getrusage(RUSAGE_SELF, &usageStart_);
+	}
+
+	measured_++;
+
+	for (auto const &it : buffers) {
+		StreamStats &stats = streams_[it.first];
+		FrameBuffer *buffer = it.second;
+		const FrameMetadata &metadata = buffer->metadata();
+
+		stats.frames++;
+
+		if (metadata.status == FrameMetadata::FrameError)
+			stats.errors++;
+
+		for (const FrameMetadata::Plane &plane : metadata.planes)
+			stats.bytes += plane.bytesused;
+
+		if (stats.lastTimestamp) {
+			stats.intervals.push_back((metadata.timestamp - stats.lastTimestamp) / 1000.0);
+
+			if (metadata.sequence > stats.lastSequence + 1) {
+				stats.gaps++;
+				stats.lost += metadata.sequence - stats.lastSequence - 1;
+			}
+		}
+
+		stats.lastTimestamp = metadata.timestamp;
+		stats.lastSequence = metadata.sequence;
+
+		auto queued = queueTime_.find(buffer);
+		if (queued != queueTime_.end() &&
+		    queued->second != clock::time_point()) {
+			std::chrono::duration<double, std::micro> latency =
+				now - queued->second;
+			stats.latencies.push_back(latency.count());
+		}
+	}
+
+	end_ = now;
+	getrusage(RUSAGE_SELF, &usageEnd_);
+
+	if (options_.frames && measured_ >= options_.frames)
+		complete_ = true;
+
+	if (options_.duration &&
+	    now - start_ >= std::chrono::seconds(options_.duration))
+		complete_ = true;
+
+	return complete_;
+}
+
+/*
+ * Print the benchmark results, and write them in JSON format if requested.
+ */
+int Benchmark::report() const
+{
+	return report({ this });
+}
+
+/*
+ * Print the results of benchmarks run concurrently on multiple cameras, followed
+ * by the aggregate results of all cameras. The JSON output of a single camera is
+ * the camera object itself, multiple cameras are reported as an array of camera
+ * objects along with an aggregate object.
+ */
+int Benchmark::report(const std::vector<const Benchmark *> &benchmarks)
+{
+	if (benchmarks.empty())
+		return 0;
+
+	for (const Benchmark *benchmark : benchmarks)
+		benchmark->writeReport(std::cout);
+
+	if (benchmarks.size() > 1)
+		writeAggregateReport(std::cout, benchmarks);
+
+	const std::string &json = benchmarks.front()->options_.json;
+	if (json.empty())
+		return 0;
+
+	return writeJsonFile(json, benchmarks);
+}
+
+int Benchmark::writeJsonFile(const std::string &path,
+			     const std::vector<const Benchmark *> &benchmarks)
+{
+	std::ofstream file;
+	std::ostream *out = &std::cout;
+
+	if (path != "-") {
+		file.open(path);
+		if (!file) {
+			std::cerr << "Failed to open " << path << std::endl;
+			return -EIO;
+		}
+
+		out = &file;
+	}
+
+	if (benchmarks.size() == 1) {
+		benchmarks.front()->writeJson(*out);
+		*out << std::endl;
+		return 0;
+	}
+
+	*out << "{" << std::endl << "  \"cameras\": [";
+
+	bool first = true;
+	for (const Benchmark *benchmark : benchmarks) {
+		*out << (first ? "" : ",") << std::endl << "    ";
+		benchmark->writeJson(*out, "    ");
+		first = false;
+	}
+
+	*out << std::endl << "  ]," << std::endl << "  \"aggregate\": ";
+	writeAggregateJson(*out, benchmarks);
+	*out << std::endl << "}" << std::endl;
+
+	return 0;
+}
+
+void Benchmark::writeReport(std::ostream &out) const
+{
+	std::chrono::duration<double> duration = end_ - start_;
+	double cpu = cpuTime(usageEnd_) - cpuTime(usageStart_);
+	double elapsed = duration.count();
+
+	out << std::fixed << std::setprecision(2) << "Benchmark";
+	if (!name_.empty())
+		out << " " << name_;
+	out << ": " << measured_ << " requests in " << elapsed << "s";
+	if (elapsed)
+		out << ", " << measured_ / elapsed << " requests/s";
+	out << ", CPU time " << cpu << "s";
+	if (elapsed)
+		out << " (" << cpu * 100 / elapsed << "%)";
+	out << std::endl;
+
+	for (auto const &it : streams_) {
+		const StreamStats &stats = it.second;
+		Summary intervals(stats.intervals);
+		Summary latencies(stats.latencies);
+
+		out << "  " << stats.name << ": " << stats.frames << " frames";
+		if (elapsed)
+			out << ", " << stats.frames / elapsed << " fps, "
+			    << stats.bytes / elapsed / 1000000 << " MB/s";
+		out << std::endl;
+
+		out << "    interval: mean " << intervals.mean << "us, jitter "
+		    << intervals.stddev << "us, min " << intervals.min
+		    << "us, max " << intervals.max << "us" << std::endl;
+		out << "    latency: p50 " << latencies.p50 << "us, p90 "
+		    << latencies.p90 << "us, p99 " << latencies.p99
+		    << "us, max " << latencies.max << "us" << std::endl;
+		out << "    sequence gaps: " << stats.gaps << ", lost frames: "
+		    << stats.lost << ", errors: " << stats.errors << std::endl;
+	}
+}
+
+/*
+ * Write the benchmark results as a JSON object. The object is not terminated
+ * with a newline, and all lines but the first are prefixed with \a indent to
+ * allow nesting the object in another one.
+ */
+void Benchmark::writeJson(std::ostream &out, const std::string &indent) const
+{
+	std::chrono::duration<double> duration = end_ - start_;
+	double user = seconds(usageEnd_.ru_utime) - seconds(usageStart_.ru_utime);
+	double system = seconds(usageEnd_.ru_stime) - seconds(usageStart_.ru_stime);
+	const std::string &i = indent;
+
+	out << std::fixed << std::setprecision(3)
+	    << "{" << std::endl;
+	if (!name_.empty())
+		out << i << "  \"name\": \"" << name_ << "\"," << std::endl;
+	out << i << "  \"requests\": " << measured_ << "," << std::endl
+	    << i << "  \"warmup\": " << options_.warmup << "," << std::endl
+	    << i << "  \"duration\": " << duration.count() << "," << std::endl
+	    << i << "  \"cpu\": { \"user\": " << user << ", \"system\": "
+	    << system << " }," << std::endl
+	    << i << "  \"streams\": [";
+
+	bool first = true;
+	for (auto const &it : streams_) {
+		const StreamStats &stats = it.second;
+		Summary intervals(stats.intervals);
+		Summary latencies(stats.latencies);
+
+		out << (first ? "" : ",") << std::endl
+		    << i << "    {" << std::endl
+		    << i << "      \"name\": \"" << stats.name << "\"," << std::endl
+		    << i << "      \"frames\": " << stats.frames << "," << std::endl
+		    << i << "      \"bytes\": " << stats.bytes << "," << std::endl
+		    << i << "      \"interval\": { \"mean\": " << intervals.mean
+		    << ", \"stddev\": " << intervals.stddev
+		    << ", \"min\": " << intervals.min
+		    << ", \"max\": " << intervals.max << " }," << std::endl
+		    << i << "      \"latency\": { \"p50\": " << latencies.p50
+		    << ", \"p90\": " << latencies.p90
+		    << ", \"p99\": " << latencies.p99
+		    << ", \"max\": " << latencies.max << " }," << std::endl
+		    << i << "      \"gaps\": " << stats.gaps << "," << std::endl
+		    << i << "      \"lost\": " << stats.lost << "," << std::endl
+		    << i << "      \"errors\": " << stats.errors << std::endl
+		    << i << "    }";
+
+		first = false;
+	}
+
+	out << std::endl << i << "  ]" << std::endl << i << "}";
+}
+
+/* Aggregate results of benchmarks run concurrently on multiple cameras. */
+struct Benchmark::Aggregate {
+	Aggregate()
+		: requests(0), frames(0), bytes(0), lost(0), errors(0),
+		  elapsed(0), cpu(0)
+	{
+	}
+
+	unsigned int requests;
+	unsigned int frames;
+	uint64_t bytes;
+	unsigned int lost;
+	unsigned int errors;
+	std::vector<double> latencies;
+
+	double elapsed;
+	double cpu;
+};
+
+/*
+ * The measurement windows of the cameras overlap but don't match exactly, the
+ * aggregate covers the union of all windows. Resource usage is sampled for the
+ * whole process, so the aggregate CPU time is likewise computed over the union
+ * instead of summing the per-camera values.
+ */
+Benchmark::Aggregate Benchmark::aggregate(const std::vector<const Benchmark *> &benchmarks)
+{
+	Aggregate result;
+	const Benchmark *first = nullptr;
+	const Benchmark *last = nullptr;
+
+	for (const Benchmark *benchmark : benchmarks) {
+		if (!benchmark->measured_)
+			continue;
+
+		if (!first || benchmark->start_ < first->start_)
+			first = benchmark;
+		if (!last || benchmark->end_ > last->end_)
+			last = benchmark;
+
+		result.requests += benchmark->measured_;
+
+		for (auto const &it : benchmark->streams_) {
+			const StreamStats &stats = it.second;
+
+			result.frames += stats.frames;
+			result.bytes += stats.bytes;
+			result.lost += stats.lost;
+			result.errors += stats.errors;
+			result.latencies.insert(result.latencies.end(),
+						stats.latencies.begin(),
+						stats.latencies.end());
+		}
+	}
+
+	if (!first)
+		return result;
+
+	std::chrono::duration<double> duration = last->end_ - first->start_;
+	result.elapsed = duration.count();
+	result.cpu = cpuTime(last->usageEnd_) - cpuTime(first->usageStart_);
+
+	return result;
+}
+
+void Benchmark::writeAggregateReport(std::ostream &out,
+				     const std::vector<const Benchmark *> &benchmarks)
+{
+	Aggregate result = aggregate(benchmarks);
+	Summary latencies(result.latencies);
+	double elapsed = result.elapsed;
+
+	out << std::fixed << std::setprecision(2)
+	    << "Aggregate: " << benchmarks.size() << " cameras, "
+	    << result.requests << " requests in " << elapsed << "s";
+	if (elapsed)
+		out << ", " << result.frames / elapsed << " fps, "
+		    << result.bytes / elapsed / 1000000 << " MB/s";
+	out << ", CPU time " << result.cpu << "s";
+	if (elapsed)
+		out << " (" << result.cpu * 100 / elapsed << "%)";
+	out << std::endl;
+
+	out << "    latency: p50 " << latencies.p50 << "us, p90 "
+	    << latencies.p90 << "us, p99 " << latencies.p99
+	    << "us, max " << latencies.max << "us" << std::endl;
+	out << "    lost frames: " << result.lost << ", errors: "
+	    << result.errors << std::endl;
+}
+
+void Benchmark::writeAggregateJson(std::ostream &out,
+				   const std::vector<const Benchmark *> &benchmarks)
+{
+	Aggregate result = aggregate(benchmarks);
+	Summary latencies(result.latencies);
+
+	out << std::fixed << std::setprecision(3)
+	    << "{" << std::endl
+	    << "    \"cameras\": " << benchmarks.size() << "," << std::endl
+	    << "    \"requests\": " << result.requests << "," << std::endl
+	    << "    \"frames\": " << result.frames << "," << std::endl
+	    << "    \"bytes\": " << result.bytes << "," << std::endl
+	    << "    \"duration\": " << result.elapsed << "," << std::endl
+	    << "    \"cpu\": " << result.cpu << "," << std::endl
+	    << "    \"latency\": { \"p50\": " << latencies.p50
+	    << ", \"p90\": " << latencies.p90
+	    << ", \"p99\": " << latencies.p99
+	    << ", \"max\": " << latencies.max << " }," << std::endl
+	    << "    \"lost\": " << result.lost << "," << std::endl
+	    << "    \"errors\": " << result.errors << std::endl
+	    << "  }";
+}
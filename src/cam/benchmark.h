@@ -0,0 +1,107 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2020, Google Inc.
+ *
+ * benchmark.h - cam - Capture benchmark
+ */
+#ifndef __CAM_BENCHMARK_H__
+#define __CAM_BENCHMARK_H__
+
+#include <chrono>
+#include <map>
+#include <ostream>
+#include <stdint.h>
+#include <string>
+#include <sys/resource.h>
+#include <vector>
+
+#include <libcamera/buffer.h>
+#include <libcamera/stream.h>
+
+class Benchmark
+{
+public:
+	struct Options {
+		Options()
+			: frames(0), duration(0), warmup(10)
+		{
+		}
+
+		/* Number of requests to measure, 0 for no limit */
+		unsigned int frames;
+		/* Measurement duration in seconds, 0 for no limit */
+		unsigned int duration;
+		/* Number of requests to ignore before measuring */
+		unsigned int warmup;
+		/* JSON output file name, "-" for stdout */
+		std::string json;
+	};
+
+	Benchmark(const Options &options, const std::string &name = "");
+
+	void addStream(libcamera::Stream *stream, const std::string &name);
+	void addBuffer(libcamera::FrameBuffer *buffer);
+
+	void bufferQueued(libcamera::FrameBuffer *buffer);
+	bool requestCompleted(const std::map<libcamera::Stream *,
+					     libcamera::FrameBuffer *> &buffers);
+
+	int report() const;
+	static int report(const std::vector<const Benchmark *> &benchmarks);
+
+private:
+	using clock = std::chrono::steady_clock;
+
+	struct StreamStats {
+		StreamStats()
+			: frames(0), bytes(0), lastTimestamp(0), lastSequence(0),
+			  gaps(0), lost(0), errors(0)
+		{
+		}
+
+		std::string name;
+		unsigned int frames;
+		uint64_t bytes;
+
+		uint64_t lastTimestamp;
+		unsigned int lastSequence;
+		unsigned int gaps;
+		unsigned int lost;
+		unsigned int errors;
+
+		/* Sensor timestamp intervals and queue to completion latencies, in µs */
+		std::vector<double> intervals;
+		std::vector<double> latencies;
+	};
+
+	struct Aggregate;
+
+	static Aggregate aggregate(const std::vector<const Benchmark *> &benchmarks);
+
+	void writeReport(std::ostream &out) const;
+	void writeJson(std::ostream &out, const std::string &indent = "") const;
+
+	static void writeAggregateReport(std::ostream &out,
+					 const std::vector<const Benchmark *> &benchmarks);
+	static void writeAggregateJson(std::ostream &out,
+				       const std::vector<const Benchmark *> &benchmarks);
+	static int writeJsonFile(const std::string &path,
+				 const std::vector<const Benchmark *> &benchmarks);
+
+	Options options_;
+	std::string name_;
+
+	std::map<libcamera::Stream *, StreamStats> streams_;
+	std::map<libcamera::FrameBuffer *, clock::time_point> queueTime_;
+
+	unsigned int requests_;
+	unsigned int measured_;
+	bool complete_;
+
+	clock::time_point start_;
+	clock::time_point end_;
+	struct rusage usageStart_;
+	struct rusage usageEnd_;
+};
+
+#endif /* __CAM_BENCHMARK_H__ */
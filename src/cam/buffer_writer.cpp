@@ -5,80 +5,395 @@
  * buffer_writer.cpp - Buffer writer
  */
 
+#include <algorithm>
+#include <errno.h>
 #include <fcntl.h>
 #include <iomanip>
 #include <iostream>
+#include <limits>
 #include <sstream>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "buffer_writer.h"
 
 using namespace libcamera;
 
-BufferWriter::BufferWriter(const std::string &pattern)
-	: pattern_(pattern)
+namespace {
+
+/* Alignment of the memory, offsets and lengths for direct I/O. */
+constexpr size_t DIRECT_ALIGNMENT = 4096;
+
+/* Size by which the single output file is grown ahead of the writes. */
+constexpr off_t PREALLOC_CHUNK = 64 * 1024 * 1024;
+
+size_t alignUp(size_t value)
+{
+	return (value + DIRECT_ALIGNMENT - 1) / DIRECT_ALIGNMENT * DIRECT_ALIGNMENT;
+}
+
+int writeAll(int fd, const void *data, size_t length, off_t offset)
+{
+	const uint8_t *ptr = static_cast<const uint8_t *>(data);
+
+	while (length) {
+		ssize_t ret = pwrite(fd, ptr, length, offset);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		if (!ret)
+			return -EIO;
+
+		ptr += ret;
+		offset += ret;
+		length -= ret;
+	}
+
+	return 0;
+}
+
+} /* namespace */
+
+BufferWriter::AlignedBuffer::AlignedBuffer()
+	: data_(nullptr), size_(0)
 {
 }
 
+BufferWriter::AlignedBuffer::~AlignedBuffer()
+{
+	free(data_);
+}
+
+void *BufferWriter::AlignedBuffer::reserve(size_t size)
+{
+	if (size <= size_)
+		return data_;
+
+	free(data_);
+	size_ = 0;
+
+	if (posix_memalign(&data_, DIRECT_ALIGNMENT, size)) {
+		data_ = nullptr;
+		return nullptr;
+	}
+
+	size_ = size;
+	return data_;
+}
+
+/*
+ * Frames are written asynchronously by a pool of threads, from a queue bounded
+ * to options.queueDepth frames. Every buffer passed to write() is signalled
+ * through bufferReleased once written or dropped, from the writer threads or
+ * from the caller.
+ *
+ * When the pattern doesn't contain a '#', all frames are appended to a single
+ * file, preallocated ahead of the writes. In direct I/O mode the frames are
+ * then stored at offsets aligned to DIRECT_ALIGNMENT, with zero padding.
+ */
+BufferWriter::BufferWriter(const std::string &pattern, const Options &options)
+	: pattern_(pattern), options_(options), fd_(-1), offset_(0),
+	  allocated_(0), running_(false), stop_(false), bytesWritten_(0),
+	  framesWritten_(0), framesDropped_(0), writeErrors_(0), highWater_(0)
+{
+	options_.threads = std::max(options_.threads, 1U);
+	options_.queueDepth = std::max(options_.queueDepth, 1U);
+}
+
 BufferWriter::~BufferWriter()
 {
+	stop();
+
 	for (auto &iter : mappedBuffers_) {
-		void *memory = iter.second.first;
-		unsigned int length = iter.second.second;
-		munmap(memory, length);
+		for (auto &plane : iter.second) {
+			void *memory = plane.first;
+			unsigned int length = plane.second;
+			munmap(memory, length);
+		}
 	}
 	mappedBuffers_.clear();
 }
 
-void BufferWriter::mapBuffer(FrameBuffer *buffer)
+int BufferWriter::start()
 {
+	if (running_)
+		return 0;
+
+	if (pattern_.find_first_of('#') == std::string::npos) {
+		int flags = O_CREAT | O_WRONLY;
+		mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
+
+		if (options_.direct) {
+			fd_ = open(pattern_.c_str(), flags | O_DIRECT, mode);
+			if (fd_ == -1 && errno == EINVAL) {
+				std::cerr << "Direct I/O not supported for "
+					  << pattern_ << std::endl;
+				options_.direct = false;
+			}
+		}
+
+		if (fd_ == -1)
+			fd_ = open(pattern_.c_str(), flags, mode);
+		if (fd_ == -1)
+			return -errno;
+
+		/* Append to the existing file content. */
+		struct stat st;
+		if (fstat(fd_, &st) < 0) {
+			int ret = -errno;
+			close(fd_);
+			fd_ = -1;
+			return ret;
+		}
+
+		offset_ = options_.direct ? alignUp(st.st_size) : st.st_size;
+		allocated_ = st.st_size;
+	}
+
+	stop_ = false;
+	bytesWritten_ = 0;
+	framesWritten_ = 0;
+	framesDropped_ = 0;
+	writeErrors_ = 0;
+	highWater_ = 0;
+	start_ = std::chrono::steady_clock::now();
+
+	for (unsigned int i = 0; i < options_.threads; ++i)
+		threads_.emplace_back(&BufferWriter::worker, this);
+
+	std::unique_lock<std::mutex> locker(mutex_);
+	running_ = true;
+
+	return 0;
+}
+
+/*
+ * Stop the writer threads once all queued frames have been written, and
+ * report the write statistics.
+ */
+void BufferWriter::stop()
+{
+	if (!running_)
+		return;
+
+	{
+		std::unique_lock<std::mutex> locker(mutex_);
+		stop_ = true;
+	}
+	workCv_.notify_all();
+	spaceCv_.notify_all();
+
+	for (std::thread &thread : threads_)
+		thread.join();
+	threads_.clear();
+
+	if (fd_ != -1) {
+		/* Drop the space preallocated past the last frame. */
+		if (allocated_ > offset_ && ftruncate(fd_, offset_) < 0)
+			std::cerr << "Failed to truncate " << pattern_ << ": "
+				  << strerror(errno) << std::endl;
+
+		close(fd_);
+		fd_ = -1;
+	}
+
+	{
+		std::unique_lock<std::mutex> locker(mutex_);
+		running_ = false;
+	}
+
+	std::chrono::duration<double> duration =
+		std::chrono::steady_clock::now() - start_;
+	double mbytes = bytesWritten_ / 1000000.0;
+	double rate = duration.count() ? mbytes / duration.count() : 0.0;
+
+	std::cout << "Wrote " << framesWritten_ << " frames, "
+		  << std::fixed << std::setprecision(2) << mbytes << " MB at "
+		  << rate << " MB/s, queue high-water mark "
+		  << highWater_ << "/" << options_.queueDepth << ", "
+		  << framesDropped_ << " frames dropped, "
+		  << writeErrors_ << " write errors" << std::endl;
+}
+
+int BufferWriter::mapBuffer(FrameBuffer *buffer)
+{
+	std::vector<std::pair<void *, unsigned int>> &planes =
+		mappedBuffers_[buffer];
+
 	for (const FrameBuffer::Plane &plane : buffer->planes()) {
 		void *memory = mmap(NULL, plane.length, PROT_READ, MAP_SHARED,
 				    plane.fd.fd(), 0);
+		if (memory == MAP_FAILED) {
+			int ret = -errno;
+			std::cerr << "Failed to map buffer: " << strerror(-ret)
+				  << std::endl;
+			return ret;
+		}
+
+		planes.emplace_back(memory, plane.length);
+	}
 
-		mappedBuffers_[plane.fd.fd()] =
-			std::make_pair(memory, plane.length);
+	return 0;
+}
+
+void BufferWriter::write(FrameBuffer *buffer, const std::string &streamName)
+{
+	FrameBuffer *dropped = nullptr;
+
+	{
+		std::unique_lock<std::mutex> locker(mutex_);
+
+		if (!running_ || stop_) {
+			dropped = buffer;
+		} else if (queue_.size() >= options_.queueDepth) {
+			switch (options_.dropPolicy) {
+			case DropNone:
+				spaceCv_.wait(locker, [&] {
+					return stop_ || queue_.size() < options_.queueDepth;
+				});
+				if (stop_)
+					dropped = buffer;
+				break;
+
+			case DropOldest:
+				dropped = queue_.front().buffer;
+				queue_.pop_front();
+				break;
+
+			case DropNewest:
+				dropped = buffer;
+				break;
+			}
+
+			if (dropped)
+				framesDropped_++;
+		}
+
+		if (dropped != buffer) {
+			queue_.push_back({ buffer, streamName });
+			highWater_ = std::max<unsigned int>(highWater_, queue_.size());
+		}
 	}
+
+	if (dropped != buffer)
+		workCv_.notify_one();
+
+	if (dropped)
+		bufferReleased.emit(dropped);
 }
 
-int BufferWriter::write(FrameBuffer *buffer, const std::string &streamName)
+void BufferWriter::worker()
 {
+	AlignedBuffer bounce;
+
+	while (true) {
+		Frame frame;
+
+		{
+			std::unique_lock<std::mutex> locker(mutex_);
+			workCv_.wait(locker, [&] {
+				return stop_ || !queue_.empty();
+			});
+
+			/* Drain the queue before stopping. */
+			if (queue_.empty())
+				return;
+
+			frame = std::move(queue_.front());
+			queue_.pop_front();
+		}
+		spaceCv_.notify_one();
+
+		int ret = writeFrame(frame, &bounce);
+
+		{
+			std::unique_lock<std::mutex> locker(mutex_);
+			if (ret < 0) {
+				writeErrors_++;
+			} else {
+				framesWritten_++;
+				for (const FrameBuffer::Plane &plane : frame.buffer->planes())
+					bytesWritten_ += plane.length;
+			}
+		}
+
+		bufferReleased.emit(frame.buffer);
+	}
+}
+
+int BufferWriter::writeFrame(const Frame &frame, AlignedBuffer *bounce)
+{
+	int ret;
+
+	if (fd_ != -1)
+		ret = writeSingleFile(frame, bounce);
+	else
+		ret = writeFile(frame, bounce);
+
+	if (ret < 0)
+		std::cerr << "write error: " << strerror(-ret) << std::endl;
+
+	return ret;
+}
+
+int BufferWriter::writeFile(const Frame &frame, AlignedBuffer *bounce)
+{
+	FrameBuffer *buffer = frame.buffer;
 	std::string filename;
 	size_t pos;
-	int fd, ret = 0;
+	int fd = -1, ret = 0;
 
 	filename = pattern_;
 	pos = filename.find_first_of('#');
-	if (pos != std::string::npos) {
-		std::stringstream ss;
-		ss << streamName << "-" << std::setw(6)
-		   << std::setfill('0') << buffer->metadata().sequence;
-		filename.replace(pos, 1, ss.str());
+	std::stringstream ss;
+	ss << frame.streamName << "-" << std::setw(6)
+	   << std::setfill('0') << buffer->metadata().sequence;
+	filename.replace(pos, 1, ss.str());
+
+	int flags = O_CREAT | O_WRONLY | O_TRUNC;
+	mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
+
+	/* Fall back to buffered I/O if direct I/O isn't supported. */
+	bool direct = options_.direct;
+	if (direct) {
+		fd = open(filename.c_str(), flags | O_DIRECT, mode);
+		if (fd == -1 && errno == EINVAL)
+			direct = false;
 	}
 
-	fd = open(filename.c_str(), O_CREAT | O_WRONLY |
-		  (pos == std::string::npos ? O_APPEND : O_TRUNC),
-		  S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+	if (fd == -1 && !direct)
+		fd = open(filename.c_str(), flags, mode);
 	if (fd == -1)
 		return -errno;
 
-	for (const FrameBuffer::Plane &plane : buffer->planes()) {
-		void *data = mappedBuffers_[plane.fd.fd()].first;
-		unsigned int length = plane.length;
+	if (direct) {
+		/* Write the padded frame and truncate the padding. */
+		size_t size = copyPlanes(buffer, bounce);
+		if (!size) {
+			close(fd);
+			return -ENOMEM;
+		}
 
-		ret = ::write(fd, data, length);
-		if (ret < 0) {
+		ret = writeAll(fd, bounce->data(), alignUp(size), 0);
+		if (!ret && ftruncate(fd, size) < 0)
 			ret = -errno;
-			std::cerr << "write error: " << strerror(-ret)
-				  << std::endl;
-			break;
-		} else if (ret != (int)length) {
-			std::cerr << "write error: only " << ret
-				  << " bytes written instead of "
-				  << length << std::endl;
-			break;
+	} else {
+		const std::vector<std::pair<void *, unsigned int>> &planes =
+			mappedBuffers_.at(buffer);
+		off_t offset = 0;
+
+		for (const auto &plane : planes) {
+			ret = writeAll(fd, plane.first, plane.second, offset);
+			if (ret < 0)
+				break;
+
+			offset += plane.second;
 		}
 	}
 
@@ -86,3 +401,83 @@ int BufferWriter::write(FrameBuffer *buffer, const std::string &streamName)
 
 	return ret;
 }
+
+int BufferWriter::writeSingleFile(const Frame &frame, AlignedBuffer *bounce)
+{
+	FrameBuffer *buffer = frame.buffer;
+	size_t size = 0;
+	off_t offset;
+
+	for (const FrameBuffer::Plane &plane : buffer->planes())
+		size += plane.length;
+
+	size_t length = options_.direct ? alignUp(size) : size;
+
+	/*
+	 * Reserve space for the frame, growing the file by large chunks to
+	 * limit fragmentation and metadata updates.
+	 */
+	{
+		std::unique_lock<std::mutex> locker(mutex_);
+
+		offset = offset_;
+		offset_ += length;
+
+		if (offset_ > allocated_) {
+			off_t grow = std::max(PREALLOC_CHUNK, offset_ - allocated_);
+			if (!fallocate(fd_, 0, allocated_, grow))
+				allocated_ += grow;
+			else
+				allocated_ = std::numeric_limits<off_t>::max();
+		}
+	}
+
+	if (options_.direct) {
+		if (!copyPlanes(buffer, bounce))
+			return -ENOMEM;
+
+		return writeAll(fd_, bounce->data(), length, offset);
+	}
+
+	const std::vector<std::pair<void *, unsigned int>> &planes =
+		mappedBuffers_.at(buffer);
+
+	for (const auto &plane : planes) {
+		int ret = writeAll(fd_, plane.first, plane.second, offset);
+		if (ret < 0)
+			return ret;
+
+		offset += plane.second;
+	}
+
+	return 0;
+}
+
+/*
+ * Copy the planes of \a buffer to the aligned \a bounce buffer, as direct I/O
+ * can't be performed from the buffer mappings, and clear the padding. Return
+ * the size of the frame, or 0 on allocation failure.
+ */
+size_t BufferWriter::copyPlanes(FrameBuffer *buffer, AlignedBuffer *bounce)
+{
+	const std::vector<std::pair<void *, unsigned int>> &planes =
+		mappedBuffers_.at(buffer);
+	size_t size = 0;
+
+	for (const auto &plane : planes)
+		size += plane.second;
+
+	uint8_t *data = static_cast<uint8_t *>(bounce->reserve(alignUp(size)));
+	if (!data)
+		return 0;
+
+	size_t offset = 0;
+	for (const auto &plane : planes) {
+		memcpy(data + offset, plane.first, plane.second);
+		offset += plane.second;
+	}
+
+	memset(data + size, 0, alignUp(size) - size);
+
+	return size;
+}
@@ -7,25 +7,109 @@
 #ifndef __LIBCAMERA_BUFFER_WRITER_H__
 #define __LIBCAMERA_BUFFER_WRITER_H__
 
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <map>
+#include <mutex>
 #include <string>
+#include <sys/types.h>
+#include <thread>
+#include <vector>
 
 #include <libcamera/buffer.h>
+#include <libcamera/signal.h>
 
 class BufferWriter
 {
 public:
-	BufferWriter(const std::string &pattern = "frame-#.bin");
+	enum DropPolicy {
+		/* Block the caller until the queue has room. */
+		DropNone,
+		/* Discard the oldest queued frame to make room. */
+		DropOldest,
+		/* Discard the frame being queued. */
+		DropNewest,
+	};
+
+	struct Options {
+		Options()
+			: threads(1), queueDepth(4), dropPolicy(DropNewest),
+			  direct(false)
+		{
+		}
+
+		unsigned int threads;
+		unsigned int queueDepth;
+		DropPolicy dropPolicy;
+		bool direct;
+	};
+
+	BufferWriter(const std::string &pattern = "frame-#.bin",
+		     const Options &options = Options());
 	~BufferWriter();
 
-	void mapBuffer(libcamera::FrameBuffer *buffer);
+	int start();
+	void stop();
+
+	int mapBuffer(libcamera::FrameBuffer *buffer);
 
-	int write(libcamera::FrameBuffer *buffer,
-		  const std::string &streamName);
+	void write(libcamera::FrameBuffer *buffer,
+		   const std::string &streamName);
+
+	libcamera::Signal<libcamera::FrameBuffer *> bufferReleased;
 
 private:
+	struct Frame {
+		libcamera::FrameBuffer *buffer;
+		std::string streamName;
+	};
+
+	class AlignedBuffer
+	{
+	public:
+		AlignedBuffer();
+		~AlignedBuffer();
+
+		void *data() const { return data_; }
+		void *reserve(size_t size);
+
+	private:
+		void *data_;
+		size_t size_;
+	};
+
+	void worker();
+	int writeFrame(const Frame &frame, AlignedBuffer *bounce);
+	int writeFile(const Frame &frame, AlignedBuffer *bounce);
+	int writeSingleFile(const Frame &frame, AlignedBuffer *bounce);
+	size_t copyPlanes(libcamera::FrameBuffer *buffer, AlignedBuffer *bounce);
+
 	std::string pattern_;
-	std::map<int, std::pair<void *, unsigned int>> mappedBuffers_;
+	Options options_;
+	std::map<libcamera::FrameBuffer *,
+		 std::vector<std::pair<void *, unsigned int>>> mappedBuffers_;
+
+	/* Single output file, when the pattern contains no '#' */
+	int fd_;
+	off_t offset_;
+	off_t allocated_;
+
+	std::vector<std::thread> threads_;
+	std::mutex mutex_;
+	std::condition_variable workCv_;
+	std::condition_variable spaceCv_;
+	std::deque<Frame> queue_;
+	bool running_;
+	bool stop_;
+
+	/* Statistics */
+	std::chrono::steady_clock::time_point start_;
+	uint64_t bytesWritten_;
+	unsigned int framesWritten_;
+	unsigned int framesDropped_;
+	unsigned int writeErrors_;
+	unsigned int highWater_;
 };
 
 #endif /* __LIBCAMERA_BUFFER_WRITER_H__ */
@@ -16,12 +16,26 @@
 
 using namespace libcamera;
 
-Capture::Capture(std::shared_ptr<Camera> camera, CameraConfiguration *config)
-	: camera_(camera), config_(config), writer_(nullptr)
+Capture::Capture(std::shared_ptr<Camera> camera, CameraConfiguration *config,
+		 const std::string &name)
+	: camera_(camera), config_(config), name_(name), allocator_(nullptr),
+	  writer_(nullptr), capturing_(false), benchmarkDone_(false)
 {
 }
 
-int Capture::run(EventLoop *loop, const OptionsParser::Options &options)
+Capture::~Capture()
+{
+	stop();
+
+	delete writer_;
+	delete allocator_;
+}
+
+/*
+ * Configure the camera and start capturing. The requests complete in the
+ * camera manager thread, capture runs until stop() is called.
+ */
+int Capture::start(const OptionsParser::Options &options)
 {
 	int ret;
 
@@ -30,10 +44,13 @@ int Capture::run(EventLoop *loop, const OptionsParser::Options &options)
 		return -ENODEV;
 	}
 
+	/* Prefix the stream names with the capture name, if any. */
+	std::string prefix = name_.empty() ? "" : name_ + "-";
+
 	streamName_.clear();
 	for (unsigned int index = 0; index < config_->size(); ++index) {
 		StreamConfiguration &cfg = config_->at(index);
-		streamName_[cfg.stream()] = "stream" + std::to_string(index);
+		streamName_[cfg.stream()] = prefix + "stream" + std::to_string(index);
 	}
 
 	ret = camera_->configure(config_);
@@ -45,28 +62,150 @@ int Capture::run(EventLoop *loop, const OptionsParser::Options &options)
 	camera_->requestCompleted.connect(this, &Capture::requestComplete);
 
 	if (options.isSet(OptFile)) {
-		if (!options[OptFile].toString().empty())
-			writer_ = new BufferWriter(options[OptFile]);
-		else
-			writer_ = new BufferWriter();
+		ret = createWriter(options);
+		if (ret < 0)
+			return ret;
 	}
 
+	if (options.isSet(OptBenchmark)) {
+		ret = createBenchmark(options);
+		if (ret < 0)
+			return ret;
+	}
 
-	FrameBufferAllocator *allocator = FrameBufferAllocator::create(camera_);
+	if (options.isSet(OptServe)) {
+		ret = createServer(options);
+		if (ret < 0)
+			return ret;
+	}
 
-	ret = capture(loop, allocator);
+	allocator_ = FrameBufferAllocator::create(camera_);
 
-	if (options.isSet(OptFile)) {
-		delete writer_;
-		writer_ = nullptr;
-	}
+	return capture(allocator_);
+}
 
-	delete allocator;
+/*
+ * Stop capturing, and wait for the pending writes to complete.
+ */
+int Capture::stop()
+{
+	if (!capturing_)
+		return 0;
+
+	/* Buffers released by the writer from now on are not requeued. */
+	capturing_ = false;
+
+	int ret = camera_->stop();
+	if (ret)
+		std::cout << "Failed to stop capture" << std::endl;
+
+	camera_->requestCompleted.disconnect(this, &Capture::requestComplete);
+
+	/* Wait for the pending writes before freeing the buffers. */
+	delete writer_;
+	writer_ = nullptr;
+
+	/* Disconnect the consumers, they must not access the buffers anymore. */
+	server_.reset();
 
 	return ret;
 }
 
-int Capture::capture(EventLoop *loop, FrameBufferAllocator *allocator)
+int Capture::createWriter(const OptionsParser::Options &options)
+{
+	BufferWriter::Options writerOptions;
+
+	if (options.isSet(OptWriter)) {
+		KeyValueParser::Options opt = options[OptWriter].toKeyValues();
+
+		if (opt.isSet("threads"))
+			writerOptions.threads = opt["threads"];
+
+		if (opt.isSet("queue"))
+			writerOptions.queueDepth = opt["queue"];
+
+		if (opt.isSet("drop")) {
+			std::string drop = opt["drop"].toString();
+
+			if (drop == "none") {
+				writerOptions.dropPolicy = BufferWriter::DropNone;
+			} else if (drop == "oldest") {
+				writerOptions.dropPolicy = BufferWriter::DropOldest;
+			} else if (drop == "newest") {
+				writerOptions.dropPolicy = BufferWriter::DropNewest;
+			} else {
+				std::cerr << "Unknown drop policy " << drop
+					  << std::endl;
+				return -EINVAL;
+			}
+		}
+
+		writerOptions.direct = opt.isSet("direct");
+	}
+
+	if (!options[OptFile].toString().empty())
+		writer_ = new BufferWriter(options[OptFile], writerOptions);
+	else
+		writer_ = new BufferWriter("frame-#.bin", writerOptions);
+
+	writer_->bufferReleased.connect(this, &Capture::bufferReleased);
+
+	return 0;
+}
+
+int Capture::createBenchmark(const OptionsParser::Options &options)
+{
+	Benchmark::Options benchmarkOptions;
+	KeyValueParser::Options opt = options[OptBenchmark].toKeyValues();
+
+	if (opt.isSet("frames"))
+		benchmarkOptions.frames = opt["frames"];
+
+	if (opt.isSet("duration"))
+		benchmarkOptions.duration = opt["duration"];
+
+	if (opt.isSet("warmup"))
+		benchmarkOptions.warmup = opt["warmup"];
+
+	if (opt.isSet("json"))
+		benchmarkOptions.json = opt["json"].toString();
+
+	benchmark_.reset(new Benchmark(benchmarkOptions, camera_->name()));
+
+	for (auto const &it : streamName_)
+		benchmark_->addStream(it.first, it.second);
+
+	return 0;
+}
+
+int Capture::createServer(const OptionsParser::Options &options)
+{
+	KeyValueParser::Options opt = options[OptServe].toKeyValues();
+	FrameServer::Options serverOptions;
+
+	if (!opt.isSet("path")) {
+		std::cerr << "The frame server requires a socket path"
+			  << std::endl;
+		return -EINVAL;
+	}
+
+	std::string path = opt["path"].toString();
+	if (!name_.empty())
+		path += "." + name_;
+
+	if (opt.isSet("credits"))
+		serverOptions.credits = opt["credits"];
+
+	server_.reset(new FrameServer(path, serverOptions));
+	server_->bufferReleased.connect(this, &Capture::bufferReleased);
+
+	for (const StreamConfiguration &cfg : *config_)
+		server_->addStream(cfg.stream(), streamName_[cfg.stream()], cfg);
+
+	return 0;
+}
+
+int Capture::capture(FrameBufferAllocator *allocator)
 {
 	int ret;
 
@@ -109,38 +248,57 @@ int Capture::capture(EventLoop *loop, FrameBufferAllocator *allocator)
 				return ret;
 			}
 
-			if (writer_)
-				writer_->mapBuffer(buffer.get());
+			if (writer_) {
+				ret = writer_->mapBuffer(buffer.get());
+				if (ret < 0)
+					return ret;
+			}
+
+			if (benchmark_)
+				benchmark_->addBuffer(buffer.get());
+
+			if (server_)
+				server_->addBuffer(buffer.get(), stream);
+
+			bufferStream_[buffer.get()] = stream;
 		}
 
 		requests.push_back(request);
 	}
 
+	if (writer_) {
+		ret = writer_->start();
+		if (ret < 0) {
+			std::cerr << "Failed to start frame writer" << std::endl;
+			return ret;
+		}
+	}
+
+	if (server_) {
+		ret = server_->start();
+		if (ret < 0)
+			return ret;
+	}
+
 	ret = camera_->start();
 	if (ret) {
 		std::cout << "Failed to start capture" << std::endl;
 		return ret;
 	}
 
+	capturing_ = true;
+
 	for (Request *request : requests) {
-		ret = camera_->queueRequest(request);
+		ret = queueRequest(request);
 		if (ret < 0) {
 			std::cerr << "Can't queue request" << std::endl;
+			capturing_ = false;
 			camera_->stop();
 			return ret;
 		}
 	}
 
-	std::cout << "Capture until user interrupts by SIGINT" << std::endl;
-	ret = loop->exec();
-	if (ret)
-		std::cout << "Failed to run capture loop" << std::endl;
-
-	ret = camera_->stop();
-	if (ret)
-		std::cout << "Failed to stop capture" << std::endl;
-
-	return ret;
+	return 0;
 }
 
 void Capture::requestComplete(Request *request)
@@ -150,6 +308,54 @@ void Capture::requestComplete(Request *request)
 
 	const std::map<Stream *, FrameBuffer *> &buffers = request->buffers();
 
+	/*
+	 * Skip printing frame information when benchmarking, as it would
+	 * affect the results.
+	 */
+	if (benchmark_) {
+		if (!benchmarkDone_ && benchmark_->requestCompleted(buffers)) {
+			benchmarkDone_ = true;
+			benchmarkComplete.emit(this);
+		}
+	} else {
+		printRequest(buffers);
+	}
+
+	/* The buffers are requeued individually once written or consumed. */
+	if (writer_) {
+		for (auto const &it : buffers)
+			writer_->write(it.second, streamName_[it.first]);
+		return;
+	}
+
+	if (server_) {
+		for (auto const &it : buffers)
+			server_->publish(it.second);
+		return;
+	}
+
+	/*
+	 * Create a new request and populate it with one buffer for each
+	 * stream.
+	 */
+	request = camera_->createRequest();
+	if (!request) {
+		std::cerr << "Can't create request" << std::endl;
+		return;
+	}
+
+	for (auto it = buffers.begin(); it != buffers.end(); ++it) {
+		Stream *stream = it->first;
+		FrameBuffer *buffer = it->second;
+
+		request->addBuffer(stream, buffer);
+	}
+
+	queueRequest(request);
+}
+
+void Capture::printRequest(const std::map<Stream *, FrameBuffer *> &buffers)
+{
 	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
 	double fps = std::chrono::duration_cast<std::chrono::milliseconds>(now - last_).count();
 	fps = last_ != std::chrono::steady_clock::time_point() && fps
@@ -176,29 +382,37 @@ void Capture::requestComplete(Request *request)
 			if (++nplane < metadata.planes.size())
 				info << "/";
 		}
-
-		if (writer_)
-			writer_->write(buffer, name);
 	}
 
 	std::cout << info.str() << std::endl;
+}
 
-	/*
-	 * Create a new request and populate it with one buffer for each
-	 * stream.
-	 */
-	request = camera_->createRequest();
+/*
+ * Buffers are released by the writer once written or dropped, possibly from
+ * the writer threads, or by the frame server once consumed. Requeue them in a
+ * request of their own, to avoid holding the buffers of other streams.
+ */
+void Capture::bufferReleased(FrameBuffer *buffer)
+{
+	if (!capturing_)
+		return;
+
+	Request *request = camera_->createRequest();
 	if (!request) {
 		std::cerr << "Can't create request" << std::endl;
 		return;
 	}
 
-	for (auto it = buffers.begin(); it != buffers.end(); ++it) {
-		Stream *stream = it->first;
-		FrameBuffer *buffer = it->second;
+	request->addBuffer(bufferStream_.at(buffer), buffer);
+	queueRequest(request);
+}
 
-		request->addBuffer(stream, buffer);
+int Capture::queueRequest(Request *request)
+{
+	if (benchmark_) {
+		for (auto const &it : request->buffers())
+			benchmark_->bufferQueued(it.second);
 	}
 
-	camera_->queueRequest(request);
+	return camera_->queueRequest(request);
 }
@@ -7,6 +7,7 @@
 #ifndef __CAM_CAPTURE_H__
 #define __CAM_CAPTURE_H__
 
+#include <atomic>
 #include <chrono>
 #include <memory>
 
@@ -14,30 +15,54 @@
 #include <libcamera/camera.h>
 #include <libcamera/framebuffer_allocator.h>
 #include <libcamera/request.h>
+#include <libcamera/signal.h>
 #include <libcamera/stream.h>
 
+#include "benchmark.h"
 #include "buffer_writer.h"
-#include "event_loop.h"
+#include "frame_server.h"
 #include "options.h"
 
 class Capture
 {
 public:
 	Capture(std::shared_ptr<libcamera::Camera> camera,
-		libcamera::CameraConfiguration *config);
+		libcamera::CameraConfiguration *config,
+		const std::string &name = "");
+	~Capture();
+
+	int start(const OptionsParser::Options &options);
+	int stop();
+
+	Benchmark *benchmark() const { return benchmark_.get(); }
+
+	libcamera::Signal<Capture *> benchmarkComplete;
 
-	int run(EventLoop *loop, const OptionsParser::Options &options);
 private:
-	int capture(EventLoop *loop,
-		    libcamera::FrameBufferAllocator *allocator);
+	int capture(libcamera::FrameBufferAllocator *allocator);
+
+	int createWriter(const OptionsParser::Options &options);
+	int createBenchmark(const OptionsParser::Options &options);
+	int createServer(const OptionsParser::Options &options);
+	int queueRequest(libcamera::Request *request);
 
 	void requestComplete(libcamera::Request *request);
+	void printRequest(const std::map<libcamera::Stream *,
+					 libcamera::FrameBuffer *> &buffers);
+	void bufferReleased(libcamera::FrameBuffer *buffer);
 
 	std::shared_ptr<libcamera::Camera> camera_;
 	libcamera::CameraConfiguration *config_;
+	std::string name_;
+	libcamera::FrameBufferAllocator *allocator_;
 
 	std::map<libcamera::Stream *, std::string> streamName_;
+	std::map<libcamera::FrameBuffer *, libcamera::Stream *> bufferStream_;
 	BufferWriter *writer_;
+	std::unique_ptr<FrameServer> server_;
+	std::unique_ptr<Benchmark> benchmark_;
+	std::atomic<bool> capturing_;
+	bool benchmarkDone_;
 	std::chrono::steady_clock::time_point last_;
 };
 
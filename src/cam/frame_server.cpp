@@ -0,0 +1,412 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2020, Google Inc.
+ *
+ * frame_server.cpp - cam - Publish frames to local processes
+ */
+
+#include <algorithm>
+#include <errno.h>
+#include <iostream>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "frame_server.h"
+#include "frame_server_protocol.h"
+
+using namespace libcamera;
+
+FrameServer::Client::Client(int fd, unsigned int credits)
+	: fd(fd), credits(credits), framesSent(0), framesSkipped(0)
+{
+}
+
+FrameServer::Client::~Client()
+{
+	/* The notifier must be destroyed before closing its fd. */
+	notifier.reset();
+	::close(fd);
+}
+
+/*
+ * The frame server publishes completed buffers to consumer processes connected
+ * to a Unix domain socket, passing the dmabuf file descriptors along with the
+ * frame metadata. A buffer is released with the bufferReleased signal once all
+ * consumers it has been sent to have returned it, or immediately if no consumer
+ * had credit left to receive it. Consumers never hold all the buffers of a
+ * stream together, at least one of them is always released immediately for
+ * capture to continue.
+ *
+ * Connections and release messages are handled by the thread that starts the
+ * server, through the event dispatcher. Frames are published from the camera
+ * manager thread, and the bufferReleased signal is emitted from either thread.
+ */
+FrameServer::FrameServer(const std::string &path, const Options &options)
+	: path_(path), options_(options), fd_(-1), framesPublished_(0),
+	  framesUnconsumed_(0)
+{
+	if (!options_.credits)
+		options_.credits = 1;
+}
+
+FrameServer::~FrameServer()
+{
+	stop();
+}
+
+void FrameServer::addStream(Stream *stream, const std::string &name,
+			    const StreamConfiguration &cfg)
+{
+	StreamInfo info;
+	info.index = streams_.size();
+	info.name = name;
+	info.pixelFormat = cfg.pixelFormat;
+	info.size = cfg.size;
+	info.buffers = 0;
+	info.held = 0;
+
+	streamIndex_[stream] = info.index;
+	streams_.push_back(info);
+}
+
+void FrameServer::addBuffer(FrameBuffer *buffer, Stream *stream)
+{
+	uint64_t cookie = buffers_.size();
+	unsigned int index = streamIndex_.at(stream);
+
+	buffers_[buffer] = { cookie, index, 0 };
+	streams_[index].buffers++;
+}
+
+int FrameServer::start()
+{
+	struct sockaddr_un addr = {};
+	int ret;
+
+	if (path_.size() >= sizeof(addr.sun_path)) {
+		std::cerr << "Socket path " << path_ << " is too long"
+			  << std::endl;
+		return -ENAMETOOLONG;
+	}
+
+	fd_ = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd_ < 0) {
+		ret = -errno;
+		std::cerr << "Failed to create socket: " << strerror(-ret)
+			  << std::endl;
+		return ret;
+	}
+
+	/* Remove the socket left behind by a previous run, if any. */
+	unlink(path_.c_str());
+
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path_.c_str(), sizeof(addr.sun_path) - 1);
+
+	if (bind(fd_, reinterpret_cast<struct sockaddr *>(&addr),
+		 sizeof(addr)) < 0 || listen(fd_, 4) < 0) {
+		ret = -errno;
+		std::cerr << "Failed to listen on " << path_ << ": "
+			  << strerror(-ret) << std::endl;
+		::close(fd_);
+		fd_ = -1;
+		return ret;
+	}
+
+	notifier_.reset(new EventNotifier(fd_, EventNotifier::Read));
+	notifier_->activated.connect(this, &FrameServer::newConnection);
+
+	std::cout << "Serving frames on " << path_ << std::endl;
+
+	return 0;
+}
+
+/*
+ * Disconnect all consumers and release the buffers they hold. This must be
+ * called from the thread that started the server, after capture has stopped.
+ */
+void FrameServer::stop()
+{
+	if (fd_ == -1)
+		return;
+
+	notifier_.reset();
+	::close(fd_);
+	fd_ = -1;
+	unlink(path_.c_str());
+
+	std::vector<int> fds;
+	{
+		std::lock_guard<std::mutex> locker(mutex_);
+		for (auto const &it : clients_)
+			fds.push_back(it.first);
+	}
+
+	for (int fd : fds)
+		removeClient(fd);
+
+	std::cout << "Frame server: " << framesPublished_
+		  << " frames published, " << framesUnconsumed_
+		  << " not consumed" << std::endl;
+}
+
+/*
+ * Publish a completed buffer to all consumers that have credit left. The
+ * buffer is released immediately if no consumer can receive it, or if all the
+ * other buffers of the stream are held by consumers.
+ */
+void FrameServer::publish(FrameBuffer *buffer)
+{
+	auto it = buffers_.find(buffer);
+	if (it == buffers_.end()) {
+		bufferReleased.emit(buffer);
+		return;
+	}
+
+	BufferInfo &info = it->second;
+	StreamInfo &stream = streams_[info.stream];
+	bool release;
+
+	{
+		std::lock_guard<std::mutex> locker(mutex_);
+
+		framesPublished_++;
+
+		/* Keep at least one buffer of the stream with the camera. */
+		bool full = stream.held + 1 >= stream.buffers;
+
+		for (auto const &client : clients_) {
+			Client *c = client.second.get();
+
+			if (full || !c->credits) {
+				c->framesSkipped++;
+				continue;
+			}
+
+			/*
+			 * Consumers that fail to receive the frame, because
+			 * their socket buffer is full or they have hung up,
+			 * skip it. Disconnection is handled by readyRead().
+			 */
+			if (sendFrame(c, buffer, info) < 0) {
+				c->framesSkipped++;
+				continue;
+			}
+
+			c->held[info.cookie] = buffer;
+			c->credits--;
+			c->framesSent++;
+			info.holders++;
+		}
+
+		release = !info.holders;
+		if (release)
+			framesUnconsumed_++;
+		else
+			stream.held++;
+	}
+
+	if (release)
+		bufferReleased.emit(buffer);
+}
+
+void FrameServer::newConnection(EventNotifier *notifier)
+{
+	int fd = accept4(fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0) {
+		std::cerr << "Failed to accept connection: " << strerror(errno)
+			  << std::endl;
+		return;
+	}
+
+	std::unique_ptr<Client> client(new Client(fd, options_.credits));
+
+	if (sendStreamInfo(client.get()) < 0)
+		return;
+
+	client->notifier.reset(new EventNotifier(fd, EventNotifier::Read));
+	client->notifier->activated.connect(this, &FrameServer::readyRead);
+
+	std::cout << "Consumer " << fd << " connected" << std::endl;
+
+	std::lock_guard<std::mutex> locker(mutex_);
+	clients_[fd] = std::move(client);
+}
+
+void FrameServer::readyRead(EventNotifier *notifier)
+{
+	int fd = notifier->fd();
+	std::vector<FrameBuffer *> released;
+	bool disconnect = false;
+
+	{
+		std::lock_guard<std::mutex> locker(mutex_);
+		Client *client = clients_.at(fd).get();
+
+		while (true) {
+			FrameServerReleaseMessage msg;
+
+			ssize_t ret = recv(fd, &msg, sizeof(msg), 0);
+			if (ret < 0) {
+				disconnect = errno != EAGAIN && errno != EINTR;
+				if (errno == EINTR)
+					continue;
+				break;
+			}
+
+			/* A zero-sized read signals the consumer hung up. */
+			if (ret == 0) {
+				disconnect = true;
+				break;
+			}
+
+			if (static_cast<size_t>(ret) < sizeof(msg) ||
+			    msg.type != FrameServerRelease) {
+				std::cerr << "Consumer " << fd
+					  << ": invalid message" << std::endl;
+				disconnect = true;
+				break;
+			}
+
+			auto it = client->held.find(msg.cookie);
+			if (it == client->held.end()) {
+				std::cerr << "Consumer " << fd
+					  << ": release of unknown buffer "
+					  << msg.cookie << std::endl;
+				continue;
+			}
+
+			FrameBuffer *buffer = it->second;
+			client->held.erase(it);
+			client->credits++;
+
+			if (unhold(buffer))
+				released.push_back(buffer);
+		}
+	}
+
+	for (FrameBuffer *buffer : released)
+		bufferReleased.emit(buffer);
+
+	if (disconnect)
+		removeClient(fd);
+}
+
+/*
+ * Remove a consumer and release the buffers it still holds, as if the consumer
+ * had returned them.
+ */
+void FrameServer::removeClient(int fd)
+{
+	std::unique_ptr<Client> client;
+	std::vector<FrameBuffer *> released;
+
+	{
+		std::lock_guard<std::mutex> locker(mutex_);
+
+		auto it = clients_.find(fd);
+		if (it == clients_.end())
+			return;
+
+		client = std::move(it->second);
+		clients_.erase(it);
+
+		for (auto const &held : client->held) {
+			if (unhold(held.second))
+				released.push_back(held.second);
+		}
+	}
+
+	std::cout << "Consumer " << fd << " disconnected: "
+		  << client->framesSent << " frames sent, "
+		  << client->framesSkipped << " skipped" << std::endl;
+
+	for (FrameBuffer *buffer : released)
+		bufferReleased.emit(buffer);
+}
+
+int FrameServer::sendStreamInfo(Client *client)
+{
+	for (const StreamInfo &stream : streams_) {
+		FrameServerStreamInfoMessage msg = {};
+
+		msg.type = FrameServerStreamInfo;
+		msg.stream = stream.index;
+		msg.pixelFormat = stream.pixelFormat;
+		msg.width = stream.size.width;
+		msg.height = stream.size.height;
+		msg.credits = options_.credits;
+		strncpy(msg.name, stream.name.c_str(), sizeof(msg.name) - 1);
+
+		if (send(client->fd, &msg, sizeof(msg), MSG_NOSIGNAL) < 0) {
+			int ret = -errno;
+			std::cerr << "Failed to send stream information: "
+				  << strerror(-ret) << std::endl;
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+int FrameServer::sendFrame(Client *client, FrameBuffer *buffer,
+			   const BufferInfo &info)
+{
+	const std::vector<FrameBuffer::Plane> &planes = buffer->planes();
+	const FrameMetadata &metadata = buffer->metadata();
+	unsigned int numPlanes = std::min<size_t>(planes.size(),
+						  FrameServerMaxPlanes);
+
+	FrameServerFrameMessage msg = {};
+	msg.type = FrameServerFrame;
+	msg.stream = info.stream;
+	msg.cookie = info.cookie;
+	msg.timestamp = metadata.timestamp;
+	msg.sequence = metadata.sequence;
+	msg.status = metadata.status;
+	msg.numPlanes = numPlanes;
+
+	int fds[FrameServerMaxPlanes];
+	for (unsigned int i = 0; i < numPlanes; ++i) {
+		fds[i] = planes[i].fd.fd();
+		msg.planes[i].length = planes[i].length;
+		msg.planes[i].bytesused = i < metadata.planes.size()
+					? metadata.planes[i].bytesused : 0;
+	}
+
+	char control[CMSG_SPACE(sizeof(fds))] = {};
+	struct iovec iov = { &msg, sizeof(msg) };
+	struct msghdr hdr = {};
+	hdr.msg_iov = &iov;
+	hdr.msg_iovlen = 1;
+	hdr.msg_control = control;
+	hdr.msg_controllen = CMSG_SPACE(numPlanes * sizeof(int));
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(numPlanes * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, numPlanes * sizeof(int));
+
+	if (sendmsg(client->fd, &hdr, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+		return -errno;
+
+	return 0;
+}
+
+/*
+ * Drop one holder of the buffer. Return true if the buffer isn't held by any
+ * consumer anymore. The caller must hold the lock.
+ */
+bool FrameServer::unhold(FrameBuffer *buffer)
+{
+	BufferInfo &info = buffers_.at(buffer);
+
+	if (--info.holders)
+		return false;
+
+	streams_[info.stream].held--;
+	return true;
+}
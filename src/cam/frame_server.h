@@ -0,0 +1,105 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2020, Google Inc.
+ *
+ * frame_server.h - cam - Publish frames to local processes
+ */
+#ifndef __CAM_FRAME_SERVER_H__
+#define __CAM_FRAME_SERVER_H__
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <libcamera/buffer.h>
+#include <libcamera/event_notifier.h>
+#include <libcamera/signal.h>
+#include <libcamera/stream.h>
+
+class FrameServer
+{
+public:
+	struct Options {
+		Options()
+			: credits(2)
+		{
+		}
+
+		/* Maximum number of frames held by each consumer */
+		unsigned int credits;
+	};
+
+	FrameServer(const std::string &path, const Options &options = Options());
+	~FrameServer();
+
+	void addStream(libcamera::Stream *stream, const std::string &name,
+		       const libcamera::StreamConfiguration &cfg);
+	void addBuffer(libcamera::FrameBuffer *buffer, libcamera::Stream *stream);
+
+	int start();
+	void stop();
+
+	void publish(libcamera::FrameBuffer *buffer);
+
+	libcamera::Signal<libcamera::FrameBuffer *> bufferReleased;
+
+private:
+	struct StreamInfo {
+		unsigned int index;
+		std::string name;
+		libcamera::PixelFormat pixelFormat;
+		libcamera::Size size;
+
+		unsigned int buffers;
+		unsigned int held;
+	};
+
+	struct BufferInfo {
+		uint64_t cookie;
+		unsigned int stream;
+		unsigned int holders;
+	};
+
+	struct Client {
+		Client(int fd, unsigned int credits);
+		~Client();
+
+		int fd;
+		std::unique_ptr<libcamera::EventNotifier> notifier;
+		unsigned int credits;
+		std::map<uint64_t, libcamera::FrameBuffer *> held;
+
+		unsigned int framesSent;
+		unsigned int framesSkipped;
+	};
+
+	void newConnection(libcamera::EventNotifier *notifier);
+	void readyRead(libcamera::EventNotifier *notifier);
+	void removeClient(int fd);
+	int sendStreamInfo(Client *client);
+	int sendFrame(Client *client, libcamera::FrameBuffer *buffer,
+		      const BufferInfo &info);
+	bool unhold(libcamera::FrameBuffer *buffer);
+
+	std::string path_;
+	Options options_;
+
+	int fd_;
+	std::unique_ptr<libcamera::EventNotifier> notifier_;
+
+	std::vector<StreamInfo> streams_;
+	std::map<libcamera::Stream *, unsigned int> streamIndex_;
+	std::map<libcamera::FrameBuffer *, BufferInfo> buffers_;
+
+	/* Protects the clients and buffer holder counts */
+	std::mutex mutex_;
+	std::map<int, std::unique_ptr<Client>> clients_;
+
+	unsigned int framesPublished_;
+	unsigned int framesUnconsumed_;
+};
+
+#endif /* __CAM_FRAME_SERVER_H__ */
@@ -0,0 +1,69 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2020, Google Inc.
+ *
+ * frame_server_protocol.h - cam - Frame server wire protocol
+ */
+#ifndef __CAM_FRAME_SERVER_PROTOCOL_H__
+#define __CAM_FRAME_SERVER_PROTOCOL_H__
+
+#include <stdint.h>
+
+/*
+ * The frame server listens on a SOCK_SEQPACKET Unix domain socket. Every
+ * message starts with a 32-bit type, and is sent as a single packet.
+ *
+ * When a consumer connects, the server sends one FrameServerStreamInfo message
+ * per stream, followed by a FrameServerFrame message for every frame published
+ * to the consumer. The dmabuf file descriptors of the frame planes are passed
+ * as SCM_RIGHTS ancillary data, one per plane, in plane order. The cookie
+ * identifies the buffer and stays constant for the whole capture session,
+ * consumers can use it to cache their mappings.
+ *
+ * The consumer returns each frame with a FrameServerRelease message. A
+ * consumer holds at most as many frames as the credits announced in the stream
+ * information, frames published while it has no credit left are skipped for
+ * that consumer. Capture never waits for consumers.
+ */
+
+enum FrameServerMessageType : uint32_t {
+	FrameServerStreamInfo = 1,
+	FrameServerFrame = 2,
+	FrameServerRelease = 3,
+};
+
+static constexpr unsigned int FrameServerMaxPlanes = 4;
+static constexpr unsigned int FrameServerNameSize = 32;
+
+struct FrameServerStreamInfoMessage {
+	uint32_t type;
+	uint32_t stream;
+	uint32_t pixelFormat;
+	uint32_t width;
+	uint32_t height;
+	uint32_t credits;
+	char name[FrameServerNameSize];
+};
+
+struct FrameServerFrameMessage {
+	uint32_t type;
+	uint32_t stream;
+	uint64_t cookie;
+	uint64_t timestamp;
+	uint32_t sequence;
+	uint32_t status;
+	uint32_t numPlanes;
+	uint32_t reserved;
+	struct {
+		uint32_t length;
+		uint32_t bytesused;
+	} planes[FrameServerMaxPlanes];
+};
+
+struct FrameServerReleaseMessage {
+	uint32_t type;
+	uint32_t reserved;
+	uint64_t cookie;
+};
+
+#endif /* __CAM_FRAME_SERVER_PROTOCOL_H__ */
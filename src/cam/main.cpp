@@ -35,22 +35,27 @@ public:
 
 private:
 	int parseOptions(int argc, char *argv[]);
-	int prepareConfig();
+	std::vector<KeyValueParser::Options> streamOptions(unsigned int index);
+	int prepareConfig(unsigned int index);
 	int infoConfiguration();
+	int capture();
 	int run();
 
+	void benchmarkComplete(Capture *capture);
+
 	static CamApp *app_;
 	OptionsParser::Options options_;
 	CameraManager *cm_;
-	std::shared_ptr<Camera> camera_;
-	std::unique_ptr<libcamera::CameraConfiguration> config_;
+	std::vector<std::shared_ptr<Camera>> cameras_;
+	std::vector<std::unique_ptr<libcamera::CameraConfiguration>> configs_;
 	EventLoop *loop_;
+	unsigned int capturesPending_;
 };
 
 CamApp *CamApp::app_ = nullptr;
 
 CamApp::CamApp()
-	: cm_(nullptr), camera_(nullptr), config_(nullptr), loop_(nullptr)
+	: cm_(nullptr), loop_(nullptr), capturesPending_(0)
 {
 	CamApp::app_ = this;
 }
@@ -83,34 +88,41 @@ int CamApp::init(int argc, char **argv)
 	}
 
 	if (options_.isSet(OptCamera)) {
-		const std::string &cameraName = options_[OptCamera];
-		char *endptr;
-		unsigned long index = strtoul(cameraName.c_str(), &endptr, 10);
-		if (*endptr == '\0' && index > 0 && index <= cm_->cameras().size())
-			camera_ = cm_->cameras()[index - 1];
-		else
-			camera_ = cm_->get(cameraName);
-
-		if (!camera_) {
-			std::cout << "Camera "
-				  << std::string(options_[OptCamera])
-				  << " not found" << std::endl;
-			cm_->stop();
-			return -ENODEV;
-		}
+		for (const OptionValue &value : options_[OptCamera].toArray()) {
+			const std::string &cameraName = value.toString();
+			std::shared_ptr<Camera> camera;
+			char *endptr;
+			unsigned long index = strtoul(cameraName.c_str(), &endptr, 10);
+			if (*endptr == '\0' && index > 0 && index <= cm_->cameras().size())
+				camera = cm_->cameras()[index - 1];
+			else
+				camera = cm_->get(cameraName);
+
+			if (!camera) {
+				std::cout << "Camera " << cameraName
+					  << " not found" << std::endl;
+				cleanup();
+				return -ENODEV;
+			}
 
-		if (camera_->acquire()) {
-			std::cout << "Failed to acquire camera" << std::endl;
-			camera_.reset();
-			cm_->stop();
-			return -EINVAL;
-		}
+			if (camera->acquire()) {
+				std::cout << "Failed to acquire camera" << std::endl;
+				cleanup();
+				return -EINVAL;
+			}
 
-		std::cout << "Using camera " << camera_->name() << std::endl;
+			cameras_.push_back(camera);
 
-		ret = prepareConfig();
-		if (ret)
-			return ret;
+			std::cout << "Using camera " << camera->name() << std::endl;
+		}
+
+		for (unsigned int index = 0; index < cameras_.size(); ++index) {
+			ret = prepareConfig(index);
+			if (ret) {
+				cleanup();
+				return ret;
+			}
+		}
 	}
 
 	loop_ = new EventLoop(cm_->eventDispatcher());
@@ -123,12 +135,11 @@ void CamApp::cleanup()
 	delete loop_;
 	loop_ = nullptr;
 
-	if (camera_) {
-		camera_->release();
-		camera_.reset();
-	}
+	for (std::shared_ptr<Camera> &camera : cameras_)
+		camera->release();
+	cameras_.clear();
 
-	config_.reset();
+	configs_.clear();
 
 	cm_->stop();
 }
@@ -152,6 +163,9 @@ void CamApp::quit()
 int CamApp::parseOptions(int argc, char *argv[])
 {
 	KeyValueParser streamKeyValue;
+	streamKeyValue.addOption("camera", OptionInteger,
+				 "Position of the camera in the --camera options, the stream applies to all cameras if not set",
+				 ArgumentRequired);
 	streamKeyValue.addOption("role", OptionString,
 				 "Role for the stream (viewfinder, video, still)",
 				 ArgumentRequired);
@@ -162,10 +176,49 @@ int CamApp::parseOptions(int argc, char *argv[])
 	streamKeyValue.addOption("pixelformat", OptionInteger, "Pixel format",
 				 ArgumentRequired);
 
+	KeyValueParser benchmarkKeyValue;
+	benchmarkKeyValue.addOption("frames", OptionInteger,
+				    "Number of requests to measure",
+				    ArgumentRequired);
+	benchmarkKeyValue.addOption("duration", OptionInteger,
+				    "Measurement duration in seconds",
+				    ArgumentRequired);
+	benchmarkKeyValue.addOption("warmup", OptionInteger,
+				    "Number of requests to ignore before measuring (default 10)",
+				    ArgumentRequired);
+	benchmarkKeyValue.addOption("json", OptionString,
+				    "Write the results in JSON format to a file, or to stdout with '-'",
+				    ArgumentRequired);
+
+	KeyValueParser writerKeyValue;
+	writerKeyValue.addOption("threads", OptionInteger,
+				 "Number of writer threads (default 1)",
+				 ArgumentRequired);
+	writerKeyValue.addOption("queue", OptionInteger,
+				 "Maximum number of frames waiting to be written (default 4)",
+				 ArgumentRequired);
+	writerKeyValue.addOption("drop", OptionString,
+				 "Frame to drop when the queue is full (none, oldest, newest)",
+				 ArgumentRequired);
+	writerKeyValue.addOption("direct", OptionNone,
+				 "Write with direct I/O, bypassing the page cache");
+
+	KeyValueParser serveKeyValue;
+	serveKeyValue.addOption("path", OptionString,
+				"Path of the Unix domain socket", ArgumentRequired);
+	serveKeyValue.addOption("credits", OptionInteger,
+				"Maximum number of frames held by each consumer (default 2)",
+				ArgumentRequired);
+
 	OptionsParser parser;
+	parser.addOption(OptBenchmark, &benchmarkKeyValue,
+			 "Benchmark capture, implies --capture\n"
+			 "Capture stops after the requested number of requests or duration, or when interrupted by the user. Per-frame information isn't printed.",
+			 "benchmark");
 	parser.addOption(OptCamera, OptionString,
-			 "Specify which camera to operate on, by name or by index", "camera",
-			 ArgumentRequired, "camera");
+			 "Specify which camera to operate on, by name or by index\n"
+			 "The option can be repeated to capture from multiple cameras concurrently.",
+			 "camera", ArgumentRequired, "camera", true);
 	parser.addOption(OptCapture, OptionNone,
 			 "Capture until interrupted by user", "capture");
 	parser.addOption(OptFile, OptionString,
@@ -173,6 +226,16 @@ int CamApp::parseOptions(int argc, char *argv[])
 			 "The first '#' character in the file name is expanded to the stream name and frame sequence number.\n"
 			 "The default file name is 'frame-#.bin'.",
 			 "file", ArgumentOptional, "filename");
+	parser.addOption(OptWriter, &writerKeyValue,
+			 "Configure the frame writer\n"
+			 "Frames are written asynchronously from a bounded queue. When the queue is full, the oldest or newest frame is dropped, or capture waits with drop=none.\n"
+			 "When writing to a single file with direct I/O, frames are padded to 4kB.",
+			 "writer");
+	parser.addOption(OptServe, &serveKeyValue,
+			 "Publish captured frames to local processes, implies --capture\n"
+			 "Frames are passed as dmabuf file descriptors over a Unix domain socket, and requeued once all consumers have released them. Consumers that hold too many frames skip the next ones. At least one buffer of each stream stays with the camera, so capture never waits for consumers.\n"
+			 "When capturing from multiple cameras, the socket path is suffixed with '.camN'.",
+			 "serve");
 	parser.addOption(OptStream, &streamKeyValue,
 			 "Set configuration of a camera stream", "stream", true);
 	parser.addOption(OptHelp, OptionNone, "Display this help message",
@@ -190,21 +253,53 @@ int CamApp::parseOptions(int argc, char *argv[])
 		return options_.empty() ? -EINVAL : -EINTR;
 	}
 
+	/*
+	 * Written and served buffers are both requeued when released, a
+	 * buffer handed to both would be requeued before the other consumer
+	 * is done with it.
+	 */
+	if (options_.isSet(OptServe) && options_.isSet(OptFile)) {
+		std::cerr << "Frames can't be both served and written to disk"
+			  << std::endl;
+		return -EINVAL;
+	}
+
 	return 0;
 }
 
-int CamApp::prepareConfig()
+/*
+ * Retrieve the stream options for the camera at \a index. Streams without a
+ * camera key apply to all cameras.
+ */
+std::vector<KeyValueParser::Options> CamApp::streamOptions(unsigned int index)
 {
-	StreamRoles roles;
+	std::vector<KeyValueParser::Options> streams;
 
-	if (options_.isSet(OptStream)) {
-		const std::vector<OptionValue> &streamOptions =
-			options_[OptStream].toArray();
+	if (!options_.isSet(OptStream))
+		return streams;
 
-		/* Use roles and get a default configuration. */
-		for (auto const &value : streamOptions) {
-			KeyValueParser::Options opt = value.toKeyValues();
+	for (auto const &value : options_[OptStream].toArray()) {
+		KeyValueParser::Options opt = value.toKeyValues();
+
+		if (opt.isSet("camera") &&
+		    opt["camera"].toInteger() != static_cast<int>(index + 1))
+			continue;
+
+		streams.push_back(opt);
+	}
+
+	return streams;
+}
+
+int CamApp::prepareConfig(unsigned int index)
+{
+	std::shared_ptr<Camera> &camera = cameras_[index];
+	std::vector<KeyValueParser::Options> streams = streamOptions(index);
+	StreamRoles roles;
 
+	if (!streams.empty()) {
+		/* Use roles and get a default configuration. */
+		for (auto const &opt : streams) {
 			if (!opt.isSet("role")) {
 				roles.push_back(StreamRole::VideoRecording);
 			} else if (opt["role"].toString() == "viewfinder") {
@@ -224,22 +319,19 @@ int CamApp::prepareConfig()
 		roles.push_back(StreamRole::VideoRecording);
 	}
 
-	config_ = camera_->generateConfiguration(roles);
-	if (!config_ || config_->size() != roles.size()) {
+	std::unique_ptr<CameraConfiguration> config =
+		camera->generateConfiguration(roles);
+	if (!config || config->size() != roles.size()) {
 		std::cerr << "Failed to get default stream configuration"
 			  << std::endl;
 		return -EINVAL;
 	}
 
 	/* Apply configuration if explicitly requested. */
-	if (options_.isSet(OptStream)) {
-		const std::vector<OptionValue> &streamOptions =
-			options_[OptStream].toArray();
-
+	if (!streams.empty()) {
 		unsigned int i = 0;
-		for (auto const &value : streamOptions) {
-			KeyValueParser::Options opt = value.toKeyValues();
-			StreamConfiguration &cfg = config_->at(i++);
+		for (auto const &opt : streams) {
+			StreamConfiguration &cfg = config->at(i++);
 
 			if (opt.isSet("width"))
 				cfg.size.width = opt["width"];
@@ -253,7 +345,7 @@ int CamApp::prepareConfig()
 		}
 	}
 
-	switch (config_->validate()) {
+	switch (config->validate()) {
 	case CameraConfiguration::Valid:
 		break;
 	case CameraConfiguration::Adjusted:
@@ -261,43 +353,121 @@ int CamApp::prepareConfig()
 		break;
 	case CameraConfiguration::Invalid:
 		std::cout << "Camera configuration invalid" << std::endl;
-		config_.reset();
 		return -EINVAL;
 	}
 
+	configs_.push_back(std::move(config));
+
 	return 0;
 }
 
 int CamApp::infoConfiguration()
 {
-	if (!config_) {
+	if (configs_.empty()) {
 		std::cout << "Cannot print stream information without a camera"
 			  << std::endl;
 		return -EINVAL;
 	}
 
-	unsigned int index = 0;
-	for (const StreamConfiguration &cfg : *config_) {
-		std::cout << index << ": " << cfg.toString() << std::endl;
-
-		const StreamFormats &formats = cfg.formats();
-		for (unsigned int pixelformat : formats.pixelformats()) {
-			std::cout << " * Pixelformat: 0x" << std::hex
-				  << std::setw(8) << pixelformat << " "
-				  << formats.range(pixelformat).toString()
+	for (unsigned int i = 0; i < configs_.size(); ++i) {
+		if (configs_.size() > 1)
+			std::cout << "Camera " << cameras_[i]->name() << ":"
 				  << std::endl;
 
-			for (const Size &size : formats.sizes(pixelformat))
-				std::cout << "  - " << size.toString()
+		unsigned int index = 0;
+		for (const StreamConfiguration &cfg : *configs_[i]) {
+			std::cout << index << ": " << cfg.toString() << std::endl;
+
+			const StreamFormats &formats = cfg.formats();
+			for (unsigned int pixelformat : formats.pixelformats()) {
+				std::cout << " * Pixelformat: 0x" << std::hex
+					  << std::setw(8) << pixelformat << " "
+					  << formats.range(pixelformat).toString()
 					  << std::endl;
-		}
 
-		index++;
+				for (const Size &size : formats.sizes(pixelformat))
+					std::cout << "  - " << size.toString()
+						  << std::endl;
+			}
+
+			index++;
+		}
 	}
 
 	return 0;
 }
 
+/*
+ * Capture from all cameras concurrently. The requests of all cameras complete
+ * in the camera manager thread, and the captures run until the user interrupts
+ * them or, when benchmarking, until all benchmarks complete.
+ */
+int CamApp::capture()
+{
+	int ret = 0;
+
+	if (cameras_.empty()) {
+		std::cout << "Can't capture without a camera" << std::endl;
+		return -ENODEV;
+	}
+
+	if (cameras_.size() > 1 && options_.isSet(OptFile)) {
+		std::string pattern = options_[OptFile];
+		if (!pattern.empty() && pattern.find('#') == std::string::npos) {
+			std::cerr << "The file name must contain a '#' when capturing from multiple cameras"
+				  << std::endl;
+			return -EINVAL;
+		}
+	}
+
+	capturesPending_ = cameras_.size();
+
+	std::vector<std::unique_ptr<Capture>> captures;
+	for (unsigned int i = 0; i < cameras_.size(); ++i) {
+		std::string name = cameras_.size() > 1
+				 ? "cam" + std::to_string(i + 1) : "";
+		Capture *capture = new Capture(cameras_[i], configs_[i].get(),
+					       name);
+		captures.emplace_back(capture);
+
+		capture->benchmarkComplete.connect(this, &CamApp::benchmarkComplete);
+
+		ret = capture->start(options_);
+		if (ret)
+			return ret;
+	}
+
+	if (options_.isSet(OptBenchmark))
+		std::cout << "Benchmarking capture" << std::endl;
+	else
+		std::cout << "Capture until user interrupts by SIGINT" << std::endl;
+
+	ret = loop_->exec();
+	if (ret)
+		std::cout << "Failed to run capture loop" << std::endl;
+
+	for (std::unique_ptr<Capture> &capture : captures) {
+		int err = capture->stop();
+		if (err)
+			ret = err;
+	}
+
+	if (ret || !options_.isSet(OptBenchmark))
+		return ret;
+
+	std::vector<const Benchmark *> benchmarks;
+	for (std::unique_ptr<Capture> &capture : captures)
+		benchmarks.push_back(capture->benchmark());
+
+	return Benchmark::report(benchmarks);
+}
+
+void CamApp::benchmarkComplete(Capture *capture)
+{
+	if (--capturesPending_ == 0)
+		loop_->exit();
+}
+
 int CamApp::run()
 {
 	int ret;
@@ -318,10 +488,9 @@ int CamApp::run()
 			return ret;
 	}
 
-	if (options_.isSet(OptCapture)) {
-		Capture capture(camera_, config_.get());
-		return capture.run(loop_, options_);
-	}
+	if (options_.isSet(OptCapture) || options_.isSet(OptBenchmark) ||
+	    options_.isSet(OptServe))
+		return capture();
 
 	return 0;
 }
@@ -8,13 +8,16 @@
 #define __CAM_MAIN_H__
 
 enum {
+	OptBenchmark = 'B',
 	OptCamera = 'c',
 	OptCapture = 'C',
 	OptFile = 'F',
 	OptHelp = 'h',
 	OptInfo = 'I',
 	OptList = 'l',
+	OptServe = 'S',
 	OptStream = 's',
+	OptWriter = 'W',
 };
 
 #endif /* __CAM_MAIN_H__ */
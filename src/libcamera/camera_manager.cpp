@@ -125,6 +125,17 @@ int CameraManager::Private::init()
 	std::vector<PipelineHandlerFactory *> &factories = PipelineHandlerFactory::factories();
 
 	for (PipelineHandlerFactory *factory : factories) {
+		/*
+		 * Skip pipeline handlers early when the devices they require
+		 * are missing, to avoid probing devices needlessly.
+		 */
+		if (!factory->canMatch(enumerator_.get())) {
+			LOG(Camera, Debug)
+				<< "Pipeline handler \"" << factory->name()
+				<< "\" skipped, no matching device";
+			continue;
+		}
+
 		/*
 		 * Try each pipeline handler until it exhaust
 		 * all pipelines it can provide.
@@ -13,7 +13,10 @@
 #include <limits.h>
 #include <math.h>
 
+#include "byte_stream_buffer.h"
+#include "device_cache.h"
 #include "formats.h"
+#include "media_device.h"
 #include "utils.h"
 #include "v4l2_subdevice.h"
 
@@ -66,6 +69,10 @@ CameraSensor::~CameraSensor()
  * This method performs the initialisation steps of the CameraSensor that may
  * fail. It shall be called once and only once after constructing the instance.
  *
+ * Enumerating the formats supported by the sensor requires a large number of
+ * ioctls. When the device cache is enabled, the formats are loaded from the
+ * cache if available, and stored in the cache after enumeration otherwise.
+ *
  * \return 0 on success or a negative error code otherwise
  */
 int CameraSensor::init()
@@ -90,6 +97,10 @@ int CameraSensor::init()
 		return ret;
 
 	/* Enumerate and cache media bus codes and sizes. */
+	DeviceCache *cache = DeviceCache::instance();
+	if (cache && loadFormats(cache))
+		return 0;
+
 	const ImageFormats formats = subdev_->formats(0);
 	if (formats.isEmpty()) {
 		LOG(CameraSensor, Error) << "No image format found";
@@ -119,9 +130,89 @@ int CameraSensor::init()
 	std::sort(mbusCodes_.begin(), mbusCodes_.end());
 	std::sort(sizes_.begin(), sizes_.end());
 
+	if (cache)
+		storeFormats(cache);
+
 	return 0;
 }
 
+/*
+ * The sensor formats only depend on the sensor driver, identified by the
+ * media device identity and the entity name. They are cached as the number
+ * of media bus codes and sizes, followed by the codes and the sizes.
+ */
+std::string CameraSensor::formatsKey() const
+{
+	return entity_->device()->identity() + ":" + entity_->name();
+}
+
+bool CameraSensor::loadFormats(const DeviceCache *cache)
+{
+	std::vector<uint8_t> data;
+	if (!cache->load("sensor-" + entity_->name(), formatsKey(), &data))
+		return false;
+
+	ByteStreamBuffer buffer(const_cast<const uint8_t *>(data.data()),
+				data.size());
+	uint32_t numCodes = 0;
+	uint32_t numSizes = 0;
+	buffer.read(&numCodes);
+	buffer.read(&numSizes);
+
+	if (buffer.overflow() || !numCodes || !numSizes ||
+	    data.size() != (2 + numCodes + numSizes * 2) * sizeof(uint32_t))
+		return false;
+
+	std::vector<unsigned int> mbusCodes(numCodes);
+	for (unsigned int &code : mbusCodes) {
+		uint32_t value;
+		buffer.read(&value);
+		code = value;
+	}
+
+	std::vector<Size> sizes(numSizes);
+	for (Size &size : sizes) {
+		uint32_t width;
+		uint32_t height;
+		buffer.read(&width);
+		buffer.read(&height);
+		size = Size(width, height);
+	}
+
+	mbusCodes_ = std::move(mbusCodes);
+	sizes_ = std::move(sizes);
+
+	LOG(CameraSensor, Debug) << "Loaded formats from cache";
+
+	return true;
+}
+
+void CameraSensor::storeFormats(const DeviceCache *cache) const
+{
+	std::vector<uint8_t> data((2 + mbusCodes_.size() + sizes_.size() * 2)
+				  * sizeof(uint32_t));
+	ByteStreamBuffer buffer(data.data(), data.size());
+
+	uint32_t numCodes = mbusCodes_.size();
+	uint32_t numSizes = sizes_.size();
+	buffer.write(&numCodes);
+	buffer.write(&numSizes);
+
+	for (unsigned int code : mbusCodes_) {
+		uint32_t value = code;
+		buffer.write(&value);
+	}
+
+	for (const Size &size : sizes_) {
+		uint32_t width = size.width;
+		uint32_t height = size.height;
+		buffer.write(&width);
+		buffer.write(&height);
+	}
+
+	cache->store("sensor-" + entity_->name(), formatsKey(), data);
+}
+
 /**
  * \fn CameraSensor::entity()
  * \brief Retrieve the sensor media entity
@@ -0,0 +1,293 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * Copyright (C) 2020, Google Inc.
+ *
+ * device_cache.cpp - Persistent cache of device information
+ */
+
+#include "device_cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fstream>
+#include <memory>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+#include "byte_stream_buffer.h"
+#include "log.h"
+#include "utils.h"
+
+/**
+ * \file device_cache.h
+ * \brief Persistent cache of device information
+ */
+
+namespace libcamera {
+
+LOG_DEFINE_CATEGORY(DeviceCache)
+
+namespace {
+
+constexpr uint32_t CacheMagic = 0x4344434c; /* "LCDC" */
+constexpr uint32_t CacheVersion = 1;
+
+struct CacheHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t keySize;
+	uint32_t dataSize;
+	uint32_t checksum;
+};
+
+/* FNV-1a hash, to detect truncated or corrupted cache entries. */
+uint32_t checksum(const std::string &key, const std::vector<uint8_t> &data)
+{
+	uint32_t hash = 2166136261;
+
+	for (char c : key)
+		hash = (hash ^ static_cast<uint8_t>(c)) * 16777619;
+	for (uint8_t byte : data)
+		hash = (hash ^ byte) * 16777619;
+
+	return hash;
+}
+
+} /* namespace */
+
+/**
+ * \class DeviceCache
+ * \brief Store device information that is costly to retrieve from the kernel
+ *
+ * Enumerating the media graph of media devices and the formats supported by
+ * camera sensors requires a large number of ioctls, whose results don't
+ * change for a given device, driver and kernel. The DeviceCache stores such
+ * information on disk to speed up subsequent starts.
+ *
+ * Cache entries are identified by a name, and store data along with a key.
+ * The key shall describe everything the data depends on, such as the device
+ * driver, model and version and the kernel release. An entry is only returned
+ * if its key matches the key passed to load(), which invalidates stale
+ * entries automatically. Entries are checksummed, and any entry that can't be
+ * read or validated is ignored, in which case the caller shall retrieve the
+ * information from the device.
+ *
+ * The cache is optional. It is enabled by setting the LIBCAMERA_DEVICE_CACHE
+ * environment variable to the path of the cache directory.
+ */
+
+/**
+ * \brief Construct a device cache stored in \a directory
+ * \param[in] directory The cache directory
+ *
+ * The directory is created when the first entry is stored if it doesn't
+ * exist.
+ */
+DeviceCache::DeviceCache(const std::string &directory)
+	: directory_(directory)
+{
+}
+
+/**
+ * \brief Retrieve the device cache instance
+ *
+ * The device cache is created on first use, in the directory specified by the
+ * LIBCAMERA_DEVICE_CACHE environment variable.
+ *
+ * \return The device cache instance, or nullptr if the cache is disabled
+ */
+DeviceCache *DeviceCache::instance()
+{
+	static std::unique_ptr<DeviceCache> cache = []() {
+		const char *directory = utils::secure_getenv("LIBCAMERA_DEVICE_CACHE");
+		if (!directory || !*directory)
+			return std::unique_ptr<DeviceCache>();
+
+		LOG(DeviceCache, Debug) << "Using device cache in " << directory;
+		return std::make_unique<DeviceCache>(directory);
+	}();
+
+	return cache.get();
+}
+
+/**
+ * \brief Load a cache entry
+ * \param[in] name The entry name
+ * \param[in] key The key the entry shall match
+ * \param[out] data The entry data
+ *
+ * \return True if a valid entry matching \a key was found, false otherwise
+ */
+bool DeviceCache::load(const std::string &name, const std::string &key,
+		       std::vector<uint8_t> *data) const
+{
+	std::string file = path(name);
+	int fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	std::vector<uint8_t> contents;
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		contents.resize(st.st_size);
+		if (read(fd, contents.data(), contents.size()) != st.st_size)
+			contents.clear();
+	}
+
+	::close(fd);
+
+	ByteStreamBuffer buffer(const_cast<const uint8_t *>(contents.data()),
+				contents.size());
+	CacheHeader header;
+	buffer.read(&header);
+
+	if (buffer.overflow() || header.magic != CacheMagic ||
+	    header.version != CacheVersion ||
+	    header.keySize != key.size() ||
+	    contents.size() != sizeof(header) + header.keySize + header.dataSize) {
+		LOG(DeviceCache, Debug) << "Ignoring invalid entry " << file;
+		return false;
+	}
+
+	const uint8_t *entryKey = contents.data() + sizeof(header);
+	if (memcmp(entryKey, key.data(), key.size())) {
+		LOG(DeviceCache, Debug) << "Ignoring stale entry " << file;
+		return false;
+	}
+
+	const uint8_t *entryData = entryKey + header.keySize;
+	data->assign(entryData, entryData + header.dataSize);
+	if (checksum(key, *data) != header.checksum) {
+		LOG(DeviceCache, Warning) << "Ignoring corrupted entry " << file;
+		data->clear();
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * \brief Store a cache entry
+ * \param[in] name The entry name
+ * \param[in] key The key describing what the entry depends on
+ * \param[in] data The entry data
+ *
+ * The entry replaces any existing entry with the same \a name atomically, so
+ * that concurrent readers never see partially written entries.
+ *
+ * \return 0 on success or a negative error code otherwise
+ */
+int DeviceCache::store(const std::string &name, const std::string &key,
+		       const std::vector<uint8_t> &data) const
+{
+	if (mkdir(directory_.c_str(), 0755) < 0 && errno != EEXIST) {
+		int ret = -errno;
+		LOG(DeviceCache, Error)
+			<< "Failed to create cache directory " << directory_
+			<< ": " << strerror(-ret);
+		return ret;
+	}
+
+	CacheHeader header;
+	header.magic = CacheMagic;
+	header.version = CacheVersion;
+	header.keySize = key.size();
+	header.dataSize = data.size();
+	header.checksum = checksum(key, data);
+
+	std::vector<uint8_t> contents(sizeof(header) + key.size() + data.size());
+	ByteStreamBuffer buffer(contents.data(), contents.size());
+	buffer.write(&header);
+	memcpy(contents.data() + sizeof(header), key.data(), key.size());
+	memcpy(contents.data() + sizeof(header) + key.size(), data.data(),
+	       data.size());
+
+	std::string file = path(name);
+	std::string temp = file + ".XXXXXX";
+	int fd = mkostemp(&temp[0], O_CLOEXEC);
+	if (fd < 0) {
+		int ret = -errno;
+		LOG(DeviceCache, Error)
+			<< "Failed to create cache entry " << file << ": "
+			<< strerror(-ret);
+		return ret;
+	}
+
+	int ret = 0;
+	if (write(fd, contents.data(), contents.size()) !=
+	    static_cast<ssize_t>(contents.size()))
+		ret = -EIO;
+
+	::close(fd);
+
+	if (!ret && rename(temp.c_str(), file.c_str()) < 0)
+		ret = -errno;
+
+	if (ret) {
+		LOG(DeviceCache, Error)
+			<< "Failed to write cache entry " << file << ": "
+			<< strerror(-ret);
+		unlink(temp.c_str());
+		return ret;
+	}
+
+	return 0;
+}
+
+/**
+ * \brief Retrieve the release of the running kernel
+ *
+ * The kernel release shall be part of the key of all entries that depend on
+ * the kernel drivers.
+ *
+ * \return The kernel release
+ */
+const std::string &DeviceCache::kernelRelease()
+{
+	static const std::string release = []() {
+		struct utsname name;
+		if (uname(&name) < 0)
+			return std::string();
+		return std::string(name.release);
+	}();
+
+	return release;
+}
+
+/**
+ * \brief Retrieve the identifier of the current boot
+ *
+ * Device numbers are assigned dynamically and may change across boots. The
+ * boot identifier shall be part of the key of all entries that depend on
+ * device numbers.
+ *
+ * \return The boot identifier, or an empty string if it isn't available
+ */
+const std::string &DeviceCache::bootId()
+{
+	static const std::string id = []() {
+		std::string value;
+		std::ifstream file("/proc/sys/kernel/random/boot_id");
+		if (file)
+			file >> value;
+		return value;
+	}();
+
+	return id;
+}
+
+std::string DeviceCache::path(const std::string &name) const
+{
+	std::string file = name;
+	for (char &c : file) {
+		if (!isalnum(c) && c != '-' && c != '.')
+			c = '_';
+	}
+
+	return directory_ + "/" + file;
+}
+
+} /* namespace libcamera */
@@ -9,7 +9,10 @@
 #include "device_enumerator_sysfs.h"
 #include "device_enumerator_udev.h"
 
+#include <algorithm>
+#include <atomic>
 #include <string.h>
+#include <thread>
 
 #include "log.h"
 #include "media_device.h"
@@ -41,6 +44,12 @@ namespace libcamera {
 
 LOG_DEFINE_CATEGORY(DeviceEnumerator)
 
+namespace {
+
+constexpr unsigned int MinWorkers = 4;
+
+} /* namespace */
+
 /**
  * \class DeviceMatch
  * \brief Description of a media device search pattern
@@ -98,16 +107,7 @@ bool DeviceMatch::match(const MediaDevice *device) const
 		return false;
 
 	for (const std::string &name : entities_) {
-		bool found = false;
-
-		for (const MediaEntity *entity : device->entities()) {
-			if (name == entity->name()) {
-				found = true;
-				break;
-			}
-		}
-
-		if (!found)
+		if (!device->getEntityByName(name))
 			return false;
 	}
 
@@ -136,6 +136,9 @@ bool DeviceMatch::match(const MediaDevice *device) const
  * the operating system based on the available resources. Not all different
  * enumerator types are guaranteed to support all features.
  *
+ * If a factory has been set with setFactory(), it is used instead to create
+ * the enumerator.
+ *
  * \return A pointer to the newly created device enumerator on success, or
  * nullptr if an error occurs
  */
@@ -143,6 +146,14 @@ std::unique_ptr<DeviceEnumerator> DeviceEnumerator::create()
 {
 	std::unique_ptr<DeviceEnumerator> enumerator;
 
+	if (factory_) {
+		enumerator = factory_();
+		if (enumerator && !enumerator->init())
+			return enumerator;
+
+		return nullptr;
+	}
+
 #ifdef HAVE_LIBUDEV
 	enumerator = std::make_unique<DeviceEnumeratorUdev>();
 	if (!enumerator->init())
@@ -160,6 +171,27 @@ std::unique_ptr<DeviceEnumerator> DeviceEnumerator::create()
 	return nullptr;
 }
 
+/**
+ * \typedef DeviceEnumerator::Factory
+ * \brief Function that creates a device enumerator
+ */
+
+/**
+ * \brief Override the device enumerator created by create()
+ * \param[in] factory The function creating the enumerator, or nullptr to
+ * restore the default behaviour
+ *
+ * This function is meant for tests, to enumerate emulated devices instead of
+ * the devices present in the system. It shall be called before the camera
+ * manager is started.
+ */
+void DeviceEnumerator::setFactory(Factory factory)
+{
+	factory_ = factory;
+}
+
+DeviceEnumerator::Factory DeviceEnumerator::factory_ = nullptr;
+
 DeviceEnumerator::~DeviceEnumerator()
 {
 	for (std::shared_ptr<MediaDevice> media : devices_) {
@@ -208,6 +240,10 @@ DeviceEnumerator::~DeviceEnumerator()
  * to be set by the system). Once done, it shall add the media device to the
  * system with addDevice().
  *
+ * This function may be called concurrently from multiple threads by
+ * createDevices(). Device enumerators that override it shall ensure their
+ * implementation is thread-safe.
+ *
  * \return Created media device instance on success, or nullptr otherwise
  */
 std::shared_ptr<MediaDevice> DeviceEnumerator::createDevice(const std::string &deviceNode)
@@ -229,6 +265,53 @@ std::shared_ptr<MediaDevice> DeviceEnumerator::createDevice(const std::string &d
 	return media;
 }
 
+/**
+ * \brief Create media device instances for multiple device nodes
+ * \param[in] deviceNodes paths to the media devices to create
+ *
+ * Create media devices for all the \a deviceNodes as createDevice() does.
+ * Opening a media device and retrieving its media graph is the most costly
+ * part of enumeration, this function thus processes the device nodes in
+ * parallel on worker threads. The device enumerator shall then populate the
+ * media devices and add them to the system, in the thread that called this
+ * function.
+ *
+ * \return The media device instances, in the order of \a deviceNodes, with a
+ * nullptr entry for each device node that failed to be created
+ */
+std::vector<std::shared_ptr<MediaDevice>>
+DeviceEnumerator::createDevices(const std::vector<std::string> &deviceNodes)
+{
+	std::vector<std::shared_ptr<MediaDevice>> devices(deviceNodes.size());
+	std::atomic<unsigned int> next(0);
+
+	auto worker = [&]() {
+		unsigned int index;
+		while ((index = next++) < deviceNodes.size())
+			devices[index] = createDevice(deviceNodes[index]);
+	};
+
+	/*
+	 * Opening media devices mostly waits for the kernel and the hardware
+	 * (for instance to resume devices from runtime suspend), use at least
+	 * MinWorkers threads even on systems with few CPUs.
+	 */
+	unsigned int count = std::max(std::thread::hardware_concurrency(),
+				      MinWorkers);
+	count = std::min<unsigned int>(count, deviceNodes.size());
+	std::vector<std::thread> workers;
+	for (unsigned int i = 1; i < count; ++i)
+		workers.emplace_back(worker);
+
+	/* Use the calling thread as a worker too. */
+	worker();
+
+	for (std::thread &thread : workers)
+		thread.join();
+
+	return devices;
+}
+
 /**
  * \brief Add a media device to the enumerator
  * \param[in] media media device instance to add
@@ -279,6 +362,25 @@ void DeviceEnumerator::removeDevice(const std::string &deviceNode)
 	media->disconnected.emit(media.get());
 }
 
+/**
+ * \brief Check if the enumerator contains a media device for a driver
+ * \param[in] driver The driver name
+ *
+ * This function doesn't take the busy state of media devices into account.
+ *
+ * \return True if a media device created by the \a driver has been added to
+ * the enumerator, false otherwise
+ */
+bool DeviceEnumerator::hasDriver(const std::string &driver) const
+{
+	for (const std::shared_ptr<MediaDevice> &media : devices_) {
+		if (media->driver() == driver)
+			return true;
+	}
+
+	return false;
+}
+
 /**
  * \brief Search available media devices for a pattern match
  * \param[in] dm Search pattern
@@ -16,6 +16,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <vector>
 
 #include "log.h"
 #include "media_device.h"
@@ -31,9 +32,9 @@ int DeviceEnumeratorSysfs::init()
 
 int DeviceEnumeratorSysfs::enumerate()
 {
+	std::vector<std::string> deviceNodes;
 	struct dirent *ent;
 	DIR *dir;
-	int ret = 0;
 
 	static const char * const sysfs_dirs[] = {
 		"/sys/subsystem/media/devices",
@@ -73,23 +74,23 @@ int DeviceEnumeratorSysfs::enumerate()
 			continue;
 		}
 
-		std::shared_ptr<MediaDevice> media = createDevice(devnode);
-		if (!media) {
-			ret = -ENODEV;
-			break;
-		}
+		deviceNodes.push_back(devnode);
+	}
 
-		if (populateMediaDevice(media) < 0) {
-			ret = -ENODEV;
-			break;
-		}
+	closedir(dir);
+
+	/* Create the media devices in parallel, and add them in order. */
+	for (const std::shared_ptr<MediaDevice> &media : createDevices(deviceNodes)) {
+		if (!media)
+			return -ENODEV;
+
+		if (populateMediaDevice(media) < 0)
+			return -ENODEV;
 
 		addDevice(media);
 	}
 
-	closedir(dir);
-
-	return ret;
+	return 0;
 }
 
 int DeviceEnumeratorSysfs::populateMediaDevice(const std::shared_ptr<MediaDevice> &media)
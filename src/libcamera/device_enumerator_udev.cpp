@@ -16,6 +16,7 @@
 #include <sys/ioctl.h>
 #include <sys/sysmacros.h>
 #include <unistd.h>
+#include <vector>
 
 #include <libcamera/event_notifier.h>
 
@@ -99,6 +100,7 @@ int DeviceEnumeratorUdev::enumerate()
 {
 	struct udev_enumerate *udev_enum = nullptr;
 	struct udev_list_entry *ents, *ent;
+	std::vector<std::string> mediaNodes;
 	int ret;
 
 	udev_enum = udev_enumerate_new(udev_);
@@ -145,6 +147,18 @@ int DeviceEnumeratorUdev::enumerate()
 			goto done;
 		}
 
+		/*
+		 * Defer creation of media devices to create them in parallel.
+		 * V4L2 devices found first are kept in the orphans list until
+		 * their media device is populated.
+		 */
+		const char *subsystem = udev_device_get_subsystem(dev);
+		if (subsystem && !strcmp(subsystem, "media")) {
+			mediaNodes.push_back(devnode);
+			udev_device_unref(dev);
+			continue;
+		}
+
 		ret = addUdevDevice(dev);
 		udev_device_unref(dev);
 		if (ret < 0)
@@ -156,6 +170,14 @@ done:
 	if (ret < 0)
 		return ret;
 
+	for (const std::shared_ptr<MediaDevice> &media : createDevices(mediaNodes)) {
+		if (!media)
+			return -ENODEV;
+
+		if (populateMediaDevice(media) == 0)
+			addDevice(media);
+	}
+
 	ret = udev_monitor_enable_receiving(monitor_);
 	if (ret < 0)
 		return ret;
@@ -18,6 +18,7 @@ namespace libcamera {
 
 class ControlInfoMap;
 class ControlList;
+class DeviceCache;
 class MediaEntity;
 class V4L2Subdevice;
 
@@ -51,6 +52,10 @@ protected:
 	std::string logPrefix() const;
 
 private:
+	std::string formatsKey() const;
+	bool loadFormats(const DeviceCache *cache);
+	void storeFormats(const DeviceCache *cache) const;
+
 	const MediaEntity *entity_;
 	V4L2Subdevice *subdev_;
 
@@ -0,0 +1,39 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * Copyright (C) 2020, Google Inc.
+ *
+ * device_cache.h - Persistent cache of device information
+ */
+#ifndef __LIBCAMERA_DEVICE_CACHE_H__
+#define __LIBCAMERA_DEVICE_CACHE_H__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace libcamera {
+
+class DeviceCache
+{
+public:
+	explicit DeviceCache(const std::string &directory);
+
+	static DeviceCache *instance();
+
+	bool load(const std::string &name, const std::string &key,
+		  std::vector<uint8_t> *data) const;
+	int store(const std::string &name, const std::string &key,
+		  const std::vector<uint8_t> &data) const;
+
+	static const std::string &kernelRelease();
+	static const std::string &bootId();
+
+private:
+	std::string path(const std::string &name) const;
+
+	std::string directory_;
+};
+
+} /* namespace libcamera */
+
+#endif /* __LIBCAMERA_DEVICE_CACHE_H__ */
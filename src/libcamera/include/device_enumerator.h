@@ -34,7 +34,10 @@ private:
 class DeviceEnumerator
 {
 public:
+	using Factory = std::unique_ptr<DeviceEnumerator> (*)();
+
 	static std::unique_ptr<DeviceEnumerator> create();
+	static void setFactory(Factory factory);
 
 	virtual ~DeviceEnumerator();
 
@@ -42,13 +45,18 @@ public:
 	virtual int enumerate() = 0;
 
 	std::shared_ptr<MediaDevice> search(const DeviceMatch &dm);
+	bool hasDriver(const std::string &driver) const;
 
 protected:
-	std::shared_ptr<MediaDevice> createDevice(const std::string &deviceNode);
+	virtual std::shared_ptr<MediaDevice> createDevice(const std::string &deviceNode);
+	std::vector<std::shared_ptr<MediaDevice>>
+	createDevices(const std::vector<std::string> &deviceNodes);
 	void addDevice(const std::shared_ptr<MediaDevice> &media);
 	void removeDevice(const std::string &deviceNode);
 
 private:
+	static Factory factory_;
+
 	std::vector<std::shared_ptr<MediaDevice>> devices_;
 };
 
@@ -10,6 +10,7 @@
 #include <map>
 #include <sstream>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include <linux/media.h>
@@ -20,11 +21,13 @@
 
 namespace libcamera {
 
+class DeviceCache;
+
 class MediaDevice
 {
 public:
 	MediaDevice(const std::string &deviceNode);
-	~MediaDevice();
+	virtual ~MediaDevice();
 
 	bool acquire();
 	void release();
@@ -39,6 +42,7 @@ public:
 	const std::string driver() const { return driver_; }
 	const std::string deviceNode() const { return deviceNode_; }
 	const std::string model() const { return model_; }
+	const std::string &identity() const { return identity_; }
 
 	const std::vector<MediaEntity *> &entities() const { return entities_; }
 	MediaEntity *getEntityByName(const std::string &name) const;
@@ -52,11 +56,15 @@ public:
 
 	Signal<MediaDevice *> disconnected;
 
+protected:
+	virtual int ioctl(unsigned long request, void *argp);
+
 private:
 	std::string driver_;
 	std::string deviceNode_;
 	std::string model_;
 	unsigned int version_;
+	std::string identity_;
 
 	int fd_;
 	bool valid_;
@@ -72,12 +80,21 @@ private:
 	void clear();
 
 	std::vector<MediaEntity *> entities_;
+	std::unordered_map<std::string, MediaEntity *> entitiesByName_;
+	std::unordered_map<uint64_t, MediaLink *> links_;
 
 	struct media_v2_interface *findInterface(const struct media_v2_topology &topology,
 						 unsigned int entityId);
 	bool populateEntities(const struct media_v2_topology &topology);
 	bool populatePads(const struct media_v2_topology &topology);
 	bool populateLinks(const struct media_v2_topology &topology);
+
+	bool loadTopology(const DeviceCache *cache,
+			  const struct media_v2_topology &topology);
+	void storeTopology(const DeviceCache *cache,
+			   const struct media_v2_topology &topology);
+	std::string topologyKey(const struct media_v2_topology &topology) const;
+	std::string cacheName() const;
 	void fixupEntityFlags(struct media_v2_entity *entity);
 
 	friend int MediaLink::setEnabled(bool enable);
@@ -115,12 +115,15 @@ private:
 class PipelineHandlerFactory
 {
 public:
-	PipelineHandlerFactory(const char *name);
+	PipelineHandlerFactory(const char *name,
+			       const std::vector<std::string> &drivers);
 	virtual ~PipelineHandlerFactory() {}
 
 	std::shared_ptr<PipelineHandler> create(CameraManager *manager);
+	bool canMatch(const DeviceEnumerator *enumerator) const;
 
 	const std::string &name() const { return name_; }
+	const std::vector<std::string> &drivers() const { return drivers_; }
 
 	static void registerType(PipelineHandlerFactory *factory);
 	static std::vector<PipelineHandlerFactory *> &factories();
@@ -129,13 +132,15 @@ private:
 	virtual PipelineHandler *createInstance(CameraManager *manager) = 0;
 
 	std::string name_;
+	std::vector<std::string> drivers_;
 };
 
-#define REGISTER_PIPELINE_HANDLER(handler)				\
+#define REGISTER_PIPELINE_HANDLER(handler, ...)				\
 class handler##Factory final : public PipelineHandlerFactory		\
 {									\
 public:									\
-	handler##Factory() : PipelineHandlerFactory(#handler) {}	\
+	handler##Factory()						\
+		: PipelineHandlerFactory(#handler, { __VA_ARGS__ }) {}	\
 									\
 private:								\
 	PipelineHandler *createInstance(CameraManager *manager)		\
@@ -33,12 +33,12 @@ public:
 
 protected:
 	V4L2Device(const std::string &deviceNode);
-	~V4L2Device();
+	virtual ~V4L2Device();
 
 	int open(unsigned int flags);
 	int setFd(int fd);
 
-	int ioctl(unsigned long request, void *argp);
+	virtual int ioctl(unsigned long request, void *argp);
 
 	int fd() { return fd_; }
 
@@ -182,6 +182,10 @@ public:
 	int setFormat(V4L2DeviceFormat *format);
 	ImageFormats formats();
 
+	int frameDurationLimits(unsigned int pixelFormat, const Size &size,
+				int64_t *min, int64_t *max);
+	int setFrameDuration(int64_t *duration);
+
 	int exportBuffers(unsigned int count,
 			  std::vector<std::unique_ptr<FrameBuffer>> *buffers);
 	int importBuffers(unsigned int count);
@@ -12,12 +12,15 @@
 #include <string>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <vector>
 
 #include <linux/media.h>
 
+#include "device_cache.h"
 #include "log.h"
+#include "utils.h"
 
 /**
  * \file media_device.h
@@ -29,6 +32,16 @@ namespace libcamera {
 
 LOG_DEFINE_CATEGORY(MediaDevice)
 
+namespace {
+
+/* Combine the ids of the source and sink pads of a link in a single key. */
+uint64_t linkKey(unsigned int sourceId, unsigned int sinkId)
+{
+	return static_cast<uint64_t>(sourceId) << 32 | sinkId;
+}
+
+} /* namespace */
+
 /**
  * \class MediaDevice
  * \brief The MediaDevice represents a Media Controller device with its full
@@ -204,6 +217,9 @@ int MediaDevice::populate()
 	struct media_v2_interface *interfaces = nullptr;
 	struct media_v2_link *links = nullptr;
 	struct media_v2_pad *pads = nullptr;
+	DeviceCache *cache = DeviceCache::instance();
+	bool lookedUp = false;
+	bool cached = false;
 	__u64 version = -1;
 	int ret;
 
@@ -214,9 +230,8 @@ int MediaDevice::populate()
 		return ret;
 
 	struct media_device_info info = {};
-	ret = ioctl(fd_, MEDIA_IOC_DEVICE_INFO, &info);
+	ret = ioctl(MEDIA_IOC_DEVICE_INFO, &info);
 	if (ret) {
-		ret = -errno;
 		LOG(MediaDevice, Error)
 			<< "Failed to get media device info " << strerror(-ret);
 		goto done;
@@ -225,20 +240,28 @@ int MediaDevice::populate()
 	driver_ = info.driver;
 	model_ = info.model;
 	version_ = info.media_version;
+	identity_ = driver_ + ":" + model_ + ":" + info.bus_info + ":"
+		  + std::to_string(info.hw_revision) + ":"
+		  + std::to_string(info.driver_version) + ":"
+		  + std::to_string(info.media_version) + ":"
+		  + DeviceCache::kernelRelease();
 
 	/*
-	 * Keep calling G_TOPOLOGY until the version number stays stable.
+	 * Keep calling G_TOPOLOGY until the version number stays stable. The
+	 * first call only retrieves the number of objects and the topology
+	 * version, use them to look the topology up in the device cache. Link
+	 * flags can be changed without bumping the topology version, links are
+	 * thus never cached, and only the links are retrieved on a cache hit.
 	 */
 	while (true) {
 		topology.topology_version = 0;
-		topology.ptr_entities = reinterpret_cast<__u64>(ents);
-		topology.ptr_interfaces = reinterpret_cast<__u64>(interfaces);
+		topology.ptr_entities = reinterpret_cast<__u64>(cached ? nullptr : ents);
+		topology.ptr_interfaces = reinterpret_cast<__u64>(cached ? nullptr : interfaces);
 		topology.ptr_links = reinterpret_cast<__u64>(links);
-		topology.ptr_pads = reinterpret_cast<__u64>(pads);
+		topology.ptr_pads = reinterpret_cast<__u64>(cached ? nullptr : pads);
 
-		ret = ioctl(fd_, MEDIA_IOC_G_TOPOLOGY, &topology);
+		ret = ioctl(MEDIA_IOC_G_TOPOLOGY, &topology);
 		if (ret < 0) {
-			ret = -errno;
 			LOG(MediaDevice, Error)
 				<< "Failed to enumerate topology: "
 				<< strerror(-ret);
@@ -248,6 +271,9 @@ int MediaDevice::populate()
 		if (version == topology.topology_version)
 			break;
 
+		/* The cached topology is stale if the version has changed. */
+		cached = false;
+
 		delete[] ents;
 		delete[] interfaces;
 		delete[] pads;
@@ -259,8 +285,25 @@ int MediaDevice::populate()
 		pads = new struct media_v2_pad[topology.num_pads]();
 
 		version = topology.topology_version;
+
+		topology.ptr_entities = reinterpret_cast<__u64>(ents);
+		topology.ptr_interfaces = reinterpret_cast<__u64>(interfaces);
+		topology.ptr_pads = reinterpret_cast<__u64>(pads);
+
+		if (cache && !lookedUp) {
+			lookedUp = true;
+			cached = loadTopology(cache, topology);
+		}
 	}
 
+	topology.ptr_entities = reinterpret_cast<__u64>(ents);
+	topology.ptr_interfaces = reinterpret_cast<__u64>(interfaces);
+	topology.ptr_links = reinterpret_cast<__u64>(links);
+	topology.ptr_pads = reinterpret_cast<__u64>(pads);
+
+	if (cache && !cached)
+		storeTopology(cache, topology);
+
 	/* Populate entities, pads and links. */
 	if (populateEntities(topology) &&
 	    populatePads(topology) &&
@@ -284,6 +327,109 @@ done:
 	return ret;
 }
 
+/*
+ * The topology is cached as the raw entities, interfaces and pads arrays, in
+ * that order. Links are not cached, as their flags reflect the current
+ * configuration of the device.
+ *
+ * The device numbers of interfaces may change when the device is registered
+ * again, the cache key thus includes the boot identifier, and the device
+ * number and change time of the media device node, which is recreated when
+ * the device is registered.
+ */
+bool MediaDevice::loadTopology(const DeviceCache *cache,
+			       const struct media_v2_topology &topology)
+{
+	std::string key = topologyKey(topology);
+	if (key.empty())
+		return false;
+
+	size_t entitiesSize = topology.num_entities * sizeof(struct media_v2_entity);
+	size_t interfacesSize = topology.num_interfaces * sizeof(struct media_v2_interface);
+	size_t padsSize = topology.num_pads * sizeof(struct media_v2_pad);
+
+	std::vector<uint8_t> data;
+	if (!cache->load(cacheName(), key, &data))
+		return false;
+
+	if (data.size() != entitiesSize + interfacesSize + padsSize)
+		return false;
+
+	const uint8_t *src = data.data();
+	memcpy(reinterpret_cast<void *>(topology.ptr_entities), src, entitiesSize);
+	src += entitiesSize;
+	memcpy(reinterpret_cast<void *>(topology.ptr_interfaces), src, interfacesSize);
+	src += interfacesSize;
+	memcpy(reinterpret_cast<void *>(topology.ptr_pads), src, padsSize);
+
+	LOG(MediaDevice, Debug) << "Loaded topology of " << deviceNode_
+				<< " from cache";
+
+	return true;
+}
+
+void MediaDevice::storeTopology(const DeviceCache *cache,
+				const struct media_v2_topology &topology)
+{
+	std::string key = topologyKey(topology);
+	if (key.empty())
+		return;
+
+	const uint8_t *arrays[] = {
+		reinterpret_cast<const uint8_t *>(topology.ptr_entities),
+		reinterpret_cast<const uint8_t *>(topology.ptr_interfaces),
+		reinterpret_cast<const uint8_t *>(topology.ptr_pads),
+	};
+	const size_t sizes[] = {
+		topology.num_entities * sizeof(struct media_v2_entity),
+		topology.num_interfaces * sizeof(struct media_v2_interface),
+		topology.num_pads * sizeof(struct media_v2_pad),
+	};
+
+	std::vector<uint8_t> data;
+	for (unsigned int i = 0; i < ARRAY_SIZE(arrays); ++i)
+		data.insert(data.end(), arrays[i], arrays[i] + sizes[i]);
+
+	cache->store(cacheName(), key, data);
+}
+
+std::string MediaDevice::topologyKey(const struct media_v2_topology &topology) const
+{
+	if (DeviceCache::bootId().empty())
+		return std::string();
+
+	struct stat st;
+	if (fstat(fd_, &st) < 0)
+		return std::string();
+
+	return identity_ + ":" + DeviceCache::bootId() + ":"
+	       + std::to_string(st.st_rdev) + ":"
+	       + std::to_string(st.st_ctim.tv_sec) + "."
+	       + std::to_string(st.st_ctim.tv_nsec) + ":"
+	       + std::to_string(topology.topology_version) + ":"
+	       + std::to_string(topology.num_entities) + ":"
+	       + std::to_string(topology.num_interfaces) + ":"
+	       + std::to_string(topology.num_links) + ":"
+	       + std::to_string(topology.num_pads);
+}
+
+std::string MediaDevice::cacheName() const
+{
+	return "topology" + deviceNode_;
+}
+
+/**
+ * \fn MediaDevice::identity()
+ * \brief Retrieve a string identifying the device, its driver and the kernel
+ *
+ * The identity combines the driver, model, bus information, hardware revision,
+ * driver and media API versions of the device with the kernel release. It is
+ * meant to be used as part of the key of DeviceCache entries that depend on
+ * the device.
+ *
+ * \return The media device identity
+ */
+
 /**
  * \fn MediaDevice::valid()
  * \brief Query whether the media graph has been populated and is valid
@@ -321,11 +467,8 @@ done:
  */
 MediaEntity *MediaDevice::getEntityByName(const std::string &name) const
 {
-	for (MediaEntity *e : entities_)
-		if (e->name() == name)
-			return e;
-
-	return nullptr;
+	auto it = entitiesByName_.find(name);
+	return it != entitiesByName_.end() ? it->second : nullptr;
 }
 
 /**
@@ -400,12 +543,8 @@ MediaLink *MediaDevice::link(const MediaEntity *source, unsigned int sourceIdx,
  */
 MediaLink *MediaDevice::link(const MediaPad *source, const MediaPad *sink)
 {
-	for (MediaLink *link : source->links()) {
-		if (link->sink()->id() == sink->id())
-			return link;
-	}
-
-	return nullptr;
+	auto it = links_.find(linkKey(source->id(), sink->id()));
+	return it != links_.end() ? it->second : nullptr;
 }
 
 /**
@@ -474,6 +613,25 @@ int MediaDevice::open()
 	return 0;
 }
 
+/**
+ * \brief Perform an IOCTL system call on the media device node
+ * \param[in] request The IOCTL request code
+ * \param[in] argp A pointer to the IOCTL argument
+ *
+ * All accesses to the media device go through this method. Derived classes
+ * may override it to emulate a media device in user space, for testing
+ * purposes.
+ *
+ * \return 0 on success or a negative error code otherwise
+ */
+int MediaDevice::ioctl(unsigned long request, void *argp)
+{
+	if (::ioctl(fd_, request, argp) < 0)
+		return -errno;
+
+	return 0;
+}
+
 /**
  * \brief Close the media device
  *
@@ -555,6 +713,8 @@ void MediaDevice::clear()
 
 	objects_.clear();
 	entities_.clear();
+	entitiesByName_.clear();
+	links_.clear();
 	valid_ = false;
 }
 
@@ -563,6 +723,16 @@ void MediaDevice::clear()
  * \brief Global list of media entities in the media graph
  */
 
+/**
+ * \var MediaDevice::entitiesByName_
+ * \brief Map of media entities keyed by their name, for fast lookup
+ */
+
+/**
+ * \var MediaDevice::links_
+ * \brief Map of pad-to-pad links keyed by their source and sink pad ids
+ */
+
 /**
  * \brief Find the interface associated with an entity
  * \param[in] topology The media topology as returned by MEDIA_IOC_G_TOPOLOGY
@@ -642,6 +812,7 @@ bool MediaDevice::populateEntities(const struct media_v2_topology &topology)
 		}
 
 		entities_.push_back(entity);
+		entitiesByName_.emplace(entity->name(), entity);
 	}
 
 	return true;
@@ -720,6 +891,8 @@ bool MediaDevice::populateLinks(const struct media_v2_topology &topology)
 
 		source->addLink(link);
 		sink->addLink(link);
+
+		links_[linkKey(source_id, sink_id)] = link;
 	}
 
 	return true;
@@ -738,9 +911,8 @@ void MediaDevice::fixupEntityFlags(struct media_v2_entity *entity)
 	struct media_entity_desc desc = {};
 	desc.id = entity->id;
 
-	int ret = ioctl(fd_, MEDIA_IOC_ENUM_ENTITIES, &desc);
+	int ret = ioctl(MEDIA_IOC_ENUM_ENTITIES, &desc);
 	if (ret < 0) {
-		ret = -errno;
 		LOG(MediaDevice, Debug)
 			<< "Failed to retrieve information for entity "
 			<< entity->id << ": " << strerror(-ret);
@@ -781,9 +953,8 @@ int MediaDevice::setupLink(const MediaLink *link, unsigned int flags)
 
 	linkDesc.flags = flags;
 
-	int ret = ioctl(fd_, MEDIA_IOC_SETUP_LINK, &linkDesc);
+	int ret = ioctl(MEDIA_IOC_SETUP_LINK, &linkDesc);
 	if (ret) {
-		ret = -errno;
 		LOG(MediaDevice, Error)
 			<< "Failed to setup link: "
 			<< strerror(-ret);
@@ -1469,6 +1469,6 @@ int CIO2Device::mediaBusToFormat(unsigned int code)
 	}
 }
 
-REGISTER_PIPELINE_HANDLER(PipelineHandlerIPU3);
+REGISTER_PIPELINE_HANDLER(PipelineHandlerIPU3, "ipu3-cio2", "ipu3-imgu");
 
 } /* namespace libcamera */
@@ -7,6 +7,7 @@
 
 #include <algorithm>
 #include <iomanip>
+#include <stdint.h>
 #include <sys/sysmacros.h>
 #include <tuple>
 
@@ -32,7 +33,8 @@ class UVCCameraData : public CameraData
 {
 public:
 	UVCCameraData(PipelineHandler *pipe)
-		: CameraData(pipe), video_(nullptr)
+		: CameraData(pipe), video_(nullptr), streaming_(false),
+		  frameDuration_(0)
 	{
 	}
 
@@ -46,6 +48,12 @@ public:
 
 	V4L2VideoDevice *video_;
 	Stream stream_;
+
+	bool streaming_;
+	int64_t frameDuration_;
+
+private:
+	bool frameDurationLimits(int64_t *min, int64_t *max);
 };
 
 class UVCCameraConfiguration : public CameraConfiguration
@@ -78,6 +86,7 @@ public:
 	bool match(DeviceEnumerator *enumerator) override;
 
 private:
+	int processFrameDuration(UVCCameraData *data, int64_t duration);
 	int processControls(UVCCameraData *data, Request *request);
 
 	UVCCameraData *cameraData(const Camera *camera)
@@ -217,16 +226,48 @@ void PipelineHandlerUVC::freeFrameBuffers(Camera *camera, Stream *stream)
 	data->video_->releaseBuffers();
 }
 
+/*
+ * The uvcvideo driver rejects frame interval changes while streaming. Starting
+ * the video stream is deferred to the first request, to apply the frame
+ * duration it carries.
+ */
 int PipelineHandlerUVC::start(Camera *camera)
 {
 	UVCCameraData *data = cameraData(camera);
-	return data->video_->streamOn();
+	data->streaming_ = false;
+	return 0;
 }
 
 void PipelineHandlerUVC::stop(Camera *camera)
 {
 	UVCCameraData *data = cameraData(camera);
 	data->video_->streamOff();
+	data->streaming_ = false;
+}
+
+int PipelineHandlerUVC::processFrameDuration(UVCCameraData *data,
+					     int64_t duration)
+{
+	if (duration == data->frameDuration_)
+		return 0;
+
+	if (data->streaming_) {
+		LOG(UVC, Warning)
+			<< "Frame duration can't be changed while streaming";
+		return 0;
+	}
+
+	int ret = data->video_->setFrameDuration(&duration);
+	if (ret) {
+		LOG(UVC, Error) << "Failed to set frame duration: " << ret;
+		return ret;
+	}
+
+	LOG(UVC, Debug) << "Frame duration set to " << duration << "us";
+
+	data->frameDuration_ = duration;
+
+	return 0;
 }
 
 int PipelineHandlerUVC::processControls(UVCCameraData *data, Request *request)
@@ -248,6 +289,10 @@ int PipelineHandlerUVC::processControls(UVCCameraData *data, Request *request)
 			controls.set(V4L2_CID_EXPOSURE_ABSOLUTE, value);
 		} else if (id == controls::ManualGain) {
 			controls.set(V4L2_CID_GAIN, value);
+		} else if (id == controls::FrameDuration) {
+			int ret = processFrameDuration(data, value.get<int64_t>());
+			if (ret)
+				return ret;
 		}
 	}
 
@@ -284,6 +329,14 @@ int PipelineHandlerUVC::queueRequestDevice(Camera *camera, Request *request)
 	if (ret < 0)
 		return ret;
 
+	if (!data->streaming_) {
+		ret = data->video_->streamOn();
+		if (ret < 0)
+			return ret;
+
+		data->streaming_ = true;
+	}
+
 	return 0;
 }
 
@@ -368,19 +421,56 @@ int UVCCameraData::init(MediaEntity *entity)
 		ctrls.emplace(id, range);
 	}
 
+	int64_t min, max;
+	if (frameDurationLimits(&min, &max))
+		ctrls.emplace(&controls::FrameDuration, ControlRange(min, max));
+
 	controlInfo_ = std::move(ctrls);
 
 	return 0;
 }
 
+/*
+ * Compute the frame duration limits across all formats and sizes, as the
+ * control limits can't depend on the camera configuration. The device adjusts
+ * the frame duration to the closest one supported by the configured format.
+ */
+bool UVCCameraData::frameDurationLimits(int64_t *min, int64_t *max)
+{
+	ImageFormats formats = video_->formats();
+	bool found = false;
+
+	*min = INT64_MAX;
+	*max = 0;
+
+	for (unsigned int pixelFormat : formats.formats()) {
+		for (const SizeRange &range : formats.sizes(pixelFormat)) {
+			int64_t rangeMin, rangeMax;
+
+			if (video_->frameDurationLimits(pixelFormat, range.max,
+							&rangeMin, &rangeMax))
+				continue;
+
+			*min = std::min(*min, rangeMin);
+			*max = std::max(*max, rangeMax);
+			found = true;
+		}
+	}
+
+	return found;
+}
+
 void UVCCameraData::bufferReady(FrameBuffer *buffer)
 {
 	Request *request = buffer->request();
 
+	if (frameDuration_)
+		request->metadata().set(controls::FrameDuration, frameDuration_);
+
 	pipe_->completeBuffer(camera_, request, buffer);
 	pipe_->completeRequest(camera_, request);
 }
 
-REGISTER_PIPELINE_HANDLER(PipelineHandlerUVC);
+REGISTER_PIPELINE_HANDLER(PipelineHandlerUVC, "uvcvideo");
 
 } /* namespace libcamera */
@@ -463,6 +463,6 @@ void VimcCameraData::bufferReady(FrameBuffer *buffer)
 	pipe_->completeRequest(camera_, request);
 }
 
-REGISTER_PIPELINE_HANDLER(PipelineHandlerVimc);
+REGISTER_PIPELINE_HANDLER(PipelineHandlerVimc, "vimc");
 
 } /* namespace libcamera */
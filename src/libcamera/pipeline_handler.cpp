@@ -462,11 +462,13 @@ int PipelineHandler::queueRequest(Camera *camera, Request *request)
  * \param[in] buffer The buffer that has completed
  *
  * This method shall be called by pipeline handlers to signal completion of the
- * \a buffer part of the \a request. It notifies applications of buffer
- * completion and updates the request's internal buffer tracking. The request
- * is not completed automatically when the last buffer completes to give
- * pipeline handlers a chance to perform any operation that may still be
- * needed. They shall complete requests explicitly with completeRequest().
+ * \a buffer part of the \a request. It updates the request's internal buffer
+ * tracking and notifies applications of buffer completion. As the buffer is
+ * detached from the request before applications are notified, they may queue
+ * it in a new request from their bufferCompleted handler. The request is not
+ * completed automatically when the last buffer completes to give pipeline
+ * handlers a chance to perform any operation that may still be needed. They
+ * shall complete requests explicitly with completeRequest().
  *
  * \context This function shall be called from the CameraManager thread.
  *
@@ -476,8 +478,9 @@ int PipelineHandler::queueRequest(Camera *camera, Request *request)
 bool PipelineHandler::completeBuffer(Camera *camera, Request *request,
 				     FrameBuffer *buffer)
 {
+	bool complete = request->completeBuffer(buffer);
 	camera->bufferCompleted.emit(request, buffer);
-	return request->completeBuffer(buffer);
+	return complete;
 }
 
 /**
@@ -641,14 +644,16 @@ CameraData *PipelineHandler::cameraData(const Camera *camera)
 /**
  * \brief Construct a pipeline handler factory
  * \param[in] name Name of the pipeline handler class
+ * \param[in] drivers Names of the media device drivers the handler requires
  *
  * Creating an instance of the factory registers is with the global list of
  * factories, accessible through the factories() function.
  *
  * The factory \a name is used for debug purpose and shall be unique.
  */
-PipelineHandlerFactory::PipelineHandlerFactory(const char *name)
-	: name_(name)
+PipelineHandlerFactory::PipelineHandlerFactory(const char *name,
+					       const std::vector<std::string> &drivers)
+	: name_(name), drivers_(drivers)
 {
 	registerType(this);
 }
@@ -667,12 +672,41 @@ std::shared_ptr<PipelineHandler> PipelineHandlerFactory::create(CameraManager *m
 	return std::shared_ptr<PipelineHandler>(handler);
 }
 
+/**
+ * \brief Check if the pipeline handler may match devices of an enumerator
+ * \param[in] enumerator The enumerator holding the media devices
+ *
+ * Matching a pipeline handler opens and probes devices, which is costly. This
+ * function allows skipping pipeline handlers early when the \a enumerator
+ * doesn't contain media devices for all the drivers they require. It only
+ * checks driver names, a pipeline handler may still fail to match devices
+ * when this function returns true.
+ *
+ * \return True if all the drivers required by the pipeline handler are
+ * present in the \a enumerator, false otherwise
+ */
+bool PipelineHandlerFactory::canMatch(const DeviceEnumerator *enumerator) const
+{
+	for (const std::string &driver : drivers_) {
+		if (!enumerator->hasDriver(driver))
+			return false;
+	}
+
+	return true;
+}
+
 /**
  * \fn PipelineHandlerFactory::name()
  * \brief Retrieve the factory name
  * \return The factory name
  */
 
+/**
+ * \fn PipelineHandlerFactory::drivers()
+ * \brief Retrieve the names of the media device drivers the handler requires
+ * \return The media device driver names
+ */
+
 /**
  * \brief Add a pipeline handler class to the registry
  * \param[in] factory Factory to use to construct the pipeline handler
@@ -721,9 +755,12 @@ std::vector<PipelineHandlerFactory *> &PipelineHandlerFactory::factories()
  * \def REGISTER_PIPELINE_HANDLER
  * \brief Register a pipeline handler with the pipeline handler factory
  * \param[in] handler Class name of PipelineHandler derived class to register
+ * \param[in] ... Names of the media device drivers the handler requires
  *
  * Register a PipelineHandler subclass with the factory and make it available to
- * try and match devices.
+ * try and match devices. The pipeline handler is only matched against the
+ * devices of an enumerator when media devices for all the listed drivers are
+ * present.
  */
 
 } /* namespace libcamera */
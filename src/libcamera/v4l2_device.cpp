@@ -311,6 +311,10 @@ int V4L2Device::setControls(ControlList *ctrls)
  * \brief Perform an IOCTL system call on the device node
  * \param[in] request The IOCTL request code
  * \param[in] argp A pointer to the IOCTL argument
+ *
+ * All accesses to the device go through this method. Derived classes may
+ * override it to emulate a device in user space, for testing purposes.
+ *
  * \return 0 on success or a negative error code otherwise
  */
 int V4L2Device::ioctl(unsigned long request, void *argp)
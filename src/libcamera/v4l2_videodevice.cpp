@@ -7,9 +7,11 @@
 
 #include "v4l2_videodevice.h"
 
+#include <algorithm>
 #include <fcntl.h>
 #include <iomanip>
 #include <sstream>
+#include <stdint.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
@@ -36,6 +38,16 @@ namespace libcamera {
 
 LOG_DECLARE_CATEGORY(V4L2)
 
+namespace {
+
+int64_t fractToMicroseconds(const struct v4l2_fract &fract)
+{
+	return static_cast<int64_t>(fract.numerator) * 1000000
+	       / fract.denominator;
+}
+
+} /* namespace */
+
 /**
  * \struct V4L2Capability
  * \brief struct v4l2_capability object wrapper and helpers
@@ -942,6 +954,119 @@ std::vector<SizeRange> V4L2VideoDevice::enumSizes(unsigned int pixelFormat)
 	return sizes;
 }
 
+/**
+ * \brief Retrieve the frame duration limits for a format
+ * \param[in] pixelFormat The V4L2 pixel format
+ * \param[in] size The frame size
+ * \param[out] min The shortest supported frame duration, in microseconds
+ * \param[out] max The longest supported frame duration, in microseconds
+ *
+ * Enumerate the frame intervals supported by the device for \a pixelFormat
+ * and \a size, and return the shortest and longest ones.
+ *
+ * \return 0 on success or a negative error code otherwise
+ * \retval -ENOTTY The device doesn't report frame intervals
+ */
+int V4L2VideoDevice::frameDurationLimits(unsigned int pixelFormat,
+					 const Size &size, int64_t *min,
+					 int64_t *max)
+{
+	int64_t shortest = INT64_MAX;
+	int64_t longest = 0;
+	int ret;
+
+	for (unsigned int index = 0;; index++) {
+		struct v4l2_frmivalenum interval = {};
+		interval.index = index;
+		interval.pixel_format = pixelFormat;
+		interval.width = size.width;
+		interval.height = size.height;
+
+		ret = ioctl(VIDIOC_ENUM_FRAMEINTERVALS, &interval);
+		if (ret)
+			break;
+
+		if (interval.type == V4L2_FRMIVAL_TYPE_DISCRETE) {
+			if (!interval.discrete.denominator)
+				continue;
+
+			int64_t duration = fractToMicroseconds(interval.discrete);
+			shortest = std::min(shortest, duration);
+			longest = std::max(longest, duration);
+			continue;
+		}
+
+		/* Stepwise and continuous intervals are reported at index 0. */
+		if (!interval.stepwise.min.denominator ||
+		    !interval.stepwise.max.denominator)
+			break;
+
+		shortest = fractToMicroseconds(interval.stepwise.min);
+		longest = fractToMicroseconds(interval.stepwise.max);
+		break;
+	}
+
+	if (ret && ret != -EINVAL) {
+		LOG(V4L2, Error)
+			<< "Unable to enumerate frame intervals: "
+			<< strerror(-ret);
+		return ret;
+	}
+
+	if (longest == 0)
+		return -ENOTTY;
+
+	*min = shortest;
+	*max = longest;
+
+	return 0;
+}
+
+/**
+ * \brief Set the frame duration
+ * \param[inout] duration The frame duration, in microseconds
+ *
+ * Set the interval between frames produced by the device. The device adjusts
+ * the duration to the closest one it supports for the current format, which is
+ * returned in \a duration. Most drivers don't allow changing the frame
+ * duration while streaming.
+ *
+ * \return 0 on success or a negative error code otherwise
+ * \retval -ENOTTY The device doesn't support setting the frame duration
+ */
+int V4L2VideoDevice::setFrameDuration(int64_t *duration)
+{
+	struct v4l2_streamparm parm = {};
+	parm.type = bufferType_;
+
+	int ret = ioctl(VIDIOC_G_PARM, &parm);
+	if (ret < 0)
+		return ret;
+
+	bool output = V4L2_TYPE_IS_OUTPUT(bufferType_);
+	uint32_t capability = output ? parm.parm.output.capability
+				     : parm.parm.capture.capability;
+	if (!(capability & V4L2_CAP_TIMEPERFRAME))
+		return -ENOTTY;
+
+	struct v4l2_fract &interval = output ? parm.parm.output.timeperframe
+					     : parm.parm.capture.timeperframe;
+	interval.numerator = *duration;
+	interval.denominator = 1000000;
+
+	ret = ioctl(VIDIOC_S_PARM, &parm);
+	if (ret < 0) {
+		LOG(V4L2, Error)
+			<< "Unable to set frame duration: " << strerror(-ret);
+		return ret;
+	}
+
+	if (interval.denominator)
+		*duration = fractToMicroseconds(interval);
+
+	return 0;
+}
+
 int V4L2VideoDevice::requestBuffers(unsigned int count)
 {
 	struct v4l2_requestbuffers rb = {};
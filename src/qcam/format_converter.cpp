@@ -12,23 +12,21 @@
 #include <QImage>
 
 #include "format_converter.h"
+#include "format_kernels.h"
 
-#define RGBSHIFT		8
-#ifndef MAX
-#define MAX(a,b)		((a)>(b)?(a):(b))
-#endif
-#ifndef MIN
-#define MIN(a,b)		((a)<(b)?(a):(b))
-#endif
-#ifndef CLAMP
-#define CLAMP(a,low,high)	MAX((low),MIN((high),(a)))
-#endif
-#ifndef CLIP
-#define CLIP(x)			CLAMP(x,0,255)
-#endif
+FormatConverter::FormatConverter()
+	: format_(0), width_(0), height_(0), stride_(0),
+	  kernels_(&formatKernels()), src_(nullptr), srcChroma_(nullptr),
+	  dst_(nullptr), dstStride_(0)
+{
+}
 
+/*
+ * The \a stride is the length in bytes of the source lines, and defaults to
+ * the width multiplied by the number of bytes per pixel when set to 0.
+ */
 int FormatConverter::configure(unsigned int format, unsigned int width,
-			       unsigned int height)
+			       unsigned int height, unsigned int stride)
 {
 	switch (format) {
 	case DRM_FORMAT_NV12:
@@ -115,138 +113,92 @@ int FormatConverter::configure(unsigned int format, unsigned int width,
 		return -EINVAL;
 	};
 
+	if (!stride) {
+		switch (formatFamily_) {
+		case NV:
+			stride = width;
+			break;
+		case RGB:
+			stride = width * bpp_;
+			break;
+		case YUV:
+			stride = width * 2;
+			break;
+		default:
+			break;
+		}
+	}
+
 	format_ = format;
 	width_ = width;
 	height_ = height;
+	stride_ = stride;
 
 	return 0;
 }
 
-void FormatConverter::convert(const unsigned char *src, size_t size,
-			      QImage *dst)
+/*
+ * Convert the frame stored in \a planes. The semi-planar formats may be stored
+ * in a single plane, with the chroma plane following the luma plane, or in two
+ * separate planes. The \a size is the number of bytes used in the first plane.
+ */
+void FormatConverter::convert(const std::vector<const unsigned char *> &planes,
+			      size_t size, QImage *dst)
 {
-	switch (formatFamily_) {
-	case MJPEG:
+	const unsigned char *src = planes[0];
+
+	if (formatFamily_ == MJPEG) {
 		dst->loadFromData(src, size, "JPEG");
-		break;
-	case YUV:
-		convertYUV(src, dst->bits());
-		break;
-	case RGB:
-		convertRGB(src, dst->bits());
-		break;
-	case NV:
-		convertNV(src, dst->bits());
-		break;
-	};
-}
+		return;
+	}
 
-static void yuv_to_rgb(int y, int u, int v, int *r, int *g, int *b)
-{
-	int c = y - 16;
-	int d = u - 128;
-	int e = v - 128;
-	*r = CLIP(( 298 * c           + 409 * e + 128) >> RGBSHIFT);
-	*g = CLIP(( 298 * c - 100 * d - 208 * e + 128) >> RGBSHIFT);
-	*b = CLIP(( 298 * c + 516 * d           + 128) >> RGBSHIFT);
+	src_ = src;
+	srcChroma_ = planes.size() > 1 ? planes[1] : src + stride_ * height_;
+	dst_ = dst->bits();
+	dstStride_ = dst->bytesPerLine();
+
+	/*
+	 * Split the frame in slices of lines, converted concurrently by the
+	 * worker threads and the caller.
+	 */
+	pool_.run(height_, [this](unsigned int start, unsigned int end) {
+		switch (formatFamily_) {
+		case YUV:
+			convertYUV(start, end);
+			break;
+		case RGB:
+			convertRGB(start, end);
+			break;
+		case NV:
+			convertNV(start, end);
+			break;
+		default:
+			break;
+		};
+	});
 }
 
-void FormatConverter::convertNV(const unsigned char *src, unsigned char *dst)
+void FormatConverter::convertNV(unsigned int start, unsigned int end)
 {
-	unsigned int c_stride = width_ * (2 / horzSubSample_);
-	unsigned int c_inc = horzSubSample_ == 1 ? 2 : 0;
-	unsigned int cb_pos = nvSwap_ ? 1 : 0;
-	unsigned int cr_pos = nvSwap_ ? 0 : 1;
-	const unsigned char *src_c = src + width_ * height_;
-	int r, g, b;
-
-	for (unsigned int y = 0; y < height_; y++) {
-		const unsigned char *src_y = src + y * width_;
-		const unsigned char *src_cb = src_c + (y / vertSubSample_) *
-					      c_stride + cb_pos;
-		const unsigned char *src_cr = src_c + (y / vertSubSample_) *
-					      c_stride + cr_pos;
-
-		for (unsigned int x = 0; x < width_; x += 2) {
-			yuv_to_rgb(*src_y, *src_cb, *src_cr, &r, &g, &b);
-			dst[0] = b;
-			dst[1] = g;
-			dst[2] = r;
-			dst[3] = 0xff;
-			src_y++;
-			src_cb += c_inc;
-			src_cr += c_inc;
-			dst += 4;
-
-			yuv_to_rgb(*src_y, *src_cb, *src_cr, &r, &g, &b);
-			dst[0] = b;
-			dst[1] = g;
-			dst[2] = r;
-			dst[3] = 0xff;
-			src_y++;
-			src_cb += 2;
-			src_cr += 2;
-			dst += 4;
-		}
-	}
+	unsigned int c_stride = stride_ * (2 / horzSubSample_);
+
+	for (unsigned int y = start; y < end; y++)
+		kernels_->nvLine(src_ + y * stride_,
+				 srcChroma_ + (y / vertSubSample_) * c_stride,
+				 dst_ + y * dstStride_, width_,
+				 horzSubSample_, nvSwap_);
 }
 
-void FormatConverter::convertRGB(const unsigned char *src, unsigned char *dst)
+void FormatConverter::convertRGB(unsigned int start, unsigned int end)
 {
-	unsigned int x, y;
-	int r, g, b;
-
-	for (y = 0; y < height_; y++) {
-		for (x = 0; x < width_; x++) {
-			r = src[bpp_ * x + r_pos_];
-			g = src[bpp_ * x + g_pos_];
-			b = src[bpp_ * x + b_pos_];
-
-			dst[4 * x + 0] = b;
-			dst[4 * x + 1] = g;
-			dst[4 * x + 2] = r;
-			dst[4 * x + 3] = 0xff;
-		}
-
-		src += width_ * bpp_;
-		dst += width_ * 4;
-	}
+	for (unsigned int y = start; y < end; y++)
+		kernels_->rgbLine(src_ + y * stride_, dst_ + y * dstStride_,
+				  width_, bpp_, r_pos_, g_pos_, b_pos_);
 }
 
-void FormatConverter::convertYUV(const unsigned char *src, unsigned char *dst)
+void FormatConverter::convertYUV(unsigned int start, unsigned int end)
 {
-	unsigned int src_x, src_y, dst_x, dst_y;
-	unsigned int src_stride;
-	unsigned int dst_stride;
-	unsigned int cr_pos;
-	int r, g, b, y, cr, cb;
-
-	cr_pos = (cb_pos_ + 2) % 4;
-	src_stride = width_ * 2;
-	dst_stride = width_ * 4;
-
-	for (src_y = 0, dst_y = 0; dst_y < height_; src_y++, dst_y++) {
-		for (src_x = 0, dst_x = 0; dst_x < width_; ) {
-			cb = src[src_y * src_stride + src_x * 4 + cb_pos_];
-			cr = src[src_y * src_stride + src_x * 4 + cr_pos];
-
-			y = src[src_y * src_stride + src_x * 4 + y_pos_];
-			yuv_to_rgb(y, cb, cr, &r, &g, &b);
-			dst[dst_y * dst_stride + 4 * dst_x + 0] = b;
-			dst[dst_y * dst_stride + 4 * dst_x + 1] = g;
-			dst[dst_y * dst_stride + 4 * dst_x + 2] = r;
-			dst[dst_y * dst_stride + 4 * dst_x + 3] = 0xff;
-			dst_x++;
-
-			y = src[src_y * src_stride + src_x * 4 + y_pos_ + 2];
-			yuv_to_rgb(y, cb, cr, &r, &g, &b);
-			dst[dst_y * dst_stride + 4 * dst_x + 0] = b;
-			dst[dst_y * dst_stride + 4 * dst_x + 1] = g;
-			dst[dst_y * dst_stride + 4 * dst_x + 2] = r;
-			dst[dst_y * dst_stride + 4 * dst_x + 3] = 0xff;
-			dst_x++;
-
-			src_x++;
-		}
-	}
+	for (unsigned int y = start; y < end; y++)
+		kernels_->yuvLine(src_ + y * stride_, dst_ + y * dstStride_,
+				  width_, y_pos_, cb_pos_);
 }
@@ -8,16 +8,23 @@
 #define __QCAM_FORMAT_CONVERTER_H__
 
 #include <stddef.h>
+#include <vector>
+
+#include "../v4l2/slice_pool.h"
 
 class QImage;
+struct FormatKernels;
 
 class FormatConverter
 {
 public:
+	FormatConverter();
+
 	int configure(unsigned int format, unsigned int width,
-		      unsigned int height);
+		      unsigned int height, unsigned int stride = 0);
 
-	void convert(const unsigned char *src, size_t size, QImage *dst);
+	void convert(const std::vector<const unsigned char *> &planes,
+		     size_t size, QImage *dst);
 
 private:
 	enum FormatFamily {
@@ -27,13 +34,16 @@ private:
 		YUV,
 	};
 
-	void convertNV(const unsigned char *src, unsigned char *dst);
-	void convertRGB(const unsigned char *src, unsigned char *dst);
-	void convertYUV(const unsigned char *src, unsigned char *dst);
+	void convertNV(unsigned int start, unsigned int end);
+	void convertRGB(unsigned int start, unsigned int end);
+	void convertYUV(unsigned int start, unsigned int end);
 
 	unsigned int format_;
 	unsigned int width_;
 	unsigned int height_;
+	unsigned int stride_;
+
+	const FormatKernels *kernels_;
 
 	enum FormatFamily formatFamily_;
 
@@ -51,6 +61,15 @@ private:
 	/* YUV parameters */
 	unsigned int y_pos_;
 	unsigned int cb_pos_;
+
+	/* Frame being converted */
+	const unsigned char *src_;
+	const unsigned char *srcChroma_;
+	unsigned char *dst_;
+	unsigned int dstStride_;
+
+	/* Worker threads converting slices of lines in parallel */
+	SlicePool pool_;
 };
 
 #endif /* __QCAM_FORMAT_CONVERTER_H__ */
@@ -0,0 +1,520 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2020, Google Inc.
+ *
+ * format_kernels.cpp - qcam - Line conversion kernels to XRGB8888
+ */
+
+#include "format_kernels.h"
+
+#include <stdint.h>
+#include <utility>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HAVE_NEON_KERNELS 1
+#endif
+
+#define RGBSHIFT		8
+#ifndef MAX
+#define MAX(a,b)		((a)>(b)?(a):(b))
+#endif
+#ifndef MIN
+#define MIN(a,b)		((a)<(b)?(a):(b))
+#endif
+#ifndef CLAMP
+#define CLAMP(a,low,high)	MAX((low),MIN((high),(a)))
+#endif
+#ifndef CLIP
+#define CLIP(x)			CLAMP(x,0,255)
+#endif
+
+/*
+ * All kernels use the same BT.601 fixed point arithmetic as yuv_to_rgb(), and
+ * the SIMD kernels produce results identical to the scalar ones. The SIMD
+ * kernels only handle chroma subsampled horizontally by two, and convert the
+ * pixels that don't fill a full vector with the scalar kernels.
+ */
+
+/* -----------------------------------------------------------------------------
+ * Scalar kernels
+ */
+
+static void yuv_to_rgb(int y, int u, int v, int *r, int *g, int *b)
+{
+	int c = y - 16;
+	int d = u - 128;
+	int e = v - 128;
+	*r = CLIP(( 298 * c           + 409 * e + 128) >> RGBSHIFT);
+	*g = CLIP(( 298 * c - 100 * d - 208 * e + 128) >> RGBSHIFT);
+	*b = CLIP(( 298 * c + 516 * d           + 128) >> RGBSHIFT);
+}
+
+static void nvLineScalar(const unsigned char *src_y, const unsigned char *src_c,
+			 unsigned char *dst, unsigned int width,
+			 unsigned int horzSubSample, bool swap)
+{
+	unsigned int c_inc = horzSubSample == 1 ? 2 : 0;
+	const unsigned char *src_cb = src_c + (swap ? 1 : 0);
+	const unsigned char *src_cr = src_c + (swap ? 0 : 1);
+	int r, g, b;
+
+	for (unsigned int x = 0; x < width; x += 2) {
+		yuv_to_rgb(*src_y, *src_cb, *src_cr, &r, &g, &b);
+		dst[0] = b;
+		dst[1] = g;
+		dst[2] = r;
+		dst[3] = 0xff;
+		src_y++;
+		src_cb += c_inc;
+		src_cr += c_inc;
+		dst += 4;
+
+		yuv_to_rgb(*src_y, *src_cb, *src_cr, &r, &g, &b);
+		dst[0] = b;
+		dst[1] = g;
+		dst[2] = r;
+		dst[3] = 0xff;
+		src_y++;
+		src_cb += 2;
+		src_cr += 2;
+		dst += 4;
+	}
+}
+
+static void yuvLineScalar(const unsigned char *src, unsigned char *dst,
+			  unsigned int width, unsigned int yPos,
+			  unsigned int cbPos)
+{
+	unsigned int crPos = (cbPos + 2) % 4;
+	int r, g, b, y, cr, cb;
+
+	for (unsigned int x = 0; x < width; x += 2) {
+		cb = src[x * 2 + cbPos];
+		cr = src[x * 2 + crPos];
+
+		y = src[x * 2 + yPos];
+		yuv_to_rgb(y, cb, cr, &r, &g, &b);
+		dst[4 * x + 0] = b;
+		dst[4 * x + 1] = g;
+		dst[4 * x + 2] = r;
+		dst[4 * x + 3] = 0xff;
+
+		y = src[x * 2 + yPos + 2];
+		yuv_to_rgb(y, cb, cr, &r, &g, &b);
+		dst[4 * x + 4] = b;
+		dst[4 * x + 5] = g;
+		dst[4 * x + 6] = r;
+		dst[4 * x + 7] = 0xff;
+	}
+}
+
+static void rgbLineScalar(const unsigned char *src, unsigned char *dst,
+			  unsigned int width, unsigned int bpp,
+			  unsigned int rPos, unsigned int gPos,
+			  unsigned int bPos)
+{
+	for (unsigned int x = 0; x < width; x++) {
+		dst[4 * x + 0] = src[bpp * x + bPos];
+		dst[4 * x + 1] = src[bpp * x + gPos];
+		dst[4 * x + 2] = src[bpp * x + rPos];
+		dst[4 * x + 3] = 0xff;
+	}
+}
+
+static const FormatKernels scalarKernels = {
+	"scalar",
+	nvLineScalar,
+	yuvLineScalar,
+	rgbLineScalar,
+};
+
+#if HAVE_X86_KERNELS
+
+/* -----------------------------------------------------------------------------
+ * SSE2 and AVX2 kernels
+ *
+ * The products are computed in 32-bit with pmaddwd, on luma and chroma values
+ * interleaved in 16-bit lanes, and the coefficients interleaved accordingly.
+ */
+
+static inline int32_t coeffs(int16_t lo, int16_t hi)
+{
+	return static_cast<uint16_t>(lo) |
+	       (static_cast<uint32_t>(static_cast<uint16_t>(hi)) << 16);
+}
+
+/*
+ * Convert 8 pixels from luma (minus 16) and interleaved chroma (minus 128)
+ * values in 16-bit lanes, and store them as XRGB8888.
+ */
+__attribute__((target("sse2")))
+static inline void storePixels(__m128i c, __m128i uv, bool swap,
+			       unsigned char *dst)
+{
+	const __m128i round = _mm_set1_epi32(128);
+	const __m128i zero = _mm_setzero_si128();
+
+	/* Duplicate the chroma values for the two pixels sharing them. */
+	__m128i d = _mm_and_si128(uv, _mm_set1_epi32(0xffff));
+	__m128i e = _mm_srli_epi32(uv, 16);
+	if (swap)
+		std::swap(d, e);
+	d = _mm_or_si128(d, _mm_slli_epi32(d, 16));
+	e = _mm_or_si128(e, _mm_slli_epi32(e, 16));
+
+	__m128i ceLo = _mm_unpacklo_epi16(c, e);
+	__m128i ceHi = _mm_unpackhi_epi16(c, e);
+	__m128i cdLo = _mm_unpacklo_epi16(c, d);
+	__m128i cdHi = _mm_unpackhi_epi16(c, d);
+	__m128i eLo = _mm_unpacklo_epi16(e, zero);
+	__m128i eHi = _mm_unpackhi_epi16(e, zero);
+
+	const __m128i kR = _mm_set1_epi32(coeffs(298, 409));
+	const __m128i kG = _mm_set1_epi32(coeffs(298, -100));
+	const __m128i kGe = _mm_set1_epi32(coeffs(-208, 0));
+	const __m128i kB = _mm_set1_epi32(coeffs(298, 516));
+
+	__m128i rLo = _mm_add_epi32(_mm_madd_epi16(ceLo, kR), round);
+	__m128i rHi = _mm_add_epi32(_mm_madd_epi16(ceHi, kR), round);
+	__m128i gLo = _mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(cdLo, kG),
+						  _mm_madd_epi16(eLo, kGe)), round);
+	__m128i gHi = _mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(cdHi, kG),
+						  _mm_madd_epi16(eHi, kGe)), round);
+	__m128i bLo = _mm_add_epi32(_mm_madd_epi16(cdLo, kB), round);
+	__m128i bHi = _mm_add_epi32(_mm_madd_epi16(cdHi, kB), round);
+
+	const __m128i max = _mm_set1_epi16(255);
+	__m128i r = _mm_packs_epi32(_mm_srai_epi32(rLo, RGBSHIFT),
+				    _mm_srai_epi32(rHi, RGBSHIFT));
+	__m128i g = _mm_packs_epi32(_mm_srai_epi32(gLo, RGBSHIFT),
+				    _mm_srai_epi32(gHi, RGBSHIFT));
+	__m128i b = _mm_packs_epi32(_mm_srai_epi32(bLo, RGBSHIFT),
+				    _mm_srai_epi32(bHi, RGBSHIFT));
+	r = _mm_min_epi16(_mm_max_epi16(r, zero), max);
+	g = _mm_min_epi16(_mm_max_epi16(g, zero), max);
+	b = _mm_min_epi16(_mm_max_epi16(b, zero), max);
+
+	__m128i bg = _mm_or_si128(b, _mm_slli_epi16(g, 8));
+	__m128i ra = _mm_or_si128(r, _mm_set1_epi16(static_cast<int16_t>(0xff00)));
+
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(dst),
+			 _mm_unpacklo_epi16(bg, ra));
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 16),
+			 _mm_unpackhi_epi16(bg, ra));
+}
+
+__attribute__((target("sse2")))
+static void nvLineSSE2(const unsigned char *y, const unsigned char *uv,
+		       unsigned char *dst, unsigned int width,
+		       unsigned int horzSubSample, bool swap)
+{
+	if (horzSubSample != 2)
+		return nvLineScalar(y, uv, dst, width, horzSubSample, swap);
+
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i k16 = _mm_set1_epi16(16);
+	const __m128i k128 = _mm_set1_epi16(128);
+	unsigned int x;
+
+	for (x = 0; x + 8 <= width; x += 8) {
+		__m128i y8 = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(y + x));
+		__m128i uv8 = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(uv + x));
+		__m128i c = _mm_sub_epi16(_mm_unpacklo_epi8(y8, zero), k16);
+		__m128i de = _mm_sub_epi16(_mm_unpacklo_epi8(uv8, zero), k128);
+
+		storePixels(c, de, swap, dst + x * 4);
+	}
+
+	if (x < width)
+		nvLineScalar(y + x, uv + x, dst + x * 4, width - x, 2, swap);
+}
+
+__attribute__((target("sse2")))
+static void yuvLineSSE2(const unsigned char *src, unsigned char *dst,
+			unsigned int width, unsigned int yPos,
+			unsigned int cbPos)
+{
+	const __m128i lowMask = _mm_set1_epi16(0xff);
+	const __m128i k16 = _mm_set1_epi16(16);
+	const __m128i k128 = _mm_set1_epi16(128);
+	bool swap = cbPos >= 2;
+	unsigned int x;
+
+	for (x = 0; x + 8 <= width; x += 8) {
+		__m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + x * 2));
+		__m128i even = _mm_and_si128(p, lowMask);
+		__m128i odd = _mm_srli_epi16(p, 8);
+		__m128i c = _mm_sub_epi16(yPos ? odd : even, k16);
+		__m128i de = _mm_sub_epi16(yPos ? even : odd, k128);
+
+		storePixels(c, de, swap, dst + x * 4);
+	}
+
+	if (x < width)
+		yuvLineScalar(src + x * 2, dst + x * 4, width - x, yPos, cbPos);
+}
+
+static const FormatKernels sse2Kernels = {
+	"sse2",
+	nvLineSSE2,
+	yuvLineSSE2,
+	rgbLineScalar,
+};
+
+/*
+ * The AVX2 unpack and pack instructions operate within 128-bit lanes. The
+ * 16-bit values of the 16 pixels are ordered across lanes after packing, and
+ * the final interleaving is fixed up with lane permutations.
+ */
+__attribute__((target("avx2")))
+static inline void storePixels(__m256i c, __m256i uv, bool swap,
+			       unsigned char *dst)
+{
+	const __m256i round = _mm256_set1_epi32(128);
+	const __m256i zero = _mm256_setzero_si256();
+
+	__m256i d = _mm256_and_si256(uv, _mm256_set1_epi32(0xffff));
+	__m256i e = _mm256_srli_epi32(uv, 16);
+	if (swap)
+		std::swap(d, e);
+	d = _mm256_or_si256(d, _mm256_slli_epi32(d, 16));
+	e = _mm256_or_si256(e, _mm256_slli_epi32(e, 16));
+
+	__m256i ceLo = _mm256_unpacklo_epi16(c, e);
+	__m256i ceHi = _mm256_unpackhi_epi16(c, e);
+	__m256i cdLo = _mm256_unpacklo_epi16(c, d);
+	__m256i cdHi = _mm256_unpackhi_epi16(c, d);
+	__m256i eLo = _mm256_unpacklo_epi16(e, zero);
+	__m256i eHi = _mm256_unpackhi_epi16(e, zero);
+
+	const __m256i kR = _mm256_set1_epi32(coeffs(298, 409));
+	const __m256i kG = _mm256_set1_epi32(coeffs(298, -100));
+	const __m256i kGe = _mm256_set1_epi32(coeffs(-208, 0));
+	const __m256i kB = _mm256_set1_epi32(coeffs(298, 516));
+
+	__m256i rLo = _mm256_add_epi32(_mm256_madd_epi16(ceLo, kR), round);
+	__m256i rHi = _mm256_add_epi32(_mm256_madd_epi16(ceHi, kR), round);
+	__m256i gLo = _mm256_add_epi32(_mm256_add_epi32(_mm256_madd_epi16(cdLo, kG),
+							_mm256_madd_epi16(eLo, kGe)), round);
+	__m256i gHi = _mm256_add_epi32(_mm256_add_epi32(_mm256_madd_epi16(cdHi, kG),
+							_mm256_madd_epi16(eHi, kGe)), round);
+	__m256i bLo = _mm256_add_epi32(_mm256_madd_epi16(cdLo, kB), round);
+	__m256i bHi = _mm256_add_epi32(_mm256_madd_epi16(cdHi, kB), round);
+
+	const __m256i max = _mm256_set1_epi16(255);
+	__m256i r = _mm256_packs_epi32(_mm256_srai_epi32(rLo, RGBSHIFT),
+				       _mm256_srai_epi32(rHi, RGBSHIFT));
+	__m256i g = _mm256_packs_epi32(_mm256_srai_epi32(gLo, RGBSHIFT),
+				       _mm256_srai_epi32(gHi, RGBSHIFT));
+	__m256i b = _mm256_packs_epi32(_mm256_srai_epi32(bLo, RGBSHIFT),
+				       _mm256_srai_epi32(bHi, RGBSHIFT));
+	r = _mm256_min_epi16(_mm256_max_epi16(r, zero), max);
+	g = _mm256_min_epi16(_mm256_max_epi16(g, zero), max);
+	b = _mm256_min_epi16(_mm256_max_epi16(b, zero), max);
+
+	__m256i bg = _mm256_or_si256(b, _mm256_slli_epi16(g, 8));
+	__m256i ra = _mm256_or_si256(r, _mm256_set1_epi16(static_cast<int16_t>(0xff00)));
+	__m256i lo = _mm256_unpacklo_epi16(bg, ra);
+	__m256i hi = _mm256_unpackhi_epi16(bg, ra);
+
+	_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst),
+			    _mm256_permute2x128_si256(lo, hi, 0x20));
+	_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + 32),
+			    _mm256_permute2x128_si256(lo, hi, 0x31));
+}
+
+__attribute__((target("avx2")))
+static void nvLineAVX2(const unsigned char *y, const unsigned char *uv,
+		       unsigned char *dst, unsigned int width,
+		       unsigned int horzSubSample, bool swap)
+{
+	if (horzSubSample != 2)
+		return nvLineScalar(y, uv, dst, width, horzSubSample, swap);
+
+	const __m256i k16 = _mm256_set1_epi16(16);
+	const __m256i k128 = _mm256_set1_epi16(128);
+	unsigned int x;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		__m128i y8 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(y + x));
+		__m128i uv8 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(uv + x));
+		__m256i c = _mm256_sub_epi16(_mm256_cvtepu8_epi16(y8), k16);
+		__m256i de = _mm256_sub_epi16(_mm256_cvtepu8_epi16(uv8), k128);
+
+		storePixels(c, de, swap, dst + x * 4);
+	}
+
+	if (x < width)
+		nvLineSSE2(y + x, uv + x, dst + x * 4, width - x, 2, swap);
+}
+
+__attribute__((target("avx2")))
+static void yuvLineAVX2(const unsigned char *src, unsigned char *dst,
+			unsigned int width, unsigned int yPos,
+			unsigned int cbPos)
+{
+	const __m256i lowMask = _mm256_set1_epi16(0xff);
+	const __m256i k16 = _mm256_set1_epi16(16);
+	const __m256i k128 = _mm256_set1_epi16(128);
+	bool swap = cbPos >= 2;
+	unsigned int x;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		__m256i p = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + x * 2));
+		__m256i even = _mm256_and_si256(p, lowMask);
+		__m256i odd = _mm256_srli_epi16(p, 8);
+		__m256i c = _mm256_sub_epi16(yPos ? odd : even, k16);
+		__m256i de = _mm256_sub_epi16(yPos ? even : odd, k128);
+
+		storePixels(c, de, swap, dst + x * 4);
+	}
+
+	if (x < width)
+		yuvLineSSE2(src + x * 2, dst + x * 4, width - x, yPos, cbPos);
+}
+
+static const FormatKernels avx2Kernels = {
+	"avx2",
+	nvLineAVX2,
+	yuvLineAVX2,
+	rgbLineScalar,
+};
+
+#endif /* HAVE_X86_KERNELS */
+
+#if HAVE_NEON_KERNELS
+
+/* -----------------------------------------------------------------------------
+ * NEON kernels
+ *
+ * The even and odd pixels are loaded in separate vectors with structure loads,
+ * which avoids duplicating the chroma values, and interleaved back when
+ * storing.
+ */
+
+static inline uint8x8_t neonChannel(int16x8_t c, int16x8_t d, int16x8_t e,
+				    int16_t kd, int16_t ke)
+{
+	int32x4_t lo = vmlal_n_s16(vdupq_n_s32(128), vget_low_s16(c), 298);
+	int32x4_t hi = vmlal_n_s16(vdupq_n_s32(128), vget_high_s16(c), 298);
+
+	lo = vmlal_n_s16(lo, vget_low_s16(d), kd);
+	hi = vmlal_n_s16(hi, vget_high_s16(d), kd);
+	lo = vmlal_n_s16(lo, vget_low_s16(e), ke);
+	hi = vmlal_n_s16(hi, vget_high_s16(e), ke);
+
+	return vqmovun_s16(vcombine_s16(vqshrn_n_s32(lo, RGBSHIFT),
+					vqshrn_n_s32(hi, RGBSHIFT)));
+}
+
+static inline uint8x16_t neonZip(uint8x8_t even, uint8x8_t odd)
+{
+	uint8x8x2_t zip = vzip_u8(even, odd);
+	return vcombine_u8(zip.val[0], zip.val[1]);
+}
+
+/* Convert 16 pixels and store them as XRGB8888. */
+static inline void storePixels(uint8x8_t yEven, uint8x8_t yOdd, uint8x8_t cb,
+			       uint8x8_t cr, unsigned char *dst)
+{
+	int16x8_t c0 = vreinterpretq_s16_u16(vsubl_u8(yEven, vdup_n_u8(16)));
+	int16x8_t c1 = vreinterpretq_s16_u16(vsubl_u8(yOdd, vdup_n_u8(16)));
+	int16x8_t d = vreinterpretq_s16_u16(vsubl_u8(cb, vdup_n_u8(128)));
+	int16x8_t e = vreinterpretq_s16_u16(vsubl_u8(cr, vdup_n_u8(128)));
+
+	uint8x16x4_t pixels;
+	pixels.val[0] = neonZip(neonChannel(c0, d, e, 516, 0),
+				neonChannel(c1, d, e, 516, 0));
+	pixels.val[1] = neonZip(neonChannel(c0, d, e, -100, -208),
+				neonChannel(c1, d, e, -100, -208));
+	pixels.val[2] = neonZip(neonChannel(c0, d, e, 0, 409),
+				neonChannel(c1, d, e, 0, 409));
+	pixels.val[3] = vdupq_n_u8(0xff);
+
+	vst4q_u8(dst, pixels);
+}
+
+static void nvLineNEON(const unsigned char *y, const unsigned char *uv,
+		       unsigned char *dst, unsigned int width,
+		       unsigned int horzSubSample, bool swap)
+{
+	if (horzSubSample != 2)
+		return nvLineScalar(y, uv, dst, width, horzSubSample, swap);
+
+	unsigned int x;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		uint8x8x2_t luma = vld2_u8(y + x);
+		uint8x8x2_t chroma = vld2_u8(uv + x);
+
+		storePixels(luma.val[0], luma.val[1], chroma.val[swap ? 1 : 0],
+			    chroma.val[swap ? 0 : 1], dst + x * 4);
+	}
+
+	if (x < width)
+		nvLineScalar(y + x, uv + x, dst + x * 4, width - x, 2, swap);
+}
+
+static void yuvLineNEON(const unsigned char *src, unsigned char *dst,
+			unsigned int width, unsigned int yPos,
+			unsigned int cbPos)
+{
+	unsigned int crPos = (cbPos + 2) % 4;
+	unsigned int x;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		uint8x8x4_t p = vld4_u8(src + x * 2);
+
+		storePixels(p.val[yPos], p.val[yPos + 2], p.val[cbPos],
+			    p.val[crPos], dst + x * 4);
+	}
+
+	if (x < width)
+		yuvLineScalar(src + x * 2, dst + x * 4, width - x, yPos, cbPos);
+}
+
+static const FormatKernels neonKernels = {
+	"neon",
+	nvLineNEON,
+	yuvLineNEON,
+	rgbLineScalar,
+};
+
+#endif /* HAVE_NEON_KERNELS */
+
+/*
+ * Return the kernels supported by the CPU, from the fastest to the scalar
+ * reference kernels.
+ */
+std::vector<const FormatKernels *> supportedFormatKernels()
+{
+	std::vector<const FormatKernels *> kernels;
+
+#if HAVE_X86_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		kernels.push_back(&avx2Kernels);
+	if (__builtin_cpu_supports("sse2"))
+		kernels.push_back(&sse2Kernels);
+#endif
+
+#if HAVE_NEON_KERNELS
+	kernels.push_back(&neonKernels);
+#endif
+
+	kernels.push_back(&scalarKernels);
+
+	return kernels;
+}
+
+const FormatKernels &formatKernels()
+{
+	static const FormatKernels *kernels = supportedFormatKernels().front();
+	return *kernels;
+}
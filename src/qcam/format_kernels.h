@@ -0,0 +1,38 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2020, Google Inc.
+ *
+ * format_kernels.h - qcam - Line conversion kernels to XRGB8888
+ */
+#ifndef __QCAM_FORMAT_KERNELS_H__
+#define __QCAM_FORMAT_KERNELS_H__
+
+#include <vector>
+
+struct FormatKernels {
+	const char *name;
+
+	/*
+	 * Convert a line of semi-planar YUV (NV12, NV21, NV16, NV61, NV24 and
+	 * NV42). The chroma samples are swapped when \a swap is true.
+	 */
+	void (*nvLine)(const unsigned char *y, const unsigned char *uv,
+		       unsigned char *dst, unsigned int width,
+		       unsigned int horzSubSample, bool swap);
+
+	/* Convert a line of packed YUV (YUYV, YVYU, UYVY and VYUY). */
+	void (*yuvLine)(const unsigned char *src, unsigned char *dst,
+			unsigned int width, unsigned int yPos,
+			unsigned int cbPos);
+
+	/* Convert a line of packed RGB (RGB888, BGR888 and BGRA8888). */
+	void (*rgbLine)(const unsigned char *src, unsigned char *dst,
+			unsigned int width, unsigned int bpp,
+			unsigned int rPos, unsigned int gPos,
+			unsigned int bPos);
+};
+
+const FormatKernels &formatKernels();
+std::vector<const FormatKernels *> supportedFormatKernels();
+
+#endif /* __QCAM_FORMAT_KERNELS_H__ */
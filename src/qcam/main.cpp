@@ -25,6 +25,15 @@ void signalHandler(int signal)
 
 OptionsParser::Options parseOptions(int argc, char *argv[])
 {
+	KeyValueParser streamParser;
+	streamParser.addOption("role", OptionString,
+			       "Role for the stream (viewfinder, video, still)",
+			       ArgumentRequired);
+	streamParser.addOption("width", OptionInteger, "Width in pixels",
+			       ArgumentRequired);
+	streamParser.addOption("height", OptionInteger, "Height in pixels",
+			       ArgumentRequired);
+
 	KeyValueParser sizeParser;
 	sizeParser.addOption("width", OptionInteger, "Width in pixels",
 			     ArgumentRequired);
@@ -37,8 +46,11 @@ OptionsParser::Options parseOptions(int argc, char *argv[])
 			 ArgumentRequired, "camera");
 	parser.addOption(OptHelp, OptionNone, "Display this help message",
 			 "help");
-	parser.addOption(OptSize, &sizeParser, "Set the stream size",
+	parser.addOption(OptSize, &sizeParser, "Set the size of all streams",
 			 "size", true);
+	parser.addOption(OptStream, &streamParser,
+			 "Add a stream, displayed in its own viewfinder",
+			 "stream", true);
 
 	OptionsParser::Options options = parser.parse(argc, argv);
 	if (options.isSet(OptHelp))
@@ -5,13 +5,19 @@
  * main_window.cpp - qcam - Main application window
  */
 
+#include <algorithm>
+#include <climits>
+#include <errno.h>
 #include <iomanip>
 #include <iostream>
 #include <string>
 #include <sys/mman.h>
 
 #include <QCoreApplication>
+#include <QEvent>
+#include <QHBoxLayout>
 #include <QInputDialog>
+#include <QStringList>
 #include <QTimer>
 
 #include <libcamera/camera_manager.h>
@@ -22,6 +28,31 @@
 
 using namespace libcamera;
 
+/*
+ * Event posted to the GUI thread when a new buffer is ready to be displayed.
+ */
+class CaptureEvent : public QEvent
+{
+public:
+	CaptureEvent()
+		: QEvent(type())
+	{
+	}
+
+	static Type type()
+	{
+		static int type = QEvent::registerEventType();
+		return static_cast<Type>(type);
+	}
+};
+
+MainWindow::ViewFinderStream::ViewFinderStream()
+	: index(0), stream(nullptr), viewfinder(nullptr), pendingBuffer(nullptr),
+	  lastBufferTime(0), lastSequence(0), framesCaptured(0),
+	  framesLost(0), framesSkipped(0), previousFrames(0)
+{
+}
+
 MainWindow::MainWindow(CameraManager *cm, const OptionsParser::Options &options)
 	: options_(options), allocator_(nullptr), isCapturing_(false)
 {
@@ -31,8 +62,10 @@ MainWindow::MainWindow(CameraManager *cm, const OptionsParser::Options &options)
 	setWindowTitle(title_);
 	connect(&titleTimer_, SIGNAL(timeout()), this, SLOT(updateTitle()));
 
-	viewfinder_ = new ViewFinder(this);
-	setCentralWidget(viewfinder_);
+	/* The viewfinders are added side by side, one per stream. */
+	QWidget *central = new QWidget(this);
+	viewfinderLayout_ = new QHBoxLayout(central);
+	setCentralWidget(central);
 	adjustSize();
 
 	ret = openCamera(cm);
@@ -56,17 +89,37 @@ MainWindow::~MainWindow()
 	}
 }
 
+bool MainWindow::event(QEvent *e)
+{
+	if (e->type() == CaptureEvent::type()) {
+		processCapture();
+		return true;
+	}
+
+	return QMainWindow::event(e);
+}
+
 void MainWindow::updateTitle()
 {
 	unsigned int duration = frameRateInterval_.elapsed();
-	unsigned int frames = framesCaptured_ - previousFrames_;
-	double fps = frames * 1000.0 / duration;
+	QStringList stats;
+
+	for (std::unique_ptr<ViewFinderStream> &vfStream : streams_) {
+		unsigned int captured = vfStream->framesCaptured;
+		unsigned int frames = captured - vfStream->previousFrames;
+		double fps = frames * 1000.0 / duration;
+
+		vfStream->previousFrames = captured;
+
+		stats.append(QString::number(fps, 'f', 2) + " fps, " +
+			     QString::number(vfStream->framesLost) + " lost, " +
+			     QString::number(vfStream->framesSkipped) + " skipped");
+	}
 
 	/* Restart counters. */
 	frameRateInterval_.start();
-	previousFrames_ = framesCaptured_;
 
-	setWindowTitle(title_ + " : " + QString::number(fps, 'f', 2) + " fps");
+	setWindowTitle(title_ + " : " + stats.join(" | "));
 }
 
 std::string MainWindow::chooseCamera(CameraManager *cm)
@@ -121,21 +174,66 @@ int MainWindow::openCamera(CameraManager *cm)
 	return 0;
 }
 
-int MainWindow::startCapture()
+int MainWindow::configureStreams()
 {
-	int ret;
+	StreamRoles roles;
 
-	config_ = camera_->generateConfiguration({ StreamRole::VideoRecording });
+	if (options_.isSet(OptStream)) {
+		const std::vector<OptionValue> &streamOptions =
+			options_[OptStream].toArray();
 
-	StreamConfiguration &cfg = config_->at(0);
-	if (options_.isSet(OptSize)) {
-		const std::vector<OptionValue> &sizeOptions =
-			options_[OptSize].toArray();
-
-		/* Set desired stream size if requested. */
-		for (const auto &value : sizeOptions) {
+		for (auto const &value : streamOptions) {
 			KeyValueParser::Options opt = value.toKeyValues();
 
+			if (!opt.isSet("role")) {
+				roles.push_back(StreamRole::VideoRecording);
+			} else if (opt["role"].toString() == "viewfinder") {
+				roles.push_back(StreamRole::Viewfinder);
+			} else if (opt["role"].toString() == "video") {
+				roles.push_back(StreamRole::VideoRecording);
+			} else if (opt["role"].toString() == "still") {
+				roles.push_back(StreamRole::StillCapture);
+			} else {
+				std::cerr << "Unknown stream role "
+					  << opt["role"].toString() << std::endl;
+				return -EINVAL;
+			}
+		}
+	} else {
+		roles.push_back(StreamRole::VideoRecording);
+	}
+
+	config_ = camera_->generateConfiguration(roles);
+	if (!config_ || config_->size() != roles.size()) {
+		std::cerr << "Failed to get default stream configuration"
+			  << std::endl;
+		return -EINVAL;
+	}
+
+	for (unsigned int i = 0; i < config_->size(); ++i) {
+		StreamConfiguration &cfg = config_->at(i);
+
+		/* Set desired size for all streams if requested. */
+		if (options_.isSet(OptSize)) {
+			const std::vector<OptionValue> &sizeOptions =
+				options_[OptSize].toArray();
+
+			for (const auto &value : sizeOptions) {
+				KeyValueParser::Options opt = value.toKeyValues();
+
+				if (opt.isSet("width"))
+					cfg.size.width = opt["width"];
+
+				if (opt.isSet("height"))
+					cfg.size.height = opt["height"];
+			}
+		}
+
+		/* The stream size, if set, takes precedence. */
+		if (options_.isSet(OptStream)) {
+			KeyValueParser::Options opt =
+				options_[OptStream].toArray()[i].toKeyValues();
+
 			if (opt.isSet("width"))
 				cfg.size.width = opt["width"];
 
@@ -150,10 +248,19 @@ int MainWindow::startCapture()
 		return -EINVAL;
 	}
 
-	if (validation == CameraConfiguration::Adjusted) {
-		std::cout << "Stream size adjusted to "
-			  << cfg.size.toString() << std::endl;
-	}
+	if (validation == CameraConfiguration::Adjusted)
+		std::cout << "Camera configuration adjusted" << std::endl;
+
+	return 0;
+}
+
+int MainWindow::startCapture()
+{
+	int ret;
+
+	ret = configureStreams();
+	if (ret < 0)
+		return ret;
 
 	ret = camera_->configure(config_.get());
 	if (ret < 0) {
@@ -161,24 +268,69 @@ int MainWindow::startCapture()
 		return ret;
 	}
 
-	Stream *stream = cfg.stream();
-	ret = viewfinder_->setFormat(cfg.pixelFormat, cfg.size.width,
-				     cfg.size.height);
-	if (ret < 0) {
-		std::cout << "Failed to set viewfinder format" << std::endl;
-		return ret;
-	}
+	for (std::unique_ptr<ViewFinderStream> &vfStream : streams_)
+		delete vfStream->viewfinder;
+	streams_.clear();
 
-	adjustSize();
+	unsigned int nbuffers = UINT_MAX;
+	for (StreamConfiguration &cfg : *config_) {
+		ViewFinderStream *vfStream = new ViewFinderStream();
+		streams_.emplace_back(vfStream);
 
-	ret = allocator_->allocate(stream);
-	if (ret < 0) {
-		std::cerr << "Failed to allocate capture buffers" << std::endl;
-		return ret;
+		vfStream->index = streams_.size() - 1;
+		vfStream->stream = cfg.stream();
+		vfStream->viewfinder = new ViewFinder(this);
+		viewfinderLayout_->addWidget(vfStream->viewfinder);
+		connect(vfStream->viewfinder, &ViewFinder::renderComplete,
+			this, &MainWindow::queueRequest);
+
+		std::cout << "Stream " << vfStream->index << ": "
+			  << cfg.toString() << std::endl;
+
+		ret = vfStream->viewfinder->setFormat(cfg.pixelFormat,
+						      cfg.size.width,
+						      cfg.size.height);
+		if (ret < 0) {
+			std::cout << "Failed to set viewfinder format" << std::endl;
+			return ret;
+		}
+
+		ret = allocator_->allocate(vfStream->stream);
+		if (ret < 0) {
+			std::cerr << "Failed to allocate capture buffers" << std::endl;
+			return ret;
+		}
+
+		nbuffers = std::min<unsigned int>(nbuffers, ret);
+
+		/* Map all planes of the buffers and cache the mappings. */
+		for (const std::unique_ptr<FrameBuffer> &buffer :
+		     allocator_->buffers(vfStream->stream)) {
+			std::vector<std::pair<void *, unsigned int>> &planes =
+				mappedBuffers_[buffer.get()];
+
+			for (const FrameBuffer::Plane &plane : buffer->planes()) {
+				void *memory = mmap(NULL, plane.length, PROT_READ,
+						    MAP_SHARED, plane.fd.fd(), 0);
+				if (memory == MAP_FAILED) {
+					ret = -errno;
+					std::cerr << "Failed to map buffer" << std::endl;
+					unmapBuffers();
+					return ret;
+				}
+
+				planes.emplace_back(memory, plane.length);
+			}
+
+			bufferStreams_[buffer.get()] = vfStream;
+		}
 	}
 
+	adjustSize();
+
+	/* Each request captures one frame for every stream. */
 	std::vector<Request *> requests;
-	for (const std::unique_ptr<FrameBuffer> &buffer : allocator_->buffers(stream)) {
+	for (unsigned int i = 0; i < nbuffers; ++i) {
 		Request *request = camera_->createRequest();
 		if (!request) {
 			std::cerr << "Can't create request" << std::endl;
@@ -186,27 +338,22 @@ int MainWindow::startCapture()
 			goto error;
 		}
 
-		ret = request->addBuffer(stream, buffer.get());
-		if (ret < 0) {
-			std::cerr << "Can't set buffer for request" << std::endl;
-			goto error;
-		}
-
 		requests.push_back(request);
 
-		/* Map memory buffers and cache the mappings. */
-		const FrameBuffer::Plane &plane = buffer->planes().front();
-		void *memory = mmap(NULL, plane.length, PROT_READ, MAP_SHARED,
-				    plane.fd.fd(), 0);
-		mappedBuffers_[plane.fd.fd()] =
-			std::make_pair(memory, plane.length);
+		for (std::unique_ptr<ViewFinderStream> &vfStream : streams_) {
+			Stream *stream = vfStream->stream;
+			FrameBuffer *buffer = allocator_->buffers(stream)[i].get();
+
+			ret = request->addBuffer(stream, buffer);
+			if (ret < 0) {
+				std::cerr << "Can't set buffer for request" << std::endl;
+				goto error;
+			}
+		}
 	}
 
 	titleTimer_.start(2000);
 	frameRateInterval_.start();
-	previousFrames_ = 0;
-	framesCaptured_ = 0;
-	lastBufferTime_ = 0;
 
 	ret = camera_->start();
 	if (ret) {
@@ -229,12 +376,7 @@ error:
 	for (Request *request : requests)
 		delete request;
 
-	for (auto &iter : mappedBuffers_) {
-		void *memory = iter.second.first;
-		unsigned int length = iter.second.second;
-		munmap(memory, length);
-	}
-	mappedBuffers_.clear();
+	unmapBuffers();
 
 	return ret;
 }
@@ -248,12 +390,13 @@ void MainWindow::stopCapture()
 	if (ret)
 		std::cout << "Failed to stop capture" << std::endl;
 
-	for (auto &iter : mappedBuffers_) {
-		void *memory = iter.second.first;
-		unsigned int length = iter.second.second;
-		munmap(memory, length);
+	/* Drop the buffers that may still be waiting for display. */
+	for (std::unique_ptr<ViewFinderStream> &vfStream : streams_) {
+		vfStream->pendingBuffer = nullptr;
+		vfStream->viewfinder->stop();
 	}
-	mappedBuffers_.clear();
+
+	unmapBuffers();
 
 	isCapturing_ = false;
 
@@ -263,55 +406,125 @@ void MainWindow::stopCapture()
 	setWindowTitle(title_);
 }
 
+void MainWindow::unmapBuffers()
+{
+	for (auto &iter : mappedBuffers_) {
+		for (auto &plane : iter.second) {
+			void *memory = plane.first;
+			unsigned int length = plane.second;
+			munmap(memory, length);
+		}
+	}
+
+	mappedBuffers_.clear();
+	bufferStreams_.clear();
+}
+
+/*
+ * Requests complete in the camera manager thread. Converting and displaying
+ * the frames there would delay the processing of all cameras, hand the
+ * buffers over to the GUI thread instead. Only the latest buffer of each
+ * stream is kept, a buffer that hasn't been displayed yet when a new one
+ * completes is stale and is requeued to the camera immediately, so that
+ * capture never waits for the GUI.
+ */
 void MainWindow::requestComplete(Request *request)
 {
 	if (request->status() == Request::RequestCancelled)
 		return;
 
-	const std::map<Stream *, FrameBuffer *> &buffers = request->buffers();
+	bool post = false;
 
-	framesCaptured_++;
+	for (auto const &it : request->buffers()) {
+		FrameBuffer *buffer = it.second;
+		ViewFinderStream *vfStream = bufferStreams_.at(buffer);
+		const FrameMetadata &metadata = buffer->metadata();
 
-	FrameBuffer *buffer = buffers.begin()->second;
-	const FrameMetadata &metadata = buffer->metadata();
+		if (vfStream->framesCaptured &&
+		    metadata.sequence > vfStream->lastSequence + 1)
+			vfStream->framesLost += metadata.sequence -
+						vfStream->lastSequence - 1;
 
-	double fps = metadata.timestamp - lastBufferTime_;
-	fps = lastBufferTime_ && fps ? 1000000000.0 / fps : 0.0;
-	lastBufferTime_ = metadata.timestamp;
+		vfStream->lastSequence = metadata.sequence;
+		vfStream->framesCaptured++;
 
-	std::cout << "seq: " << std::setw(6) << std::setfill('0') << metadata.sequence
-		  << " bytesused: " << metadata.planes[0].bytesused
-		  << " timestamp: " << metadata.timestamp
-		  << " fps: " << std::fixed << std::setprecision(2) << fps
-		  << std::endl;
+		double fps = metadata.timestamp - vfStream->lastBufferTime;
+		fps = vfStream->lastBufferTime && fps ? 1000000000.0 / fps : 0.0;
+		vfStream->lastBufferTime = metadata.timestamp;
 
-	display(buffer);
+		std::cout << "stream: " << vfStream->index
+			  << " seq: " << std::setw(6) << std::setfill('0') << metadata.sequence
+			  << " bytesused: " << metadata.planes[0].bytesused
+			  << " timestamp: " << metadata.timestamp
+			  << " fps: " << std::fixed << std::setprecision(2) << fps
+			  << std::endl;
+
+		/*
+		 * A capture event is pending whenever the slot holds a buffer,
+		 * only post a new one when the slot was empty.
+		 */
+		FrameBuffer *stale = vfStream->pendingBuffer.exchange(buffer);
+		if (stale) {
+			vfStream->framesSkipped++;
+			queueRequest(stale);
+		} else {
+			post = true;
+		}
+	}
 
-	request = camera_->createRequest();
+	if (post)
+		QCoreApplication::postEvent(this, new CaptureEvent);
+}
+
+void MainWindow::processCapture()
+{
+	for (std::unique_ptr<ViewFinderStream> &vfStream : streams_) {
+		FrameBuffer *buffer = vfStream->pendingBuffer.exchange(nullptr);
+		if (!buffer)
+			continue;
+
+		/* The buffer is requeued when the viewfinder signals completion. */
+		if (display(vfStream.get(), buffer) < 0)
+			queueRequest(buffer);
+	}
+}
+
+int MainWindow::queueRequest(FrameBuffer *buffer)
+{
+	Request *request = camera_->createRequest();
 	if (!request) {
 		std::cerr << "Can't create request" << std::endl;
-		return;
+		return -ENOMEM;
 	}
 
-	for (auto it = buffers.begin(); it != buffers.end(); ++it) {
-		Stream *stream = it->first;
-		FrameBuffer *buffer = it->second;
+	int ret = request->addBuffer(bufferStreams_.at(buffer)->stream, buffer);
+	if (ret < 0) {
+		std::cerr << "Can't set buffer for request" << std::endl;
+		delete request;
+		return ret;
+	}
 
-		request->addBuffer(stream, buffer);
+	ret = camera_->queueRequest(request);
+	if (ret < 0) {
+		std::cerr << "Can't queue request" << std::endl;
+		delete request;
 	}
 
-	camera_->queueRequest(request);
+	return ret;
 }
 
-int MainWindow::display(FrameBuffer *buffer)
+int MainWindow::display(ViewFinderStream *vfStream, FrameBuffer *buffer)
 {
-	if (buffer->planes().size() != 1)
+	auto it = mappedBuffers_.find(buffer);
+	if (it == mappedBuffers_.end())
 		return -EINVAL;
 
-	const FrameBuffer::Plane &plane = buffer->planes().front();
-	void *memory = mappedBuffers_[plane.fd.fd()].first;
-	unsigned char *raw = static_cast<unsigned char *>(memory);
-	viewfinder_->display(raw, buffer->metadata().planes[0].bytesused);
+	std::vector<const unsigned char *> planes;
+	for (auto &plane : it->second)
+		planes.push_back(static_cast<const unsigned char *>(plane.first));
+
+	vfStream->viewfinder->display(buffer, planes,
+				      buffer->metadata().planes[0].bytesused);
 
 	return 0;
 }
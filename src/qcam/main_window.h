@@ -7,7 +7,10 @@
 #ifndef __QCAM_MAIN_WINDOW_H__
 #define __QCAM_MAIN_WINDOW_H__
 
+#include <atomic>
+#include <map>
 #include <memory>
+#include <vector>
 
 #include <QElapsedTimer>
 #include <QMainWindow>
@@ -24,12 +27,14 @@
 
 using namespace libcamera;
 
+class QHBoxLayout;
 class ViewFinder;
 
 enum {
 	OptCamera = 'c',
 	OptHelp = 'h',
 	OptSize = 's',
+	OptStream = 'S',
 };
 
 class MainWindow : public QMainWindow
@@ -40,18 +45,46 @@ public:
 	MainWindow(CameraManager *cm, const OptionsParser::Options &options);
 	~MainWindow();
 
+	bool event(QEvent *e) override;
+
 private Q_SLOTS:
 	void updateTitle();
 
 private:
+	struct ViewFinderStream {
+		ViewFinderStream();
+
+		unsigned int index;
+		Stream *stream;
+		ViewFinder *viewfinder;
+
+		/*
+		 * Latest completed buffer waiting to be displayed, handed over
+		 * from the camera manager thread to the GUI thread.
+		 */
+		std::atomic<FrameBuffer *> pendingBuffer;
+
+		/* Statistics, updated in the camera manager thread. */
+		uint64_t lastBufferTime;
+		unsigned int lastSequence;
+		std::atomic<unsigned int> framesCaptured;
+		std::atomic<unsigned int> framesLost;
+		std::atomic<unsigned int> framesSkipped;
+		unsigned int previousFrames;
+	};
+
 	std::string chooseCamera(CameraManager *cm);
 	int openCamera(CameraManager *cm);
 
+	int configureStreams();
 	int startCapture();
 	void stopCapture();
+	void unmapBuffers();
 
 	void requestComplete(Request *request);
-	int display(FrameBuffer *buffer);
+	void processCapture();
+	int display(ViewFinderStream *vfStream, FrameBuffer *buffer);
+	int queueRequest(FrameBuffer *buffer);
 
 	QString title_;
 	QTimer titleTimer_;
@@ -64,14 +97,17 @@ private:
 	bool isCapturing_;
 	std::unique_ptr<CameraConfiguration> config_;
 
-	uint64_t lastBufferTime_;
-
 	QElapsedTimer frameRateInterval_;
-	uint32_t previousFrames_;
-	uint32_t framesCaptured_;
 
-	ViewFinder *viewfinder_;
-	std::map<int, std::pair<void *, unsigned int>> mappedBuffers_;
+	QHBoxLayout *viewfinderLayout_;
+	std::vector<std::unique_ptr<ViewFinderStream>> streams_;
+
+	/*
+	 * The buffers are mapped and associated with their stream before
+	 * capture starts, and only looked up during capture.
+	 */
+	std::map<FrameBuffer *, ViewFinderStream *> bufferStreams_;
+	std::map<FrameBuffer *, std::vector<std::pair<void *, unsigned int>>> mappedBuffers_;
 };
 
 #endif /* __QCAM_MAIN_WINDOW__ */
@@ -5,26 +5,93 @@
  * viewfinder.cpp - qcam - Viewfinder
  */
 
+#include <map>
+#include <utility>
+
+#include <linux/drm_fourcc.h>
+
 #include <QImage>
 #include <QPainter>
 
 #include "format_converter.h"
 #include "viewfinder.h"
 
+namespace {
+
+/*
+ * Formats whose memory layout matches a QImage format on little-endian
+ * machines, along with their number of bytes per pixel. The alpha channel of
+ * camera frames carries no transparency information, formats with alpha are
+ * thus mapped to opaque QImage formats.
+ */
+const std::map<unsigned int, std::pair<QImage::Format, unsigned int>> nativeFormats = {
+	{ DRM_FORMAT_ABGR8888, { QImage::Format_RGBX8888, 4 } },
+	{ DRM_FORMAT_ARGB8888, { QImage::Format_RGB32, 4 } },
+	{ DRM_FORMAT_BGR888, { QImage::Format_RGB888, 3 } },
+#if QT_VERSION >= QT_VERSION_CHECK(5, 14, 0)
+	{ DRM_FORMAT_RGB888, { QImage::Format_BGR888, 3 } },
+#endif
+	{ DRM_FORMAT_XBGR8888, { QImage::Format_RGBX8888, 4 } },
+	{ DRM_FORMAT_XRGB8888, { QImage::Format_RGB32, 4 } },
+};
+
+} /* namespace */
+
 ViewFinder::ViewFinder(QWidget *parent)
-	: QWidget(parent), format_(0), width_(0), height_(0), image_(nullptr)
+	: QWidget(parent), format_(0), width_(0), height_(0), stride_(0),
+	  native_(false), nativeFormat_(QImage::Format_Invalid),
+	  buffer_(nullptr)
 {
 }
 
-ViewFinder::~ViewFinder()
+/*
+ * Display the frame contained in \a buffer, mapped in memory at \a planes. The
+ * renderComplete signal is emitted when the viewfinder doesn't need the buffer
+ * anymore, either right after conversion, or when the next frame replaces it
+ * when the frame is displayed without conversion.
+ */
+void ViewFinder::display(libcamera::FrameBuffer *buffer,
+			 const std::vector<const unsigned char *> &planes,
+			 size_t size)
 {
-	delete image_;
+	if (!native_) {
+		converter_.convert(planes, size, &image_);
+		update();
+
+		renderComplete(buffer);
+		return;
+	}
+
+	/* Drop truncated frames. */
+	if (size < stride_ * height_) {
+		renderComplete(buffer);
+		return;
+	}
+
+	/*
+	 * Wrap the buffer memory in the image directly. The image may be
+	 * painted again at any time, the buffer is thus held until the next
+	 * frame replaces it.
+	 */
+	image_ = QImage(planes[0], width_, height_, stride_, nativeFormat_);
+	std::swap(buffer, buffer_);
+	update();
+
+	if (buffer)
+		renderComplete(buffer);
 }
 
-void ViewFinder::display(const unsigned char *raw, size_t size)
+/*
+ * Detach the image from the buffer memory when capture stops, as the buffers
+ * are about to be unmapped. The buffer being displayed, if any, is dropped
+ * without signalling completion as it can't be queued anymore.
+ */
+void ViewFinder::stop()
 {
-	converter_.convert(raw, size, image_);
-	update();
+	if (native_)
+		image_ = image_.copy();
+
+	buffer_ = nullptr;
 }
 
 int ViewFinder::setFormat(unsigned int format, unsigned int width,
@@ -32,16 +99,28 @@ int ViewFinder::setFormat(unsigned int format, unsigned int width,
 {
 	int ret;
 
-	ret = converter_.configure(format, width, height);
-	if (ret < 0)
-		return ret;
+	auto it = nativeFormats.find(format);
+	unsigned int stride = it != nativeFormats.end()
+			    ? width * it->second.second : 0;
+
+	/* QImage requires lines to be aligned on 32-bit boundaries. */
+	native_ = stride && !(stride % 4);
+	if (native_) {
+		nativeFormat_ = it->second.first;
+	} else {
+		ret = converter_.configure(format, width, height);
+		if (ret < 0)
+			return ret;
+	}
 
 	format_ = format;
 	width_ = width;
 	height_ = height;
+	stride_ = stride;
+	buffer_ = nullptr;
 
-	delete image_;
-	image_ = new QImage(width, height, QImage::Format_RGB32);
+	image_ = QImage(width, height, QImage::Format_RGB32);
+	image_.fill(Qt::black);
 
 	updateGeometry();
 	return 0;
@@ -50,10 +129,10 @@ int ViewFinder::setFormat(unsigned int format, unsigned int width,
 void ViewFinder::paintEvent(QPaintEvent *)
 {
 	QPainter painter(this);
-	painter.drawImage(rect(), *image_, image_->rect());
+	painter.drawImage(rect(), image_, image_.rect());
 }
 
 QSize ViewFinder::sizeHint() const
 {
-	return image_ ? image_->size() : QSize(640, 480);
+	return image_.isNull() ? QSize(640, 480) : image_.size();
 }
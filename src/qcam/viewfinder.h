@@ -7,21 +7,31 @@
 #ifndef __QCAM_VIEWFINDER_H__
 #define __QCAM_VIEWFINDER_H__
 
+#include <vector>
+
+#include <QImage>
 #include <QWidget>
 
-#include "format_converter.h"
+#include <libcamera/buffer.h>
 
-class QImage;
+#include "format_converter.h"
 
 class ViewFinder : public QWidget
 {
+	Q_OBJECT
+
 public:
 	ViewFinder(QWidget *parent);
-	~ViewFinder();
 
 	int setFormat(unsigned int format, unsigned int width,
 		      unsigned int height);
-	void display(const unsigned char *rgb, size_t size);
+	void display(libcamera::FrameBuffer *buffer,
+		     const std::vector<const unsigned char *> &planes,
+		     size_t size);
+	void stop();
+
+Q_SIGNALS:
+	void renderComplete(libcamera::FrameBuffer *buffer);
 
 protected:
 	void paintEvent(QPaintEvent *) override;
@@ -31,9 +41,17 @@ private:
 	unsigned int format_;
 	unsigned int width_;
 	unsigned int height_;
+	unsigned int stride_;
+
+	/* True when the frames are displayed without conversion. */
+	bool native_;
+	QImage::Format nativeFormat_;
 
 	FormatConverter converter_;
-	QImage *image_;
+	QImage image_;
+
+	/* Buffer wrapped by image_, held until the next frame replaces it. */
+	libcamera::FrameBuffer *buffer_;
 };
 
 #endif /* __QCAM_VIEWFINDER__ */
@@ -0,0 +1,99 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2020, Google Inc.
+ *
+ * slice_pool.cpp - Worker threads processing frames in horizontal slices
+ */
+
+#include "slice_pool.h"
+
+#include <algorithm>
+
+/*
+ * Every user of the pool creates its own threads, and the line processing
+ * functions only perform a handful of operations per byte, so their
+ * throughput is expected to be bound by memory bandwidth well before all
+ * cores of larger systems are busy. Cap the number of threads accordingly.
+ */
+static constexpr unsigned int MAX_THREADS = 4;
+
+/*
+ * The pool splits the lines of a frame in as many slices as it has threads,
+ * the thread calling run() processing the first slice.
+ */
+SlicePool::SlicePool()
+	: sequence_(0), pending_(0), stop_(false), func_(nullptr), lines_(0)
+{
+	unsigned int threads = std::thread::hardware_concurrency();
+	threads = std::min(std::max(threads, 1U), MAX_THREADS);
+
+	for (unsigned int i = 1; i < threads; ++i)
+		workers_.emplace_back(&SlicePool::worker, this, i);
+}
+
+SlicePool::~SlicePool()
+{
+	{
+		std::unique_lock<std::mutex> locker(mutex_);
+		stop_ = true;
+	}
+	workCv_.notify_all();
+
+	for (std::thread &thread : workers_)
+		thread.join();
+}
+
+/*
+ * Call \a func for each slice of a frame of \a lines lines, with the range of
+ * lines in the slice, and return once all slices have been processed.
+ */
+void SlicePool::run(unsigned int lines, const Function &func)
+{
+	{
+		std::unique_lock<std::mutex> locker(mutex_);
+		func_ = &func;
+		lines_ = lines;
+		pending_ = workers_.size();
+		sequence_++;
+	}
+	workCv_.notify_all();
+
+	process(0);
+
+	std::unique_lock<std::mutex> locker(mutex_);
+	doneCv_.wait(locker, [&] { return pending_ == 0; });
+}
+
+void SlicePool::process(unsigned int slice)
+{
+	unsigned int slices = workers_.size() + 1;
+	unsigned int start = lines_ * slice / slices;
+	unsigned int end = lines_ * (slice + 1) / slices;
+
+	if (start != end)
+		(*func_)(start, end);
+}
+
+void SlicePool::worker(unsigned int slice)
+{
+	unsigned int sequence = 0;
+
+	while (true) {
+		{
+			std::unique_lock<std::mutex> locker(mutex_);
+			workCv_.wait(locker, [&] {
+				return stop_ || sequence_ != sequence;
+			});
+			if (stop_)
+				return;
+
+			sequence = sequence_;
+		}
+
+		process(slice);
+
+		std::unique_lock<std::mutex> locker(mutex_);
+		if (--pending_ == 0)
+			doneCv_.notify_one();
+	}
+}
@@ -0,0 +1,48 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2020, Google Inc.
+ *
+ * slice_pool.h - Worker threads processing frames in horizontal slices
+ */
+
+#ifndef __SLICE_POOL_H__
+#define __SLICE_POOL_H__
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * The pool doesn't depend on libcamera, and is shared between the V4L2
+ * compatibility layer and qcam.
+ */
+class SlicePool
+{
+public:
+	using Function = std::function<void(unsigned int start, unsigned int end)>;
+
+	SlicePool();
+	~SlicePool();
+
+	void run(unsigned int lines, const Function &func);
+
+private:
+	void process(unsigned int slice);
+	void worker(unsigned int slice);
+
+	std::vector<std::thread> workers_;
+
+	std::mutex mutex_;
+	std::condition_variable workCv_;
+	std::condition_variable doneCv_;
+	unsigned int sequence_;
+	unsigned int pending_;
+	bool stop_;
+
+	const Function *func_;
+	unsigned int lines_;
+};
+
+#endif /* __SLICE_POOL_H__ */
@@ -8,6 +8,8 @@
 #include "v4l2_camera.h"
 
 #include <errno.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "log.h"
 
@@ -15,8 +17,23 @@ using namespace libcamera;
 
 LOG_DECLARE_CATEGORY(V4L2Compat);
 
+namespace {
+
+bool isSameDmabuf(int fd1, int fd2)
+{
+	struct stat s1, s2;
+
+	if (fstat(fd1, &s1) < 0 || fstat(fd2, &s2) < 0)
+		return false;
+
+	return s1.st_dev == s2.st_dev && s1.st_ino == s2.st_ino;
+}
+
+} /* namespace */
+
 V4L2Camera::V4L2Camera(std::shared_ptr<Camera> camera)
-	: camera_(camera), isRunning_(false), bufferAllocator_(nullptr)
+	: camera_(camera), isAcquired_(false), isRunning_(false), efd_(-1),
+	  bufferAllocator_(nullptr), completionHead_(0), completionTail_(0)
 {
 	camera_->requestCompleted.connect(this, &V4L2Camera::requestComplete);
 }
@@ -28,29 +45,66 @@ V4L2Camera::~V4L2Camera()
 
 int V4L2Camera::open()
 {
-	/* \todo Support multiple open. */
-	if (camera_->acquire() < 0) {
-		LOG(V4L2Compat, Error) << "Failed to acquire camera";
-		return -EINVAL;
-	}
+	/*
+	 * Opening the camera only generates the default configuration, which
+	 * is cached for subsequent opens. Exclusive access to the camera is
+	 * acquired when the application configures it, so that tools that
+	 * only query the device capabilities and formats don't lock the
+	 * pipeline handler.
+	 */
+	if (config_)
+		return 0;
 
 	config_ = camera_->generateConfiguration({ StreamRole::Viewfinder });
-	if (!config_) {
-		camera_->release();
+	if (!config_)
 		return -EINVAL;
-	}
-
-	bufferAllocator_ = FrameBufferAllocator::create(camera_);
 
 	return 0;
 }
 
 void V4L2Camera::close()
 {
+	streamOff();
+
+	importedBuffers_.clear();
+
 	delete bufferAllocator_;
 	bufferAllocator_ = nullptr;
 
-	camera_->release();
+	if (isAcquired_) {
+		camera_->release();
+		isAcquired_ = false;
+	}
+}
+
+int V4L2Camera::acquire()
+{
+	if (isAcquired_)
+		return 0;
+
+	if (camera_->acquire() < 0) {
+		LOG(V4L2Compat, Error) << "Failed to acquire camera";
+		return -EBUSY;
+	}
+
+	bufferAllocator_ = FrameBufferAllocator::create(camera_);
+	isAcquired_ = true;
+
+	return 0;
+}
+
+/*
+ * Bind the eventfd handed to the application. It is signalled for every
+ * completed buffer and serves as the pollable file descriptor.
+ */
+void V4L2Camera::bind(int efd)
+{
+	efd_ = efd;
+}
+
+void V4L2Camera::unbind()
+{
+	efd_ = -1;
 }
 
 void V4L2Camera::getStreamConfig(StreamConfiguration *streamConfig)
@@ -58,17 +112,34 @@ void V4L2Camera::getStreamConfig(StreamConfiguration *streamConfig)
 	*streamConfig = config_->at(0);
 }
 
-std::vector<V4L2Camera::Buffer> V4L2Camera::completedBuffers()
+/*
+ * Retrieve the oldest completed buffer. The metadata pointer stays valid until
+ * the buffer is queued again.
+ */
+bool V4L2Camera::dequeueBuffer(Buffer *buffer)
 {
-	std::vector<Buffer> v;
+	unsigned int tail = completionTail_.load(std::memory_order_relaxed);
+	if (tail == completionHead_.load(std::memory_order_acquire))
+		return false;
 
-	bufferLock_.lock();
-	for (std::unique_ptr<Buffer> &metadata : completedBuffers_)
-		v.push_back(*metadata.get());
-	completedBuffers_.clear();
-	bufferLock_.unlock();
+	unsigned int mask = completionRing_.size() - 1;
+	buffer->index = completionRing_[tail & mask];
+	buffer->data = &this->buffer(buffer->index)->metadata();
 
-	return v;
+	completionTail_.store(tail + 1, std::memory_order_release);
+
+	return true;
+}
+
+void V4L2Camera::resetCompletionRing(unsigned int count)
+{
+	unsigned int size = 1;
+	while (size < count)
+		size <<= 1;
+
+	completionRing_.assign(size, 0);
+	completionHead_.store(0, std::memory_order_relaxed);
+	completionTail_.store(0, std::memory_order_relaxed);
 }
 
 void V4L2Camera::requestComplete(Request *request)
@@ -76,20 +147,31 @@ void V4L2Camera::requestComplete(Request *request)
 	if (request->status() == Request::RequestCancelled)
 		return;
 
-	/* We only have one stream at the moment. */
-	bufferLock_.lock();
-	FrameBuffer *buffer = request->buffers().begin()->second;
-	std::unique_ptr<Buffer> metadata =
-		std::make_unique<Buffer>(request->cookie(), buffer->metadata());
-	completedBuffers_.push_back(std::move(metadata));
-	bufferLock_.unlock();
+	/*
+	 * We only have one stream at the moment. The buffer metadata is
+	 * retrieved from the FrameBuffer at dequeue time, only its index is
+	 * recorded here.
+	 */
+	unsigned int head = completionHead_.load(std::memory_order_relaxed);
+	unsigned int mask = completionRing_.size() - 1;
+	completionRing_[head & mask] = request->cookie();
+	completionHead_.store(head + 1, std::memory_order_release);
+
+	/*
+	 * Signal the eventfd before releasing the semaphore, to guarantee that
+	 * the counter is non-zero when DQBUF clears it.
+	 */
+	uint64_t data = 1;
+	ssize_t ret = ::write(efd_, &data, sizeof(data));
+	if (ret != sizeof(data))
+		LOG(V4L2Compat, Error) << "Failed to signal eventfd POLLIN";
 
 	bufferSema_.release();
 }
 
-int V4L2Camera::configure(StreamConfiguration *streamConfigOut,
-			  const Size &size, PixelFormat pixelformat,
-			  unsigned int bufferCount)
+int V4L2Camera::validateConfiguration(StreamConfiguration *streamConfigOut,
+				      const Size &size, PixelFormat pixelformat,
+				      unsigned int bufferCount)
 {
 	StreamConfiguration &streamConfig = config_->at(0);
 	streamConfig.size.width = size.width;
@@ -109,7 +191,25 @@ int V4L2Camera::configure(StreamConfiguration *streamConfigOut,
 	LOG(V4L2Compat, Debug) << "Validated configuration is: "
 			      << streamConfig.toString();
 
-	int ret = camera_->configure(config_.get());
+	*streamConfigOut = config_->at(0);
+
+	return 0;
+}
+
+int V4L2Camera::configure(StreamConfiguration *streamConfigOut,
+			  const Size &size, PixelFormat pixelformat,
+			  unsigned int bufferCount)
+{
+	int ret = validateConfiguration(streamConfigOut, size, pixelformat,
+					bufferCount);
+	if (ret < 0)
+		return ret;
+
+	ret = acquire();
+	if (ret < 0)
+		return ret;
+
+	ret = camera_->configure(config_.get());
 	if (ret < 0)
 		return ret;
 
@@ -122,17 +222,81 @@ int V4L2Camera::allocBuffers(unsigned int count)
 {
 	Stream *stream = *camera_->streams().begin();
 
-	return bufferAllocator_->allocate(stream);
+	int ret = bufferAllocator_->allocate(stream);
+	if (ret < 0)
+		return ret;
+
+	resetCompletionRing(ret);
+
+	return ret;
+}
+
+/*
+ * Prepare \a count slots for buffers imported from dmabuf file descriptors.
+ * The FrameBuffer instances are created when the buffers are queued.
+ */
+int V4L2Camera::importBuffers(unsigned int count)
+{
+	importedBuffers_.clear();
+	importedBuffers_.resize(count);
+
+	resetCompletionRing(count);
+
+	return 0;
+}
+
+int V4L2Camera::importBuffer(unsigned int index, int fd, unsigned int length)
+{
+	if (index >= importedBuffers_.size())
+		return -EINVAL;
+
+	/*
+	 * Reuse the FrameBuffer when the application queues the same dmabuf
+	 * at the same index, which is the common case. This keeps the
+	 * FrameBuffer stable and avoids remapping the buffer in the V4L2
+	 * buffer cache for every frame.
+	 */
+	std::unique_ptr<FrameBuffer> &buffer = importedBuffers_[index];
+	if (buffer && buffer->planes()[0].length == length &&
+	    isSameDmabuf(buffer->planes()[0].fd.fd(), fd))
+		return 0;
+
+	FrameBuffer::Plane plane;
+	plane.fd = FileDescriptor(fd);
+	if (!plane.fd.isValid())
+		return -EBADF;
+	plane.length = length;
+
+	buffer = std::make_unique<FrameBuffer>(std::vector<FrameBuffer::Plane>{ plane });
+
+	return 0;
 }
 
 void V4L2Camera::freeBuffers()
 {
+	importedBuffers_.clear();
+
+	if (!bufferAllocator_)
+		return;
+
 	Stream *stream = *camera_->streams().begin();
 	bufferAllocator_->free(stream);
 }
 
+FrameBuffer *V4L2Camera::buffer(unsigned int index)
+{
+	if (!importedBuffers_.empty())
+		return importedBuffers_[index].get();
+
+	Stream *stream = config_->at(0).stream();
+	return bufferAllocator_->buffers(stream)[index].get();
+}
+
 FileDescriptor V4L2Camera::getBufferFd(unsigned int index)
 {
+	if (!bufferAllocator_)
+		return FileDescriptor();
+
 	Stream *stream = *camera_->streams().begin();
 	const std::vector<std::unique_ptr<FrameBuffer>> &buffers =
 		bufferAllocator_->buffers(stream);
@@ -178,6 +342,20 @@ int V4L2Camera::streamOff()
 
 	isRunning_ = false;
 
+	/*
+	 * Drop the buffers that completed but haven't been dequeued, and clear
+	 * the eventfd accordingly so that poll() doesn't report them anymore.
+	 * The camera is stopped, no completion can race with the reset.
+	 */
+	completionTail_.store(completionHead_.load(std::memory_order_acquire),
+			      std::memory_order_release);
+
+	while (bufferSema_.tryAcquire()) {
+		uint64_t data;
+		if (::read(efd_, &data, sizeof(data)) != sizeof(data))
+			LOG(V4L2Compat, Error) << "Failed to clear eventfd POLLIN";
+	}
+
 	return 0;
 }
 
@@ -191,13 +369,23 @@ int V4L2Camera::qbuf(unsigned int index)
 	}
 
 	Stream *stream = config_->at(0).stream();
-	FrameBuffer *buffer = bufferAllocator_->buffers(stream)[index].get();
+	FrameBuffer *buffer = this->buffer(index);
+	if (!buffer) {
+		LOG(V4L2Compat, Error) << "No buffer imported at index " << index;
+		return -EINVAL;
+	}
+
 	int ret = request->addBuffer(stream, buffer);
 	if (ret < 0) {
 		LOG(V4L2Compat, Error) << "Can't set buffer for request";
 		return -ENOMEM;
 	}
 
+	/* Apply the controls set by the application since the last request. */
+	for (const auto &ctrl : pendingControls_)
+		request->controls().set(ctrl.first, ctrl.second);
+	pendingControls_.clear();
+
 	if (!isRunning_) {
 		pendingRequests_.push_back(std::move(request));
 		return 0;
@@ -211,3 +399,13 @@ int V4L2Camera::qbuf(unsigned int index)
 
 	return 0;
 }
+
+const ControlInfoMap &V4L2Camera::controlInfo()
+{
+	return camera_->controls();
+}
+
+void V4L2Camera::setControl(const ControlId &id, const ControlValue &value)
+{
+	pendingControls_.set(id.id(), value);
+}
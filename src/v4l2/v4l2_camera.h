@@ -8,12 +8,14 @@
 #ifndef __V4L2_CAMERA_H__
 #define __V4L2_CAMERA_H__
 
+#include <atomic>
 #include <deque>
-#include <mutex>
 #include <utility>
+#include <vector>
 
 #include <libcamera/buffer.h>
 #include <libcamera/camera.h>
+#include <libcamera/controls.h>
 #include <libcamera/file_descriptor.h>
 #include <libcamera/framebuffer_allocator.h>
 
@@ -25,13 +27,8 @@ class V4L2Camera
 {
 public:
 	struct Buffer {
-		Buffer(unsigned int index, const FrameMetadata &data)
-			: index(index), data(data)
-		{
-		}
-
 		unsigned int index;
-		FrameMetadata data;
+		const FrameMetadata *data;
 	};
 
 	V4L2Camera(std::shared_ptr<Camera> camera);
@@ -39,14 +36,21 @@ public:
 
 	int open();
 	void close();
+	void bind(int efd);
+	void unbind();
 	void getStreamConfig(StreamConfiguration *streamConfig);
-	std::vector<Buffer> completedBuffers();
+	bool dequeueBuffer(Buffer *buffer);
 
+	int validateConfiguration(StreamConfiguration *streamConfigOut,
+				  const Size &size, PixelFormat pixelformat,
+				  unsigned int bufferCount);
 	int configure(StreamConfiguration *streamConfigOut,
 		      const Size &size, PixelFormat pixelformat,
 		      unsigned int bufferCount);
 
 	int allocBuffers(unsigned int count);
+	int importBuffers(unsigned int count);
+	int importBuffer(unsigned int index, int fd, unsigned int length);
 	void freeBuffers();
 	FileDescriptor getBufferFd(unsigned int index);
 
@@ -55,21 +59,39 @@ public:
 
 	int qbuf(unsigned int index);
 
+	const ControlInfoMap &controlInfo();
+	void setControl(const ControlId &id, const ControlValue &value);
+
 	Semaphore bufferSema_;
 
 private:
+	int acquire();
+	FrameBuffer *buffer(unsigned int index);
+	void resetCompletionRing(unsigned int count);
 	void requestComplete(Request *request);
 
 	std::shared_ptr<Camera> camera_;
 	std::unique_ptr<CameraConfiguration> config_;
 
+	bool isAcquired_;
 	bool isRunning_;
+	int efd_;
 
-	std::mutex bufferLock_;
 	FrameBufferAllocator *bufferAllocator_;
+	std::vector<std::unique_ptr<FrameBuffer>> importedBuffers_;
 
 	std::deque<std::unique_ptr<Request>> pendingRequests_;
-	std::deque<std::unique_ptr<Buffer>> completedBuffers_;
+	ControlList pendingControls_;
+
+	/*
+	 * Single-producer single-consumer ring of completed buffer indices, in
+	 * completion order. The producer is the camera manager thread and the
+	 * consumer is VIDIOC_DQBUF. The ring is sized to the number of buffers
+	 * rounded up to a power of two, and can thus never overflow.
+	 */
+	std::vector<unsigned int> completionRing_;
+	std::atomic<unsigned int> completionHead_;
+	std::atomic<unsigned int> completionTail_;
 };
 
 #endif /* __V4L2_CAMERA_H__ */
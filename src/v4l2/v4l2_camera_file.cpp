@@ -0,0 +1,36 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2020, Google Inc.
+ *
+ * v4l2_camera_file.cpp - V4L2 compatibility camera file information
+ */
+
+#include "v4l2_camera_file.h"
+
+#include "v4l2_camera_proxy.h"
+#include "v4l2_compat_manager.h"
+
+/*
+ * A V4L2CameraFile stores the state of an open file description, shared by
+ * all the file descriptors duplicated from the one returned by open(). It
+ * keeps a private duplicate of the eventfd handed to the application, as the
+ * application may close that file descriptor while keeping a dup() of it.
+ *
+ * The file is closed on the proxy when the last file descriptor referencing
+ * it is closed.
+ */
+V4L2CameraFile::V4L2CameraFile(int efd, bool nonBlocking,
+			       V4L2CameraProxy *proxy)
+	: proxy_(proxy), nonBlocking_(nonBlocking),
+	  efd_(V4L2CompatManager::instance()->fops().dup(efd)),
+	  priority_(V4L2_PRIORITY_DEFAULT)
+{
+}
+
+V4L2CameraFile::~V4L2CameraFile()
+{
+	proxy_->close(this);
+
+	if (efd_ >= 0)
+		V4L2CompatManager::instance()->fops().close(efd_);
+}
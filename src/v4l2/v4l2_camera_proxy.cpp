@@ -9,18 +9,23 @@
 
 #include <algorithm>
 #include <array>
+#include <chrono>
 #include <errno.h>
+#include <fcntl.h>
 #include <linux/drm_fourcc.h>
 #include <linux/videodev2.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <unistd.h>
 
 #include <libcamera/camera.h>
+#include <libcamera/control_ids.h>
 #include <libcamera/object.h>
 
 #include "log.h"
 #include "utils.h"
 #include "v4l2_camera.h"
+#include "v4l2_camera_file.h"
 #include "v4l2_compat_manager.h"
 
 #define KERNEL_VERSION(a, b, c) (((a) << 16) + ((b) << 8) + (c))
@@ -29,55 +34,143 @@ using namespace libcamera;
 
 LOG_DECLARE_CATEGORY(V4L2Compat);
 
+namespace {
+
+struct ControlMapping {
+	const ControlId *id;
+	uint32_t v4l2Id;
+	const char *name;
+};
+
+/* Sorted by V4L2 control ID, to support V4L2_CTRL_FLAG_NEXT_CTRL. */
+const ControlMapping controlMappings[] = {
+	{ &controls::Brightness,	V4L2_CID_BRIGHTNESS,		"Brightness" },
+	{ &controls::Contrast,		V4L2_CID_CONTRAST,		"Contrast" },
+	{ &controls::Saturation,	V4L2_CID_SATURATION,		"Saturation" },
+	{ &controls::AwbEnable,		V4L2_CID_AUTO_WHITE_BALANCE,	"White Balance, Automatic" },
+	{ &controls::ManualGain,	V4L2_CID_GAIN,			"Gain" },
+	{ &controls::ManualExposure,	V4L2_CID_EXPOSURE_ABSOLUTE,	"Exposure Time, Absolute" },
+};
+
+const ControlMapping *findControlMapping(const ControlInfoMap &info,
+					 uint32_t id, bool next = false)
+{
+	for (const ControlMapping &mapping : controlMappings) {
+		if (!info.count(mapping.id))
+			continue;
+
+		if (next ? mapping.v4l2Id > id : mapping.v4l2Id == id)
+			return &mapping;
+	}
+
+	return nullptr;
+}
+
+int32_t controlValueToV4L2(const ControlValue &value)
+{
+	switch (value.type()) {
+	case ControlTypeBool:
+		return value.get<bool>();
+	case ControlTypeInteger32:
+		return value.get<int32_t>();
+	case ControlTypeInteger64:
+		return std::min<int64_t>(std::max<int64_t>(value.get<int64_t>(),
+							   INT32_MIN),
+					 INT32_MAX);
+	default:
+		return 0;
+	}
+}
+
+ControlValue controlValueFromV4L2(const ControlId &id, int32_t value)
+{
+	switch (id.type()) {
+	case ControlTypeBool:
+		return ControlValue(value != 0);
+	case ControlTypeInteger64:
+		return ControlValue(static_cast<int64_t>(value));
+	default:
+		return ControlValue(value);
+	}
+}
+
+} /* namespace */
+
 V4L2CameraProxy::V4L2CameraProxy(unsigned int index,
 				 std::shared_ptr<Camera> camera)
-	: refcount_(0), index_(index), bufferCount_(0), currentBuf_(0),
-	  vcam_(std::make_unique<V4L2Camera>(camera))
+	: index_(index), bufferCount_(0),
+	  memory_(V4L2_MEMORY_MMAP), frameDuration_(0),
+	  vcam_(std::make_unique<V4L2Camera>(camera)), owner_(nullptr)
 {
 	querycap(camera);
 }
 
-int V4L2CameraProxy::open(bool nonBlocking)
+/*
+ * Multiple files can be open on the same camera. The first open generates the
+ * default configuration, subsequent opens share the current state and don't
+ * touch the camera, which makes them cheap for applications that only query
+ * the device. Streaming is restricted to a single file, which becomes the
+ * owner of the buffers when it requests them, following the V4L2 semantics.
+ */
+int V4L2CameraProxy::open(V4L2CameraFile *file)
 {
 	LOG(V4L2Compat, Debug) << "Servicing open";
 
-	int ret = vcam_->open();
-	if (ret < 0) {
-		errno = -ret;
-		return -1;
-	}
+	MutexLocker locker(proxyMutex_);
 
-	nonBlocking_ = nonBlocking;
+	if (files_.empty()) {
+		int ret = vcam_->open();
+		if (ret < 0)
+			return ret;
 
-	vcam_->getStreamConfig(&streamConfig_);
-	setFmtFromConfig(streamConfig_);
-	sizeimage_ = calculateSizeImage(streamConfig_);
+		vcam_->getStreamConfig(&streamConfig_);
+		setFmtFromConfig(streamConfig_);
+		sizeimage_ = calculateSizeImage(streamConfig_);
+	}
 
-	refcount_++;
+	files_.insert(file);
+	openTime_ = utils::clock::now();
 
 	return 0;
 }
 
-void V4L2CameraProxy::dup()
-{
-	refcount_++;
-}
-
-void V4L2CameraProxy::close()
+void V4L2CameraProxy::close(V4L2CameraFile *file)
 {
 	LOG(V4L2Compat, Debug) << "Servicing close";
 
-	if (--refcount_ > 0)
+	MutexLocker locker(proxyMutex_);
+
+	if (!files_.erase(file))
 		return;
 
-	vcam_->close();
+	/*
+	 * Closing the owner stops streaming, frees the buffers and releases
+	 * the camera, for other files or processes to use it.
+	 */
+	if (hasOwnership(file)) {
+		freeConversionBuffers();
+		vcam_->close();
+		bufferCount_ = 0;
+		release(file);
+	}
+
+	if (files_.empty())
+		converter_.reset();
 }
 
-void *V4L2CameraProxy::mmap(void *addr, size_t length, int prot, int flags,
-			    off_t offset)
+void *V4L2CameraProxy::mmap(V4L2CameraFile *file, void *addr, size_t length,
+			    int prot, int flags, off_t offset)
 {
 	LOG(V4L2Compat, Debug) << "Servicing mmap";
 
+	MutexLocker locker(proxyMutex_);
+
+	/* DMABUF buffers are mapped by the application through their fd. */
+	if (memory_ != V4L2_MEMORY_MMAP) {
+		errno = EINVAL;
+		return MAP_FAILED;
+	}
+
 	/* \todo Validate prot and flags properly. */
 	if (prot != (PROT_READ | PROT_WRITE)) {
 		errno = EINVAL;
@@ -90,14 +183,30 @@ void *V4L2CameraProxy::mmap(void *addr, size_t length, int prot, int flags,
 		return MAP_FAILED;
 	}
 
-	FileDescriptor fd = vcam_->getBufferFd(index);
-	if (!fd.isValid()) {
-		errno = EINVAL;
-		return MAP_FAILED;
+	/*
+	 * When converting pixel formats, the application maps the buffers
+	 * holding the converted frames instead of the camera buffers.
+	 */
+	int fd;
+	if (converter_) {
+		if (index >= conversionBuffers_.size()) {
+			errno = EINVAL;
+			return MAP_FAILED;
+		}
+
+		fd = conversionBuffers_[index].fd;
+	} else {
+		FileDescriptor buffer = vcam_->getBufferFd(index);
+		if (!buffer.isValid()) {
+			errno = EINVAL;
+			return MAP_FAILED;
+		}
+
+		fd = buffer.fd();
 	}
 
 	void *map = V4L2CompatManager::instance()->fops().mmap(addr, length, prot,
-							       flags, fd.fd(), 0);
+							       flags, fd, 0);
 	if (map == MAP_FAILED)
 		return map;
 
@@ -107,10 +216,12 @@ void *V4L2CameraProxy::mmap(void *addr, size_t length, int prot, int flags,
 	return map;
 }
 
-int V4L2CameraProxy::munmap(void *addr, size_t length)
+int V4L2CameraProxy::munmap(V4L2CameraFile *file, void *addr, size_t length)
 {
 	LOG(V4L2Compat, Debug) << "Servicing munmap";
 
+	MutexLocker locker(proxyMutex_);
+
 	auto iter = mmaps_.find(addr);
 	if (iter == mmaps_.end() || length != sizeimage_) {
 		errno = EINVAL;
@@ -134,7 +245,7 @@ bool V4L2CameraProxy::validateBufferType(uint32_t type)
 
 bool V4L2CameraProxy::validateMemoryType(uint32_t memory)
 {
-	return memory == V4L2_MEMORY_MMAP;
+	return memory == V4L2_MEMORY_MMAP || memory == V4L2_MEMORY_DMABUF;
 }
 
 void V4L2CameraProxy::setFmtFromConfig(StreamConfiguration &streamConfig)
@@ -183,29 +294,24 @@ void V4L2CameraProxy::querycap(std::shared_ptr<Camera> camera)
 	memset(capabilities_.reserved, 0, sizeof(capabilities_.reserved));
 }
 
-void V4L2CameraProxy::updateBuffers()
-{
-	std::vector<V4L2Camera::Buffer> completedBuffers = vcam_->completedBuffers();
-	for (const V4L2Camera::Buffer &buffer : completedBuffers) {
-		const FrameMetadata &fmd = buffer.data;
-		struct v4l2_buffer &buf = buffers_[buffer.index];
-
-		switch (fmd.status) {
-		case FrameMetadata::FrameSuccess:
-			buf.bytesused = fmd.planes[0].bytesused;
-			buf.field = V4L2_FIELD_NONE;
-			buf.timestamp.tv_sec = fmd.timestamp / 1000000000;
-			buf.timestamp.tv_usec = fmd.timestamp % 1000000;
-			buf.sequence = fmd.sequence;
-
-			buf.flags |= V4L2_BUF_FLAG_DONE;
-			break;
-		case FrameMetadata::FrameError:
-			buf.flags |= V4L2_BUF_FLAG_ERROR;
-			break;
-		default:
-			break;
-		}
+void V4L2CameraProxy::updateBuffer(struct v4l2_buffer *buf,
+				   const FrameMetadata &fmd)
+{
+	switch (fmd.status) {
+	case FrameMetadata::FrameSuccess:
+		buf->bytesused = fmd.planes[0].bytesused;
+		buf->field = V4L2_FIELD_NONE;
+		buf->timestamp.tv_sec = fmd.timestamp / 1000000000;
+		buf->timestamp.tv_usec = (fmd.timestamp / 1000) % 1000000;
+		buf->sequence = fmd.sequence;
+
+		buf->flags |= V4L2_BUF_FLAG_DONE;
+		break;
+	case FrameMetadata::FrameError:
+		buf->flags |= V4L2_BUF_FLAG_ERROR;
+		break;
+	default:
+		break;
 	}
 }
 
@@ -218,18 +324,69 @@ int V4L2CameraProxy::vidioc_querycap(struct v4l2_capability *arg)
 	return 0;
 }
 
+/*
+ * Enumerate the formats supported natively by the camera, followed by the
+ * formats the compatibility layer can convert them to.
+ */
+std::vector<uint32_t> V4L2CameraProxy::enumFormats()
+{
+	std::vector<uint32_t> formats;
+
+	for (const PixelFormat &format : streamConfig_.formats().pixelformats())
+		formats.push_back(drmToV4L2(format));
+
+	unsigned int numNative = formats.size();
+	for (unsigned int i = 0; i < numNative; ++i) {
+		for (uint32_t format : V4L2FormatConverter::formats(formats[i])) {
+			if (std::find(formats.begin(), formats.end(), format) == formats.end())
+				formats.push_back(format);
+		}
+	}
+
+	return formats;
+}
+
+/*
+ * Return the format to capture from the camera to produce \a format, or 0 if
+ * \a format is neither supported natively nor through conversion.
+ */
+uint32_t V4L2CameraProxy::nativeFormat(uint32_t format)
+{
+	uint32_t converted = 0;
+
+	for (const PixelFormat &pixelFormat : streamConfig_.formats().pixelformats()) {
+		uint32_t native = drmToV4L2(pixelFormat);
+		if (native == format)
+			return native;
+
+		if (converted)
+			continue;
+
+		std::vector<uint32_t> formats = V4L2FormatConverter::formats(native);
+		if (std::find(formats.begin(), formats.end(), format) != formats.end())
+			converted = native;
+	}
+
+	return converted;
+}
+
 int V4L2CameraProxy::vidioc_enum_fmt(struct v4l2_fmtdesc *arg)
 {
 	LOG(V4L2Compat, Debug) << "Servicing vidioc_enum_fmt";
 
-	if (!validateBufferType(arg->type) ||
-	    arg->index > streamConfig_.formats().pixelformats().size())
+	if (!validateBufferType(arg->type))
+		return -EINVAL;
+
+	std::vector<uint32_t> formats = enumFormats();
+	if (arg->index >= formats.size())
 		return -EINVAL;
 
 	/* \todo Add map from format to description. */
 	utils::strlcpy(reinterpret_cast<char *>(arg->description), "Video Format Description",
 		       sizeof(arg->description));
-	arg->pixelformat = drmToV4L2(streamConfig_.formats().pixelformats()[arg->index]);
+	arg->pixelformat = formats[arg->index];
+	arg->flags = arg->index >= streamConfig_.formats().pixelformats().size()
+		   ? V4L2_FMT_FLAG_EMULATED : 0;
 
 	return 0;
 }
@@ -249,11 +406,14 @@ int V4L2CameraProxy::vidioc_g_fmt(struct v4l2_format *arg)
 
 void V4L2CameraProxy::tryFormat(struct v4l2_format *arg)
 {
-	PixelFormat format = v4l2ToDrm(arg->fmt.pix.pixelformat);
+	uint32_t v4l2Format = arg->fmt.pix.pixelformat;
+	PixelFormat format = v4l2ToDrm(nativeFormat(v4l2Format));
 	const std::vector<PixelFormat> &formats =
 		streamConfig_.formats().pixelformats();
-	if (std::find(formats.begin(), formats.end(), format) == formats.end())
+	if (std::find(formats.begin(), formats.end(), format) == formats.end()) {
 		format = streamConfig_.formats().pixelformats()[0];
+		v4l2Format = drmToV4L2(format);
+	}
 
 	Size size(arg->fmt.pix.width, arg->fmt.pix.height);
 	const std::vector<Size> &sizes = streamConfig_.formats().sizes(format);
@@ -262,11 +422,11 @@ void V4L2CameraProxy::tryFormat(struct v4l2_format *arg)
 
 	arg->fmt.pix.width        = size.width;
 	arg->fmt.pix.height       = size.height;
-	arg->fmt.pix.pixelformat  = drmToV4L2(format);
+	arg->fmt.pix.pixelformat  = v4l2Format;
 	arg->fmt.pix.field        = V4L2_FIELD_NONE;
-	arg->fmt.pix.bytesperline = bplMultiplier(drmToV4L2(format)) *
+	arg->fmt.pix.bytesperline = bplMultiplier(v4l2Format) *
 				    arg->fmt.pix.width;
-	arg->fmt.pix.sizeimage    = imageSize(drmToV4L2(format),
+	arg->fmt.pix.sizeimage    = imageSize(v4l2Format,
 					      arg->fmt.pix.width,
 					      arg->fmt.pix.height);
 	arg->fmt.pix.colorspace   = V4L2_COLORSPACE_SRGB;
@@ -279,22 +439,29 @@ int V4L2CameraProxy::vidioc_s_fmt(struct v4l2_format *arg)
 	if (!validateBufferType(arg->type))
 		return -EINVAL;
 
+	/* The buffers have been sized for the current format. */
+	if (bufferCount_)
+		return -EBUSY;
+
 	tryFormat(arg);
 
+	/*
+	 * Only validate the format here, the camera is configured when buffers
+	 * are requested. This avoids acquiring and configuring the pipeline
+	 * for applications that only negotiate formats.
+	 */
 	Size size(arg->fmt.pix.width, arg->fmt.pix.height);
-	int ret = vcam_->configure(&streamConfig_, size,
-				   v4l2ToDrm(arg->fmt.pix.pixelformat),
-				   bufferCount_);
+	int ret = vcam_->validateConfiguration(&streamConfig_, size,
+					       v4l2ToDrm(nativeFormat(arg->fmt.pix.pixelformat)),
+					       bufferCount_);
 	if (ret < 0)
 		return -EINVAL;
 
-	unsigned int sizeimage = calculateSizeImage(streamConfig_);
-	if (sizeimage == 0)
-		return -EINVAL;
-
-	sizeimage_ = sizeimage;
+	ret = updateFormat(arg->fmt.pix.pixelformat);
+	if (ret < 0)
+		return ret;
 
-	setFmtFromConfig(streamConfig_);
+	arg->fmt.pix = curV4L2Format_.fmt.pix;
 
 	return 0;
 }
@@ -311,6 +478,120 @@ int V4L2CameraProxy::vidioc_try_fmt(struct v4l2_format *arg)
 	return 0;
 }
 
+/*
+ * Update the format exposed to the application from the stream configuration,
+ * and set up conversion from the camera format to \a format if they differ.
+ * If the conversion isn't possible, the camera format is exposed unmodified.
+ */
+int V4L2CameraProxy::updateFormat(uint32_t format)
+{
+	unsigned int sizeimage = calculateSizeImage(streamConfig_);
+	if (sizeimage == 0)
+		return -EINVAL;
+
+	sizeimage_ = sizeimage;
+	setFmtFromConfig(streamConfig_);
+
+	uint32_t native = curV4L2Format_.fmt.pix.pixelformat;
+	if (format == native) {
+		converter_.reset();
+		return 0;
+	}
+
+	if (!converter_)
+		converter_ = std::make_unique<V4L2FormatConverter>();
+
+	/*
+	 * The semi-planar camera formats store the chroma plane right after
+	 * the luma plane, with the same line length.
+	 */
+	unsigned int inputStride = curV4L2Format_.fmt.pix.bytesperline;
+	unsigned int outputStride =
+		bplMultiplier(format) * curV4L2Format_.fmt.pix.width;
+
+	int ret = converter_->configure(native, format, streamConfig_.size,
+					{ inputStride, inputStride },
+					outputStride);
+	if (ret < 0) {
+		converter_.reset();
+		return 0;
+	}
+
+	curV4L2Format_.fmt.pix.pixelformat = format;
+	curV4L2Format_.fmt.pix.bytesperline = outputStride;
+	curV4L2Format_.fmt.pix.sizeimage =
+		imageSize(format, curV4L2Format_.fmt.pix.width,
+			  curV4L2Format_.fmt.pix.height);
+	sizeimage_ = curV4L2Format_.fmt.pix.sizeimage;
+
+	LOG(V4L2Compat, Debug)
+		<< "Converting from " << utils::hex(native)
+		<< " to " << utils::hex(format);
+
+	return 0;
+}
+
+/*
+ * Allocate the buffers exposed to the application when converting pixel
+ * formats, and map them along with the camera buffers they are converted
+ * from.
+ */
+int V4L2CameraProxy::allocConversionBuffers(unsigned int count)
+{
+	const V4L2CompatManager::FileOperations &fops =
+		V4L2CompatManager::instance()->fops();
+	size_t inputLength = calculateSizeImage(streamConfig_);
+
+	freeConversionBuffers();
+
+	for (unsigned int i = 0; i < count; ++i) {
+		conversionBuffers_.push_back({ -1, MAP_FAILED, inputLength, MAP_FAILED });
+		ConversionBuffer &buffer = conversionBuffers_.back();
+
+		FileDescriptor fd = vcam_->getBufferFd(i);
+		if (!fd.isValid()) {
+			freeConversionBuffers();
+			return -EINVAL;
+		}
+
+		buffer.input = fops.mmap(nullptr, inputLength, PROT_READ,
+					 MAP_SHARED, fd.fd(), 0);
+		if (buffer.input != MAP_FAILED)
+			buffer.fd = memfd_create("v4l2-compat", MFD_CLOEXEC);
+		if (buffer.fd >= 0 && ftruncate(buffer.fd, sizeimage_) == 0)
+			buffer.output = fops.mmap(nullptr, sizeimage_,
+						  PROT_READ | PROT_WRITE,
+						  MAP_SHARED, buffer.fd, 0);
+		if (buffer.output == MAP_FAILED) {
+			int ret = -errno;
+			LOG(V4L2Compat, Error)
+				<< "Failed to allocate conversion buffer " << i
+				<< ": " << strerror(-ret);
+			freeConversionBuffers();
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+void V4L2CameraProxy::freeConversionBuffers()
+{
+	const V4L2CompatManager::FileOperations &fops =
+		V4L2CompatManager::instance()->fops();
+
+	for (const ConversionBuffer &buffer : conversionBuffers_) {
+		if (buffer.output != MAP_FAILED)
+			fops.munmap(buffer.output, sizeimage_);
+		if (buffer.input != MAP_FAILED)
+			fops.munmap(buffer.input, buffer.inputLength);
+		if (buffer.fd >= 0)
+			fops.close(buffer.fd);
+	}
+
+	conversionBuffers_.clear();
+}
+
 int V4L2CameraProxy::freeBuffers()
 {
 	LOG(V4L2Compat, Debug) << "Freeing libcamera bufs";
@@ -320,13 +601,15 @@ int V4L2CameraProxy::freeBuffers()
 		LOG(V4L2Compat, Error) << "Failed to stop stream";
 		return ret;
 	}
+	freeConversionBuffers();
 	vcam_->freeBuffers();
 	bufferCount_ = 0;
 
 	return 0;
 }
 
-int V4L2CameraProxy::vidioc_reqbufs(struct v4l2_requestbuffers *arg)
+int V4L2CameraProxy::vidioc_reqbufs(V4L2CameraFile *file,
+				    struct v4l2_requestbuffers *arg)
 {
 	int ret;
 
@@ -336,47 +619,77 @@ int V4L2CameraProxy::vidioc_reqbufs(struct v4l2_requestbuffers *arg)
 	    !validateMemoryType(arg->memory))
 		return -EINVAL;
 
+	if (owner_ && !hasOwnership(file))
+		return -EBUSY;
+
 	LOG(V4L2Compat, Debug) << arg->count << " buffers requested ";
 
-	arg->capabilities = V4L2_BUF_CAP_SUPPORTS_MMAP;
+	arg->capabilities = V4L2_BUF_CAP_SUPPORTS_MMAP |
+			    V4L2_BUF_CAP_SUPPORTS_DMABUF;
 
-	if (arg->count == 0)
-		return freeBuffers();
+	if (arg->count == 0) {
+		ret = freeBuffers();
+		if (ret < 0)
+			return ret;
 
+		release(file);
+		return 0;
+	}
+
+	/* Converted frames can't be captured to application buffers. */
+	if (converter_ && arg->memory == V4L2_MEMORY_DMABUF)
+		return -EINVAL;
+
+	uint32_t format = curV4L2Format_.fmt.pix.pixelformat;
 	Size size(curV4L2Format_.fmt.pix.width, curV4L2Format_.fmt.pix.height);
 	ret = vcam_->configure(&streamConfig_, size,
-			       v4l2ToDrm(curV4L2Format_.fmt.pix.pixelformat),
-			       arg->count);
+			       v4l2ToDrm(nativeFormat(format)), arg->count);
 	if (ret < 0)
-		return -EINVAL;
-
-	sizeimage_ = calculateSizeImage(streamConfig_);
-	if (sizeimage_ == 0)
-		return -EINVAL;
+		return ret == -EBUSY ? ret : -EINVAL;
 
-	setFmtFromConfig(streamConfig_);
+	ret = updateFormat(format);
+	if (ret < 0)
+		return ret;
 
 	arg->count = streamConfig_.bufferCount;
 	bufferCount_ = arg->count;
+	memory_ = arg->memory;
 
-	ret = vcam_->allocBuffers(arg->count);
+	if (memory_ == V4L2_MEMORY_DMABUF)
+		ret = vcam_->importBuffers(arg->count);
+	else
+		ret = vcam_->allocBuffers(arg->count);
 	if (ret < 0) {
 		arg->count = 0;
 		return ret;
 	}
 
+	if (converter_) {
+		ret = allocConversionBuffers(arg->count);
+		if (ret < 0) {
+			vcam_->freeBuffers();
+			arg->count = 0;
+			return ret;
+		}
+	}
+
 	buffers_.resize(arg->count);
 	for (unsigned int i = 0; i < arg->count; i++) {
 		struct v4l2_buffer buf = {};
 		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 		buf.length = curV4L2Format_.fmt.pix.sizeimage;
-		buf.memory = V4L2_MEMORY_MMAP;
-		buf.m.offset = i * curV4L2Format_.fmt.pix.sizeimage;
+		buf.memory = memory_;
+		if (memory_ == V4L2_MEMORY_DMABUF)
+			buf.m.fd = -1;
+		else
+			buf.m.offset = i * curV4L2Format_.fmt.pix.sizeimage;
 		buf.index = i;
 
 		buffers_[i] = buf;
 	}
 
+	acquire(file);
+
 	LOG(V4L2Compat, Debug) << "Allocated " << arg->count << " buffers";
 
 	return 0;
@@ -390,76 +703,448 @@ int V4L2CameraProxy::vidioc_querybuf(struct v4l2_buffer *arg)
 	    arg->index >= bufferCount_)
 		return -EINVAL;
 
-	updateBuffers();
-
 	*arg = buffers_[arg->index];
 
 	return 0;
 }
 
-int V4L2CameraProxy::vidioc_qbuf(struct v4l2_buffer *arg)
+int V4L2CameraProxy::vidioc_qbuf(V4L2CameraFile *file, struct v4l2_buffer *arg)
 {
 	LOG(V4L2Compat, Debug) << "Servicing vidioc_qbuf, index = "
 			       << arg->index;
 
+	if (!hasOwnership(file))
+		return -EBUSY;
+
 	if (!validateBufferType(arg->type) ||
-	    !validateMemoryType(arg->memory) ||
+	    arg->memory != memory_ ||
 	    arg->index >= bufferCount_)
 		return -EINVAL;
 
-	int ret = vcam_->qbuf(arg->index);
+	int ret;
+	if (memory_ == V4L2_MEMORY_DMABUF) {
+		unsigned int length = arg->length ? arg->length : sizeimage_;
+		if (length < sizeimage_)
+			return -EINVAL;
+
+		ret = vcam_->importBuffer(arg->index, arg->m.fd, length);
+		if (ret < 0)
+			return ret;
+
+		buffers_[arg->index].m.fd = arg->m.fd;
+		buffers_[arg->index].length = length;
+	}
+
+	ret = vcam_->qbuf(arg->index);
 	if (ret < 0)
 		return ret;
 
+	buffers_[arg->index].flags |= V4L2_BUF_FLAG_QUEUED;
+	buffers_[arg->index].flags &= ~(V4L2_BUF_FLAG_DONE | V4L2_BUF_FLAG_ERROR);
+
 	arg->flags |= V4L2_BUF_FLAG_QUEUED;
 	arg->flags &= ~V4L2_BUF_FLAG_DONE;
 
 	return ret;
 }
 
-int V4L2CameraProxy::vidioc_dqbuf(struct v4l2_buffer *arg)
+int V4L2CameraProxy::vidioc_dqbuf(V4L2CameraFile *file, struct v4l2_buffer *arg,
+				  MutexLocker *locker)
 {
 	LOG(V4L2Compat, Debug) << "Servicing vidioc_dqbuf";
 
+	if (!hasOwnership(file))
+		return -EBUSY;
+
 	if (!validateBufferType(arg->type) ||
-	    !validateMemoryType(arg->memory))
+	    arg->memory != memory_)
 		return -EINVAL;
 
-	if (nonBlocking_ && !vcam_->bufferSema_.tryAcquire())
-		return -EAGAIN;
-	else
+	if (file->nonBlocking()) {
+		if (!vcam_->bufferSema_.tryAcquire())
+			return -EAGAIN;
+	} else {
+		/*
+		 * Don't block other threads (such as one queueing buffers)
+		 * while waiting for a buffer to complete.
+		 */
+		locker->unlock();
 		vcam_->bufferSema_.acquire();
+		locker->lock();
+	}
+
+	/*
+	 * Return the buffer that actually completed, in completion order,
+	 * which may differ from the order in which buffers were queued.
+	 */
+	V4L2Camera::Buffer buffer;
+	if (!vcam_->dequeueBuffer(&buffer)) {
+		LOG(V4L2Compat, Error) << "No completed buffer to dequeue";
+		return -EINVAL;
+	}
+
+	struct v4l2_buffer &buf = buffers_[buffer.index];
 
-	updateBuffers();
+	updateBuffer(&buf, *buffer.data);
 
-	struct v4l2_buffer &buf = buffers_[currentBuf_];
+	if (converter_ && buffer.data->status == FrameMetadata::FrameSuccess) {
+		const ConversionBuffer &conversion = conversionBuffers_[buffer.index];
+		utils::time_point start = utils::clock::now();
+
+		converter_->convert(static_cast<const uint8_t *>(conversion.input),
+				    static_cast<uint8_t *>(conversion.output));
+		buf.bytesused = sizeimage_;
+
+		std::chrono::microseconds duration =
+			std::chrono::duration_cast<std::chrono::microseconds>(
+				utils::clock::now() - start);
+		LOG(V4L2Compat, Debug)
+			<< "Converted frame " << buf.sequence << " in "
+			<< duration.count() << "us";
+	}
 
 	buf.flags &= ~V4L2_BUF_FLAG_QUEUED;
-	buf.length = sizeimage_;
+	if (memory_ == V4L2_MEMORY_MMAP)
+		buf.length = sizeimage_;
 	*arg = buf;
 
-	currentBuf_ = (currentBuf_ + 1) % bufferCount_;
+	/*
+	 * The eventfd is created in semaphore mode, reading it decrements the
+	 * counter by one and clears POLLIN once all buffers are dequeued.
+	 */
+	uint64_t data;
+	int ret = ::read(file->efd(), &data, sizeof(data));
+	if (ret != sizeof(data))
+		LOG(V4L2Compat, Error) << "Failed to clear eventfd POLLIN";
 
 	return 0;
 }
 
-int V4L2CameraProxy::vidioc_streamon(int *arg)
+int V4L2CameraProxy::vidioc_expbuf(V4L2CameraFile *file,
+				   struct v4l2_exportbuffer *arg)
+{
+	LOG(V4L2Compat, Debug) << "Servicing vidioc_expbuf";
+
+	if (!hasOwnership(file))
+		return -EBUSY;
+
+	/* \todo Export the buffers holding converted frames. */
+	if (!validateBufferType(arg->type) ||
+	    memory_ != V4L2_MEMORY_MMAP || converter_ ||
+	    arg->index >= bufferCount_ || arg->plane != 0)
+		return -EINVAL;
+
+	FileDescriptor fd = vcam_->getBufferFd(arg->index);
+	if (!fd.isValid())
+		return -EINVAL;
+
+	/*
+	 * Export a new file descriptor referencing the dmabuf backing the
+	 * libcamera FrameBuffer, with the close-on-exec flag requested by the
+	 * application.
+	 */
+	int dmabuf = fcntl(fd.fd(), (arg->flags & O_CLOEXEC) ? F_DUPFD_CLOEXEC
+							     : F_DUPFD, 0);
+	if (dmabuf < 0)
+		return -errno;
+
+	arg->fd = dmabuf;
+
+	return 0;
+}
+
+bool V4L2CameraProxy::frameDurationLimits(int64_t *min, int64_t *max)
+{
+	const ControlInfoMap &info = vcam_->controlInfo();
+	auto iter = info.find(&controls::FrameDuration);
+	if (iter == info.end())
+		return false;
+
+	*min = iter->second.min().get<int64_t>();
+	*max = iter->second.max().get<int64_t>();
+
+	return true;
+}
+
+int V4L2CameraProxy::vidioc_g_parm(struct v4l2_streamparm *arg)
+{
+	LOG(V4L2Compat, Debug) << "Servicing vidioc_g_parm";
+
+	if (!validateBufferType(arg->type))
+		return -EINVAL;
+
+	memset(&arg->parm, 0, sizeof(arg->parm));
+
+	/*
+	 * The frame interval can only be reported and selected when the camera
+	 * supports the FrameDuration control. The nominal frame interval is
+	 * the shortest one.
+	 */
+	int64_t min, max;
+	if (!frameDurationLimits(&min, &max))
+		return 0;
+
+	struct v4l2_captureparm &capture = arg->parm.capture;
+	capture.capability = V4L2_CAP_TIMEPERFRAME;
+	capture.timeperframe.numerator = frameDuration_ ? frameDuration_ : min;
+	capture.timeperframe.denominator = 1000000;
+
+	return 0;
+}
+
+int V4L2CameraProxy::vidioc_s_parm(struct v4l2_streamparm *arg)
+{
+	LOG(V4L2Compat, Debug) << "Servicing vidioc_s_parm";
+
+	if (!validateBufferType(arg->type))
+		return -EINVAL;
+
+	int64_t min, max;
+	if (frameDurationLimits(&min, &max)) {
+		const struct v4l2_fract &interval = arg->parm.capture.timeperframe;
+
+		/* A zero interval selects the nominal frame interval. */
+		int64_t duration = min;
+		if (interval.numerator && interval.denominator)
+			duration = static_cast<int64_t>(interval.numerator) * 1000000
+				 / interval.denominator;
+
+		frameDuration_ = std::min(std::max(duration, min), max);
+		vcam_->setControl(controls::FrameDuration, ControlValue(frameDuration_));
+
+		LOG(V4L2Compat, Debug)
+			<< "Frame duration set to " << frameDuration_ << "us";
+	}
+
+	return vidioc_g_parm(arg);
+}
+
+int V4L2CameraProxy::vidioc_enum_framesizes(struct v4l2_frmsizeenum *arg)
+{
+	LOG(V4L2Compat, Debug) << "Servicing vidioc_enum_framesizes";
+
+	PixelFormat format = v4l2ToDrm(nativeFormat(arg->pixel_format));
+	const std::vector<Size> sizes = streamConfig_.formats().sizes(format);
+	if (arg->index >= sizes.size())
+		return -EINVAL;
+
+	arg->type = V4L2_FRMSIZE_TYPE_DISCRETE;
+	arg->discrete.width = sizes[arg->index].width;
+	arg->discrete.height = sizes[arg->index].height;
+	memset(arg->reserved, 0, sizeof(arg->reserved));
+
+	return 0;
+}
+
+int V4L2CameraProxy::vidioc_enum_frameintervals(struct v4l2_frmivalenum *arg)
+{
+	LOG(V4L2Compat, Debug) << "Servicing vidioc_enum_frameintervals";
+
+	PixelFormat format = v4l2ToDrm(nativeFormat(arg->pixel_format));
+	const std::vector<Size> sizes = streamConfig_.formats().sizes(format);
+	Size size(arg->width, arg->height);
+	if (arg->index != 0 ||
+	    std::find(sizes.begin(), sizes.end(), size) == sizes.end())
+		return -EINVAL;
+
+	int64_t min, max;
+	if (!frameDurationLimits(&min, &max))
+		return -EINVAL;
+
+	arg->type = V4L2_FRMIVAL_TYPE_CONTINUOUS;
+	arg->stepwise.min = { static_cast<uint32_t>(min), 1000000 };
+	arg->stepwise.max = { static_cast<uint32_t>(max), 1000000 };
+	arg->stepwise.step = { 1, 1000000 };
+	memset(arg->reserved, 0, sizeof(arg->reserved));
+
+	return 0;
+}
+
+/*
+ * \todo libcamera doesn't report default control values yet. Use the value
+ * closest to zero within the control range as a default.
+ */
+int V4L2CameraProxy::getControl(uint32_t id, int32_t *value, bool defaultValue)
+{
+	const ControlInfoMap &info = vcam_->controlInfo();
+	const ControlMapping *mapping = findControlMapping(info, id);
+	if (!mapping)
+		return -EINVAL;
+
+	auto iter = controls_.find(id);
+	if (!defaultValue && iter != controls_.end()) {
+		*value = iter->second;
+		return 0;
+	}
+
+	const ControlRange &range = info.at(mapping->id);
+	*value = std::min(std::max(0, controlValueToV4L2(range.min())),
+			  controlValueToV4L2(range.max()));
+
+	return 0;
+}
+
+int V4L2CameraProxy::setControl(uint32_t id, int32_t *value, bool apply)
+{
+	const ControlInfoMap &info = vcam_->controlInfo();
+	const ControlMapping *mapping = findControlMapping(info, id);
+	if (!mapping)
+		return -EINVAL;
+
+	const ControlRange &range = info.at(mapping->id);
+	*value = std::min(std::max(*value, controlValueToV4L2(range.min())),
+			  controlValueToV4L2(range.max()));
+
+	if (!apply)
+		return 0;
+
+	controls_[id] = *value;
+	vcam_->setControl(*mapping->id, controlValueFromV4L2(*mapping->id, *value));
+
+	return 0;
+}
+
+int V4L2CameraProxy::vidioc_queryctrl(struct v4l2_queryctrl *arg)
+{
+	LOG(V4L2Compat, Debug) << "Servicing vidioc_queryctrl";
+
+	const uint32_t nextFlags = V4L2_CTRL_FLAG_NEXT_CTRL
+				 | V4L2_CTRL_FLAG_NEXT_COMPOUND;
+	const ControlInfoMap &info = vcam_->controlInfo();
+	const ControlMapping *mapping =
+		findControlMapping(info, arg->id & ~nextFlags, arg->id & nextFlags);
+	if (!mapping)
+		return -EINVAL;
+
+	const ControlRange &range = info.at(mapping->id);
+
+	memset(arg, 0, sizeof(*arg));
+	arg->id = mapping->v4l2Id;
+	arg->type = mapping->id->type() == ControlTypeBool
+		  ? V4L2_CTRL_TYPE_BOOLEAN : V4L2_CTRL_TYPE_INTEGER;
+	utils::strlcpy(reinterpret_cast<char *>(arg->name), mapping->name,
+		       sizeof(arg->name));
+	arg->minimum = controlValueToV4L2(range.min());
+	arg->maximum = controlValueToV4L2(range.max());
+	arg->step = 1;
+	getControl(arg->id, &arg->default_value, true);
+
+	return 0;
+}
+
+int V4L2CameraProxy::vidioc_g_ctrl(struct v4l2_control *arg)
+{
+	LOG(V4L2Compat, Debug) << "Servicing vidioc_g_ctrl";
+
+	return getControl(arg->id, &arg->value, false);
+}
+
+int V4L2CameraProxy::vidioc_s_ctrl(struct v4l2_control *arg)
+{
+	LOG(V4L2Compat, Debug) << "Servicing vidioc_s_ctrl";
+
+	return setControl(arg->id, &arg->value, true);
+}
+
+int V4L2CameraProxy::vidioc_g_ext_ctrls(struct v4l2_ext_controls *arg)
+{
+	LOG(V4L2Compat, Debug) << "Servicing vidioc_g_ext_ctrls";
+
+	if (arg->which != V4L2_CTRL_WHICH_CUR_VAL &&
+	    arg->which != V4L2_CTRL_WHICH_DEF_VAL &&
+	    arg->which != V4L2_CTRL_CLASS_USER &&
+	    arg->which != V4L2_CTRL_CLASS_CAMERA)
+		return -EINVAL;
+
+	bool defaultValue = arg->which == V4L2_CTRL_WHICH_DEF_VAL;
+
+	for (unsigned int i = 0; i < arg->count; ++i) {
+		struct v4l2_ext_control &ctrl = arg->controls[i];
+		int32_t value;
+
+		int ret = getControl(ctrl.id, &value, defaultValue);
+		if (ret < 0) {
+			arg->error_idx = arg->count;
+			return ret;
+		}
+
+		ctrl.value = value;
+	}
+
+	return 0;
+}
+
+int V4L2CameraProxy::setExtControls(struct v4l2_ext_controls *arg, bool apply)
+{
+	if (arg->which != V4L2_CTRL_WHICH_CUR_VAL &&
+	    arg->which != V4L2_CTRL_CLASS_USER &&
+	    arg->which != V4L2_CTRL_CLASS_CAMERA)
+		return -EINVAL;
+
+	/* Validate all controls before applying any of them. */
+	for (unsigned int i = 0; i < arg->count; ++i) {
+		struct v4l2_ext_control &ctrl = arg->controls[i];
+		int32_t value = ctrl.value;
+
+		int ret = setControl(ctrl.id, &value, false);
+		if (ret < 0) {
+			arg->error_idx = apply ? arg->count : i;
+			return ret;
+		}
+
+		ctrl.value = value;
+	}
+
+	if (!apply)
+		return 0;
+
+	for (unsigned int i = 0; i < arg->count; ++i) {
+		struct v4l2_ext_control &ctrl = arg->controls[i];
+		int32_t value = ctrl.value;
+
+		setControl(ctrl.id, &value, true);
+	}
+
+	return 0;
+}
+
+int V4L2CameraProxy::vidioc_s_ext_ctrls(struct v4l2_ext_controls *arg)
+{
+	LOG(V4L2Compat, Debug) << "Servicing vidioc_s_ext_ctrls";
+
+	return setExtControls(arg, true);
+}
+
+int V4L2CameraProxy::vidioc_try_ext_ctrls(struct v4l2_ext_controls *arg)
+{
+	LOG(V4L2Compat, Debug) << "Servicing vidioc_try_ext_ctrls";
+
+	return setExtControls(arg, false);
+}
+
+int V4L2CameraProxy::vidioc_streamon(V4L2CameraFile *file, int *arg)
 {
 	LOG(V4L2Compat, Debug) << "Servicing vidioc_streamon";
 
 	if (!validateBufferType(*arg))
 		return -EINVAL;
 
+	if (!hasOwnership(file))
+		return -EBUSY;
+
 	return vcam_->streamOn();
 }
 
-int V4L2CameraProxy::vidioc_streamoff(int *arg)
+int V4L2CameraProxy::vidioc_streamoff(V4L2CameraFile *file, int *arg)
 {
 	LOG(V4L2Compat, Debug) << "Servicing vidioc_streamoff";
 
 	if (!validateBufferType(*arg))
 		return -EINVAL;
 
+	if (!hasOwnership(file))
+		return -EBUSY;
+
 	int ret = vcam_->streamOff();
 
 	for (struct v4l2_buffer &buf : buffers_)
@@ -468,8 +1153,110 @@ int V4L2CameraProxy::vidioc_streamoff(int *arg)
 	return ret;
 }
 
-int V4L2CameraProxy::ioctl(unsigned long request, void *arg)
+int V4L2CameraProxy::vidioc_g_priority(V4L2CameraFile *file,
+				       enum v4l2_priority *arg)
+{
+	LOG(V4L2Compat, Debug) << "Servicing vidioc_g_priority";
+
+	*arg = maxPriority();
+
+	return 0;
+}
+
+int V4L2CameraProxy::vidioc_s_priority(V4L2CameraFile *file,
+				       enum v4l2_priority *arg)
+{
+	LOG(V4L2Compat, Debug) << "Servicing vidioc_s_priority";
+
+	enum v4l2_priority priority = *arg;
+	if (priority == V4L2_PRIORITY_UNSET)
+		priority = V4L2_PRIORITY_DEFAULT;
+
+	if (priority != V4L2_PRIORITY_BACKGROUND &&
+	    priority != V4L2_PRIORITY_INTERACTIVE &&
+	    priority != V4L2_PRIORITY_RECORD)
+		return -EINVAL;
+
+	file->setPriority(priority);
+
+	return 0;
+}
+
+bool V4L2CameraProxy::hasOwnership(V4L2CameraFile *file)
 {
+	return owner_ == file;
+}
+
+/*
+ * The owner is the file that allocated the buffers. It is the only one allowed
+ * to queue and dequeue buffers and to control streaming, and its eventfd is
+ * signalled when buffers complete.
+ */
+void V4L2CameraProxy::acquire(V4L2CameraFile *file)
+{
+	if (owner_ == file)
+		return;
+
+	vcam_->bind(file->efd());
+	owner_ = file;
+}
+
+void V4L2CameraProxy::release(V4L2CameraFile *file)
+{
+	if (owner_ != file)
+		return;
+
+	vcam_->unbind();
+	owner_ = nullptr;
+}
+
+enum v4l2_priority V4L2CameraProxy::maxPriority()
+{
+	enum v4l2_priority priority = V4L2_PRIORITY_BACKGROUND;
+
+	for (V4L2CameraFile *file : files_)
+		priority = std::max(priority, file->priority());
+
+	return priority;
+}
+
+int V4L2CameraProxy::ioctl(V4L2CameraFile *file, unsigned long request,
+			   void *arg)
+{
+	MutexLocker locker(proxyMutex_);
+
+	if (openTime_ != utils::time_point()) {
+		std::chrono::microseconds latency =
+			std::chrono::duration_cast<std::chrono::microseconds>(
+				utils::clock::now() - openTime_);
+		LOG(V4L2Compat, Debug)
+			<< "First ioctl " << utils::hex(static_cast<uint32_t>(request))
+			<< " serviced " << latency.count() << "us after open";
+		openTime_ = utils::time_point();
+	}
+
+	/*
+	 * As in the kernel, ioctls that modify the device state are rejected
+	 * when another file has a higher priority.
+	 */
+	switch (request) {
+	case VIDIOC_S_FMT:
+	case VIDIOC_REQBUFS:
+	case VIDIOC_STREAMON:
+	case VIDIOC_STREAMOFF:
+	case VIDIOC_S_PARM:
+	case VIDIOC_S_CTRL:
+	case VIDIOC_S_EXT_CTRLS:
+	case VIDIOC_S_PRIORITY:
+		if (file->priority() < maxPriority()) {
+			errno = EBUSY;
+			return -1;
+		}
+		break;
+	default:
+		break;
+	}
+
 	int ret;
 	switch (request) {
 	case VIDIOC_QUERYCAP:
@@ -488,22 +1275,61 @@ int V4L2CameraProxy::ioctl(unsigned long request, void *arg)
 		ret = vidioc_try_fmt(static_cast<struct v4l2_format *>(arg));
 		break;
 	case VIDIOC_REQBUFS:
-		ret = vidioc_reqbufs(static_cast<struct v4l2_requestbuffers *>(arg));
+		ret = vidioc_reqbufs(file, static_cast<struct v4l2_requestbuffers *>(arg));
 		break;
 	case VIDIOC_QUERYBUF:
 		ret = vidioc_querybuf(static_cast<struct v4l2_buffer *>(arg));
 		break;
 	case VIDIOC_QBUF:
-		ret = vidioc_qbuf(static_cast<struct v4l2_buffer *>(arg));
+		ret = vidioc_qbuf(file, static_cast<struct v4l2_buffer *>(arg));
 		break;
 	case VIDIOC_DQBUF:
-		ret = vidioc_dqbuf(static_cast<struct v4l2_buffer *>(arg));
+		ret = vidioc_dqbuf(file, static_cast<struct v4l2_buffer *>(arg), &locker);
+		break;
+	case VIDIOC_EXPBUF:
+		ret = vidioc_expbuf(file, static_cast<struct v4l2_exportbuffer *>(arg));
+		break;
+	case VIDIOC_G_PARM:
+		ret = vidioc_g_parm(static_cast<struct v4l2_streamparm *>(arg));
+		break;
+	case VIDIOC_S_PARM:
+		ret = vidioc_s_parm(static_cast<struct v4l2_streamparm *>(arg));
+		break;
+	case VIDIOC_ENUM_FRAMESIZES:
+		ret = vidioc_enum_framesizes(static_cast<struct v4l2_frmsizeenum *>(arg));
+		break;
+	case VIDIOC_ENUM_FRAMEINTERVALS:
+		ret = vidioc_enum_frameintervals(static_cast<struct v4l2_frmivalenum *>(arg));
+		break;
+	case VIDIOC_QUERYCTRL:
+		ret = vidioc_queryctrl(static_cast<struct v4l2_queryctrl *>(arg));
+		break;
+	case VIDIOC_G_CTRL:
+		ret = vidioc_g_ctrl(static_cast<struct v4l2_control *>(arg));
+		break;
+	case VIDIOC_S_CTRL:
+		ret = vidioc_s_ctrl(static_cast<struct v4l2_control *>(arg));
+		break;
+	case VIDIOC_G_EXT_CTRLS:
+		ret = vidioc_g_ext_ctrls(static_cast<struct v4l2_ext_controls *>(arg));
+		break;
+	case VIDIOC_S_EXT_CTRLS:
+		ret = vidioc_s_ext_ctrls(static_cast<struct v4l2_ext_controls *>(arg));
+		break;
+	case VIDIOC_TRY_EXT_CTRLS:
+		ret = vidioc_try_ext_ctrls(static_cast<struct v4l2_ext_controls *>(arg));
 		break;
 	case VIDIOC_STREAMON:
-		ret = vidioc_streamon(static_cast<int *>(arg));
+		ret = vidioc_streamon(file, static_cast<int *>(arg));
 		break;
 	case VIDIOC_STREAMOFF:
-		ret = vidioc_streamoff(static_cast<int *>(arg));
+		ret = vidioc_streamoff(file, static_cast<int *>(arg));
+		break;
+	case VIDIOC_G_PRIORITY:
+		ret = vidioc_g_priority(file, static_cast<enum v4l2_priority *>(arg));
+		break;
+	case VIDIOC_S_PRIORITY:
+		ret = vidioc_s_priority(file, static_cast<enum v4l2_priority *>(arg));
 		break;
 	default:
 		ret = -ENOTTY;
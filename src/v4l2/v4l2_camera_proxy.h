@@ -11,49 +11,90 @@
 #include <linux/videodev2.h>
 #include <map>
 #include <memory>
+#include <set>
 #include <sys/types.h>
 #include <vector>
 
 #include <libcamera/camera.h>
 
+#include "thread.h"
+#include "utils.h"
 #include "v4l2_camera.h"
+#include "v4l2_format_converter.h"
 
 using namespace libcamera;
 
+class V4L2CameraFile;
+
 class V4L2CameraProxy
 {
 public:
 	V4L2CameraProxy(unsigned int index, std::shared_ptr<Camera> camera);
 
-	int open(bool nonBlocking);
-	void dup();
-	void close();
-	void *mmap(void *addr, size_t length, int prot, int flags, off_t offset);
-	int munmap(void *addr, size_t length);
+	int open(V4L2CameraFile *file);
+	void close(V4L2CameraFile *file);
+	void *mmap(V4L2CameraFile *file, void *addr, size_t length, int prot,
+		   int flags, off_t offset);
+	int munmap(V4L2CameraFile *file, void *addr, size_t length);
 
-	int ioctl(unsigned long request, void *arg);
+	int ioctl(V4L2CameraFile *file, unsigned long request, void *arg);
 
 private:
+	struct ConversionBuffer {
+		int fd;
+		void *input;
+		size_t inputLength;
+		void *output;
+	};
+
 	bool validateBufferType(uint32_t type);
 	bool validateMemoryType(uint32_t memory);
 	void setFmtFromConfig(StreamConfiguration &streamConfig);
 	unsigned int calculateSizeImage(StreamConfiguration &streamConfig);
 	void querycap(std::shared_ptr<Camera> camera);
+	std::vector<uint32_t> enumFormats();
+	uint32_t nativeFormat(uint32_t format);
 	void tryFormat(struct v4l2_format *arg);
-	void updateBuffers();
+	int updateFormat(uint32_t format);
+	void updateBuffer(struct v4l2_buffer *buf, const FrameMetadata &fmd);
+	bool frameDurationLimits(int64_t *min, int64_t *max);
+	int getControl(uint32_t id, int32_t *value, bool defaultValue);
+	int setControl(uint32_t id, int32_t *value, bool apply);
+	int setExtControls(struct v4l2_ext_controls *arg, bool apply);
 	int freeBuffers();
+	int allocConversionBuffers(unsigned int count);
+	void freeConversionBuffers();
 
 	int vidioc_querycap(struct v4l2_capability *arg);
 	int vidioc_enum_fmt(struct v4l2_fmtdesc *arg);
 	int vidioc_g_fmt(struct v4l2_format *arg);
 	int vidioc_s_fmt(struct v4l2_format *arg);
 	int vidioc_try_fmt(struct v4l2_format *arg);
-	int vidioc_reqbufs(struct v4l2_requestbuffers *arg);
+	int vidioc_reqbufs(V4L2CameraFile *file, struct v4l2_requestbuffers *arg);
 	int vidioc_querybuf(struct v4l2_buffer *arg);
-	int vidioc_qbuf(struct v4l2_buffer *arg);
-	int vidioc_dqbuf(struct v4l2_buffer *arg);
-	int vidioc_streamon(int *arg);
-	int vidioc_streamoff(int *arg);
+	int vidioc_qbuf(V4L2CameraFile *file, struct v4l2_buffer *arg);
+	int vidioc_dqbuf(V4L2CameraFile *file, struct v4l2_buffer *arg,
+			 MutexLocker *locker);
+	int vidioc_expbuf(V4L2CameraFile *file, struct v4l2_exportbuffer *arg);
+	int vidioc_g_parm(struct v4l2_streamparm *arg);
+	int vidioc_s_parm(struct v4l2_streamparm *arg);
+	int vidioc_enum_framesizes(struct v4l2_frmsizeenum *arg);
+	int vidioc_enum_frameintervals(struct v4l2_frmivalenum *arg);
+	int vidioc_queryctrl(struct v4l2_queryctrl *arg);
+	int vidioc_g_ctrl(struct v4l2_control *arg);
+	int vidioc_s_ctrl(struct v4l2_control *arg);
+	int vidioc_g_ext_ctrls(struct v4l2_ext_controls *arg);
+	int vidioc_s_ext_ctrls(struct v4l2_ext_controls *arg);
+	int vidioc_try_ext_ctrls(struct v4l2_ext_controls *arg);
+	int vidioc_streamon(V4L2CameraFile *file, int *arg);
+	int vidioc_streamoff(V4L2CameraFile *file, int *arg);
+	int vidioc_g_priority(V4L2CameraFile *file, enum v4l2_priority *arg);
+	int vidioc_s_priority(V4L2CameraFile *file, enum v4l2_priority *arg);
+
+	bool hasOwnership(V4L2CameraFile *file);
+	void acquire(V4L2CameraFile *file);
+	void release(V4L2CameraFile *file);
+	enum v4l2_priority maxPriority();
 
 	static unsigned int bplMultiplier(uint32_t format);
 	static unsigned int imageSize(uint32_t format, unsigned int width,
@@ -62,21 +103,36 @@ private:
 	static PixelFormat v4l2ToDrm(uint32_t format);
 	static uint32_t drmToV4L2(PixelFormat format);
 
-	unsigned int refcount_;
 	unsigned int index_;
-	bool nonBlocking_;
+	utils::time_point openTime_;
 
 	struct v4l2_format curV4L2Format_;
 	StreamConfiguration streamConfig_;
 	struct v4l2_capability capabilities_;
 	unsigned int bufferCount_;
-	unsigned int currentBuf_;
+	uint32_t memory_;
 	unsigned int sizeimage_;
 
 	std::vector<struct v4l2_buffer> buffers_;
 	std::map<void *, unsigned int> mmaps_;
 
+	std::unique_ptr<V4L2FormatConverter> converter_;
+	std::vector<ConversionBuffer> conversionBuffers_;
+
+	int64_t frameDuration_;
+	std::map<uint32_t, int32_t> controls_;
+
 	std::unique_ptr<V4L2Camera> vcam_;
+
+	std::set<V4L2CameraFile *> files_;
+	/* The file that owns the buffers, if any. */
+	V4L2CameraFile *owner_;
+
+	/*
+	 * Serialises the file operations and ioctls issued on the proxy from
+	 * different application threads.
+	 */
+	Mutex proxyMutex_;
 };
 
 #endif /* __V4L2_CAMERA_PROXY_H__ */
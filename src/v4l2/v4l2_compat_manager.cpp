@@ -7,7 +7,9 @@
 
 #include "v4l2_compat_manager.h"
 
+#include <chrono>
 #include <dlfcn.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <map>
 #include <stdarg.h>
@@ -23,6 +25,7 @@
 #include <libcamera/camera_manager.h>
 
 #include "log.h"
+#include "utils.h"
 
 using namespace libcamera;
 
@@ -37,7 +40,7 @@ void get_symbol(T &func, const char *name)
 } /* namespace */
 
 V4L2CompatManager::V4L2CompatManager()
-	: cm_(nullptr)
+	: cm_(nullptr), largeFdCount_(0), mmapCount_(0)
 {
 	get_symbol(fops_.openat, "openat");
 	get_symbol(fops_.dup, "dup");
@@ -45,11 +48,25 @@ V4L2CompatManager::V4L2CompatManager()
 	get_symbol(fops_.ioctl, "ioctl");
 	get_symbol(fops_.mmap, "mmap");
 	get_symbol(fops_.munmap, "munmap");
+
+	for (std::atomic<uint64_t> &entry : fdTable_)
+		entry.store(0, std::memory_order_relaxed);
 }
 
 V4L2CompatManager::~V4L2CompatManager()
 {
-	devices_.clear();
+	std::unique_lock<std::mutex> locker(mutex_);
+
+	/*
+	 * Clear the fast path filters first, file operations performed after
+	 * this point (for instance by atexit handlers) are passed through.
+	 */
+	for (std::atomic<uint64_t> &entry : fdTable_)
+		entry.store(0, std::memory_order_release);
+	largeFdCount_.store(0, std::memory_order_release);
+	mmapCount_.store(0, std::memory_order_release);
+
+	files_.clear();
 	mmaps_.clear();
 
 	if (cm_) {
@@ -95,10 +112,69 @@ V4L2CompatManager *V4L2CompatManager::instance()
 	return &instance;
 }
 
-V4L2CameraProxy *V4L2CompatManager::getProxy(int fd)
+/*
+ * Check without locking whether \a fd may be a camera file descriptor. This
+ * is called for every intercepted file operation in the process, and rejects
+ * non-camera file descriptors with a single atomic load. A false positive is
+ * only possible for file descriptors beyond the table size, and is resolved
+ * by the caller with a lookup in files_.
+ *
+ * Entries are set before the file descriptor is returned to the application
+ * and cleared before it is closed, so a file descriptor number reused by the
+ * kernel is never mistaken for a camera file descriptor.
+ */
+bool V4L2CompatManager::isCameraFd(int fd) const
+{
+	if (fd < 0)
+		return false;
+
+	if (static_cast<unsigned int>(fd) >= FD_TABLE_SIZE)
+		return largeFdCount_.load(std::memory_order_acquire) > 0;
+
+	uint64_t bits = fdTable_[fd / 64].load(std::memory_order_acquire);
+	return bits & (1ULL << (fd % 64));
+}
+
+/* Must be called with mutex_ held. */
+void V4L2CompatManager::addDevice(int fd, std::shared_ptr<V4L2CameraFile> file)
 {
-	auto device = devices_.find(fd);
-	if (device == devices_.end())
+	files_[fd] = file;
+
+	if (static_cast<unsigned int>(fd) >= FD_TABLE_SIZE)
+		largeFdCount_.fetch_add(1, std::memory_order_release);
+	else
+		fdTable_[fd / 64].fetch_or(1ULL << (fd % 64),
+					   std::memory_order_release);
+}
+
+/* Must be called with mutex_ held. */
+std::shared_ptr<V4L2CameraFile> V4L2CompatManager::removeDevice(int fd)
+{
+	auto device = files_.find(fd);
+	if (device == files_.end())
+		return nullptr;
+
+	std::shared_ptr<V4L2CameraFile> file = std::move(device->second);
+	files_.erase(device);
+
+	if (static_cast<unsigned int>(fd) >= FD_TABLE_SIZE)
+		largeFdCount_.fetch_sub(1, std::memory_order_release);
+	else
+		fdTable_[fd / 64].fetch_and(~(1ULL << (fd % 64)),
+					    std::memory_order_release);
+
+	return file;
+}
+
+std::shared_ptr<V4L2CameraFile> V4L2CompatManager::cameraFile(int fd)
+{
+	if (!isCameraFd(fd))
+		return nullptr;
+
+	std::unique_lock<std::mutex> locker(mutex_);
+
+	auto device = files_.find(fd);
+	if (device == files_.end())
 		return nullptr;
 
 	return device->second;
@@ -137,9 +213,29 @@ int V4L2CompatManager::openat(int dirfd, const char *path, int oflag, mode_t mod
 	    major(statbuf.st_rdev) != 81)
 		return fd;
 
-	if (!cm_)
+	std::unique_lock<std::mutex> locker(mutex_);
+
+	utils::time_point openTime = utils::clock::now();
+
+	/*
+	 * The camera manager has to be started to find out whether the device
+	 * node belongs to a camera. Only the pipeline bring-up is deferred to
+	 * VIDIOC_REQBUFS, by the camera proxy.
+	 *
+	 * \todo Start the camera manager without matching pipeline handlers
+	 * when libcamera supports it, and complete the start when the device
+	 * node is found to belong to a camera.
+	 */
+	if (!cm_) {
 		start();
 
+		std::chrono::microseconds duration =
+			std::chrono::duration_cast<std::chrono::microseconds>(
+				utils::clock::now() - openTime);
+		LOG(V4L2Compat, Debug)
+			<< "Camera manager started in " << duration.count() << "us";
+	}
+
 	ret = getCameraIndex(fd);
 	if (ret < 0) {
 		LOG(V4L2Compat, Info) << "No camera found for " << path;
@@ -151,45 +247,70 @@ int V4L2CompatManager::openat(int dirfd, const char *path, int oflag, mode_t mod
 	unsigned int camera_index = static_cast<unsigned int>(ret);
 
 	V4L2CameraProxy *proxy = proxies_[camera_index].get();
-	ret = proxy->open(oflag & O_NONBLOCK);
-	if (ret < 0)
-		return ret;
 
-	int efd = eventfd(0, oflag & (O_CLOEXEC | O_NONBLOCK));
-	if (efd < 0) {
-		proxy->close();
+	/*
+	 * The eventfd is the file descriptor handed to the application. It is
+	 * signalled by the camera for every completed buffer, which makes
+	 * poll(), select() and epoll report POLLIN when a buffer is ready to
+	 * be dequeued.
+	 */
+	int efd = eventfd(0, EFD_SEMAPHORE |
+			     ((oflag & O_CLOEXEC) ? EFD_CLOEXEC : 0) |
+			     ((oflag & O_NONBLOCK) ? EFD_NONBLOCK : 0));
+	if (efd < 0)
 		return efd;
+
+	std::shared_ptr<V4L2CameraFile> file =
+		std::make_shared<V4L2CameraFile>(efd, oflag & O_NONBLOCK, proxy);
+	ret = file->efd() < 0 ? -errno : proxy->open(file.get());
+	if (ret < 0) {
+		fops_.close(efd);
+		errno = -ret;
+		return -1;
 	}
 
-	devices_.emplace(efd, proxy);
+	addDevice(efd, file);
+
+	std::chrono::microseconds duration =
+		std::chrono::duration_cast<std::chrono::microseconds>(
+			utils::clock::now() - openTime);
+	LOG(V4L2Compat, Debug)
+		<< "Opened " << path << " in " << duration.count() << "us";
 
 	return efd;
 }
 
 int V4L2CompatManager::dup(int oldfd)
 {
+	if (!isCameraFd(oldfd))
+		return fops_.dup(oldfd);
+
+	std::unique_lock<std::mutex> locker(mutex_);
+
 	int newfd = fops_.dup(oldfd);
 	if (newfd < 0)
 		return newfd;
 
-	auto device = devices_.find(oldfd);
-	if (device != devices_.end()) {
-		V4L2CameraProxy *proxy = device->second;
-		devices_[newfd] = proxy;
-		proxy->dup();
-	}
+	auto device = files_.find(oldfd);
+	if (device != files_.end())
+		addDevice(newfd, device->second);
 
 	return newfd;
 }
 
 int V4L2CompatManager::close(int fd)
 {
-	V4L2CameraProxy *proxy = getProxy(fd);
-	if (proxy) {
-		proxy->close();
-		devices_.erase(fd);
-		return 0;
-	}
+	if (!isCameraFd(fd))
+		return fops_.close(fd);
+
+	std::unique_lock<std::mutex> locker(mutex_);
+
+	std::shared_ptr<V4L2CameraFile> file = removeDevice(fd);
+
+	locker.unlock();
+
+	/* Close the file on the proxy if this was its last reference. */
+	file.reset();
 
 	return fops_.close(fd);
 }
@@ -197,40 +318,53 @@ int V4L2CompatManager::close(int fd)
 void *V4L2CompatManager::mmap(void *addr, size_t length, int prot, int flags,
 			      int fd, off_t offset)
 {
-	V4L2CameraProxy *proxy = getProxy(fd);
-	if (!proxy)
+	std::shared_ptr<V4L2CameraFile> file = cameraFile(fd);
+	if (!file)
 		return fops_.mmap(addr, length, prot, flags, fd, offset);
 
-	void *map = proxy->mmap(addr, length, prot, flags, offset);
+	void *map = file->proxy()->mmap(file.get(), addr, length, prot, flags,
+					offset);
 	if (map == MAP_FAILED)
 		return map;
 
-	mmaps_[map] = proxy;
+	std::unique_lock<std::mutex> locker(mutex_);
+
+	mmaps_[map] = file;
+	mmapCount_.fetch_add(1, std::memory_order_release);
+
 	return map;
 }
 
 int V4L2CompatManager::munmap(void *addr, size_t length)
 {
+	if (!mmapCount_.load(std::memory_order_acquire))
+		return fops_.munmap(addr, length);
+
+	std::unique_lock<std::mutex> locker(mutex_);
+
 	auto device = mmaps_.find(addr);
-	if (device == mmaps_.end())
+	if (device == mmaps_.end()) {
+		locker.unlock();
 		return fops_.munmap(addr, length);
+	}
 
-	V4L2CameraProxy *proxy = device->second;
+	std::shared_ptr<V4L2CameraFile> file = device->second;
 
-	int ret = proxy->munmap(addr, length);
+	int ret = file->proxy()->munmap(file.get(), addr, length);
 	if (ret < 0)
 		return ret;
 
 	mmaps_.erase(device);
+	mmapCount_.fetch_sub(1, std::memory_order_release);
 
 	return 0;
 }
 
 int V4L2CompatManager::ioctl(int fd, unsigned long request, void *arg)
 {
-	V4L2CameraProxy *proxy = getProxy(fd);
-	if (!proxy)
+	std::shared_ptr<V4L2CameraFile> file = cameraFile(fd);
+	if (!file)
 		return fops_.ioctl(fd, request, arg);
 
-	return proxy->ioctl(request, arg);
+	return file->proxy()->ioctl(file.get(), request, arg);
 }
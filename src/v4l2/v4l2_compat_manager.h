@@ -8,14 +8,19 @@
 #ifndef __V4L2_COMPAT_MANAGER_H__
 #define __V4L2_COMPAT_MANAGER_H__
 
+#include <array>
+#include <atomic>
 #include <fcntl.h>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <stdint.h>
 #include <sys/types.h>
 #include <vector>
 
 #include <libcamera/camera_manager.h>
 
+#include "v4l2_camera_file.h"
 #include "v4l2_camera_proxy.h"
 
 using namespace libcamera;
@@ -43,7 +48,7 @@ public:
 
 	static V4L2CompatManager *instance();
 
-	V4L2CameraProxy *getProxy(int fd);
+	std::shared_ptr<V4L2CameraFile> cameraFile(int fd);
 	const FileOperations &fops() const { return fops_; }
 
 	int openat(int dirfd, const char *path, int oflag, mode_t mode);
@@ -59,16 +64,43 @@ private:
 	V4L2CompatManager();
 	~V4L2CompatManager();
 
+	static constexpr unsigned int FD_TABLE_SIZE = 65536;
+
 	int start();
 	int getCameraIndex(int fd);
 
+	bool isCameraFd(int fd) const;
+	void addDevice(int fd, std::shared_ptr<V4L2CameraFile> file);
+	std::shared_ptr<V4L2CameraFile> removeDevice(int fd);
+
 	FileOperations fops_;
 
+	/*
+	 * The camera manager is started with the mutex held, before any camera
+	 * file exists. This doesn't re-enter the file operations that take the
+	 * mutex: V4L2 device nodes are opened with a direct system call that
+	 * bypasses interception, and operations on other files, including
+	 * media device nodes, are passed through without taking the mutex.
+	 */
+	std::mutex mutex_;
+
 	CameraManager *cm_;
 
 	std::vector<std::unique_ptr<V4L2CameraProxy>> proxies_;
-	std::map<int, V4L2CameraProxy *> devices_;
-	std::map<void *, V4L2CameraProxy *> mmaps_;
+	/*
+	 * Files are shared by duplicated file descriptors, and referenced by
+	 * the memory mappings created through them, as in the kernel.
+	 */
+	std::map<int, std::shared_ptr<V4L2CameraFile>> files_;
+	std::map<void *, std::shared_ptr<V4L2CameraFile>> mmaps_;
+
+	/*
+	 * Lock-free filters to reject non-camera file descriptors and mappings
+	 * without taking mutex_. They are only modified with mutex_ held.
+	 */
+	std::array<std::atomic<uint64_t>, FD_TABLE_SIZE / 64> fdTable_;
+	std::atomic<unsigned int> largeFdCount_;
+	std::atomic<unsigned int> mmapCount_;
 };
 
 #endif /* __V4L2_COMPAT_MANAGER_H__ */
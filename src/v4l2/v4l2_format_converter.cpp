@@ -0,0 +1,184 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2020, Google Inc.
+ *
+ * v4l2_format_converter.cpp - Pixel format conversion for the V4L2 compatibility layer
+ */
+
+#include "v4l2_format_converter.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <linux/videodev2.h>
+
+using namespace libcamera;
+
+namespace {
+
+using LineConverter = void (*)(const uint8_t *y, const uint8_t *uv,
+			       uint8_t *dst, unsigned int width);
+
+/*
+ * The line converters process pixels in pairs sharing the same chroma sample.
+ * The loop bodies have no data-dependent branches, which allows the compiler
+ * to vectorise them.
+ */
+template<unsigned int Cb, unsigned int Y0, unsigned int Y1, unsigned int U,
+	 unsigned int V>
+void semiPlanarToPacked(const uint8_t *y, const uint8_t *uv, uint8_t *dst,
+			unsigned int width)
+{
+	for (unsigned int x = 0; x < width; x += 2) {
+		dst[x * 2 + Y0] = y[x];
+		dst[x * 2 + Y1] = y[x + 1];
+		dst[x * 2 + U] = uv[x + Cb];
+		dst[x * 2 + V] = uv[x + 1 - Cb];
+	}
+}
+
+inline uint8_t clamp8(int value)
+{
+	return std::min(std::max(value, 0), 255);
+}
+
+/* BT.601 limited range to full range RGB, in 8-bit fixed point. */
+template<unsigned int Cb, unsigned int R, unsigned int B>
+void semiPlanarToRGB(const uint8_t *y, const uint8_t *uv, uint8_t *dst,
+		     unsigned int width)
+{
+	for (unsigned int x = 0; x < width; x += 2) {
+		int u = uv[x + Cb] - 128;
+		int v = uv[x + 1 - Cb] - 128;
+		int r = 409 * v + 128;
+		int g = -100 * u - 208 * v + 128;
+		int b = 516 * u + 128;
+
+		for (unsigned int i = 0; i < 2; ++i) {
+			int luma = 298 * (y[x + i] - 16);
+			uint8_t *pixel = &dst[(x + i) * 3];
+
+			pixel[R] = clamp8((luma + r) >> 8);
+			pixel[1] = clamp8((luma + g) >> 8);
+			pixel[B] = clamp8((luma + b) >> 8);
+		}
+	}
+}
+
+struct InputFormatInfo {
+	uint32_t format;
+	unsigned int cb;
+	unsigned int vSubSampling;
+};
+
+const InputFormatInfo inputFormats[] = {
+	{ V4L2_PIX_FMT_NV12, 0, 2 },
+	{ V4L2_PIX_FMT_NV21, 1, 2 },
+	{ V4L2_PIX_FMT_NV16, 0, 1 },
+	{ V4L2_PIX_FMT_NV61, 1, 1 },
+};
+
+struct OutputFormatInfo {
+	uint32_t format;
+	unsigned int bytesPerPixel;
+	/* Line converters indexed by the position of Cb in the input. */
+	LineConverter convert[2];
+};
+
+const OutputFormatInfo outputFormats[] = {
+	{ V4L2_PIX_FMT_YUYV, 2, { semiPlanarToPacked<0, 0, 2, 1, 3>, semiPlanarToPacked<1, 0, 2, 1, 3> } },
+	{ V4L2_PIX_FMT_UYVY, 2, { semiPlanarToPacked<0, 1, 3, 0, 2>, semiPlanarToPacked<1, 1, 3, 0, 2> } },
+	{ V4L2_PIX_FMT_YVYU, 2, { semiPlanarToPacked<0, 0, 2, 3, 1>, semiPlanarToPacked<1, 0, 2, 3, 1> } },
+	{ V4L2_PIX_FMT_VYUY, 2, { semiPlanarToPacked<0, 1, 3, 2, 0>, semiPlanarToPacked<1, 1, 3, 2, 0> } },
+	{ V4L2_PIX_FMT_RGB24, 3, { semiPlanarToRGB<0, 0, 2>, semiPlanarToRGB<1, 0, 2> } },
+	{ V4L2_PIX_FMT_BGR24, 3, { semiPlanarToRGB<0, 2, 0>, semiPlanarToRGB<1, 2, 0> } },
+};
+
+const InputFormatInfo *findInput(uint32_t format)
+{
+	for (const InputFormatInfo &info : inputFormats) {
+		if (info.format == format)
+			return &info;
+	}
+
+	return nullptr;
+}
+
+const OutputFormatInfo *findOutput(uint32_t format)
+{
+	for (const OutputFormatInfo &info : outputFormats) {
+		if (info.format == format)
+			return &info;
+	}
+
+	return nullptr;
+}
+
+} /* namespace */
+
+V4L2FormatConverter::V4L2FormatConverter()
+	: convertLine_(nullptr), vSubSampling_(1), inputStrides_{}, outputStride_(0)
+{
+}
+
+std::vector<uint32_t> V4L2FormatConverter::formats(uint32_t input)
+{
+	std::vector<uint32_t> formats;
+
+	if (!findInput(input))
+		return formats;
+
+	for (const OutputFormatInfo &info : outputFormats)
+		formats.push_back(info.format);
+
+	return formats;
+}
+
+/*
+ * The input frame is stored in a single buffer, with the chroma plane
+ * immediately following the luma plane. \a inputStrides hold the line length
+ * in bytes of the luma and chroma planes respectively, and \a outputStride the
+ * line length in bytes of the output frame.
+ */
+int V4L2FormatConverter::configure(uint32_t input, uint32_t output,
+				   const Size &size,
+				   const std::array<unsigned int, 2> &inputStrides,
+				   unsigned int outputStride)
+{
+	const InputFormatInfo *inputInfo = findInput(input);
+	const OutputFormatInfo *outputInfo = findOutput(output);
+	if (!inputInfo || !outputInfo || size.width % 2 ||
+	    size.height % inputInfo->vSubSampling)
+		return -EINVAL;
+
+	if (inputStrides[0] < size.width || inputStrides[1] < size.width ||
+	    outputStride < size.width * outputInfo->bytesPerPixel)
+		return -EINVAL;
+
+	convertLine_ = outputInfo->convert[inputInfo->cb];
+	size_ = size;
+	vSubSampling_ = inputInfo->vSubSampling;
+	inputStrides_ = inputStrides;
+	outputStride_ = outputStride;
+
+	return 0;
+}
+
+/* The frame is split in slices of lines converted in parallel by pool_. */
+void V4L2FormatConverter::convert(const uint8_t *src, uint8_t *dst)
+{
+	pool_.run(size_.height, [&](unsigned int start, unsigned int end) {
+		convertLines(src, dst, start, end);
+	});
+}
+
+void V4L2FormatConverter::convertLines(const uint8_t *src, uint8_t *dst,
+				       unsigned int start, unsigned int end)
+{
+	const uint8_t *luma = src;
+	const uint8_t *chroma = src + inputStrides_[0] * size_.height;
+
+	for (unsigned int line = start; line < end; ++line)
+		convertLine_(luma + line * inputStrides_[0],
+			     chroma + line / vSubSampling_ * inputStrides_[1],
+			     dst + line * outputStride_, size_.width);
+}
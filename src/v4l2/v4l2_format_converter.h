@@ -0,0 +1,51 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2020, Google Inc.
+ *
+ * v4l2_format_converter.h - Pixel format conversion for the V4L2 compatibility layer
+ */
+
+#ifndef __V4L2_FORMAT_CONVERTER_H__
+#define __V4L2_FORMAT_CONVERTER_H__
+
+#include <array>
+#include <stdint.h>
+#include <vector>
+
+#include <libcamera/geometry.h>
+
+#include "slice_pool.h"
+
+using namespace libcamera;
+
+class V4L2FormatConverter
+{
+public:
+	V4L2FormatConverter();
+
+	static std::vector<uint32_t> formats(uint32_t input);
+
+	int configure(uint32_t input, uint32_t output, const Size &size,
+		      const std::array<unsigned int, 2> &inputStrides,
+		      unsigned int outputStride);
+	void convert(const uint8_t *src, uint8_t *dst);
+
+private:
+	using LineConverter = void (*)(const uint8_t *y, const uint8_t *uv,
+				       uint8_t *dst, unsigned int width);
+
+	static LineConverter lineConverter(uint32_t input, uint32_t output);
+
+	void convertLines(const uint8_t *src, uint8_t *dst, unsigned int start,
+			  unsigned int end);
+
+	LineConverter convertLine_;
+	Size size_;
+	unsigned int vSubSampling_;
+	std::array<unsigned int, 2> inputStrides_;
+	unsigned int outputStride_;
+
+	SlicePool pool_;
+};
+
+#endif /* __V4L2_FORMAT_CONVERTER_H__ */
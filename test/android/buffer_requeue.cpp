@@ -0,0 +1,261 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2020, Google Inc.
+ *
+ * buffer_requeue.cpp - Android HAL buffer requeue from the result callback
+ */
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
+
+#include <libcamera/camera_manager.h>
+
+#include "camera_device.h"
+#include "fake_device_enumerator.h"
+#include "test.h"
+
+using namespace libcamera;
+using namespace std;
+
+/*
+ * The framework owns the buffers as soon as they're passed to
+ * process_capture_result(), and may queue them again in a new request before
+ * the call returns. Capture frames from an emulated camera, requeuing every
+ * buffer from within the result callback, and verify that no request is
+ * rejected and that the buffers are imported once only.
+ */
+class BufferRequeueTest : public Test
+{
+protected:
+	static constexpr unsigned int NumBuffers = 4;
+	static constexpr unsigned int NumFrames = 60;
+
+	int init() override
+	{
+		FakeDeviceEnumerator::install({ 1, 120, Size(640, 480) });
+
+		cm_ = make_unique<CameraManager>();
+		if (cm_->start()) {
+			cerr << "Failed to start camera manager" << endl;
+			return TestFail;
+		}
+
+		camera_ = cm_->get("Fake Camera 0");
+		if (!camera_) {
+			cerr << "Emulated camera not found" << endl;
+			return TestFail;
+		}
+
+		/*
+		 * Create native handles for memfd buffers large enough to
+		 * store NV12 frames, mimicking gralloc buffers.
+		 */
+		size_t frameSize = 640 * 480 * 3 / 2;
+		for (unsigned int i = 0; i < NumBuffers; ++i) {
+			int fd = memfd_create("buffer", MFD_CLOEXEC);
+			if (fd < 0 || ftruncate(fd, frameSize) < 0) {
+				cerr << "Failed to allocate buffer" << endl;
+				if (fd >= 0)
+					close(fd);
+				return TestFail;
+			}
+
+			native_handle_t *handle = static_cast<native_handle_t *>(
+				malloc(sizeof(*handle) + 3 * sizeof(int)));
+			handle->version = sizeof(*handle);
+			handle->numFds = 3;
+			handle->numInts = 0;
+			for (unsigned int j = 0; j < 3; ++j)
+				handle->data[j] = fd;
+
+			handles_.push_back(handle);
+		}
+
+		return TestPass;
+	}
+
+	static void processCaptureResult(const camera3_callback_ops_t *ops,
+					 const camera3_capture_result_t *result)
+	{
+		const Callbacks *callbacks = reinterpret_cast<const Callbacks *>(ops);
+		callbacks->test->captureResult(result);
+	}
+
+	static void notify(const camera3_callback_ops_t *,
+			   const camera3_notify_msg_t *)
+	{
+	}
+
+	int queueRequest(buffer_handle_t *handle)
+	{
+		camera3_stream_buffer_t buffer = {};
+		buffer.stream = &stream_;
+		buffer.buffer = handle;
+		buffer.acquire_fence = -1;
+		buffer.release_fence = -1;
+
+		camera3_capture_request_t request = {};
+		request.frame_number = frameNumber_++;
+		request.num_output_buffers = 1;
+		request.output_buffers = &buffer;
+
+		return device_->processCaptureRequest(&request);
+	}
+
+	/* Called in the camera manager thread. */
+	void captureResult(const camera3_capture_result_t *result)
+	{
+		for (unsigned int i = 0; i < result->num_output_buffers; ++i) {
+			const camera3_stream_buffer_t &buffer = result->output_buffers[i];
+
+			if (stopping_)
+				continue;
+
+			if (buffer.status != CAMERA3_BUFFER_STATUS_OK)
+				errors_++;
+
+			unsigned int completed = ++completed_;
+			if (completed + NumBuffers <= NumFrames &&
+			    queueRequest(buffer.buffer)) {
+				cerr << "Failed to requeue buffer" << endl;
+				errors_++;
+			}
+
+			if (completed == NumFrames) {
+				std::lock_guard<std::mutex> locker(mutex_);
+				done_.notify_one();
+			}
+		}
+	}
+
+	int run() override
+	{
+		device_ = make_unique<CameraDevice>(0, camera_);
+
+		hw_module_t module = {};
+		if (device_->open(&module)) {
+			cerr << "Failed to open camera device" << endl;
+			return TestFail;
+		}
+
+		Callbacks callbacks;
+		callbacks.ops.process_capture_result = processCaptureResult;
+		callbacks.ops.notify = notify;
+		callbacks.test = this;
+		device_->setCallbacks(&callbacks.ops);
+
+		stream_ = {};
+		stream_.stream_type = CAMERA3_STREAM_OUTPUT;
+		stream_.width = 640;
+		stream_.height = 480;
+		stream_.format = HAL_PIXEL_FORMAT_IMPLEMENTATION_DEFINED;
+
+		camera3_stream_t *streams[] = { &stream_ };
+		camera3_stream_configuration_t config = {};
+		config.num_streams = 1;
+		config.streams = streams;
+		config.operation_mode = CAMERA3_STREAM_CONFIGURATION_NORMAL_MODE;
+
+		if (device_->configureStreams(&config)) {
+			cerr << "Failed to configure streams" << endl;
+			device_->close();
+			return TestFail;
+		}
+
+		frameNumber_ = 0;
+		completed_ = 0;
+		errors_ = 0;
+		stopping_ = false;
+
+		int ret = TestPass;
+		for (buffer_handle_t &handle : handles_) {
+			if (queueRequest(&handle)) {
+				cerr << "Failed to queue request" << endl;
+				ret = TestFail;
+				break;
+			}
+		}
+
+		if (ret == TestPass) {
+			std::unique_lock<std::mutex> locker(mutex_);
+			done_.wait_for(locker, std::chrono::seconds(5), [&] {
+				return completed_ >= NumFrames;
+			});
+		}
+
+		/* The cache is cleared when closing the device. */
+		unsigned int misses = device_->bufferCacheMisses();
+
+		stopping_ = true;
+		device_->close();
+
+		if (ret != TestPass)
+			return ret;
+
+		if (completed_ < NumFrames) {
+			cerr << "Captured " << completed_ << " frames, expected "
+			     << NumFrames << endl;
+			return TestFail;
+		}
+
+		if (errors_) {
+			cerr << errors_ << " buffers failed" << endl;
+			return TestFail;
+		}
+
+		/* Every buffer shall be imported once, and reused afterwards. */
+		if (misses != NumBuffers) {
+			cerr << "Imported buffers " << misses << " times, expected "
+			     << NumBuffers << endl;
+			return TestFail;
+		}
+
+		return TestPass;
+	}
+
+	void cleanup() override
+	{
+		device_.reset();
+		camera_.reset();
+
+		if (cm_)
+			cm_->stop();
+		cm_.reset();
+
+		FakeDeviceEnumerator::uninstall();
+
+		for (buffer_handle_t handle : handles_) {
+			close(handle->data[0]);
+			free(const_cast<native_handle_t *>(handle));
+		}
+	}
+
+private:
+	struct Callbacks {
+		camera3_callback_ops_t ops;
+		BufferRequeueTest *test;
+	};
+
+	unique_ptr<CameraManager> cm_;
+	shared_ptr<Camera> camera_;
+	unique_ptr<CameraDevice> device_;
+	std::vector<buffer_handle_t> handles_;
+	camera3_stream_t stream_;
+
+	std::mutex mutex_;
+	std::condition_variable done_;
+	std::atomic<unsigned int> frameNumber_;
+	std::atomic<unsigned int> completed_;
+	std::atomic<unsigned int> errors_;
+	std::atomic<bool> stopping_;
+};
+
+TEST_REGISTER(BufferRequeueTest)
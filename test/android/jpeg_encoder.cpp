@@ -0,0 +1,185 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2020, Google Inc.
+ *
+ * jpeg_encoder.cpp - Android HAL software JPEG encoder test
+ */
+
+#include <errno.h>
+#include <iostream>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
+
+#include "jpeg_encoder.h"
+#include "test.h"
+
+using namespace libcamera;
+using namespace std;
+
+/*
+ * Memory mapped such that the end of the buffer is followed by an inaccessible
+ * page, to catch reads past the end of the image planes.
+ */
+class GuardedBuffer
+{
+public:
+	GuardedBuffer(size_t size)
+	{
+		long pageSize = sysconf(_SC_PAGESIZE);
+
+		mapSize_ = (size + pageSize - 1) / pageSize * pageSize + pageSize;
+		map_ = static_cast<uint8_t *>(mmap(nullptr, mapSize_,
+						   PROT_READ | PROT_WRITE,
+						   MAP_PRIVATE | MAP_ANONYMOUS,
+						   -1, 0));
+		if (map_ == MAP_FAILED) {
+			map_ = nullptr;
+			return;
+		}
+
+		mprotect(map_ + mapSize_ - pageSize, pageSize, PROT_NONE);
+		data_ = map_ + mapSize_ - pageSize - size;
+	}
+
+	~GuardedBuffer()
+	{
+		if (map_)
+			munmap(map_, mapSize_);
+	}
+
+	uint8_t *data() { return map_ ? data_ : nullptr; }
+
+private:
+	uint8_t *map_;
+	uint8_t *data_;
+	size_t mapSize_;
+};
+
+class JpegEncoderTest : public Test
+{
+protected:
+	int run()
+	{
+		/*
+		 * Use sizes that aren't multiples of the MCU size, with a luma
+		 * width that is or isn't a multiple of the block size.
+		 */
+		const Size sizes[] = {
+			{ 328, 250 },
+			{ 330, 246 },
+		};
+
+		for (const Size &size : sizes) {
+			int ret = testEncode(size.width, size.height);
+			if (ret != TestPass)
+				return ret;
+		}
+
+		return TestPass;
+	}
+
+	int testEncode(unsigned int width, unsigned int height)
+	{
+		/* Create an NV12 frame with gradients on all components. */
+		GuardedBuffer luma(width * height);
+		GuardedBuffer chroma(width * height / 2);
+		uint8_t *y = luma.data();
+		uint8_t *uv = chroma.data();
+		if (!y || !uv) {
+			cerr << "Failed to allocate frame" << endl;
+			return TestFail;
+		}
+
+		for (unsigned int row = 0; row < height; ++row) {
+			for (unsigned int col = 0; col < width; ++col)
+				y[row * width + col] = (row + col) & 0xff;
+		}
+
+		for (unsigned int row = 0; row < height / 2; ++row) {
+			for (unsigned int col = 0; col < width / 2; ++col) {
+				uv[row * width + col * 2] = 64 + col / 4;
+				uv[row * width + col * 2 + 1] = 192 - row / 4;
+			}
+		}
+
+		JpegEncoder encoder(Size(width, height), false);
+		vector<uint8_t> jpeg(width * height * 3);
+
+		int ret = encoder.encode(y, uv, width, jpeg.data(), jpeg.size(), 90);
+		if (ret <= 0) {
+			cerr << "Failed to encode frame: " << ret << endl;
+			return TestFail;
+		}
+
+		if (jpeg[0] != 0xff || jpeg[1] != 0xd8 ||
+		    jpeg[ret - 2] != 0xff || jpeg[ret - 1] != 0xd9) {
+			cerr << "Invalid JPEG markers" << endl;
+			return TestFail;
+		}
+
+		/* Decode the image and compare it with the source. */
+		struct jpeg_decompress_struct decompress;
+		struct jpeg_error_mgr jerr;
+		decompress.err = jpeg_std_error(&jerr);
+		jpeg_create_decompress(&decompress);
+		jpeg_mem_src(&decompress, jpeg.data(), ret);
+		jpeg_read_header(&decompress, TRUE);
+		decompress.out_color_space = JCS_YCbCr;
+		jpeg_start_decompress(&decompress);
+
+		if (decompress.output_width != width ||
+		    decompress.output_height != height) {
+			cerr << "Invalid decoded size" << endl;
+			jpeg_destroy_decompress(&decompress);
+			return TestFail;
+		}
+
+		vector<uint8_t> line(width * 3);
+		unsigned int errors = 0;
+
+		while (decompress.output_scanline < height) {
+			unsigned int row = decompress.output_scanline;
+			JSAMPROW rows[1] = { line.data() };
+			jpeg_read_scanlines(&decompress, rows, 1);
+
+			for (unsigned int col = 0; col < width; ++col) {
+				const uint8_t *yuv = &uv[(row / 2) * width + (col / 2) * 2];
+
+				if (abs(line[col * 3] - y[row * width + col]) > 12 ||
+				    abs(line[col * 3 + 1] - yuv[0]) > 12 ||
+				    abs(line[col * 3 + 2] - yuv[1]) > 12)
+					errors++;
+			}
+		}
+
+		jpeg_finish_decompress(&decompress);
+		jpeg_destroy_decompress(&decompress);
+
+		if (errors > width * height / 100) {
+			cerr << "Decoded " << width << "x" << height
+			     << " image differs from the source: "
+			     << errors << " errors" << endl;
+			return TestFail;
+		}
+
+		/* Encoding to a buffer that is too small must fail gracefully. */
+		ret = encoder.encode(y, uv, width, jpeg.data(), 1024, 90);
+		if (ret != -ENOSPC) {
+			cerr << "Overflow not detected: " << ret << endl;
+			return TestFail;
+		}
+
+		/* The encoder must be reusable after a failure. */
+		ret = encoder.encode(y, uv, width, jpeg.data(), jpeg.size(), 90);
+		if (ret <= 0) {
+			cerr << "Failed to encode frame after error" << endl;
+			return TestFail;
+		}
+
+		return TestPass;
+	}
+};
+
+TEST_REGISTER(JpegEncoderTest)
@@ -0,0 +1,255 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2020, Google Inc.
+ *
+ * metadata_lookup.cpp - Android metadata sorted lookup test
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string.h>
+#include <vector>
+
+#include "camera_metadata.h"
+#include "test.h"
+#include "utils.h"
+
+using namespace std;
+
+namespace {
+
+/* Keys looked up in the request settings for every frame. */
+const uint32_t requestKeys[] = {
+	ANDROID_COLOR_CORRECTION_MODE,
+	ANDROID_CONTROL_AE_MODE,
+	ANDROID_CONTROL_AE_TARGET_FPS_RANGE,
+	ANDROID_CONTROL_AF_MODE,
+	ANDROID_CONTROL_AF_TRIGGER,
+	ANDROID_CONTROL_AWB_MODE,
+	ANDROID_CONTROL_CAPTURE_INTENT,
+	ANDROID_CONTROL_MODE,
+	ANDROID_JPEG_ORIENTATION,
+	ANDROID_JPEG_QUALITY,
+	ANDROID_LENS_FOCUS_DISTANCE,
+	ANDROID_NOISE_REDUCTION_MODE,
+	ANDROID_SCALER_CROP_REGION,
+	ANDROID_SENSOR_EXPOSURE_TIME,
+	ANDROID_STATISTICS_FACE_DETECT_MODE,
+	ANDROID_TONEMAP_MODE,
+};
+
+/*
+ * Fill \a data with a value derived from \a tag, to verify the values returned
+ * by lookups.
+ */
+void tagValue(uint32_t tag, int type, uint8_t *data)
+{
+	switch (type) {
+	case TYPE_BYTE: {
+		uint8_t value = tag & 0xff;
+		memcpy(data, &value, sizeof(value));
+		break;
+	}
+	case TYPE_INT32: {
+		int32_t value = tag;
+		memcpy(data, &value, sizeof(value));
+		break;
+	}
+	case TYPE_FLOAT: {
+		float value = tag;
+		memcpy(data, &value, sizeof(value));
+		break;
+	}
+	case TYPE_INT64: {
+		int64_t value = tag;
+		memcpy(data, &value, sizeof(value));
+		break;
+	}
+	case TYPE_DOUBLE: {
+		double value = tag;
+		memcpy(data, &value, sizeof(value));
+		break;
+	}
+	case TYPE_RATIONAL: {
+		camera_metadata_rational_t value = { static_cast<int32_t>(tag), 1 };
+		memcpy(data, &value, sizeof(value));
+		break;
+	}
+	}
+}
+
+/*
+ * Create a large settings buffer with one entry for every tag known to the
+ * metadata library, in random order. This mirrors templates carrying many
+ * entries, as produced by vendor-heavy camera stacks.
+ */
+camera_metadata_t *createSettings()
+{
+	vector<uint32_t> tags;
+	for (uint32_t section = 0; section < ANDROID_SECTION_COUNT; ++section) {
+		for (uint32_t tag = section << 16;
+		     get_camera_metadata_tag_type(tag) != -1; ++tag)
+			tags.push_back(tag);
+	}
+
+	shuffle(tags.begin(), tags.end(), mt19937(0x5eed));
+
+	camera_metadata_t *settings =
+		allocate_camera_metadata(tags.size(), tags.size() * 8);
+	if (!settings)
+		return nullptr;
+
+	for (uint32_t tag : tags) {
+		uint8_t data[8];
+		tagValue(tag, get_camera_metadata_tag_type(tag), data);
+
+		if (add_camera_metadata_entry(settings, tag, data, 1)) {
+			free_camera_metadata(settings);
+			return nullptr;
+		}
+	}
+
+	return settings;
+}
+
+} /* namespace */
+
+class MetadataLookupTest : public Test
+{
+protected:
+	int init()
+	{
+		settings_ = createSettings();
+		if (!settings_) {
+			cerr << "Failed to create the request settings" << endl;
+			return TestFail;
+		}
+
+		return TestPass;
+	}
+
+	int run()
+	{
+		static constexpr unsigned int iterations = 10000;
+
+		/* The copy must return the same entries as the original. */
+		CameraMetadata settings(settings_);
+		if (!settings.isValid()) {
+			cerr << "Failed to copy the request settings" << endl;
+			return TestFail;
+		}
+
+		for (uint32_t tag : requestKeys) {
+			camera_metadata_ro_entry_t expected;
+			camera_metadata_ro_entry_t entry;
+
+			if (find_camera_metadata_ro_entry(settings_, tag, &expected) ||
+			    !settings.getEntry(tag, &entry) ||
+			    entry.type != expected.type ||
+			    entry.count != expected.count ||
+			    memcmp(entry.data.u8, expected.data.u8,
+				   camera_metadata_type_size[entry.type])) {
+				cerr << "Invalid entry for "
+				     << get_camera_metadata_tag_name(tag) << endl;
+				return TestFail;
+			}
+		}
+
+		/* Test the typed getters. */
+		uint8_t quality;
+		int32_t crop;
+		float focusDistance;
+		int64_t exposureTime;
+
+		if (!settings.getValue(ANDROID_JPEG_QUALITY, &quality) ||
+		    quality != (ANDROID_JPEG_QUALITY & 0xff) ||
+		    !settings.getValue(ANDROID_SCALER_CROP_REGION, &crop) ||
+		    crop != ANDROID_SCALER_CROP_REGION ||
+		    !settings.getValue(ANDROID_LENS_FOCUS_DISTANCE, &focusDistance) ||
+		    focusDistance != static_cast<float>(ANDROID_LENS_FOCUS_DISTANCE) ||
+		    !settings.getValue(ANDROID_SENSOR_EXPOSURE_TIME, &exposureTime) ||
+		    exposureTime != ANDROID_SENSOR_EXPOSURE_TIME) {
+			cerr << "Invalid typed value" << endl;
+			return TestFail;
+		}
+
+		if (settings.getValue(ANDROID_JPEG_QUALITY, &crop)) {
+			cerr << "Value retrieved with the wrong type" << endl;
+			return TestFail;
+		}
+
+		/* Entries added after a lookup must be found too. */
+		CameraMetadata metadata(4, 16);
+		const uint8_t jpegQuality = 90;
+		const int32_t orientation = 180;
+		metadata.addEntry(ANDROID_JPEG_QUALITY, &jpegQuality, 1);
+		if (!metadata.getValue(ANDROID_JPEG_QUALITY, &quality) ||
+		    metadata.getValue(ANDROID_JPEG_ORIENTATION, &crop)) {
+			cerr << "Invalid lookup in new metadata" << endl;
+			return TestFail;
+		}
+
+		metadata.addEntry(ANDROID_JPEG_ORIENTATION, &orientation, 1);
+		if (!metadata.getValue(ANDROID_JPEG_ORIENTATION, &crop) ||
+		    crop != orientation ||
+		    !metadata.getValue(ANDROID_JPEG_QUALITY, &quality) ||
+		    quality != jpegQuality) {
+			cerr << "Invalid lookup after adding an entry" << endl;
+			return TestFail;
+		}
+
+		/* Compare lookups in the unsorted and sorted buffers. */
+		unsigned int found = 0;
+		auto start = chrono::steady_clock::now();
+
+		for (unsigned int i = 0; i < iterations; ++i) {
+			for (uint32_t tag : requestKeys) {
+				camera_metadata_ro_entry_t entry;
+				if (!find_camera_metadata_ro_entry(settings_, tag, &entry))
+					found++;
+			}
+		}
+
+		chrono::duration<double, nano> linear =
+			chrono::steady_clock::now() - start;
+
+		start = chrono::steady_clock::now();
+
+		for (unsigned int i = 0; i < iterations; ++i) {
+			for (uint32_t tag : requestKeys) {
+				camera_metadata_ro_entry_t entry;
+				if (settings.getEntry(tag, &entry))
+					found--;
+			}
+		}
+
+		chrono::duration<double, nano> sorted =
+			chrono::steady_clock::now() - start;
+
+		if (found) {
+			cerr << "Lookup results differ" << endl;
+			return TestFail;
+		}
+
+		unsigned int lookups = iterations * ARRAY_SIZE(requestKeys);
+		cout << "Metadata lookup in "
+		     << get_camera_metadata_entry_count(settings_) << " entries: "
+		     << linear.count() / lookups << "ns linear, "
+		     << sorted.count() / lookups << "ns sorted" << endl;
+
+		return TestPass;
+	}
+
+	void cleanup()
+	{
+		if (settings_)
+			free_camera_metadata(settings_);
+	}
+
+private:
+	camera_metadata_t *settings_;
+};
+
+TEST_REGISTER(MetadataLookupTest)
@@ -0,0 +1,340 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2020, Google Inc.
+ *
+ * result_metadata.cpp - Android HAL result metadata recycling test
+ */
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
+
+#include <libcamera/camera_manager.h>
+
+#include "camera_device.h"
+#include "camera_metadata.h"
+#include "fake_device_enumerator.h"
+#include "test.h"
+
+using namespace libcamera;
+using namespace std;
+
+/*
+ * The HAL produces the result metadata of every frame by updating buffers
+ * recycled across requests. Capture frames from an emulated camera, and verify
+ * that once the pipeline is primed, the partial and final results are always
+ * delivered in the same metadata buffers without any new buffer being
+ * allocated, and that the partial results carry the timestamp reported by the
+ * shutter notification of their frame.
+ */
+class ResultMetadataTest : public Test
+{
+protected:
+	static constexpr unsigned int NumBuffers = 4;
+	static constexpr unsigned int NumFrames = 60;
+	/* Frames completed before the result metadata buffers are recycled. */
+	static constexpr unsigned int WarmupFrames = NumBuffers;
+
+	int init() override
+	{
+		FakeDeviceEnumerator::install({ 1, 120, Size(640, 480) });
+
+		cm_ = make_unique<CameraManager>();
+		if (cm_->start()) {
+			cerr << "Failed to start camera manager" << endl;
+			return TestFail;
+		}
+
+		camera_ = cm_->get("Fake Camera 0");
+		if (!camera_) {
+			cerr << "Emulated camera not found" << endl;
+			return TestFail;
+		}
+
+		/*
+		 * Create native handles for memfd buffers large enough to
+		 * store NV12 frames, mimicking gralloc buffers.
+		 */
+		size_t frameSize = 640 * 480 * 3 / 2;
+		for (unsigned int i = 0; i < NumBuffers; ++i) {
+			int fd = memfd_create("buffer", MFD_CLOEXEC);
+			if (fd < 0 || ftruncate(fd, frameSize) < 0) {
+				cerr << "Failed to allocate buffer" << endl;
+				if (fd >= 0)
+					close(fd);
+				return TestFail;
+			}
+
+			native_handle_t *handle = static_cast<native_handle_t *>(
+				malloc(sizeof(*handle) + 3 * sizeof(int)));
+			handle->version = sizeof(*handle);
+			handle->numFds = 3;
+			handle->numInts = 0;
+			for (unsigned int j = 0; j < 3; ++j)
+				handle->data[j] = fd;
+
+			handles_.push_back(handle);
+		}
+
+		return TestPass;
+	}
+
+	static void processCaptureResult(const camera3_callback_ops_t *ops,
+					 const camera3_capture_result_t *result)
+	{
+		const Callbacks *callbacks = reinterpret_cast<const Callbacks *>(ops);
+		callbacks->test->captureResult(result);
+	}
+
+	static void notify(const camera3_callback_ops_t *ops,
+			   const camera3_notify_msg_t *msg)
+	{
+		const Callbacks *callbacks = reinterpret_cast<const Callbacks *>(ops);
+		callbacks->test->shutter(msg);
+	}
+
+	int queueRequest(buffer_handle_t *handle)
+	{
+		camera3_stream_buffer_t buffer = {};
+		buffer.stream = &stream_;
+		buffer.buffer = handle;
+		buffer.acquire_fence = -1;
+		buffer.release_fence = -1;
+
+		camera3_capture_request_t request = {};
+		request.frame_number = frameNumber_++;
+		request.num_output_buffers = 1;
+		request.output_buffers = &buffer;
+
+		return device_->processCaptureRequest(&request);
+	}
+
+	/* Called in the camera manager thread. */
+	void shutter(const camera3_notify_msg_t *msg)
+	{
+		if (msg->type != CAMERA3_MSG_SHUTTER) {
+			errors_++;
+			return;
+		}
+
+		std::lock_guard<std::mutex> locker(mutex_);
+		timestamps_[msg->message.shutter.frame_number] =
+			msg->message.shutter.timestamp;
+	}
+
+	/*
+	 * Check that the result metadata is delivered in a buffer produced
+	 * during warm-up, recording it otherwise.
+	 */
+	void checkMetadata(const camera3_capture_result_t *result,
+			   std::set<const camera_metadata_t *> *buffers)
+	{
+		std::lock_guard<std::mutex> locker(mutex_);
+
+		if (completed_ < WarmupFrames) {
+			buffers->insert(result->result);
+			return;
+		}
+
+		if (!buffers->count(result->result)) {
+			cerr << "Frame " << result->frame_number
+			     << ": result metadata not recycled" << endl;
+			errors_++;
+		}
+	}
+
+	/* Called in the camera manager thread. */
+	void captureResult(const camera3_capture_result_t *result)
+	{
+		if (stopping_)
+			return;
+
+		if (result->result && result->partial_result == 1) {
+			checkMetadata(result, &partialBuffers_);
+
+			camera_metadata_ro_entry_t entry;
+			int ret = find_camera_metadata_ro_entry(result->result,
+								ANDROID_SENSOR_TIMESTAMP,
+								&entry);
+
+			std::lock_guard<std::mutex> locker(mutex_);
+			if (ret || entry.data.i64[0] !=
+				   static_cast<int64_t>(timestamps_[result->frame_number])) {
+				cerr << "Frame " << result->frame_number
+				     << ": invalid partial result timestamp" << endl;
+				errors_++;
+			}
+		} else if (result->result) {
+			checkMetadata(result, &finalBuffers_);
+		}
+
+		for (unsigned int i = 0; i < result->num_output_buffers; ++i) {
+			const camera3_stream_buffer_t &buffer = result->output_buffers[i];
+
+			if (buffer.status != CAMERA3_BUFFER_STATUS_OK)
+				errors_++;
+
+			unsigned int queued = frameNumber_;
+			if (queued < NumFrames && queueRequest(buffer.buffer)) {
+				cerr << "Failed to requeue buffer" << endl;
+				errors_++;
+			}
+		}
+
+		/* The final result is the last one of each frame. */
+		if (result->result && result->partial_result != 1) {
+			std::lock_guard<std::mutex> locker(mutex_);
+			if (++completed_ == WarmupFrames)
+				warmupAllocations_ = device_->resultMetadataAllocations();
+			if (completed_ == NumFrames)
+				done_.notify_one();
+		}
+	}
+
+	int run() override
+	{
+		device_ = make_unique<CameraDevice>(0, camera_);
+
+		hw_module_t module = {};
+		if (device_->open(&module)) {
+			cerr << "Failed to open camera device" << endl;
+			return TestFail;
+		}
+
+		Callbacks callbacks;
+		callbacks.ops.process_capture_result = processCaptureResult;
+		callbacks.ops.notify = notify;
+		callbacks.test = this;
+		device_->setCallbacks(&callbacks.ops);
+
+		stream_ = {};
+		stream_.stream_type = CAMERA3_STREAM_OUTPUT;
+		stream_.width = 640;
+		stream_.height = 480;
+		stream_.format = HAL_PIXEL_FORMAT_IMPLEMENTATION_DEFINED;
+
+		camera3_stream_t *streams[] = { &stream_ };
+		camera3_stream_configuration_t config = {};
+		config.num_streams = 1;
+		config.streams = streams;
+		config.operation_mode = CAMERA3_STREAM_CONFIGURATION_NORMAL_MODE;
+
+		if (device_->configureStreams(&config)) {
+			cerr << "Failed to configure streams" << endl;
+			device_->close();
+			return TestFail;
+		}
+
+		frameNumber_ = 0;
+		completed_ = 0;
+		warmupAllocations_ = 0;
+		errors_ = 0;
+		stopping_ = false;
+
+		int ret = TestPass;
+		for (buffer_handle_t &handle : handles_) {
+			if (queueRequest(&handle)) {
+				cerr << "Failed to queue request" << endl;
+				ret = TestFail;
+				break;
+			}
+		}
+
+		if (ret == TestPass) {
+			std::unique_lock<std::mutex> locker(mutex_);
+			done_.wait_for(locker, std::chrono::seconds(5), [&] {
+				return completed_ >= NumFrames;
+			});
+		}
+
+		stopping_ = true;
+		device_->close();
+
+		if (ret != TestPass)
+			return ret;
+
+		if (completed_ < NumFrames) {
+			cerr << "Completed " << completed_ << " frames, expected "
+			     << NumFrames << endl;
+			return TestFail;
+		}
+
+		if (errors_) {
+			cerr << errors_ << " errors" << endl;
+			return TestFail;
+		}
+
+		/*
+		 * Results are sent synchronously from the camera manager
+		 * thread, and their metadata buffers recycled when the callback
+		 * returns, so a single buffer of each kind shall be allocated.
+		 */
+		if (partialBuffers_.size() != 1 || finalBuffers_.size() != 1) {
+			cerr << "Allocated " << partialBuffers_.size()
+			     << " partial and " << finalBuffers_.size()
+			     << " final result metadata buffers" << endl;
+			return TestFail;
+		}
+
+		if (device_->resultMetadataAllocations() != warmupAllocations_) {
+			cerr << "Allocated "
+			     << device_->resultMetadataAllocations() - warmupAllocations_
+			     << " result metadata buffers after warm-up" << endl;
+			return TestFail;
+		}
+
+		return TestPass;
+	}
+
+	void cleanup() override
+	{
+		device_.reset();
+		camera_.reset();
+
+		if (cm_)
+			cm_->stop();
+		cm_.reset();
+
+		FakeDeviceEnumerator::uninstall();
+
+		for (buffer_handle_t handle : handles_) {
+			close(handle->data[0]);
+			free(const_cast<native_handle_t *>(handle));
+		}
+	}
+
+private:
+	struct Callbacks {
+		camera3_callback_ops_t ops;
+		ResultMetadataTest *test;
+	};
+
+	unique_ptr<CameraManager> cm_;
+	shared_ptr<Camera> camera_;
+	unique_ptr<CameraDevice> device_;
+	std::vector<buffer_handle_t> handles_;
+	camera3_stream_t stream_;
+
+	std::mutex mutex_;
+	std::condition_variable done_;
+	std::map<uint32_t, uint64_t> timestamps_;
+	std::set<const camera_metadata_t *> partialBuffers_;
+	std::set<const camera_metadata_t *> finalBuffers_;
+	unsigned int completed_;
+	unsigned int warmupAllocations_;
+
+	std::atomic<unsigned int> frameNumber_;
+	std::atomic<unsigned int> errors_;
+	std::atomic<bool> stopping_;
+};
+
+TEST_REGISTER(ResultMetadataTest)
@@ -0,0 +1,107 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2020, Google Inc.
+ *
+ * static_metadata.cpp - Android static metadata construction test
+ */
+
+#include <iostream>
+#include <memory>
+
+#include <libcamera/camera_manager.h>
+
+#include "camera_device.h"
+#include "fake_device_enumerator.h"
+#include "test.h"
+
+using namespace libcamera;
+using namespace std;
+
+/*
+ * Construct the static metadata of a camera emulated in user space, and
+ * verify that the pack holds every entry added by the HAL. The static pack is
+ * allocated with a fixed capacity, an entry that doesn't fit invalidates it.
+ */
+class StaticMetadataTest : public Test
+{
+protected:
+	int init() override
+	{
+		FakeDeviceEnumerator::install({ 1, 30, Size(640, 480) });
+
+		cm_ = make_unique<CameraManager>();
+		if (cm_->start()) {
+			cerr << "Failed to start camera manager" << endl;
+			return TestFail;
+		}
+
+		camera_ = cm_->get("Fake Camera 0");
+		if (!camera_) {
+			cerr << "Emulated camera not found" << endl;
+			return TestFail;
+		}
+
+		return TestPass;
+	}
+
+	int run() override
+	{
+		CameraDevice device(0, camera_);
+
+		const camera_metadata_t *metadata = device.getStaticMetadata();
+		if (!metadata) {
+			cerr << "Failed to construct static metadata" << endl;
+			return TestFail;
+		}
+
+		size_t entries = get_camera_metadata_entry_count(metadata);
+		size_t data = get_camera_metadata_data_count(metadata);
+		cout << "Static metadata: " << entries << " entries, "
+		     << data << " bytes" << endl;
+
+		/* Every characteristics key advertised shall be present. */
+		camera_metadata_ro_entry_t keys;
+		if (find_camera_metadata_ro_entry(metadata,
+						  ANDROID_REQUEST_AVAILABLE_CHARACTERISTICS_KEYS,
+						  &keys)) {
+			cerr << "Characteristics keys not reported" << endl;
+			return TestFail;
+		}
+
+		for (size_t i = 0; i < keys.count; ++i) {
+			camera_metadata_ro_entry_t entry;
+			if (find_camera_metadata_ro_entry(metadata, keys.data.i32[i],
+							  &entry)) {
+				cerr << "Missing static metadata entry "
+				     << get_camera_metadata_tag_name(keys.data.i32[i])
+				     << endl;
+				return TestFail;
+			}
+		}
+
+		/* The pack shall be constructed once only. */
+		if (device.getStaticMetadata() != metadata) {
+			cerr << "Static metadata constructed twice" << endl;
+			return TestFail;
+		}
+
+		return TestPass;
+	}
+
+	void cleanup() override
+	{
+		camera_.reset();
+
+		if (cm_)
+			cm_->stop();
+		cm_.reset();
+
+		FakeDeviceEnumerator::uninstall();
+	}
+
+private:
+	unique_ptr<CameraManager> cm_;
+	shared_ptr<Camera> camera_;
+};
+
+TEST_REGISTER(StaticMetadataTest)
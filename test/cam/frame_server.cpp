@@ -0,0 +1,285 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2020, Google Inc.
+ *
+ * frame_server.cpp - cam frame server test
+ */
+
+#include <fcntl.h>
+#include <iostream>
+#include <memory>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
+
+#include <libcamera/buffer.h>
+#include <libcamera/event_dispatcher.h>
+#include <libcamera/file_descriptor.h>
+#include <libcamera/stream.h>
+
+#include "frame_server.h"
+#include "frame_server_protocol.h"
+#include "test.h"
+#include "thread.h"
+
+using namespace libcamera;
+using namespace std;
+
+class FrameServerTest : public Test
+{
+protected:
+	int init()
+	{
+		path_ = "/tmp/libcamera-test-frame-server-" + to_string(getpid());
+		consumer_ = -1;
+
+		for (unsigned int i = 0; i < 2; ++i) {
+			int fd = open("/tmp", O_TMPFILE | O_RDWR, S_IRUSR | S_IWUSR);
+			if (fd < 0)
+				return TestFail;
+
+			struct stat s;
+			fstat(fd, &s);
+			inodes_.push_back(s.st_ino);
+
+			FrameBuffer::Plane plane;
+			plane.fd = FileDescriptor(fd);
+			plane.length = 4096;
+			close(fd);
+
+			buffers_.emplace_back(new FrameBuffer({ plane }));
+		}
+
+		return TestPass;
+	}
+
+	int run()
+	{
+		EventDispatcher *dispatcher = Thread::current()->eventDispatcher();
+		FrameServer::Options options;
+		options.credits = 1;
+
+		FrameServer server(path_, options);
+		server.bufferReleased.connect(this, &FrameServerTest::bufferReleased);
+
+		StreamConfiguration cfg;
+		cfg.pixelFormat = 0x56595559;
+		cfg.size = { 640, 480 };
+		server.addStream(&stream_, "stream0", cfg);
+
+		for (const unique_ptr<FrameBuffer> &buffer : buffers_)
+			server.addBuffer(buffer.get(), &stream_);
+
+		if (server.start()) {
+			cerr << "Failed to start the frame server" << endl;
+			return TestFail;
+		}
+
+		/* Frames published without consumer are released immediately. */
+		server.publish(buffers_[0].get());
+		if (released_.size() != 1 || released_[0] != buffers_[0].get()) {
+			cerr << "Unconsumed frame not released" << endl;
+			return TestFail;
+		}
+		released_.clear();
+
+		/* Connect a consumer and check the stream information. */
+		if (connectConsumer(1) != TestPass)
+			return TestFail;
+
+		/* The first frame is sent along with its dmabuf. */
+		server.publish(buffers_[0].get());
+		if (!released_.empty() || receiveFrame(0) != TestPass)
+			return TestFail;
+
+		/* The consumer has no credit left, the second frame is skipped. */
+		server.publish(buffers_[1].get());
+		if (released_.size() != 1 || released_[0] != buffers_[1].get()) {
+			cerr << "Skipped frame not released" << endl;
+			return TestFail;
+		}
+		released_.clear();
+
+		/* Releasing the first frame returns the buffer and the credit. */
+		FrameServerReleaseMessage release = {};
+		release.type = FrameServerRelease;
+		release.cookie = 0;
+		send(consumer_, &release, sizeof(release), 0);
+
+		dispatcher->processEvents();
+
+		if (released_.size() != 1 || released_[0] != buffers_[0].get()) {
+			cerr << "Consumed frame not released" << endl;
+			return TestFail;
+		}
+		released_.clear();
+
+		server.publish(buffers_[1].get());
+		if (!released_.empty() || receiveFrame(1) != TestPass)
+			return TestFail;
+
+		/* Disconnecting returns the frames held by the consumer. */
+		close(consumer_);
+		consumer_ = -1;
+
+		dispatcher->processEvents();
+
+		if (released_.size() != 1 || released_[0] != buffers_[1].get()) {
+			cerr << "Frame not released on disconnection" << endl;
+			return TestFail;
+		}
+		released_.clear();
+
+		server.stop();
+
+		return testBufferCap();
+	}
+
+	/*
+	 * A consumer with as many credits as buffers must not hold all of
+	 * them, or capture would stall.
+	 */
+	int testBufferCap()
+	{
+		FrameServer::Options options;
+		options.credits = buffers_.size();
+
+		FrameServer server(path_, options);
+		server.bufferReleased.connect(this, &FrameServerTest::bufferReleased);
+
+		StreamConfiguration cfg;
+		cfg.pixelFormat = 0x56595559;
+		cfg.size = { 640, 480 };
+		server.addStream(&stream_, "stream0", cfg);
+
+		for (const unique_ptr<FrameBuffer> &buffer : buffers_)
+			server.addBuffer(buffer.get(), &stream_);
+
+		if (server.start()) {
+			cerr << "Failed to start the frame server" << endl;
+			return TestFail;
+		}
+
+		if (connectConsumer(buffers_.size()) != TestPass)
+			return TestFail;
+
+		server.publish(buffers_[0].get());
+		if (!released_.empty() || receiveFrame(0) != TestPass)
+			return TestFail;
+
+		/* The last buffer stays with the camera despite the credit. */
+		server.publish(buffers_[1].get());
+		if (released_.size() != 1 || released_[0] != buffers_[1].get()) {
+			cerr << "Last buffer held by the consumer" << endl;
+			return TestFail;
+		}
+		released_.clear();
+
+		close(consumer_);
+		consumer_ = -1;
+
+		Thread::current()->eventDispatcher()->processEvents();
+
+		if (released_.size() != 1 || released_[0] != buffers_[0].get()) {
+			cerr << "Frame not released on disconnection" << endl;
+			return TestFail;
+		}
+		released_.clear();
+
+		server.stop();
+
+		return TestPass;
+	}
+
+	void cleanup()
+	{
+		if (consumer_ != -1)
+			close(consumer_);
+
+		unlink(path_.c_str());
+	}
+
+private:
+	int connectConsumer(unsigned int credits)
+	{
+		consumer_ = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+		struct sockaddr_un addr = {};
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, path_.c_str(), sizeof(addr.sun_path) - 1);
+		if (connect(consumer_, reinterpret_cast<struct sockaddr *>(&addr),
+			    sizeof(addr)) < 0) {
+			cerr << "Failed to connect to the frame server" << endl;
+			return TestFail;
+		}
+
+		Thread::current()->eventDispatcher()->processEvents();
+
+		FrameServerStreamInfoMessage info;
+		if (recv(consumer_, &info, sizeof(info), 0) != sizeof(info) ||
+		    info.type != FrameServerStreamInfo || info.width != 640 ||
+		    info.height != 480 || info.credits != credits ||
+		    strcmp(info.name, "stream0")) {
+			cerr << "Invalid stream information" << endl;
+			return TestFail;
+		}
+
+		return TestPass;
+	}
+
+	int receiveFrame(unsigned int index)
+	{
+		FrameServerFrameMessage msg;
+		char control[CMSG_SPACE(sizeof(int))] = {};
+		struct iovec iov = { &msg, sizeof(msg) };
+		struct msghdr hdr = {};
+		hdr.msg_iov = &iov;
+		hdr.msg_iovlen = 1;
+		hdr.msg_control = control;
+		hdr.msg_controllen = sizeof(control);
+
+		if (recvmsg(consumer_, &hdr, MSG_DONTWAIT) != sizeof(msg) ||
+		    msg.type != FrameServerFrame || msg.cookie != index ||
+		    msg.numPlanes != 1 || msg.planes[0].length != 4096) {
+			cerr << "Invalid frame message" << endl;
+			return TestFail;
+		}
+
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+		if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS) {
+			cerr << "Frame received without dmabuf" << endl;
+			return TestFail;
+		}
+
+		int fd;
+		memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+
+		struct stat s;
+		fstat(fd, &s);
+		close(fd);
+
+		if (s.st_ino != inodes_[index]) {
+			cerr << "Frame received with the wrong dmabuf" << endl;
+			return TestFail;
+		}
+
+		return TestPass;
+	}
+
+	void bufferReleased(FrameBuffer *buffer)
+	{
+		released_.push_back(buffer);
+	}
+
+	string path_;
+	int consumer_;
+
+	Stream stream_;
+	vector<unique_ptr<FrameBuffer>> buffers_;
+	vector<ino_t> inodes_;
+	vector<FrameBuffer *> released_;
+};
+
+TEST_REGISTER(FrameServerTest)
@@ -0,0 +1,123 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2020, Google Inc.
+ *
+ * device-cache.cpp - Device cache test
+ */
+
+#include <fcntl.h>
+#include <iostream>
+#include <stdlib.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "device_cache.h"
+
+#include "test.h"
+
+using namespace std;
+using namespace libcamera;
+
+class DeviceCacheTest : public Test
+{
+protected:
+	int init()
+	{
+		char tmpl[] = "/tmp/libcamera.test.XXXXXX";
+		if (!mkdtemp(tmpl)) {
+			cerr << "Failed to create temporary directory" << endl;
+			return TestFail;
+		}
+
+		directory_ = tmpl;
+		return TestPass;
+	}
+
+	int run()
+	{
+		/* The cache directory is created on demand. */
+		DeviceCache cache(directory_ + "/cache");
+		const string key = "driver:model:bus:1:2:3:" + DeviceCache::kernelRelease();
+		const vector<uint8_t> data = { 1, 2, 3, 4, 5, 6, 7, 8, 9 };
+		vector<uint8_t> loaded;
+
+		if (cache.load("topology/dev/media0", key, &loaded)) {
+			cerr << "Missing entry loaded" << endl;
+			return TestFail;
+		}
+
+		if (cache.store("topology/dev/media0", key, data)) {
+			cerr << "Failed to store entry" << endl;
+			return TestFail;
+		}
+
+		if (!cache.load("topology/dev/media0", key, &loaded) ||
+		    loaded != data) {
+			cerr << "Failed to load entry" << endl;
+			return TestFail;
+		}
+
+		/* Entries with a different key are stale. */
+		if (cache.load("topology/dev/media0", key + "-1", &loaded)) {
+			cerr << "Stale entry loaded" << endl;
+			return TestFail;
+		}
+
+		/* Corrupted and truncated entries must be ignored. */
+		const string file = directory_ + "/cache/topology_dev_media0";
+		struct stat st;
+		if (stat(file.c_str(), &st)) {
+			cerr << "Entry not found in " << file << endl;
+			return TestFail;
+		}
+
+		int fd = open(file.c_str(), O_WRONLY);
+		if (fd < 0 || pwrite(fd, "X", 1, st.st_size - 1) != 1) {
+			cerr << "Failed to corrupt entry" << endl;
+			return TestFail;
+		}
+
+		if (cache.load("topology/dev/media0", key, &loaded)) {
+			cerr << "Corrupted entry loaded" << endl;
+			close(fd);
+			return TestFail;
+		}
+
+		if (ftruncate(fd, st.st_size - 2)) {
+			cerr << "Failed to truncate entry" << endl;
+			close(fd);
+			return TestFail;
+		}
+
+		close(fd);
+
+		if (cache.load("topology/dev/media0", key, &loaded)) {
+			cerr << "Truncated entry loaded" << endl;
+			return TestFail;
+		}
+
+		/* Entries are replaced when stored again. */
+		if (cache.store("topology/dev/media0", key, data) ||
+		    !cache.load("topology/dev/media0", key, &loaded) ||
+		    loaded != data) {
+			cerr << "Failed to replace entry" << endl;
+			return TestFail;
+		}
+
+		return TestPass;
+	}
+
+	void cleanup()
+	{
+		unlink((directory_ + "/cache/topology_dev_media0").c_str());
+		rmdir((directory_ + "/cache").c_str());
+		rmdir(directory_.c_str());
+	}
+
+private:
+	string directory_;
+};
+
+TEST_REGISTER(DeviceCacheTest)
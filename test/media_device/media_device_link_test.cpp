@@ -105,6 +105,32 @@ class MediaDeviceLinkTest : public MediaDeviceTest
 			return TestFail;
 		}
 
+		/* All links of the graph shall be found by their pads. */
+		for (MediaEntity *entity : media_->entities()) {
+			if (media_->getEntityByName(entity->name()) != entity) {
+				cerr << "Lookup of entity " << entity->name()
+				     << " by name failed" << endl;
+				return TestFail;
+			}
+
+			for (MediaPad *pad : entity->pads()) {
+				for (MediaLink *l : pad->links()) {
+					if (media_->link(l->source(), l->sink()) != l) {
+						cerr << "Lookup of link from pad "
+						     << l->source()->id() << " to pad "
+						     << l->sink()->id() << " failed"
+						     << endl;
+						return TestFail;
+					}
+				}
+			}
+		}
+
+		if (media_->link(sink->getPadByIndex(0), source->getPadByIndex(1))) {
+			cerr << "Link found with swapped pads" << endl;
+			return TestFail;
+		}
+
 		/* After reset the link shall not be enabled. */
 		if (link->flags() & MEDIA_LNK_FL_ENABLED) {
 			cerr << "Link " << linkName
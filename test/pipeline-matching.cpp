@@ -0,0 +1,145 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2020, Google Inc.
+ *
+ * pipeline-matching.cpp - Media device enumeration and pipeline matching test
+ */
+
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "device_enumerator.h"
+#include "media_device.h"
+#include "pipeline_handler.h"
+
+#include "test.h"
+
+using namespace std;
+using namespace libcamera;
+
+/*
+ * A device enumerator that simulates the latency of opening media devices
+ * and retrieving their topology, without accessing any kernel device.
+ */
+class FakeEnumerator : public DeviceEnumerator
+{
+public:
+	FakeEnumerator(unsigned int count, bool parallel)
+		: count_(count), parallel_(parallel)
+	{
+	}
+
+	int init() override
+	{
+		return 0;
+	}
+
+	int enumerate() override
+	{
+		vector<string> deviceNodes;
+		for (unsigned int i = 0; i < count_; ++i)
+			deviceNodes.push_back("/dev/fake-media" + to_string(i));
+
+		vector<shared_ptr<MediaDevice>> devices;
+		if (parallel_) {
+			devices = createDevices(deviceNodes);
+		} else {
+			for (const string &deviceNode : deviceNodes)
+				devices.push_back(createDevice(deviceNode));
+		}
+
+		for (unsigned int i = 0; i < devices.size(); ++i) {
+			if (!devices[i] ||
+			    devices[i]->deviceNode() != deviceNodes[i])
+				return -ENODEV;
+
+			addDevice(devices[i]);
+		}
+
+		return 0;
+	}
+
+protected:
+	shared_ptr<MediaDevice> createDevice(const string &deviceNode) override
+	{
+		this_thread::sleep_for(chrono::milliseconds(2));
+		return make_shared<MediaDevice>(deviceNode);
+	}
+
+private:
+	unsigned int count_;
+	bool parallel_;
+};
+
+class PipelineMatchingTest : public Test
+{
+protected:
+	int run()
+	{
+		static constexpr unsigned int numDevices = 32;
+
+		/* Compare serial and parallel media device creation. */
+		FakeEnumerator serial(numDevices, false);
+		auto start = chrono::steady_clock::now();
+
+		if (serial.enumerate()) {
+			cerr << "Serial enumeration failed" << endl;
+			return TestFail;
+		}
+
+		chrono::duration<double, milli> serialTime =
+			chrono::steady_clock::now() - start;
+
+		FakeEnumerator parallel(numDevices, true);
+		start = chrono::steady_clock::now();
+
+		if (parallel.enumerate()) {
+			cerr << "Parallel enumeration failed" << endl;
+			return TestFail;
+		}
+
+		chrono::duration<double, milli> parallelTime =
+			chrono::steady_clock::now() - start;
+
+		/*
+		 * None of the fake devices is backed by a driver, all pipeline
+		 * handlers must be skipped without being matched.
+		 */
+		unsigned int candidates = 0;
+		start = chrono::steady_clock::now();
+
+		for (PipelineHandlerFactory *factory : PipelineHandlerFactory::factories()) {
+			if (factory->drivers().empty()) {
+				cerr << "Pipeline handler " << factory->name()
+				     << " doesn't list its drivers" << endl;
+				return TestFail;
+			}
+
+			if (factory->canMatch(&parallel))
+				candidates++;
+		}
+
+		chrono::duration<double, micro> matchTime =
+			chrono::steady_clock::now() - start;
+
+		if (candidates) {
+			cerr << candidates << " pipeline handlers not skipped" << endl;
+			return TestFail;
+		}
+
+		cout << "Enumerated " << numDevices << " devices in "
+		     << serialTime.count() << "ms serially, "
+		     << parallelTime.count() << "ms in parallel, skipped "
+		     << PipelineHandlerFactory::factories().size()
+		     << " pipeline handlers in " << matchTime.count() << "us"
+		     << endl;
+
+		return TestPass;
+	}
+};
+
+TEST_REGISTER(PipelineMatchingTest)
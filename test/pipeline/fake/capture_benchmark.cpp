@@ -0,0 +1,252 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2020, Google Inc.
+ *
+ * capture_benchmark.cpp - Request throughput and latency on emulated devices
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <map>
+#include <sys/mman.h>
+#include <time.h>
+#include <vector>
+
+#include <libcamera/libcamera.h>
+
+#include "fake_device_enumerator.h"
+#include "fake_video_device.h"
+#include "test.h"
+
+using namespace libcamera;
+using namespace std;
+
+namespace {
+
+uint64_t monotonicTime()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+} /* namespace */
+
+/*
+ * Capture frames from an emulated camera at a high frame rate, and measure
+ * the request throughput and the latency between the frame capture by the
+ * emulated device and the request completion. As no kernel driver is
+ * involved, the measurements reflect the overhead of libcamera itself.
+ */
+class CaptureBenchmark : public Test
+{
+public:
+	CaptureBenchmark()
+		: cm_(nullptr), allocator_(nullptr), dispatcher_(nullptr),
+		  queued_(0), errors_(0), completed_(0)
+	{
+	}
+
+protected:
+	static constexpr unsigned int FrameRate = 1000;
+	static constexpr unsigned int NumFrames = 300;
+
+	int init() override
+	{
+		FakeDeviceEnumerator::install({ 1, FrameRate, Size(640, 480) });
+
+		cm_ = new CameraManager();
+		if (cm_->start()) {
+			cerr << "Failed to start camera manager" << endl;
+			return TestFail;
+		}
+
+		camera_ = cm_->get("Fake Camera 0");
+		if (!camera_) {
+			cerr << "Emulated camera not found" << endl;
+			return TestFail;
+		}
+
+		if (camera_->acquire()) {
+			cerr << "Failed to acquire the camera" << endl;
+			return TestFail;
+		}
+
+		allocator_ = FrameBufferAllocator::create(camera_);
+
+		return TestPass;
+	}
+
+	/* Called in the camera manager thread. */
+	void requestComplete(Request *request)
+	{
+		uint64_t now = monotonicTime();
+
+		if (request->status() != Request::RequestComplete)
+			return;
+
+		Stream *stream = request->buffers().begin()->first;
+		FrameBuffer *buffer = request->buffers().begin()->second;
+		const FrameMetadata &metadata = buffer->metadata();
+
+		if (metadata.status != FrameMetadata::FrameSuccess) {
+			errors_++;
+			return;
+		}
+
+		/* Verify that the frame has been written to the buffer. */
+		const FakeFrameHeader *header =
+			static_cast<const FakeFrameHeader *>(mappings_[buffer]);
+		if (header->sequence != metadata.sequence ||
+		    header->timestamp != metadata.timestamp)
+			errors_++;
+
+		latencies_.push_back(now - metadata.timestamp);
+
+		/* Wake up the test thread when all frames have been captured. */
+		completed_ = latencies_.size();
+		if (completed_ == NumFrames)
+			dispatcher_->interrupt();
+
+		if (latencies_.size() + queued_ > NumFrames)
+			return;
+
+		request = camera_->createRequest();
+		request->addBuffer(stream, buffer);
+		camera_->queueRequest(request);
+	}
+
+	int run() override
+	{
+		std::unique_ptr<CameraConfiguration> config =
+			camera_->generateConfiguration({ StreamRole::VideoRecording });
+		if (!config || config->size() != 1) {
+			cerr << "Failed to generate configuration" << endl;
+			return TestFail;
+		}
+
+		if (camera_->configure(config.get())) {
+			cerr << "Failed to configure the camera" << endl;
+			return TestFail;
+		}
+
+		Stream *stream = config->at(0).stream();
+		if (allocator_->allocate(stream) < 0) {
+			cerr << "Failed to allocate buffers" << endl;
+			return TestFail;
+		}
+
+		std::vector<Request *> requests;
+		for (const std::unique_ptr<FrameBuffer> &buffer : allocator_->buffers(stream)) {
+			const FrameBuffer::Plane &plane = buffer->planes()[0];
+			void *mem = mmap(nullptr, plane.length, PROT_READ, MAP_SHARED,
+					 plane.fd.fd(), 0);
+			if (mem == MAP_FAILED) {
+				cerr << "Failed to map buffer" << endl;
+				return TestFail;
+			}
+
+			mappings_[buffer.get()] = mem;
+
+			Request *request = camera_->createRequest();
+			if (!request || request->addBuffer(stream, buffer.get())) {
+				cerr << "Failed to create request" << endl;
+				return TestFail;
+			}
+
+			requests.push_back(request);
+		}
+
+		dispatcher_ = cm_->eventDispatcher();
+		queued_ = requests.size();
+		errors_ = 0;
+		latencies_.clear();
+
+		camera_->requestCompleted.connect(this, &CaptureBenchmark::requestComplete);
+
+		uint64_t start = monotonicTime();
+
+		if (camera_->start()) {
+			cerr << "Failed to start camera" << endl;
+			return TestFail;
+		}
+
+		for (Request *request : requests) {
+			if (camera_->queueRequest(request)) {
+				cerr << "Failed to queue request" << endl;
+				return TestFail;
+			}
+		}
+
+		Timer timer;
+		timer.start(5000);
+		while (timer.isRunning() && completed_ < NumFrames)
+			dispatcher_->processEvents();
+
+		uint64_t duration = monotonicTime() - start;
+
+		if (camera_->stop()) {
+			cerr << "Failed to stop camera" << endl;
+			return TestFail;
+		}
+
+		if (latencies_.size() < NumFrames) {
+			cerr << "Captured " << latencies_.size() << " frames, expected "
+			     << NumFrames << endl;
+			return TestFail;
+		}
+
+		if (errors_) {
+			cerr << errors_ << " invalid frames" << endl;
+			return TestFail;
+		}
+
+		std::sort(latencies_.begin(), latencies_.end());
+		uint64_t total = 0;
+		for (uint64_t latency : latencies_)
+			total += latency;
+
+		cout << "Captured " << latencies_.size() << " frames at "
+		     << latencies_.size() * 1000000000.0 / duration << " fps, latency "
+		     << total / latencies_.size() / 1000 << "us average, "
+		     << latencies_[latencies_.size() / 2] / 1000 << "us median, "
+		     << latencies_.back() / 1000 << "us max" << endl;
+
+		return TestPass;
+	}
+
+	void cleanup() override
+	{
+		for (const auto &mapping : mappings_)
+			munmap(mapping.second, mapping.first->planes()[0].length);
+
+		delete allocator_;
+
+		if (camera_) {
+			camera_->release();
+			camera_.reset();
+		}
+
+		if (cm_) {
+			cm_->stop();
+			delete cm_;
+		}
+
+		FakeDeviceEnumerator::uninstall();
+	}
+
+private:
+	CameraManager *cm_;
+	std::shared_ptr<Camera> camera_;
+	FrameBufferAllocator *allocator_;
+	EventDispatcher *dispatcher_;
+
+	std::map<FrameBuffer *, void *> mappings_;
+	std::vector<uint64_t> latencies_;
+	unsigned int queued_;
+	unsigned int errors_;
+	std::atomic<unsigned int> completed_;
+};
+
+TEST_REGISTER(CaptureBenchmark)
@@ -0,0 +1,106 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2020, Google Inc.
+ *
+ * fake_device_enumerator.cpp - Enumerator for media devices emulated in user space
+ */
+
+#include "fake_device_enumerator.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace libcamera {
+
+namespace {
+
+FakeDeviceConfig installedConfig;
+
+} /* namespace */
+
+/*
+ * Make the camera manager enumerate emulated devices instead of the devices
+ * present in the system. This shall be called before starting the camera
+ * manager.
+ */
+void FakeDeviceEnumerator::install(const FakeDeviceConfig &config)
+{
+	installedConfig = config;
+	DeviceEnumerator::setFactory(&FakeDeviceEnumerator::create);
+}
+
+void FakeDeviceEnumerator::uninstall()
+{
+	DeviceEnumerator::setFactory(nullptr);
+}
+
+std::unique_ptr<DeviceEnumerator> FakeDeviceEnumerator::create()
+{
+	return std::make_unique<FakeDeviceEnumerator>(installedConfig);
+}
+
+FakeDeviceEnumerator::FakeDeviceEnumerator(const FakeDeviceConfig &config)
+	: config_(config)
+{
+}
+
+FakeDeviceEnumerator::~FakeDeviceEnumerator()
+{
+	for (int fd : fds_)
+		close(fd);
+}
+
+/*
+ * Every emulated media device is backed by a memfd, to provide a device node
+ * that MediaDevice can open and lock like a real media device node.
+ */
+int FakeDeviceEnumerator::init()
+{
+	for (unsigned int i = 0; i < config_.cameras; ++i) {
+		int fd = memfd_create(("fake-media" + std::to_string(i)).c_str(),
+				      MFD_CLOEXEC);
+		if (fd < 0)
+			return -errno;
+
+		fds_.push_back(fd);
+		deviceNodes_.push_back("/proc/self/fd/" + std::to_string(fd));
+	}
+
+	return 0;
+}
+
+int FakeDeviceEnumerator::enumerate()
+{
+	std::vector<std::shared_ptr<MediaDevice>> devices =
+		createDevices(deviceNodes_);
+
+	for (const std::shared_ptr<MediaDevice> &media : devices) {
+		if (!media)
+			return -ENODEV;
+
+		addDevice(media);
+	}
+
+	return 0;
+}
+
+std::shared_ptr<MediaDevice>
+FakeDeviceEnumerator::createDevice(const std::string &deviceNode)
+{
+	auto it = std::find(deviceNodes_.begin(), deviceNodes_.end(), deviceNode);
+	if (it == deviceNodes_.end())
+		return nullptr;
+
+	unsigned int index = it - deviceNodes_.begin();
+	std::shared_ptr<MediaDevice> media =
+		std::make_shared<FakeMediaDevice>(deviceNode, index, config_);
+
+	if (media->populate() < 0)
+		return nullptr;
+
+	return media;
+}
+
+} /* namespace libcamera */
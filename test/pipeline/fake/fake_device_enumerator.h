@@ -0,0 +1,44 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2020, Google Inc.
+ *
+ * fake_device_enumerator.h - Enumerator for media devices emulated in user space
+ */
+#ifndef __LIBCAMERA_TEST_FAKE_DEVICE_ENUMERATOR_H__
+#define __LIBCAMERA_TEST_FAKE_DEVICE_ENUMERATOR_H__
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "device_enumerator.h"
+#include "fake_media_device.h"
+
+namespace libcamera {
+
+class FakeDeviceEnumerator : public DeviceEnumerator
+{
+public:
+	static void install(const FakeDeviceConfig &config);
+	static void uninstall();
+
+	FakeDeviceEnumerator(const FakeDeviceConfig &config);
+	~FakeDeviceEnumerator();
+
+	int init() override;
+	int enumerate() override;
+
+protected:
+	std::shared_ptr<MediaDevice> createDevice(const std::string &deviceNode) override;
+
+private:
+	static std::unique_ptr<DeviceEnumerator> create();
+
+	FakeDeviceConfig config_;
+	std::vector<int> fds_;
+	std::vector<std::string> deviceNodes_;
+};
+
+} /* namespace libcamera */
+
+#endif /* __LIBCAMERA_TEST_FAKE_DEVICE_ENUMERATOR_H__ */
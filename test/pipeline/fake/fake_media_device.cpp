@@ -0,0 +1,157 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2020, Google Inc.
+ *
+ * fake_media_device.cpp - Media device emulated in user space
+ */
+
+#include "fake_media_device.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <linux/version.h>
+
+namespace libcamera {
+
+namespace {
+
+/*
+ * Copy the objects of a graph to the array of \a size elements provided by the
+ * caller of MEDIA_IOC_G_TOPOLOGY, if any.
+ */
+template<typename T>
+int copyObjects(const std::vector<T> &objects, __u64 ptr, __u32 size)
+{
+	T *array = reinterpret_cast<T *>(ptr);
+	if (!array)
+		return 0;
+
+	if (size < objects.size())
+		return -ENOSPC;
+
+	memcpy(array, objects.data(), objects.size() * sizeof(T));
+	return 0;
+}
+
+} /* namespace */
+
+/*
+ * The emulated graph contains a sensor entity whose source pad is connected
+ * to the sink pad of a video capture entity through an immutable link.
+ */
+FakeMediaDevice::FakeMediaDevice(const std::string &deviceNode,
+				 unsigned int index,
+				 const FakeDeviceConfig &config)
+	: MediaDevice(deviceNode), index_(index), config_(config)
+{
+	struct media_v2_entity sensor = {};
+	sensor.id = 1;
+	strncpy(sensor.name, "Fake Sensor", sizeof(sensor.name));
+	sensor.function = MEDIA_ENT_F_CAM_SENSOR;
+
+	struct media_v2_entity capture = {};
+	capture.id = 2;
+	strncpy(capture.name, "Fake Capture", sizeof(capture.name));
+	capture.function = MEDIA_ENT_F_IO_V4L;
+	capture.flags = MEDIA_ENT_FL_DEFAULT;
+
+	graphEntities_ = { sensor, capture };
+
+	struct media_v2_pad source = {};
+	source.id = 3;
+	source.entity_id = sensor.id;
+	source.flags = MEDIA_PAD_FL_SOURCE;
+	source.index = 0;
+
+	struct media_v2_pad sink = {};
+	sink.id = 4;
+	sink.entity_id = capture.id;
+	sink.flags = MEDIA_PAD_FL_SINK;
+	sink.index = 0;
+
+	graphPads_ = { source, sink };
+
+	struct media_v2_link link = {};
+	link.id = 5;
+	link.source_id = source.id;
+	link.sink_id = sink.id;
+	link.flags = MEDIA_LNK_FL_DATA_LINK | MEDIA_LNK_FL_ENABLED |
+		     MEDIA_LNK_FL_IMMUTABLE;
+
+	graphLinks_ = { link };
+}
+
+int FakeMediaDevice::ioctl(unsigned long request, void *argp)
+{
+	switch (request) {
+	case MEDIA_IOC_DEVICE_INFO:
+		return getDeviceInfo(static_cast<struct media_device_info *>(argp));
+	case MEDIA_IOC_G_TOPOLOGY:
+		return getTopology(static_cast<struct media_v2_topology *>(argp));
+	case MEDIA_IOC_SETUP_LINK:
+		return linkSetup(static_cast<struct media_link_desc *>(argp));
+	default:
+		return -ENOTTY;
+	}
+}
+
+int FakeMediaDevice::getDeviceInfo(struct media_device_info *info)
+{
+	std::string model = "Fake Camera " + std::to_string(index_);
+	std::string busInfo = "platform:fake-" + std::to_string(index_);
+
+	memset(info, 0, sizeof(*info));
+	strncpy(info->driver, "fake", sizeof(info->driver) - 1);
+	strncpy(info->model, model.c_str(), sizeof(info->model) - 1);
+	strncpy(info->bus_info, busInfo.c_str(), sizeof(info->bus_info) - 1);
+	info->media_version = KERNEL_VERSION(5, 4, 0);
+	info->hw_revision = 0;
+	info->driver_version = KERNEL_VERSION(5, 4, 0);
+
+	return 0;
+}
+
+int FakeMediaDevice::getTopology(struct media_v2_topology *topology)
+{
+	int ret;
+
+	topology->topology_version = 1;
+
+	ret = copyObjects(graphEntities_, topology->ptr_entities,
+			  topology->num_entities);
+	if (ret)
+		return ret;
+
+	ret = copyObjects(graphPads_, topology->ptr_pads, topology->num_pads);
+	if (ret)
+		return ret;
+
+	ret = copyObjects(graphLinks_, topology->ptr_links, topology->num_links);
+	if (ret)
+		return ret;
+
+	topology->num_entities = graphEntities_.size();
+	topology->num_interfaces = 0;
+	topology->num_pads = graphPads_.size();
+	topology->num_links = graphLinks_.size();
+
+	return 0;
+}
+
+int FakeMediaDevice::linkSetup(struct media_link_desc *desc)
+{
+	const struct media_v2_pad &source = graphPads_[0];
+	const struct media_v2_pad &sink = graphPads_[1];
+
+	if (desc->source.entity != source.entity_id ||
+	    desc->source.index != source.index ||
+	    desc->sink.entity != sink.entity_id ||
+	    desc->sink.index != sink.index)
+		return -EINVAL;
+
+	/* The only link of the graph is immutable, it can't be disabled. */
+	return desc->flags & MEDIA_LNK_FL_ENABLED ? 0 : -EINVAL;
+}
+
+} /* namespace libcamera */
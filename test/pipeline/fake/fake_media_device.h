@@ -0,0 +1,54 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2020, Google Inc.
+ *
+ * fake_media_device.h - Media device emulated in user space
+ */
+#ifndef __LIBCAMERA_TEST_FAKE_MEDIA_DEVICE_H__
+#define __LIBCAMERA_TEST_FAKE_MEDIA_DEVICE_H__
+
+#include <string>
+#include <vector>
+
+#include <linux/media.h>
+
+#include <libcamera/geometry.h>
+
+#include "media_device.h"
+
+namespace libcamera {
+
+struct FakeDeviceConfig {
+	unsigned int cameras;
+	unsigned int frameRate;
+	Size size;
+};
+
+class FakeMediaDevice : public MediaDevice
+{
+public:
+	FakeMediaDevice(const std::string &deviceNode, unsigned int index,
+			const FakeDeviceConfig &config);
+
+	unsigned int index() const { return index_; }
+	const FakeDeviceConfig &config() const { return config_; }
+
+protected:
+	int ioctl(unsigned long request, void *argp) override;
+
+private:
+	int getDeviceInfo(struct media_device_info *info);
+	int getTopology(struct media_v2_topology *topology);
+	int linkSetup(struct media_link_desc *desc);
+
+	unsigned int index_;
+	FakeDeviceConfig config_;
+
+	std::vector<struct media_v2_entity> graphEntities_;
+	std::vector<struct media_v2_pad> graphPads_;
+	std::vector<struct media_v2_link> graphLinks_;
+};
+
+} /* namespace libcamera */
+
+#endif /* __LIBCAMERA_TEST_FAKE_MEDIA_DEVICE_H__ */
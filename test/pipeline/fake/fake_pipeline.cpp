@@ -0,0 +1,306 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2020, Google Inc.
+ *
+ * fake_pipeline.cpp - Pipeline handler for devices emulated in user space
+ */
+
+#include <algorithm>
+
+#include <libcamera/camera.h>
+#include <libcamera/control_ids.h>
+#include <libcamera/request.h>
+#include <libcamera/stream.h>
+
+#include "device_enumerator.h"
+#include "fake_media_device.h"
+#include "fake_video_device.h"
+#include "log.h"
+#include "media_device.h"
+#include "pipeline_handler.h"
+
+namespace libcamera {
+
+LOG_DEFINE_CATEGORY(Fake)
+
+class FakeCameraData : public CameraData
+{
+public:
+	FakeCameraData(PipelineHandler *pipe)
+		: CameraData(pipe), streaming_(false), frameDuration_(0)
+	{
+	}
+
+	int init(const FakeMediaDevice *media);
+	void bufferReady(FrameBuffer *buffer);
+
+	std::unique_ptr<FakeVideoDevice> video_;
+	Stream stream_;
+
+	bool streaming_;
+	int64_t frameDuration_;
+};
+
+class FakeCameraConfiguration : public CameraConfiguration
+{
+public:
+	Status validate() override;
+};
+
+class PipelineHandlerFake : public PipelineHandler
+{
+public:
+	PipelineHandlerFake(CameraManager *manager);
+
+	CameraConfiguration *generateConfiguration(Camera *camera,
+		const StreamRoles &roles) override;
+	int configure(Camera *camera, CameraConfiguration *config) override;
+
+	int exportFrameBuffers(Camera *camera, Stream *stream,
+			       std::vector<std::unique_ptr<FrameBuffer>> *buffers) override;
+	int importFrameBuffers(Camera *camera, Stream *stream) override;
+	void freeFrameBuffers(Camera *camera, Stream *stream) override;
+
+	int start(Camera *camera) override;
+	void stop(Camera *camera) override;
+
+	int queueRequestDevice(Camera *camera, Request *request) override;
+
+	bool match(DeviceEnumerator *enumerator) override;
+
+private:
+	FakeCameraData *cameraData(const Camera *camera)
+	{
+		return static_cast<FakeCameraData *>(
+			PipelineHandler::cameraData(camera));
+	}
+};
+
+CameraConfiguration::Status FakeCameraConfiguration::validate()
+{
+	Status status = Valid;
+
+	if (config_.empty())
+		return Invalid;
+
+	if (config_.size() > 1) {
+		config_.resize(1);
+		status = Adjusted;
+	}
+
+	/* The device supports a single pixel format and size. */
+	StreamConfiguration &cfg = config_[0];
+	const StreamFormats &formats = cfg.formats();
+	const PixelFormat pixelFormat = formats.pixelformats().front();
+	const Size size = formats.sizes(pixelFormat).front();
+
+	if (cfg.pixelFormat != pixelFormat || cfg.size != size) {
+		cfg.pixelFormat = pixelFormat;
+		cfg.size = size;
+		status = Adjusted;
+	}
+
+	cfg.bufferCount = 4;
+
+	return status;
+}
+
+PipelineHandlerFake::PipelineHandlerFake(CameraManager *manager)
+	: PipelineHandler(manager)
+{
+}
+
+CameraConfiguration *PipelineHandlerFake::generateConfiguration(Camera *camera,
+	const StreamRoles &roles)
+{
+	FakeCameraData *data = cameraData(camera);
+	CameraConfiguration *config = new FakeCameraConfiguration();
+
+	if (roles.empty())
+		return config;
+
+	ImageFormats v4l2Formats = data->video_->formats();
+	StreamFormats formats(v4l2Formats.data());
+	StreamConfiguration cfg(formats);
+
+	cfg.pixelFormat = formats.pixelformats().front();
+	cfg.size = formats.sizes(cfg.pixelFormat).front();
+	cfg.bufferCount = 4;
+
+	config->addConfiguration(cfg);
+
+	config->validate();
+
+	return config;
+}
+
+int PipelineHandlerFake::configure(Camera *camera, CameraConfiguration *config)
+{
+	FakeCameraData *data = cameraData(camera);
+	StreamConfiguration &cfg = config->at(0);
+	int ret;
+
+	V4L2DeviceFormat format = {};
+	format.fourcc = data->video_->toV4L2Fourcc(cfg.pixelFormat);
+	format.size = cfg.size;
+
+	ret = data->video_->setFormat(&format);
+	if (ret)
+		return ret;
+
+	if (format.size != cfg.size ||
+	    format.fourcc != data->video_->toV4L2Fourcc(cfg.pixelFormat))
+		return -EINVAL;
+
+	cfg.setStream(&data->stream_);
+
+	return 0;
+}
+
+int PipelineHandlerFake::exportFrameBuffers(Camera *camera, Stream *stream,
+					    std::vector<std::unique_ptr<FrameBuffer>> *buffers)
+{
+	FakeCameraData *data = cameraData(camera);
+	unsigned int count = stream->configuration().bufferCount;
+
+	return data->video_->exportBuffers(count, buffers);
+}
+
+int PipelineHandlerFake::importFrameBuffers(Camera *camera, Stream *stream)
+{
+	FakeCameraData *data = cameraData(camera);
+	unsigned int count = stream->configuration().bufferCount;
+
+	return data->video_->importBuffers(count);
+}
+
+void PipelineHandlerFake::freeFrameBuffers(Camera *camera, Stream *stream)
+{
+	FakeCameraData *data = cameraData(camera);
+
+	data->video_->releaseBuffers();
+}
+
+/*
+ * As in the uvcvideo pipeline handler, starting the video stream is deferred
+ * to the first request, to apply the frame duration it carries.
+ */
+int PipelineHandlerFake::start(Camera *camera)
+{
+	FakeCameraData *data = cameraData(camera);
+	data->streaming_ = false;
+	return 0;
+}
+
+void PipelineHandlerFake::stop(Camera *camera)
+{
+	FakeCameraData *data = cameraData(camera);
+	data->video_->streamOff();
+	data->streaming_ = false;
+}
+
+int PipelineHandlerFake::queueRequestDevice(Camera *camera, Request *request)
+{
+	FakeCameraData *data = cameraData(camera);
+	FrameBuffer *buffer = request->findBuffer(&data->stream_);
+	if (!buffer) {
+		LOG(Fake, Error)
+			<< "Attempt to queue request with invalid stream";
+
+		return -ENOENT;
+	}
+
+	const ControlList &controls = request->controls();
+	if (controls.contains(controls::FrameDuration)) {
+		int64_t duration = controls.get(controls::FrameDuration);
+
+		if (duration != data->frameDuration_ && !data->streaming_) {
+			int ret = data->video_->setFrameDuration(&duration);
+			if (ret)
+				return ret;
+
+			data->frameDuration_ = duration;
+		}
+	}
+
+	int ret = data->video_->queueBuffer(buffer);
+	if (ret < 0)
+		return ret;
+
+	if (!data->streaming_) {
+		ret = data->video_->streamOn();
+		if (ret < 0)
+			return ret;
+
+		data->streaming_ = true;
+	}
+
+	return 0;
+}
+
+bool PipelineHandlerFake::match(DeviceEnumerator *enumerator)
+{
+	DeviceMatch dm("fake");
+	dm.add("Fake Sensor");
+	dm.add("Fake Capture");
+
+	MediaDevice *media = acquireMediaDevice(enumerator, dm);
+	if (!media)
+		return false;
+
+	const FakeMediaDevice *fake = dynamic_cast<FakeMediaDevice *>(media);
+	if (!fake) {
+		LOG(Fake, Error) << "Media device is not emulated";
+		return false;
+	}
+
+	std::unique_ptr<FakeCameraData> data =
+		std::make_unique<FakeCameraData>(this);
+	if (data->init(fake))
+		return false;
+
+	std::set<Stream *> streams{ &data->stream_ };
+	std::shared_ptr<Camera> camera =
+		Camera::create(this, media->model(), streams);
+	registerCamera(std::move(camera), std::move(data));
+
+	return true;
+}
+
+int FakeCameraData::init(const FakeMediaDevice *media)
+{
+	const FakeDeviceConfig &config = media->config();
+
+	video_ = std::make_unique<FakeVideoDevice>("fake-video" +
+						   std::to_string(media->index()),
+						   config.size, config.frameRate);
+	int ret = video_->open();
+	if (ret)
+		return ret;
+
+	video_->bufferReady.connect(this, &FakeCameraData::bufferReady);
+
+	int64_t min, max;
+	if (!video_->frameDurationLimits(V4L2_PIX_FMT_NV12, config.size,
+					 &min, &max))
+		controlInfo_ = {
+			{ &controls::FrameDuration, ControlRange(min, max) },
+		};
+
+	return 0;
+}
+
+void FakeCameraData::bufferReady(FrameBuffer *buffer)
+{
+	Request *request = buffer->request();
+
+	if (frameDuration_)
+		request->metadata().set(controls::FrameDuration, frameDuration_);
+
+	pipe_->completeBuffer(camera_, request, buffer);
+	pipe_->completeRequest(camera_, request);
+}
+
+REGISTER_PIPELINE_HANDLER(PipelineHandlerFake, "fake");
+
+} /* namespace libcamera */
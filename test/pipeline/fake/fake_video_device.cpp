@@ -0,0 +1,477 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2020, Google Inc.
+ *
+ * fake_video_device.cpp - V4L2 video capture device emulated in user space
+ */
+
+#include "fake_video_device.h"
+
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/version.h>
+
+#include "utils.h"
+
+namespace libcamera {
+
+namespace {
+
+/*
+ * The device produces frames at the nominal frame rate, or at a half or a
+ * quarter of it.
+ */
+const unsigned int intervalMultipliers[] = { 1, 2, 4 };
+
+} /* namespace */
+
+/*
+ * The emulated device is a single-planar NV12 capture device, exposed through
+ * the multi-planar API. Emulation of the kernel happens in the ioctl() method,
+ * called by V4L2VideoDevice for every device access.
+ *
+ * Frames are produced by a thread at the configured frame rate in the first
+ * queued buffer, and dropped when no buffer is queued. Completed buffers are
+ * signalled through an eventfd, which the V4L2VideoDevice polls as it would
+ * poll a video device node. Buffers allocated with VIDIOC_REQBUFS are backed
+ * by memfds.
+ *
+ * As with the uvcvideo driver, the frame interval can only be changed when the
+ * device isn't streaming.
+ */
+FakeVideoDevice::FakeVideoDevice(const std::string &name, const Size &size,
+				 unsigned int frameRate)
+	: V4L2VideoDevice(name), name_(name), size_(size),
+	  frameRate_(frameRate), frameSize_(size.width * size.height * 3 / 2),
+	  intervalMultiplier_(1), eventFd_(-1), memory_(V4L2_MEMORY_MMAP),
+	  streaming_(false), sequence_(0)
+{
+}
+
+FakeVideoDevice::~FakeVideoDevice()
+{
+	/* Close the device while the ioctl() override is still reachable. */
+	close();
+}
+
+int FakeVideoDevice::open()
+{
+	eventFd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK | EFD_SEMAPHORE);
+	if (eventFd_ < 0)
+		return -errno;
+
+	int ret = V4L2VideoDevice::open(eventFd_, V4L2_BUF_TYPE_VIDEO_CAPTURE);
+	if (ret < 0) {
+		::close(eventFd_);
+		eventFd_ = -1;
+	}
+
+	return ret;
+}
+
+void FakeVideoDevice::close()
+{
+	stopStreaming();
+
+	V4L2VideoDevice::close();
+
+	if (eventFd_ != -1) {
+		::close(eventFd_);
+		eventFd_ = -1;
+	}
+}
+
+int FakeVideoDevice::ioctl(unsigned long request, void *argp)
+{
+	switch (request) {
+	case VIDIOC_QUERYCAP: {
+		struct v4l2_capability *caps =
+			static_cast<struct v4l2_capability *>(argp);
+
+		memset(caps, 0, sizeof(*caps));
+		strncpy(reinterpret_cast<char *>(caps->driver), "fake",
+			sizeof(caps->driver) - 1);
+		strncpy(reinterpret_cast<char *>(caps->card), name_.c_str(),
+			sizeof(caps->card) - 1);
+		strncpy(reinterpret_cast<char *>(caps->bus_info), "platform:fake",
+			sizeof(caps->bus_info) - 1);
+		caps->version = KERNEL_VERSION(5, 4, 0);
+		caps->device_caps = V4L2_CAP_VIDEO_CAPTURE_MPLANE |
+				    V4L2_CAP_STREAMING;
+		caps->capabilities = caps->device_caps | V4L2_CAP_DEVICE_CAPS;
+		return 0;
+	}
+
+	case VIDIOC_ENUM_FMT: {
+		struct v4l2_fmtdesc *desc = static_cast<struct v4l2_fmtdesc *>(argp);
+
+		if (desc->type != V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE ||
+		    desc->index > 0)
+			return -EINVAL;
+
+		desc->pixelformat = V4L2_PIX_FMT_NV12;
+		strncpy(reinterpret_cast<char *>(desc->description),
+			"Y/CbCr 4:2:0", sizeof(desc->description) - 1);
+		return 0;
+	}
+
+	case VIDIOC_ENUM_FRAMESIZES: {
+		struct v4l2_frmsizeenum *frameSize =
+			static_cast<struct v4l2_frmsizeenum *>(argp);
+
+		if (frameSize->index > 0 ||
+		    frameSize->pixel_format != V4L2_PIX_FMT_NV12)
+			return -EINVAL;
+
+		frameSize->type = V4L2_FRMSIZE_TYPE_DISCRETE;
+		frameSize->discrete.width = size_.width;
+		frameSize->discrete.height = size_.height;
+		return 0;
+	}
+
+	case VIDIOC_ENUM_FRAMEINTERVALS:
+		return enumFrameIntervals(static_cast<struct v4l2_frmivalenum *>(argp));
+
+	case VIDIOC_G_PARM:
+		return parm(static_cast<struct v4l2_streamparm *>(argp), false);
+
+	case VIDIOC_S_PARM:
+		return parm(static_cast<struct v4l2_streamparm *>(argp), true);
+
+	case VIDIOC_G_FMT:
+	case VIDIOC_S_FMT:
+	case VIDIOC_TRY_FMT: {
+		struct v4l2_format *format = static_cast<struct v4l2_format *>(argp);
+
+		if (format->type != V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE)
+			return -EINVAL;
+
+		/* The device supports a single format, always return it. */
+		fillFormat(format);
+		return 0;
+	}
+
+	case VIDIOC_REQBUFS:
+		return reqBufs(static_cast<struct v4l2_requestbuffers *>(argp));
+
+	case VIDIOC_QUERYBUF:
+		return queryBuf(static_cast<struct v4l2_buffer *>(argp));
+
+	case VIDIOC_EXPBUF:
+		return expBuf(static_cast<struct v4l2_exportbuffer *>(argp));
+
+	case VIDIOC_QBUF:
+		return qBuf(static_cast<struct v4l2_buffer *>(argp));
+
+	case VIDIOC_DQBUF:
+		return dqBuf(static_cast<struct v4l2_buffer *>(argp));
+
+	case VIDIOC_STREAMON:
+		if (*static_cast<enum v4l2_buf_type *>(argp) !=
+		    V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE)
+			return -EINVAL;
+
+		return startStreaming();
+
+	case VIDIOC_STREAMOFF:
+		if (*static_cast<enum v4l2_buf_type *>(argp) !=
+		    V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE)
+			return -EINVAL;
+
+		stopStreaming();
+		return 0;
+
+	default:
+		return -ENOTTY;
+	}
+}
+
+void FakeVideoDevice::fillFormat(struct v4l2_format *format)
+{
+	struct v4l2_pix_format_mplane *pix = &format->fmt.pix_mp;
+
+	memset(pix, 0, sizeof(*pix));
+	pix->width = size_.width;
+	pix->height = size_.height;
+	pix->pixelformat = V4L2_PIX_FMT_NV12;
+	pix->field = V4L2_FIELD_NONE;
+	pix->num_planes = 1;
+	pix->plane_fmt[0].bytesperline = size_.width;
+	pix->plane_fmt[0].sizeimage = frameSize_;
+}
+
+int FakeVideoDevice::enumFrameIntervals(struct v4l2_frmivalenum *interval)
+{
+	if (interval->index >= ARRAY_SIZE(intervalMultipliers) ||
+	    interval->pixel_format != V4L2_PIX_FMT_NV12 ||
+	    interval->width != size_.width || interval->height != size_.height)
+		return -EINVAL;
+
+	interval->type = V4L2_FRMIVAL_TYPE_DISCRETE;
+	interval->discrete.numerator = intervalMultipliers[interval->index];
+	interval->discrete.denominator = frameRate_;
+
+	return 0;
+}
+
+int FakeVideoDevice::parm(struct v4l2_streamparm *parm, bool set)
+{
+	if (parm->type != V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE)
+		return -EINVAL;
+
+	struct v4l2_captureparm *capture = &parm->parm.capture;
+
+	std::lock_guard<std::mutex> locker(mutex_);
+
+	if (set) {
+		if (streaming_)
+			return -EBUSY;
+
+		/* Select the closest supported interval, a zero one is ignored. */
+		const struct v4l2_fract &interval = capture->timeperframe;
+		if (interval.numerator && interval.denominator) {
+			uint64_t requested = static_cast<uint64_t>(interval.numerator)
+					   * frameRate_ * 1000 / interval.denominator;
+			uint64_t best = UINT64_MAX;
+
+			for (unsigned int multiplier : intervalMultipliers) {
+				uint64_t distance = multiplier * 1000 > requested
+						  ? multiplier * 1000 - requested
+						  : requested - multiplier * 1000;
+				if (distance < best) {
+					best = distance;
+					intervalMultiplier_ = multiplier;
+				}
+			}
+		}
+	}
+
+	memset(capture, 0, sizeof(*capture));
+	capture->capability = V4L2_CAP_TIMEPERFRAME;
+	capture->timeperframe.numerator = intervalMultiplier_;
+	capture->timeperframe.denominator = frameRate_;
+
+	return 0;
+}
+
+int FakeVideoDevice::reqBufs(struct v4l2_requestbuffers *rb)
+{
+	if (rb->type != V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE)
+		return -EINVAL;
+
+	if (rb->memory != V4L2_MEMORY_MMAP && rb->memory != V4L2_MEMORY_DMABUF)
+		return -EINVAL;
+
+	if (streaming_)
+		return -EBUSY;
+
+	freeBuffers();
+
+	memory_ = static_cast<enum v4l2_memory>(rb->memory);
+
+	for (unsigned int i = 0; i < rb->count; ++i) {
+		Buffer buffer = { -1, false };
+
+		if (memory_ == V4L2_MEMORY_MMAP) {
+			buffer.fd = memfd_create("fake-video", MFD_CLOEXEC);
+			if (buffer.fd < 0 || ftruncate(buffer.fd, frameSize_) < 0) {
+				int ret = -errno;
+				if (buffer.fd >= 0)
+					::close(buffer.fd);
+				freeBuffers();
+				return ret;
+			}
+
+			buffer.owned = true;
+		}
+
+		buffers_.push_back(buffer);
+	}
+
+	return 0;
+}
+
+void FakeVideoDevice::freeBuffers()
+{
+	for (const Buffer &buffer : buffers_) {
+		if (buffer.owned)
+			::close(buffer.fd);
+	}
+
+	buffers_.clear();
+}
+
+int FakeVideoDevice::queryBuf(struct v4l2_buffer *buf)
+{
+	if (buf->type != V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE ||
+	    buf->index >= buffers_.size() || buf->length < 1)
+		return -EINVAL;
+
+	buf->memory = memory_;
+	buf->length = 1;
+	buf->m.planes[0].length = frameSize_;
+	buf->m.planes[0].m.mem_offset = 0;
+
+	return 0;
+}
+
+int FakeVideoDevice::expBuf(struct v4l2_exportbuffer *expbuf)
+{
+	if (expbuf->type != V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE ||
+	    expbuf->index >= buffers_.size() || expbuf->plane > 0 ||
+	    memory_ != V4L2_MEMORY_MMAP)
+		return -EINVAL;
+
+	/*
+	 * V4L2VideoDevice duplicates the exported file descriptor, return the
+	 * memfd itself to avoid leaking a copy. It is closed when the buffers
+	 * are freed.
+	 */
+	expbuf->fd = buffers_[expbuf->index].fd;
+
+	return 0;
+}
+
+int FakeVideoDevice::qBuf(struct v4l2_buffer *buf)
+{
+	if (buf->type != V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE ||
+	    buf->memory != memory_ || buf->index >= buffers_.size() ||
+	    buf->length < 1)
+		return -EINVAL;
+
+	std::lock_guard<std::mutex> locker(mutex_);
+
+	/* Imported buffers are identified by their dmabuf fd when queued. */
+	if (memory_ == V4L2_MEMORY_DMABUF)
+		buffers_[buf->index].fd = buf->m.planes[0].m.fd;
+
+	queued_.push_back(buf->index);
+
+	return 0;
+}
+
+int FakeVideoDevice::dqBuf(struct v4l2_buffer *buf)
+{
+	if (buf->type != V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE ||
+	    buf->length < 1)
+		return -EINVAL;
+
+	std::unique_lock<std::mutex> locker(mutex_);
+
+	if (done_.empty())
+		return -EAGAIN;
+
+	Frame frame = done_.front();
+	done_.pop_front();
+
+	locker.unlock();
+
+	uint64_t value;
+	if (read(eventFd_, &value, sizeof(value)) != sizeof(value))
+		return -EIO;
+
+	buf->index = frame.index;
+	buf->memory = memory_;
+	buf->flags = V4L2_BUF_FLAG_DONE | V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+	if (frame.error)
+		buf->flags |= V4L2_BUF_FLAG_ERROR;
+	buf->field = V4L2_FIELD_NONE;
+	buf->sequence = frame.sequence;
+	buf->timestamp.tv_sec = frame.timestamp / 1000000000;
+	buf->timestamp.tv_usec = frame.timestamp / 1000 % 1000000;
+	buf->length = 1;
+	buf->m.planes[0].bytesused = frameSize_;
+	buf->m.planes[0].length = frameSize_;
+
+	return 0;
+}
+
+int FakeVideoDevice::startStreaming()
+{
+	if (buffers_.empty())
+		return -EINVAL;
+
+	if (streaming_)
+		return 0;
+
+	streaming_ = true;
+	sequence_ = 0;
+	thread_ = std::thread(&FakeVideoDevice::produce, this);
+
+	return 0;
+}
+
+void FakeVideoDevice::stopStreaming()
+{
+	{
+		std::lock_guard<std::mutex> locker(mutex_);
+		streaming_ = false;
+	}
+
+	cv_.notify_one();
+
+	if (thread_.joinable())
+		thread_.join();
+
+	queued_.clear();
+	done_.clear();
+
+	/* Reset the eventfd counter. */
+	uint64_t value;
+	while (eventFd_ != -1 && read(eventFd_, &value, sizeof(value)) > 0)
+		;
+}
+
+void FakeVideoDevice::produce()
+{
+	const std::chrono::nanoseconds interval(1000000000ULL * intervalMultiplier_
+						/ frameRate_);
+	std::chrono::steady_clock::time_point next =
+		std::chrono::steady_clock::now() + interval;
+
+	std::unique_lock<std::mutex> locker(mutex_);
+
+	while (true) {
+		if (cv_.wait_until(locker, next, [this] { return !streaming_; }))
+			break;
+
+		next += interval;
+
+		unsigned int sequence = sequence_++;
+
+		/* Drop the frame if no buffer is available. */
+		if (queued_.empty())
+			continue;
+
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+
+		Frame frame;
+		frame.index = queued_.front();
+		frame.sequence = sequence;
+		/* V4L2 reports timestamps with a microsecond resolution. */
+		frame.timestamp = ts.tv_sec * 1000000000ULL + ts.tv_nsec / 1000 * 1000;
+		queued_.pop_front();
+
+		FakeFrameHeader header = {};
+		header.sequence = frame.sequence;
+		header.timestamp = frame.timestamp;
+		frame.error = pwrite(buffers_[frame.index].fd, &header,
+				     sizeof(header), 0) != sizeof(header);
+
+		done_.push_back(frame);
+
+		uint64_t value = 1;
+		if (write(eventFd_, &value, sizeof(value)) != sizeof(value))
+			done_.pop_back();
+	}
+}
+
+} /* namespace libcamera */
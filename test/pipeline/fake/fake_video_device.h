@@ -0,0 +1,95 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2020, Google Inc.
+ *
+ * fake_video_device.h - V4L2 video capture device emulated in user space
+ */
+#ifndef __LIBCAMERA_TEST_FAKE_VIDEO_DEVICE_H__
+#define __LIBCAMERA_TEST_FAKE_VIDEO_DEVICE_H__
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <linux/videodev2.h>
+
+#include <libcamera/geometry.h>
+
+#include "v4l2_videodevice.h"
+
+namespace libcamera {
+
+/* Header written by the emulated device at the beginning of every frame. */
+struct FakeFrameHeader {
+	uint32_t sequence;
+	uint32_t reserved;
+	uint64_t timestamp;
+};
+
+class FakeVideoDevice : public V4L2VideoDevice
+{
+public:
+	FakeVideoDevice(const std::string &name, const Size &size,
+			unsigned int frameRate);
+	~FakeVideoDevice();
+
+	int open();
+	void close();
+
+protected:
+	int ioctl(unsigned long request, void *argp) override;
+
+private:
+	struct Buffer {
+		int fd;
+		bool owned;
+	};
+
+	struct Frame {
+		unsigned int index;
+		unsigned int sequence;
+		uint64_t timestamp;
+		bool error;
+	};
+
+	void fillFormat(struct v4l2_format *format);
+	int enumFrameIntervals(struct v4l2_frmivalenum *interval);
+	int parm(struct v4l2_streamparm *parm, bool set);
+	int reqBufs(struct v4l2_requestbuffers *rb);
+	void freeBuffers();
+	int queryBuf(struct v4l2_buffer *buf);
+	int expBuf(struct v4l2_exportbuffer *expbuf);
+	int qBuf(struct v4l2_buffer *buf);
+	int dqBuf(struct v4l2_buffer *buf);
+	int startStreaming();
+	void stopStreaming();
+
+	void produce();
+
+	std::string name_;
+	Size size_;
+	unsigned int frameRate_;
+	unsigned int frameSize_;
+	unsigned int intervalMultiplier_;
+
+	int eventFd_;
+	enum v4l2_memory memory_;
+	std::vector<Buffer> buffers_;
+
+	/* Protects the members below, shared with the producer thread. */
+	std::mutex mutex_;
+	std::condition_variable cv_;
+	std::thread thread_;
+	bool streaming_;
+	unsigned int sequence_;
+	std::deque<unsigned int> queued_;
+	std::deque<Frame> done_;
+};
+
+} /* namespace libcamera */
+
+#endif /* __LIBCAMERA_TEST_FAKE_VIDEO_DEVICE_H__ */
@@ -0,0 +1,216 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2020, Google Inc.
+ *
+ * frame_duration.cpp - Frame duration control on emulated devices
+ */
+
+#include <iostream>
+#include <vector>
+
+#include <libcamera/libcamera.h>
+
+#include "fake_device_enumerator.h"
+#include "test.h"
+
+using namespace libcamera;
+using namespace std;
+
+/*
+ * Capture frames from an emulated camera with the frame duration set in the
+ * first request, and verify that the duration is adjusted to one supported by
+ * the device, reported in the request metadata, and applied to the frame
+ * timestamps.
+ */
+class FrameDurationTest : public Test
+{
+public:
+	FrameDurationTest()
+		: cm_(nullptr), allocator_(nullptr), dispatcher_(nullptr),
+		  errors_(0)
+	{
+	}
+
+protected:
+	static constexpr unsigned int FrameRate = 120;
+	static constexpr unsigned int NumFrames = 12;
+
+	int init() override
+	{
+		FakeDeviceEnumerator::install({ 1, FrameRate, Size(640, 480) });
+
+		cm_ = new CameraManager();
+		if (cm_->start()) {
+			cerr << "Failed to start camera manager" << endl;
+			return TestFail;
+		}
+
+		camera_ = cm_->get("Fake Camera 0");
+		if (!camera_) {
+			cerr << "Emulated camera not found" << endl;
+			return TestFail;
+		}
+
+		if (camera_->acquire()) {
+			cerr << "Failed to acquire the camera" << endl;
+			return TestFail;
+		}
+
+		allocator_ = FrameBufferAllocator::create(camera_);
+
+		return TestPass;
+	}
+
+	void requestComplete(Request *request)
+	{
+		if (request->status() != Request::RequestComplete)
+			return;
+
+		Stream *stream = request->buffers().begin()->first;
+		FrameBuffer *buffer = request->buffers().begin()->second;
+
+		if (buffer->metadata().status != FrameMetadata::FrameSuccess ||
+		    !request->metadata().contains(controls::FrameDuration) ||
+		    request->metadata().get(controls::FrameDuration) != expected_)
+			errors_++;
+
+		timestamps_.push_back(buffer->metadata().timestamp);
+		if (timestamps_.size() == NumFrames)
+			dispatcher_->interrupt();
+
+		request = camera_->createRequest();
+		request->addBuffer(stream, buffer);
+		camera_->queueRequest(request);
+	}
+
+	int run() override
+	{
+		/* The device supports 1, 1/2 and 1/4 of its nominal frame rate. */
+		const ControlInfoMap &info = camera_->controls();
+		auto iter = info.find(&controls::FrameDuration);
+		if (iter == info.end()) {
+			cerr << "Frame duration control not reported" << endl;
+			return TestFail;
+		}
+
+		int64_t min = iter->second.min().get<int64_t>();
+		int64_t max = iter->second.max().get<int64_t>();
+		if (min != 1000000 / FrameRate || max != 4000000 / FrameRate) {
+			cerr << "Invalid frame duration limits " << min << "-"
+			     << max << endl;
+			return TestFail;
+		}
+
+		std::unique_ptr<CameraConfiguration> config =
+			camera_->generateConfiguration({ StreamRole::VideoRecording });
+		if (!config || camera_->configure(config.get())) {
+			cerr << "Failed to configure the camera" << endl;
+			return TestFail;
+		}
+
+		Stream *stream = config->at(0).stream();
+		if (allocator_->allocate(stream) < 0) {
+			cerr << "Failed to allocate buffers" << endl;
+			return TestFail;
+		}
+
+		std::vector<Request *> requests;
+		for (const std::unique_ptr<FrameBuffer> &buffer : allocator_->buffers(stream)) {
+			Request *request = camera_->createRequest();
+			if (!request || request->addBuffer(stream, buffer.get())) {
+				cerr << "Failed to create request" << endl;
+				return TestFail;
+			}
+
+			requests.push_back(request);
+		}
+
+		/*
+		 * Request a duration slightly shorter than half the nominal
+		 * frame rate, the device shall select the closest interval.
+		 */
+		expected_ = 2000000 / FrameRate;
+		requests.front()->controls().set(controls::FrameDuration,
+						 expected_ - 500);
+
+		dispatcher_ = cm_->eventDispatcher();
+		camera_->requestCompleted.connect(this, &FrameDurationTest::requestComplete);
+
+		if (camera_->start()) {
+			cerr << "Failed to start camera" << endl;
+			return TestFail;
+		}
+
+		for (Request *request : requests) {
+			if (camera_->queueRequest(request)) {
+				cerr << "Failed to queue request" << endl;
+				return TestFail;
+			}
+		}
+
+		Timer timer;
+		timer.start(5000);
+		while (timer.isRunning() && timestamps_.size() < NumFrames)
+			dispatcher_->processEvents();
+
+		if (camera_->stop()) {
+			cerr << "Failed to stop camera" << endl;
+			return TestFail;
+		}
+
+		if (timestamps_.size() < NumFrames) {
+			cerr << "Captured " << timestamps_.size()
+			     << " frames, expected " << NumFrames << endl;
+			return TestFail;
+		}
+
+		if (errors_) {
+			cerr << errors_ << " frames with invalid metadata" << endl;
+			return TestFail;
+		}
+
+		/*
+		 * The frames are produced on a fixed schedule, the average
+		 * interval can't be shorter than the frame duration.
+		 */
+		uint64_t interval = (timestamps_.back() - timestamps_.front())
+				  / (timestamps_.size() - 1) / 1000;
+		if (interval < static_cast<uint64_t>(expected_) * 9 / 10) {
+			cerr << "Frame interval " << interval
+			     << "us shorter than frame duration " << expected_
+			     << "us" << endl;
+			return TestFail;
+		}
+
+		return TestPass;
+	}
+
+	void cleanup() override
+	{
+		delete allocator_;
+
+		if (camera_) {
+			camera_->release();
+			camera_.reset();
+		}
+
+		if (cm_) {
+			cm_->stop();
+			delete cm_;
+		}
+
+		FakeDeviceEnumerator::uninstall();
+	}
+
+private:
+	CameraManager *cm_;
+	std::shared_ptr<Camera> camera_;
+	FrameBufferAllocator *allocator_;
+	EventDispatcher *dispatcher_;
+
+	std::vector<uint64_t> timestamps_;
+	unsigned int errors_;
+	int64_t expected_;
+};
+
+TEST_REGISTER(FrameDurationTest)
@@ -0,0 +1,161 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2020, Google Inc.
+ *
+ * format_kernels.cpp - qcam format conversion kernels test and benchmark
+ */
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string.h>
+#include <vector>
+
+#include "format_kernels.h"
+
+#include "test.h"
+
+using namespace std;
+
+namespace {
+
+enum Family {
+	NV,
+	YUV,
+	RGB,
+};
+
+struct Format {
+	const char *name;
+	Family family;
+	unsigned int params[4];
+};
+
+/*
+ * The parameters are the horizontal and vertical subsampling and chroma swap
+ * for NV formats, the luma and Cb positions for YUV formats, and the bytes
+ * per pixel and R, G and B positions for RGB formats.
+ */
+const Format formats[] = {
+	{ "NV12", NV, { 2, 2, 0 } },
+	{ "NV21", NV, { 2, 2, 1 } },
+	{ "NV16", NV, { 2, 1, 0 } },
+	{ "NV61", NV, { 2, 1, 1 } },
+	{ "NV24", NV, { 1, 1, 0 } },
+	{ "NV42", NV, { 1, 1, 1 } },
+	{ "YUYV", YUV, { 0, 1 } },
+	{ "YVYU", YUV, { 0, 3 } },
+	{ "UYVY", YUV, { 1, 0 } },
+	{ "VYUY", YUV, { 1, 2 } },
+	{ "RGB888", RGB, { 3, 2, 1, 0 } },
+	{ "BGR888", RGB, { 3, 0, 1, 2 } },
+	{ "BGRA8888", RGB, { 4, 1, 2, 3 } },
+};
+
+} /* namespace */
+
+class FormatKernelsTest : public Test
+{
+protected:
+	int init()
+	{
+		/* Fill the source with random data, including clipped values. */
+		std::mt19937 generator(0x5eed);
+		std::uniform_int_distribution<unsigned int> distribution(0, 255);
+
+		src_.resize(width * height * 4);
+		for (unsigned char &value : src_)
+			value = distribution(generator);
+
+		return TestPass;
+	}
+
+	int run()
+	{
+		std::vector<const FormatKernels *> kernels = supportedFormatKernels();
+		const FormatKernels *reference = kernels.back();
+
+		for (const FormatKernels *k : kernels) {
+			for (const Format &format : formats) {
+				/*
+				 * Use a width that is not a multiple of the
+				 * vector size to exercise the scalar tail.
+				 */
+				std::vector<unsigned char> expected(width * height * 4);
+				std::vector<unsigned char> output(width * height * 4);
+
+				convert(reference, format, width - 2, &expected);
+				convert(k, format, width - 2, &output);
+
+				if (output != expected) {
+					cout << "Kernel " << k->name
+					     << " mismatch for " << format.name
+					     << endl;
+					return TestFail;
+				}
+			}
+		}
+
+		for (const FormatKernels *k : kernels) {
+			for (const Format &format : formats)
+				benchmark(k, format);
+		}
+
+		return TestPass;
+	}
+
+private:
+	static constexpr unsigned int width = 1920;
+	static constexpr unsigned int height = 1080;
+
+	void convert(const FormatKernels *k, const Format &format,
+		     unsigned int lineWidth, std::vector<unsigned char> *dst)
+	{
+		const unsigned int *p = format.params;
+
+		for (unsigned int y = 0; y < height; ++y) {
+			unsigned char *line = &(*dst)[y * lineWidth * 4];
+
+			switch (format.family) {
+			case NV: {
+				const unsigned char *luma = &src_[y * lineWidth];
+				const unsigned char *chroma = &src_[lineWidth * height]
+							    + y / p[1] * lineWidth * 2 / p[0];
+				k->nvLine(luma, chroma, line, lineWidth, p[0], p[2]);
+				break;
+			}
+			case YUV:
+				k->yuvLine(&src_[y * lineWidth * 2], line,
+					   lineWidth, p[0], p[1]);
+				break;
+			case RGB:
+				k->rgbLine(&src_[y * lineWidth * p[0]], line,
+					   lineWidth, p[0], p[1], p[2], p[3]);
+				break;
+			}
+		}
+	}
+
+	void benchmark(const FormatKernels *k, const Format &format)
+	{
+		constexpr unsigned int iterations = 10;
+		std::vector<unsigned char> output(width * height * 4);
+
+		auto start = std::chrono::steady_clock::now();
+		for (unsigned int i = 0; i < iterations; ++i)
+			convert(k, format, width, &output);
+		auto end = std::chrono::steady_clock::now();
+
+		std::chrono::duration<double> duration = end - start;
+		double mpixels = static_cast<double>(width) * height * iterations / 1e6;
+
+		cout << std::setw(8) << k->name << " " << std::setw(8)
+		     << format.name << ": " << std::fixed << std::setprecision(1)
+		     << mpixels / duration.count() << " Mpix/s" << endl;
+	}
+
+	std::vector<unsigned char> src_;
+};
+
+TEST_REGISTER(FormatKernelsTest)
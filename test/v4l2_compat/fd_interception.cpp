@@ -0,0 +1,126 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2020, Google Inc.
+ *
+ * fd_interception.cpp - V4L2 compatibility layer file operations stress test
+ */
+
+#include <atomic>
+#include <fcntl.h>
+#include <iostream>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "test.h"
+
+using namespace std;
+
+/*
+ * Open, duplicate, map and close file descriptors unrelated to cameras from
+ * many threads concurrently. The V4L2 compatibility layer intercepts all
+ * those operations, and must pass them through to the C library without
+ * corrupting its internal state or mixing up file descriptors reused by the
+ * kernel.
+ */
+class FdInterceptionTest : public Test
+{
+protected:
+	int init()
+	{
+		const char *preload = getenv("LD_PRELOAD");
+		if (!preload || !strstr(preload, "v4l2-compat")) {
+			cout << "V4L2 compatibility layer not preloaded" << endl;
+			return TestSkip;
+		}
+
+		return TestPass;
+	}
+
+	int run()
+	{
+		std::vector<std::thread> threads;
+		failures_ = 0;
+
+		for (unsigned int i = 0; i < numThreads; ++i)
+			threads.emplace_back(&FdInterceptionTest::worker, this);
+
+		for (std::thread &thread : threads)
+			thread.join();
+
+		if (failures_) {
+			cout << failures_ << " file operations failed" << endl;
+			return TestFail;
+		}
+
+		return TestPass;
+	}
+
+private:
+	static constexpr unsigned int numThreads = 16;
+	static constexpr unsigned int numIterations = 5000;
+
+	void worker()
+	{
+		for (unsigned int i = 0; i < numIterations; ++i) {
+			if (iteration())
+				failures_++;
+		}
+	}
+
+	int iteration()
+	{
+		int fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+		if (fd < 0)
+			return -1;
+
+		int fd2 = dup(fd);
+		if (fd2 < 0) {
+			close(fd);
+			return -1;
+		}
+
+		char data = 0x5a;
+		int ret = write(fd2, &data, sizeof(data)) == sizeof(data) ? 0 : -1;
+
+		if (close(fd2) || close(fd))
+			ret = -1;
+
+		void *map = mmap(nullptr, 4096, PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (map == MAP_FAILED)
+			return -1;
+
+		static_cast<char *>(map)[0] = data;
+
+		if (munmap(map, 4096))
+			ret = -1;
+
+		/*
+		 * Make sure close() really closes the file descriptor: reading
+		 * from a pipe must report end of file once the write end is
+		 * closed.
+		 */
+		int fds[2];
+		if (pipe(fds))
+			return -1;
+
+		if (close(fds[1]))
+			ret = -1;
+
+		if (read(fds[0], &data, sizeof(data)) != 0)
+			ret = -1;
+
+		if (close(fds[0]))
+			ret = -1;
+
+		return ret;
+	}
+
+	std::atomic<unsigned int> failures_;
+};
+
+TEST_REGISTER(FdInterceptionTest)
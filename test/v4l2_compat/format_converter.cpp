@@ -0,0 +1,217 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2020, Google Inc.
+ *
+ * format_converter.cpp - V4L2 compatibility layer pixel format conversion test
+ */
+
+#include <algorithm>
+#include <errno.h>
+#include <iostream>
+#include <linux/videodev2.h>
+#include <vector>
+
+#include "v4l2_format_converter.h"
+
+#include "test.h"
+
+using namespace std;
+
+class FormatConverterTest : public Test
+{
+protected:
+	int init()
+	{
+		/*
+		 * Fill an NV12 frame with a luma gradient and a chroma plane
+		 * whose Cb and Cr samples differ, to catch swapped components.
+		 */
+		input_.resize(width * height * 3 / 2);
+
+		for (unsigned int y = 0; y < height; ++y) {
+			for (unsigned int x = 0; x < width; ++x)
+				input_[y * width + x] = 16 + (x + y * 3) % 220;
+		}
+
+		uint8_t *chroma = &input_[width * height];
+		for (unsigned int y = 0; y < height / 2; ++y) {
+			for (unsigned int x = 0; x < width; x += 2) {
+				chroma[y * width + x] = 64 + x;
+				chroma[y * width + x + 1] = 192 - y;
+			}
+		}
+
+		return TestPass;
+	}
+
+	int run()
+	{
+		V4L2FormatConverter converter;
+
+		if (!V4L2FormatConverter::formats(V4L2_PIX_FMT_YUYV).empty()) {
+			cout << "Unexpected conversion from YUYV" << endl;
+			return TestFail;
+		}
+
+		if (converter.configure(V4L2_PIX_FMT_NV12, V4L2_PIX_FMT_YUYV,
+					Size(width + 1, height), { width, width },
+					width * 2) != -EINVAL) {
+			cout << "Odd width accepted" << endl;
+			return TestFail;
+		}
+
+		/* Check the packed YUV output against the input samples. */
+		std::vector<uint8_t> output(width * height * 2);
+
+		if (converter.configure(V4L2_PIX_FMT_NV12, V4L2_PIX_FMT_YUYV,
+					Size(width, height), { width, width },
+					width * 2)) {
+			cout << "Failed to configure NV12 to YUYV conversion" << endl;
+			return TestFail;
+		}
+
+		converter.convert(input_.data(), output.data());
+
+		const uint8_t *chroma = &input_[width * height];
+		for (unsigned int y = 0; y < height; ++y) {
+			for (unsigned int x = 0; x < width; x += 2) {
+				const uint8_t *yuyv = &output[(y * width + x) * 2];
+				const uint8_t *uv = &chroma[y / 2 * width + x];
+
+				if (yuyv[0] != input_[y * width + x] ||
+				    yuyv[1] != uv[0] ||
+				    yuyv[2] != input_[y * width + x + 1] ||
+				    yuyv[3] != uv[1]) {
+					cout << "YUYV mismatch at (" << x << ", "
+					     << y << ")" << endl;
+					return TestFail;
+				}
+			}
+		}
+
+		/*
+		 * Lines padded beyond the frame width in the input and output
+		 * must produce the same pixels, and leave the output padding
+		 * untouched.
+		 */
+		constexpr unsigned int inputStride = width + 32;
+		constexpr unsigned int outputStride = width * 2 + 64;
+
+		std::vector<uint8_t> padded(inputStride * height * 3 / 2, 0);
+		for (unsigned int y = 0; y < height * 3 / 2; ++y)
+			std::copy_n(&input_[y * width], width,
+				    &padded[y * inputStride]);
+
+		std::vector<uint8_t> paddedOutput(outputStride * height, 0xaa);
+
+		if (converter.configure(V4L2_PIX_FMT_NV12, V4L2_PIX_FMT_YUYV,
+					Size(width, height),
+					{ inputStride, inputStride },
+					outputStride)) {
+			cout << "Failed to configure padded conversion" << endl;
+			return TestFail;
+		}
+
+		converter.convert(padded.data(), paddedOutput.data());
+
+		for (unsigned int y = 0; y < height; ++y) {
+			const uint8_t *line = &paddedOutput[y * outputStride];
+
+			if (!std::equal(line, line + width * 2,
+					&output[y * width * 2])) {
+				cout << "Padded YUYV mismatch on line " << y
+				     << endl;
+				return TestFail;
+			}
+
+			if (std::any_of(line + width * 2, line + outputStride,
+					[](uint8_t value) { return value != 0xaa; })) {
+				cout << "Output padding overwritten on line "
+				     << y << endl;
+				return TestFail;
+			}
+		}
+
+		if (converter.configure(V4L2_PIX_FMT_NV12, V4L2_PIX_FMT_YUYV,
+					Size(width, height), { width, width },
+					width) != -EINVAL) {
+			cout << "Short output stride accepted" << endl;
+			return TestFail;
+		}
+
+		/*
+		 * Converting NV12 to RGB24 and NV21 to BGR24 with the chroma
+		 * samples swapped must produce the same pixels with the red
+		 * and blue components swapped.
+		 */
+		std::vector<uint8_t> swapped = input_;
+		uint8_t *swappedChroma = &swapped[width * height];
+		for (unsigned int i = 0; i < width * height / 2; i += 2)
+			std::swap(swappedChroma[i], swappedChroma[i + 1]);
+
+		std::vector<uint8_t> rgb(width * height * 3);
+		std::vector<uint8_t> bgr(width * height * 3);
+
+		if (converter.configure(V4L2_PIX_FMT_NV12, V4L2_PIX_FMT_RGB24,
+					Size(width, height), { width, width },
+					width * 3)) {
+			cout << "Failed to configure NV12 to RGB24 conversion" << endl;
+			return TestFail;
+		}
+
+		converter.convert(input_.data(), rgb.data());
+
+		if (converter.configure(V4L2_PIX_FMT_NV21, V4L2_PIX_FMT_BGR24,
+					Size(width, height), { width, width },
+					width * 3)) {
+			cout << "Failed to configure NV21 to BGR24 conversion" << endl;
+			return TestFail;
+		}
+
+		converter.convert(swapped.data(), bgr.data());
+
+		for (unsigned int i = 0; i < width * height * 3; i += 3) {
+			if (rgb[i] != bgr[i + 2] || rgb[i + 1] != bgr[i + 1] ||
+			    rgb[i + 2] != bgr[i]) {
+				cout << "RGB24 and BGR24 mismatch at pixel "
+				     << i / 3 << endl;
+				return TestFail;
+			}
+		}
+
+		/* Black and white must map to the extremes of the RGB range. */
+		std::vector<uint8_t> grey(width * height * 3 / 2, 128);
+		std::fill(grey.begin(), grey.begin() + width * height / 2, 16);
+		std::fill(grey.begin() + width * height / 2,
+			  grey.begin() + width * height, 235);
+
+		if (converter.configure(V4L2_PIX_FMT_NV12, V4L2_PIX_FMT_RGB24,
+					Size(width, height), { width, width },
+					width * 3)) {
+			cout << "Failed to configure NV12 to RGB24 conversion" << endl;
+			return TestFail;
+		}
+
+		converter.convert(grey.data(), rgb.data());
+
+		unsigned int half = width * height / 2 * 3;
+		for (unsigned int i = 0; i < width * height * 3; ++i) {
+			uint8_t expected = i < half ? 0 : 255;
+			if (rgb[i] != expected) {
+				cout << "Grey level mismatch at pixel " << i / 3
+				     << endl;
+				return TestFail;
+			}
+		}
+
+		return TestPass;
+	}
+
+private:
+	static constexpr unsigned int width = 128;
+	static constexpr unsigned int height = 96;
+
+	std::vector<uint8_t> input_;
+};
+
+TEST_REGISTER(FormatConverterTest)